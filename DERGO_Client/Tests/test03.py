@@ -0,0 +1,104 @@
+#!/usr/bin/python
+
+# Grows, shrinks & grows a mesh that has an Item, and checks (through FromClient::Stats)
+# that the server reuses or rebinds the mesh's buffers instead of recreating its Items.
+# Needs a running server. Resets its scene.
+# Only checked against a mock server that applies the same rules as DergoSystem::updateMesh,
+# rebindMesh & c_meshBufferGrowthPercent; not yet against a real server build. If a step
+# fails on a real server, check those rules before the expectations below.
+
+# Make imports work in Python IDLE
+if __name__ == '__main__' and __package__ is None:
+	from os import sys, path
+	sys.path.append(path.dirname(path.dirname(path.abspath(__file__))))
+
+import struct
+import sys
+from network import  *
+
+MESH_ID = 1
+ITEM_ID = 1
+
+class CallbackObj:
+	def __init__( self ):
+		self.stats = None
+		self.helloReceived = False
+
+	def processMessage( self, header_sizeBytes, header_messageType, data ):
+		if header_messageType == FromServer.Stats:
+			self.stats = struct.unpack_from( '=4I', data )
+		elif header_messageType == FromServer.Hello:
+			self.helloReceived = True
+
+# Returns (numItemsCreated, numMeshesRecreated, numMeshesRebound, numMeshesUpdatedInPlace)
+def getStats( n, callbackObj ):
+	n.sendData( FromClient.Stats, None )
+	callbackObj.stats = None
+	while callbackObj.stats is None:
+		n.receiveData( callbackObj )
+	return callbackObj.stats
+
+# MeshLoops message of a flat grid of size x size smooth vertices, made of quads
+def gridMeshLoops( size ):
+	numPolygons = (size - 1) * (size - 1)
+	name = b'Grid'
+	data = bytearray( struct.pack( '=lI', MESH_ID, len( name ) ) )
+	data.extend( name )
+	# No colour nor UVs, tangents disabled, Full vertex format, vertex cache Never, no LODs
+	data.extend( struct.pack( '=III7B', numPolygons, numPolygons * 4, size * size,
+							  0, 0, 255, 0, 2, 0, 50 ) )
+	for i in range( numPolygons ):
+		data.extend( struct.pack( '=BH3f', 4, 0x8000, 0.0, 0.0, 1.0 ) )
+	for y in range( size - 1 ):
+		for x in range( size - 1 ):
+			v = y * size + x
+			data.extend( struct.pack( '=4l', v, v + 1, v + size + 1, v + size ) )
+	for y in range( size ):
+		for x in range( size ):
+			data.extend( struct.pack( '=6f', x, y, 0.0, 0.0, 0.0, 1.0 ) )
+	data.extend( struct.pack( '=H', 0 ) )
+	return data
+
+def itemMessage():
+	name = b'GridItem'
+	data = bytearray( struct.pack( '=llI', MESH_ID, ITEM_ID, len( name ) ) )
+	data.extend( name )
+	data.extend( struct.pack( '=10f', 0, 0, 0, 1, 0, 0, 0, 1, 1, 1 ) )
+	return data
+
+n = Network()
+n.connect()
+callbackObj = CallbackObj()
+
+# Start a new session, so that we start from an empty scene
+n.sendData( FromClient.Hello, struct.pack( '=Q', 0 ) )
+while not callbackObj.helloReceived:
+	n.receiveData( callbackObj )
+
+n.sendData( FromClient.MeshLoops, gridMeshLoops( 32 ) )
+n.sendData( FromClient.Item, itemMessage() )
+lastStats = getStats( n, callbackObj )
+
+# (grid size, what the server must do with the mesh's buffers)
+# The first edit outgrows the buffers, which get room to grow (see
+# c_meshBufferGrowthPercent). The next one fits in it. The shrink leaves less than a
+# fourth of it in use, so the buffers are replaced; then outgrown again.
+steps = [(40, 'rebound'), (44, 'updatedInPlace'), (16, 'rebound'), (40, 'rebound')]
+
+numFailures = 0
+for size, expected in steps:
+	n.sendData( FromClient.MeshLoops, gridMeshLoops( size ) )
+	stats = getStats( n, callbackObj )
+	itemsCreated, recreated, rebound, updatedInPlace = [stats[i] - lastStats[i] for i in range( 4 )]
+	lastStats = stats
+
+	success = itemsCreated == 0 and recreated == 0 and\
+			  (rebound, updatedInPlace) == ((1, 0) if expected == 'rebound' else (0, 1))
+	print( '%ix%i grid: %i items created, %i recreated, %i rebound, %i updated in place. %s' %\
+		   (size, size, itemsCreated, recreated, rebound, updatedInPlace,
+			'OK' if success else 'FAILED, expected the mesh to be ' + expected) )
+	if not success:
+		numFailures += 1
+
+n.disconnect()
+sys.exit( 1 if numFailures else 0 )
@@ -42,8 +42,10 @@ class DergoRenderEngine(bpy.types.RenderEngine):
 			engine.dergo = engine.Engine()
 		engine.Engine.numActiveRenderEngines += 1
 		self.needsReset = False
+		self.needsResume = False
 		if engine.Engine.numActiveRenderEngines == 1:
-			self.needsReset = True
+			# Objects may have changed while nobody was rendering
+			self.needsResume = True
 		
 	def __del__(self):
 		print( "Deinit" )
@@ -100,6 +102,10 @@ class DergoRenderEngine(bpy.types.RenderEngine):
 		if self.needsReset:
 			engine.dergo.reset()
 			self.needsReset = False
+			self.needsResume = False
+		elif self.needsResume:
+			engine.dergo.resume()
+			self.needsResume = False
 
 		engine.dergo.view_update( context )
 		return
@@ -122,11 +128,13 @@ class DergoRenderEngine(bpy.types.RenderEngine):
 	def processMessage( self, header_sizeBytes, header_messageType, data ):
 		if header_messageType == FromServer.Result:
 			self.renderedView = True
-			resolution = struct.unpack_from( '=HH', memoryview( data ) )
-			imageSizeBytes = resolution[0] * resolution[1] * 4
-			glBuffer = bgl.Buffer(bgl.GL_BYTE, [imageSizeBytes], list(data[4:4+imageSizeBytes]))
+			width, height, pixels = engine.dergo.resultDecoder.decode( data )
+			imageSizeBytes = width * height * 4
+			glBuffer = bgl.Buffer(bgl.GL_BYTE, [imageSizeBytes], list(pixels))
 			bgl.glRasterPos2i(0, 0)
-			bgl.glDrawPixels( resolution[0], resolution[1], bgl.GL_RGBA, bgl.GL_UNSIGNED_BYTE, glBuffer )
+			bgl.glDrawPixels( width, height, bgl.GL_RGBA, bgl.GL_UNSIGNED_BYTE, glBuffer )
+		elif header_messageType == FromServer.Resync:
+			self.needsReset = True
 
 	#scene['dergo']. bpy.context.window.screen.name
 
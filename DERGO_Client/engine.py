@@ -3,9 +3,12 @@ import bpy
 import bgl
 import mathutils
 import ctypes
+import os
+import tempfile
 
 from .mesh_export import MeshExport
 from .network import  *
+from .result_decoder import ResultDecoder
 from .instant_radiosity import InstantRadiosity
 from .parallax_corrected_cubemaps import ParallaxCorrectedCubemaps
 from .shadows import ShadowsSettings
@@ -51,6 +54,8 @@ BlenderCmpFuncToOgre = { 'ALWAYS_FAIL' : 0, 'ALWAYS_PASS' : 1, 'LESS' : 2, 'LESS
 'EQUAL' : 4, 'NOT_EQUAL' : 5, 'GREATER_EQUAL' : 6, 'GREATER' : 7 }
 BlenderMaterialWorkflowToOgre = { 'SPECULAR' : 0, 'FRESNEL' : 1, 'METALLIC' : 2 }
 BlenderCullModeToOgre = { 'AUTO' : 0, 'NONE' : 1, 'CW' : 2, 'CCW' : 3 }
+BlenderVertexFormatToOgre = { 'FULL' : 0, 'COMPACT' : 1 }
+BlenderVertexCacheModeToOgre = { 'AUTO' : 0, 'ALWAYS' : 1, 'NEVER' : 2 }
 BlenderVctDebugVisualizationToOgre = { 'DEBUG_VISUAL_VCT_ALBEDO' : 0, 'DEBUG_VISUAL_VCT_NORMAL' : 1,\
 'DEBUG_VISUAL_VCT_EMISSIVE' : 2, 'DEBUG_VISUAL_VCT_NONE' : 3, 'DEBUG_VISUAL_VCT_LIGHT' :4 }
 
@@ -69,11 +74,20 @@ class Engine:
 		self.activeObjects	= set()
 		self.activeLights	= set()
 		self.activeEmpties	= set()
+
+		# Last Mesh data sent to the server, per mesh ID. Needed to send deltas
+		self.meshSendBuffers = {}
+
+		# Transform-only updates of items, per mesh ID. Sent together at the end of view_update
+		self.pendingItemTransforms = {}
 		
+		self.resultDecoder = ResultDecoder()
+
 		try:
 			self.network = Network()
 			self.network.connect()
-			self.reset()
+			self.sendInit()
+			self.resume()
 		except ConnectionError as e:
 			print( e )
 			pass
@@ -81,9 +95,67 @@ class Engine:
 	def __del__(self):
 		return
 		
+	# Tells the server how we want the rendered viewport to be sent. Raw is the
+	# cheapest when the server runs on this machine. Over a network, try e.g.
+	# DERGO_RESULT_ENCODINGS=YCoCgTiles,DeltaDeflate,Raw
+	# The server prints the frame rate & bandwidth of the encoding in use.
+	def sendInit( self ):
+		preferred = os.environ.get( 'DERGO_RESULT_ENCODINGS', 'Raw' ).split( ',' )
+		encodings = self.resultDecoder.supportedEncodings( preferred )
+		self.network.sendData( FromClient.Init,\
+			struct.pack( '=B%dB' % len( encodings ), len( encodings ), *encodings ) )
+
+	# Starts a new session. The server throws away everything we sent.
 	def reset( self ):
-		# Tell server to reset
-		self.network.sendData( FromClient.Reset, None )
+		self.hello( 0 )
+
+	# Picks up the session we had with the server (e.g. before Blender crashed or the addon
+	# got reloaded), if the server still keeps it. Otherwise starts a new one.
+	def resume( self ):
+		self.hello( Engine.loadSessionId() )
+
+	def hello( self, sessionId ):
+		self.network.sendData( FromClient.Hello, struct.pack( '=Q', sessionId ) )
+		self.helloReply = None
+		while self.helloReply is None:
+			self.network.receiveData( self )
+
+		sessionId, resumed, manifest = self.helloReply
+		self.helloReply = None
+		Engine.saveSessionId( sessionId )
+
+		if resumed:
+			self.resyncWithManifest( manifest )
+		else:
+			self.forgetServerState()
+
+	# Where we remember our session, so that it survives Blender and the addon.
+	@staticmethod
+	def getSessionFilePath():
+		return os.path.join( tempfile.gettempdir(), 'dergo_session.txt' )
+
+	# Returns 0 if we don't have a session for the current .blend file
+	@staticmethod
+	def loadSessionId():
+		try:
+			with open( Engine.getSessionFilePath(), 'r' ) as f:
+				sessionId, filepath = f.read().split( '\n', 1 )
+			if filepath == bpy.data.filepath:
+				return int( sessionId )
+		except (OSError, ValueError):
+			pass
+		return 0
+
+	@staticmethod
+	def saveSessionId( sessionId ):
+		try:
+			with open( Engine.getSessionFilePath(), 'w' ) as f:
+				f.write( '%d\n%s' % (sessionId, bpy.data.filepath) )
+		except OSError:
+			pass
+
+	# The server has nothing from us.
+	def forgetServerState( self ):
 		# Remove our data
 		for object in bpy.data.objects:
 			object.dergo.in_sync	= False
@@ -111,6 +183,69 @@ class Engine:
 		self.activeObjects	= set()
 		self.activeLights	= set()
 		self.activeEmpties	= set()
+
+		# Last Mesh data sent to the server, per mesh ID. Needed to send deltas
+		self.meshSendBuffers = {}
+
+		# Transform-only updates of items, per mesh ID. Sent together at the end of view_update
+		self.pendingItemTransforms = {}
+
+		self.network.sessionManifest = {}
+
+	# The server still has every object in the manifest, but we can't trust our own
+	# bookkeeping. Keep our IDs and sync everything again; Network drops the messages
+	# the server already has (see Network.isRedundant), and the objects we no longer
+	# have get removed like any other object that disappeared.
+	def resyncWithManifest( self, manifest ):
+		maxObjId	= 0
+		maxMeshId	= 0
+		maxMatId	= 0
+
+		self.activeObjects	= set()
+		self.activeLights	= set()
+		self.activeEmpties	= set()
+
+		for messageType, parentId, id in manifest:
+			if messageType == FromClient.Item:
+				self.activeObjects.add( (id, ctypes.c_int32( parentId ).value) )
+				maxObjId = max( maxObjId, id )
+			elif messageType == FromClient.Light:
+				self.activeLights.add( id )
+				maxObjId = max( maxObjId, id )
+			elif messageType == FromClient.Empty:
+				self.activeEmpties.add( id )
+				maxObjId = max( maxObjId, id )
+			elif messageType == FromClient.Mesh and id < 0x80000000:
+				# Meshes with modifiers use their object's ID, with the high bit set
+				maxMeshId = max( maxMeshId, id )
+			elif messageType == FromClient.Material:
+				maxMatId = max( maxMatId, id )
+
+		for object in bpy.data.objects:
+			object.dergo.in_sync = False
+			maxObjId = max( maxObjId, object.dergo.id )
+		for mesh in bpy.data.meshes:
+			mesh.dergo.frame_sync = 0
+			maxMeshId = max( maxMeshId, mesh.dergo.id )
+		for mat in bpy.data.materials:
+			mat.dergo.in_sync = False
+			maxMatId = max( maxMatId, mat.dergo.id )
+		for image in bpy.data.images:
+			image.dergo.in_sync	= False
+		for world in bpy.data.worlds:
+			world.dergo.in_sync = False
+
+		self.objId	= maxObjId + 1
+		self.meshId	= maxMeshId + 1
+		self.matId	= maxMatId + 1
+
+		# Resends all material texture slots
+		self.frame	= 1
+
+		self.meshSendBuffers = {}
+		self.pendingItemTransforms = {}
+
+		self.network.sessionManifest = manifest
 		
 	def view_update(self, context):
 		scene = context.scene
@@ -173,12 +308,21 @@ class Engine:
 			elif object.type == 'EMPTY' and Engine.isEmptyRelevant( object ):
 				self.syncEmpty( object, scene )
 				newActiveEmpties.add( object.dergo.id )
+
+		self.flushItemTransforms()
 		
 		# Remove items that are gone.
 		if newActiveObjects != self.activeObjects:
 			removedObjects = self.activeObjects - newActiveObjects
 			for idPair in removedObjects:
 				self.network.sendData( FromClient.ItemRemove, struct.pack( '=ll', idPair[1], idPair[0] ) )
+
+			# Forget the last data sent for meshes no item uses anymore (deleted objects,
+			# modifiers removed, relinked meshes). Sending one again starts without a delta.
+			usedMeshIds = set( idPair[1] for idPair in newActiveObjects )
+			for meshId in list( self.meshSendBuffers.keys() ):
+				if meshId not in usedMeshIds:
+					del self.meshSendBuffers[meshId]
 		
 		self.activeObjects = newActiveObjects
 		
@@ -201,6 +345,9 @@ class Engine:
 		# Sync world last, so GI rebuilds can account for latest changes
 		self.syncWorld( scene.world )
 		
+		# Anything from a resumed session we haven't sent by now is stale
+		self.network.sessionManifest = {}
+
 		# Always keep in 32-bit signed range, non-zero
 		self.frame = (self.frame % 2147483647) + 1
 		return
@@ -280,7 +427,7 @@ class Engine:
 			if \
 			((not object.dergo.in_sync or object.is_updated_data) and len( object.modifiers ) > 0) or \
 			((data.dergo.frame_sync == 0 or (data.dergo.frame_sync != self.frame and object.is_updated_data)) and len( object.modifiers ) == 0):
-				exportMesh = object.to_mesh( scene, True, "PREVIEW", True, False)
+				exportMesh = object.to_mesh( scene, True, "PREVIEW", False, False)
 				
 				if not data.dergo.tangent_uv_source:
 					tangentUvSource = 255
@@ -288,10 +435,35 @@ class Engine:
 					tangentUvSource = data.uv_textures.find( data.dergo.tangent_uv_source )
 					if tangentUvSource < 0: tangentUvSource = 255
 					
-				dataToSend = MeshExport.createSendBuffer( linkedMeshId, meshName,
-															exportMesh, tangentUvSource )
-				
-				self.network.sendData( FromClient.Mesh, dataToSend )
+				vertexFormat = BlenderVertexFormatToOgre[data.dergo.vertex_format]
+				vertexCacheMode = BlenderVertexCacheModeToOgre[data.dergo.vertex_cache]
+				lodSettings = (data.dergo.lod_levels if scene.dergo.generate_lods else 0,
+							   data.dergo.lod_quality)
+
+				# Polygons & loops can be bulk copied. Only n-gons need tessfaces.
+				messageType = FromClient.MeshLoops
+				dataToSend = MeshExport.createLoopsSendBuffer( linkedMeshId, meshName, exportMesh,
+															   tangentUvSource, vertexFormat,
+															   vertexCacheMode, lodSettings )
+				if dataToSend is None:
+					messageType = FromClient.Mesh
+					exportMesh.calc_tessface()
+					dataToSend = MeshExport.createSendBuffer( linkedMeshId, meshName,
+															  exportMesh, tangentUvSource, vertexFormat,
+															  vertexCacheMode, lodSettings )
+
+				# If only vertices moved (e.g. sculpting), send just what changed
+				deltaToSend = None
+				if linkedMeshId in self.meshSendBuffers:
+					prevMessageType, prevDataToSend = self.meshSendBuffers[linkedMeshId]
+					if prevMessageType == messageType:
+						deltaToSend = MeshExport.createDeltaBuffer( linkedMeshId, messageType,
+																	prevDataToSend, dataToSend )
+				if deltaToSend is not None:
+					self.network.sendData( FromClient.MeshDelta, deltaToSend )
+				else:
+					self.network.sendData( messageType, dataToSend )
+				self.meshSendBuffers[linkedMeshId] = (messageType, dataToSend)
 				bpy.data.meshes.remove( exportMesh )
 				if len( object.modifiers ) == 0:
 					data.dergo.frame_sync = self.frame
@@ -305,7 +477,13 @@ class Engine:
 			object.dergo.id_mesh = linkedMeshId
 
 			# Create or Update Item.
-			if not object.dergo.in_sync or object.is_updated:
+			if object.dergo.in_sync and object.is_updated:
+				# Server already has it. Only the transform can have changed, which
+				# we send along with all the other items of the same mesh.
+				loc, rot, scale = object.matrix_world.decompose()
+				self.pendingItemTransforms.setdefault( linkedMeshId, [] ).append(
+					(object.dergo.id, loc, rot, scale) )
+			elif not object.dergo.in_sync:
 				# Mesh ID & Item ID
 				dataToSend = bytearray( struct.pack( '=ll', linkedMeshId, object.dergo.id ) )
 				
@@ -323,6 +501,22 @@ class Engine:
 
 			object.dergo.in_sync = True
 			
+	# Sends all pending transform-only updates, one ItemTransformBatch message per mesh
+	def flushItemTransforms( self ):
+		for meshId, transforms in self.pendingItemTransforms.items():
+			numItems = len( transforms )
+			dataToSend = bytearray( struct.pack( '=lI', meshId, numItems ) )
+			dataToSend.extend( struct.pack( '=%il' % numItems,
+											*[t[0] for t in transforms] ) )
+			dataToSend.extend( struct.pack( '=%if' % (numItems * 3),
+											*[v for t in transforms for v in t[1]] ) )
+			dataToSend.extend( struct.pack( '=%if' % (numItems * 4),
+											*[v for t in transforms for v in t[2]] ) )
+			dataToSend.extend( struct.pack( '=%if' % (numItems * 3),
+											*[v for t in transforms for v in t[3]] ) )
+			self.network.sendData( FromClient.ItemTransformBatch, dataToSend )
+		self.pendingItemTransforms = {}
+
 	def syncLight( self, object, scene ):
 		if object.data.type not in {'POINT', 'SUN', 'SPOT', 'AREA'}:
 			return
@@ -712,7 +906,13 @@ class Engine:
 
 	# Callback to process Network messages from server.
 	def processMessage( self, header_sizeBytes, header_messageType, data ):
-		return
+		if header_messageType == FromServer.Hello:
+			sessionId, resumed, numObjects = struct.unpack_from( '=QBI', data )
+			entries = memoryview( data )[13:13 + numObjects * 21]
+			manifest = {}
+			for messageType, parentId, id, digest in struct.iter_unpack( '=BIQQ', entries ):
+				manifest[(messageType, parentId, id)] = digest
+			self.helloReply = (sessionId, resumed != 0, manifest)
 	
 dergo = None
 
@@ -3,6 +3,13 @@
 
 import struct
 
+from .network import FromClient
+
+try:
+	import numpy
+except ImportError:
+	numpy = None
+
 class ExportVertex:
 	__slots__ = ("hash", "vertexIndex", "faceIndex", "position", "normal", "color", "texcoord")
 
@@ -203,13 +210,15 @@ class MeshExport:
 
 		return (exportVertexArray)
 	
+	# lodSettings is (numLods, lodQuality). See FromClient::Mesh
 	@staticmethod
-	def createSendBuffer(meshId, meshName, mesh, tangentUvSource):
+	def createSendBuffer(meshId, meshName, mesh, tangentUvSource, vertexFormat, vertexCacheMode,
+						 lodSettings):
 		nameAsUtfBytes = meshName.encode('utf-8')
 		hasColour = False
 		
 		bytesNeeded = 4 + 4 + len( nameAsUtfBytes )
-		bytesNeeded += 4 + 4 + 1 + 1 + 1
+		bytesNeeded += 4 + 4 + 1 + 1 + 1 + 1 + 1 + 1 + 1
 		bytesNeeded += len( mesh.tessfaces ) * 31 + \
 						len( mesh.vertices ) * 24
 		if len(mesh.tessface_vertex_colors) > 0:
@@ -231,10 +240,11 @@ class MeshExport:
 		currentOffset += len( nameAsUtfBytes )
 
 		# Most of data's header
-		struct.pack_into( "=II3B", bytesObj, currentOffset,
+		struct.pack_into( "=II7B", bytesObj, currentOffset,
 			len( mesh.tessfaces ), len( mesh.vertices ), hasColour,
-			len( mesh.tessface_uv_textures ), tangentUvSource )
-		currentOffset += 4 + 4 + 3
+			len( mesh.tessface_uv_textures ), tangentUvSource, vertexFormat, vertexCacheMode,
+			lodSettings[0], lodSettings[1] )
+		currentOffset += 4 + 4 + 7
 
 		faceStruct = struct.Struct( "=4I3fHB" )
 		faceColourStruct = struct.Struct( "=12f" )
@@ -295,3 +305,199 @@ class MeshExport:
 		currentOffset += 2 + len( materialIdTable )
 
 		return bytesObj
+
+	# Same as createSendBuffer, but for a FromClient::MeshLoops message, which is filled
+	# with bulk copies straight from the polygons & loops. Doesn't need tessfaces.
+	# Returns None if the mesh can't be sent this way (it has n-gons, or there's no numpy).
+	@staticmethod
+	def createLoopsSendBuffer(meshId, meshName, mesh, tangentUvSource, vertexFormat, vertexCacheMode,
+							  lodSettings):
+		if numpy is None:
+			return None
+
+		numPolygons = len( mesh.polygons )
+		numLoops = len( mesh.loops )
+		numRawVertices = len( mesh.vertices )
+
+		loopTotals = numpy.empty( numPolygons, dtype=numpy.int32 )
+		mesh.polygons.foreach_get( 'loop_total', loopTotals )
+		if numPolygons > 0 and loopTotals.max() > 4:
+			return None
+
+		materialIndices = numpy.empty( numPolygons, dtype=numpy.int32 )
+		mesh.polygons.foreach_get( 'material_index', materialIndices )
+		useSmooth = numpy.empty( numPolygons, dtype=numpy.bool_ )
+		mesh.polygons.foreach_get( 'use_smooth', useSmooth )
+		polygonNormals = numpy.empty( numPolygons * 3, dtype=numpy.float32 )
+		mesh.polygons.foreach_get( 'normal', polygonNormals )
+
+		polygons = numpy.empty( numPolygons, dtype=[('numLoops', '<u1'), ('materialId', '<u2'),\
+													('normal', '<f4', 3)] )
+		polygons['numLoops'] = loopTotals
+		polygons['materialId'] = (useSmooth.astype( numpy.uint16 ) << 15) |\
+								 (materialIndices & 0x7FFF).astype( numpy.uint16 )
+		polygons['normal'] = polygonNormals.reshape( -1, 3 )
+
+		loopVertices = numpy.empty( numLoops, dtype=numpy.int32 )
+		mesh.loops.foreach_get( 'vertex_index', loopVertices )
+
+		blocks = [polygons.tobytes(), loopVertices.tobytes()]
+
+		hasColour = len( mesh.vertex_colors ) > 0
+		if hasColour:
+			colours = numpy.empty( numLoops * 3, dtype=numpy.float32 )
+			mesh.vertex_colors[0].data.foreach_get( 'color', colours )
+			loopColours = numpy.full( (numLoops, 4), 255, dtype=numpy.uint8 )
+			loopColours[:, :3] = numpy.clip( colours.reshape( -1, 3 ) * 255.0 + 0.5, 0, 255 )
+			blocks.append( loopColours.tobytes() )
+
+		for uvLayer in mesh.uv_layers:
+			uvs = numpy.empty( numLoops * 2, dtype=numpy.float32 )
+			uvLayer.data.foreach_get( 'uv', uvs )
+			blocks.append( uvs.tobytes() )
+
+		rawVertices = numpy.empty( (numRawVertices, 6), dtype=numpy.float32 )
+		positions = numpy.empty( numRawVertices * 3, dtype=numpy.float32 )
+		mesh.vertices.foreach_get( 'co', positions )
+		rawVertices[:, :3] = positions.reshape( -1, 3 )
+		mesh.vertices.foreach_get( 'normal', positions )
+		rawVertices[:, 3:] = positions.reshape( -1, 3 )
+		blocks.append( rawVertices.tobytes() )
+
+		materialIdTable = [mat.dergo.id for mat in mesh.materials]
+		blocks.append( struct.pack( '=H%sl' % len( materialIdTable ),
+									len( materialIdTable ), *materialIdTable ) )
+
+		nameAsUtfBytes = meshName.encode('utf-8')
+		header = struct.pack( '=lI', meshId, len( nameAsUtfBytes ) ) + nameAsUtfBytes +\
+				 struct.pack( '=III7B', numPolygons, numLoops, numRawVertices, hasColour,
+							  len( mesh.uv_layers ), tangentUvSource, vertexFormat, vertexCacheMode,
+							  lodSettings[0], lodSettings[1] )
+
+		return bytearray( header + b''.join( blocks ) )
+
+	# Returns the offsets of each block inside a buffer made by createSendBuffer (Mesh) or
+	# createLoopsSendBuffer (MeshLoops), plus the size of each face & where its normal is.
+	@staticmethod
+	def getSendBufferLayout( messageType, bytesObj ):
+		nameLength = struct.unpack_from( '=I', bytesObj, 4 )[0]
+		if messageType == FromClient.MeshLoops:
+			facesStart = 8 + nameLength + 4 + 4 + 4 + 7
+			numFaces, numLoops, numRawVertices, hasColour, numUVs, tangentUvSource, vertexFormat,\
+				vertexCacheMode, numLods, lodQuality = struct.unpack_from( '=III7B', bytesObj,
+																		   facesStart - 19 )
+			faceSize = 15
+			faceNormalOffset = 3
+			facesEnd = facesStart + numFaces * faceSize
+			rawStart = facesEnd + numLoops * (4 + (4 if hasColour else 0) + numUVs * 8)
+		else:
+			facesStart = 8 + nameLength + 4 + 4 + 7
+			numFaces, numRawVertices, hasColour, numUVs, tangentUvSource, vertexFormat,\
+				vertexCacheMode, numLods, lodQuality = struct.unpack_from( '=II7B', bytesObj,
+																		   facesStart - 15 )
+			faceSize = 31
+			faceNormalOffset = 16
+			facesEnd = facesStart + numFaces * faceSize
+			rawStart = facesEnd + numFaces * (48 if hasColour else 0) + numFaces * numUVs * 32
+
+		rawEnd = rawStart + numRawVertices * 24
+		return (numFaces, numRawVertices, facesStart, facesEnd, rawStart, rawEnd,
+				faceSize, faceNormalOffset)
+
+	# Returns the indices of the elements that differ between both buffers. Whole blocks
+	# are compared at once (which is done natively) and only blocks that differ are
+	# looked at element by element.
+	@staticmethod
+	def findChangedElements( prevView, newView, start, elementSize, numElements ):
+		changed = []
+		blockSize = 256
+		for blockStart in range( 0, numElements, blockSize ):
+			blockEnd = min( blockStart + blockSize, numElements )
+			a = start + blockStart * elementSize
+			b = start + blockEnd * elementSize
+			if prevView[a:b] != newView[a:b]:
+				for i in range( blockStart, blockEnd ):
+					a = start + i * elementSize
+					if prevView[a:a+elementSize] != newView[a:a+elementSize]:
+						changed.append( i )
+		return changed
+
+	# Converts a sorted list of indices into a list of (start, count)
+	@staticmethod
+	def toRanges( indices ):
+		ranges = []
+		for idx in indices:
+			if ranges and ranges[-1][0] + ranges[-1][1] == idx:
+				ranges[-1][1] += 1
+			else:
+				ranges.append( [idx, 1] )
+		return ranges
+
+	# Creates a MeshDelta message out of two buffers of the same messageType (Mesh or
+	# MeshLoops) for the same mesh. Returns None if the topology changed (i.e. a full
+	# message is needed) or if the delta wouldn't be much smaller than the full message.
+	@staticmethod
+	def createDeltaBuffer( meshId, messageType, prevBytesObj, bytesObj ):
+		if len( prevBytesObj ) != len( bytesObj ):
+			return None
+
+		layout = MeshExport.getSendBufferLayout( messageType, bytesObj )
+		if layout != MeshExport.getSendBufferLayout( messageType, prevBytesObj ):
+			return None
+
+		numFaces, numRawVertices, facesStart, facesEnd, rawStart, rawEnd,\
+			faceSize, faceNormalOffset = layout
+		faceNormalEnd = faceNormalOffset + 12
+
+		prevView = memoryview( prevBytesObj )
+		newView = memoryview( bytesObj )
+
+		# Everything other than face normals & raw vertices must be the same
+		if prevView[:facesStart] != newView[:facesStart] or \
+			prevView[facesEnd:rawStart] != newView[facesEnd:rawStart] or \
+			prevView[rawEnd:] != newView[rawEnd:]:
+			return None
+
+		changedFaces = MeshExport.findChangedElements( prevView, newView, facesStart, faceSize,
+													   numFaces )
+		for i in changedFaces:
+			offset = facesStart + i * faceSize
+			# Vertex indices, material & number of indices must be the same
+			if prevView[offset:offset+faceNormalOffset] != newView[offset:offset+faceNormalOffset] or \
+				prevView[offset+faceNormalEnd:offset+faceSize] != newView[offset+faceNormalEnd:offset+faceSize]:
+				return None
+
+		changedRawVertices = MeshExport.findChangedElements( prevView, newView, rawStart, 24,
+															 numRawVertices )
+
+		rawRanges = MeshExport.toRanges( changedRawVertices )
+		faceRanges = MeshExport.toRanges( changedFaces )
+
+		bytesNeeded = 4 + 4 + 4 + 4 + len( rawRanges ) * 8 + len( changedRawVertices ) * 24 + \
+					  4 + len( faceRanges ) * 8 + len( changedFaces ) * 12
+		if bytesNeeded * 2 > len( bytesObj ):
+			return None
+
+		deltaObj = bytearray( bytesNeeded )
+		struct.pack_into( '=lIII', deltaObj, 0, meshId, numRawVertices, numFaces, len( rawRanges ) )
+		currentOffset = 16
+
+		for start, count in rawRanges:
+			struct.pack_into( '=II', deltaObj, currentOffset, start, count )
+			currentOffset += 8
+			srcOffset = rawStart + start * 24
+			deltaObj[currentOffset:currentOffset+count*24] = newView[srcOffset:srcOffset+count*24]
+			currentOffset += count * 24
+
+		struct.pack_into( '=I', deltaObj, currentOffset, len( faceRanges ) )
+		currentOffset += 4
+
+		for start, count in faceRanges:
+			struct.pack_into( '=II', deltaObj, currentOffset, start, count )
+			currentOffset += 8
+			for i in range( start, start + count ):
+				srcOffset = facesStart + i * faceSize + faceNormalOffset
+				deltaObj[currentOffset:currentOffset+12] = newView[srcOffset:srcOffset+12]
+				currentOffset += 12
+
+		return deltaObj
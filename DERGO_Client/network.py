@@ -2,6 +2,7 @@
 
 import socket
 import struct
+import zlib
 
 class FromClient:
 	ConnectionTest, \
@@ -26,13 +27,27 @@ class FromClient:
 	InitAsync, \
 	FinishAsync, \
 	ReloadShaders, \
-	NumClientMessages = range( 23 )
+	Export, \
+	MeshDelta, \
+	ItemTransformBatch, \
+	Hello, \
+	MeshLoops, \
+	Stats, \
+	NumClientMessages = range( 29 )
 	
 class FromServer:
 	ConnectionTest, \
 	Resync, \
 	Result, \
-	NumServerMessages = range( 4 )
+	Hello, \
+	Stats, \
+	NumServerMessages = range( 6 )
+
+class ResultEncoding:
+	Raw, \
+	DeltaDeflate, \
+	YCoCgTiles, \
+	NumResultEncodings = range( 4 )
 
 class Network:
 	def __init__( self ):
@@ -41,6 +56,9 @@ class Network:
 		
 		self.HEADER_SIZE = 5
 
+		# What the server still has from a resumed session. See FromServer::Hello
+		self.sessionManifest = {}
+
 	def connect( self ):
 		self.socket = socket.socket()	# Create a socket object
 		host = socket.gethostname() 	# Get local machine name
@@ -59,10 +77,47 @@ class Network:
 		else:
 			sizeBytes = len( data )
 		
+		if self.sessionManifest and self.isRedundant( messageType, data ):
+			return
+
 		packet = self.headerStruct.pack( sizeBytes, messageType )
 		
 		self.socket.send( b''.join( (packet, bytes(data)) ) )
 		
+	# Identifies the object a message is about, the same way the server does for its
+	# session manifest. Returns None for messages that don't describe a whole object.
+	@staticmethod
+	def getSessionObjectKey( messageType, data ):
+		if messageType in (FromClient.WorldParams, FromClient.InstantRadiosity,\
+						   FromClient.ParallaxCorrectedCubemaps, FromClient.ShadowsSettings):
+			return (messageType, 0, 0)
+		if messageType in (FromClient.Mesh, FromClient.MeshLoops, FromClient.MeshDelta):
+			return (FromClient.Mesh, 0, struct.unpack_from( '=I', data )[0])
+		if messageType in (FromClient.Item, FromClient.ItemRemove):
+			meshId, itemId = struct.unpack_from( '=II', data )
+			return (FromClient.Item, meshId, itemId)
+		if messageType in (FromClient.Light, FromClient.LightRemove):
+			return (FromClient.Light, 0, struct.unpack_from( '=I', data )[0])
+		if messageType in (FromClient.Empty, FromClient.EmptyRemove):
+			return (FromClient.Empty, 0, struct.unpack_from( '=I', data )[0])
+		if messageType == FromClient.Material:
+			return (messageType, 0, struct.unpack_from( '=I', data )[0])
+		if messageType == FromClient.Texture:
+			return (messageType, 0, struct.unpack_from( '=Q', data )[0])
+		return None
+
+	# True if the server already has exactly this message applied, thus there's no need to
+	# send it. Every object is only skipped once; after that it's up to us to keep track.
+	def isRedundant( self, messageType, data ):
+		key = Network.getSessionObjectKey( messageType, data )
+		if key is None:
+			return False
+		serverDigest = self.sessionManifest.pop( key, None )
+		if serverDigest is None:
+			return False
+		digest = (zlib.crc32( data ) << 32) | zlib.adler32( data )
+		return digest == serverDigest
+
 	def receiveData( self, callbackObj ):
 		chunk = self.socket.recv( 8192 * 1024 )
 		if chunk == '':
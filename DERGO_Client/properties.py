@@ -97,6 +97,18 @@ enum_detail_blending_modes = (
 	('DIFFERENCE', "Difference", ""),
 	)
 
+enum_vertex_formats = (
+	('FULL', "Full", "32-bit floats for everything. Required for fast updates while sculpting or editing"),
+	('COMPACT', "Compact", "Half floats and packed normals & tangents. Roughly halves GPU memory "
+				"and bandwidth, at a small loss of precision. Every edit rebuilds the whole mesh"),
+	)
+
+enum_vertex_cache_modes = (
+	('AUTO', "Auto", "Reorder triangles & vertices for the GPU once the mesh stops changing"),
+	('ALWAYS', "Always", "Reorder every time the mesh changes. Slower to update big meshes"),
+	('NEVER', "Never", "Keep Blender's order"),
+	)
+
 class DergoSpaceViewSettings(bpy.types.PropertyGroup):
 	@classmethod
 	def register(drg):
@@ -136,6 +148,11 @@ class DergoSceneSettings(bpy.types.PropertyGroup):
 				description="Checks for errors in objects that make them incompatible with the material. Disable if UI responsiveness is degraded (e.g. many thousands of objects on scene)",
 				default=True,
 				)
+		cls.generate_lods = BoolProperty(
+				name="Generate LODs",
+				description="Lets the server build simplified versions of heavy meshes (see each mesh's LOD settings), used when they're far from the camera",
+				default=True,
+				)
 
 	@classmethod
 	def unregister(cls):
@@ -321,6 +338,27 @@ class DergoMeshSettings(bpy.types.PropertyGroup):
 		cls.tangent_uv_source = StringProperty(
 				description="Select UV source for generating tangents for normal maps. Blank for none (faster if you don't use normal maps!)",
 				)
+		cls.vertex_format = EnumProperty(
+				name="Vertex Format",
+				items=enum_vertex_formats,
+				default='FULL',
+				)
+		cls.vertex_cache = EnumProperty(
+				name="Vertex Cache Optimization",
+				items=enum_vertex_cache_modes,
+				default='AUTO',
+				)
+		cls.lod_levels = IntProperty(
+				name="LOD Levels",
+				description="Simplified versions the server builds in the background if the mesh is heavy. 0 to disable",
+				default=3, min=0, max=4,
+				)
+		cls.lod_quality = IntProperty(
+				name="LOD Quality",
+				description="Percentage of the triangles of the previous level each LOD keeps",
+				default=50, min=10, max=90,
+				subtype='PERCENTAGE',
+				)
 
 	@classmethod
 	def unregister(cls):
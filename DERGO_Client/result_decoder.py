@@ -0,0 +1,108 @@
+
+import struct
+import zlib
+
+from .network import ResultEncoding
+
+try:
+	import numpy
+except ImportError:
+	numpy = None
+
+# Decodes FromServer::Result messages. See NetworkMessage.h for the formats.
+class ResultDecoder:
+	TILE_SIZE = 16
+
+	def __init__( self ):
+		# Last YCoCgTiles frame, padded to a multiple of TILE_SIZE. Unchanged tiles aren't sent.
+		self.tileFrame = None
+
+	# Encodings we can decode, most preferred first, picked from 'preferred' (names or values)
+	def supportedEncodings( self, preferred ):
+		retVal = []
+		for encoding in preferred:
+			if isinstance( encoding, str ):
+				encoding = getattr( ResultEncoding, encoding.strip(), None )
+			if encoding is None or encoding >= ResultEncoding.NumResultEncodings:
+				continue
+			# Everything but Raw is too slow to decode without numpy
+			if encoding != ResultEncoding.Raw and numpy is None:
+				continue
+			if encoding not in retVal:
+				retVal.append( encoding )
+		return retVal
+
+	# Returns width, height and the RGBA8 pixels
+	def decode( self, data ):
+		width, height, encoding = struct.unpack_from( '=HHB', data )
+		payload = memoryview( data )[5:]
+
+		if encoding == ResultEncoding.DeltaDeflate:
+			pixels = self.decodeDeltaDeflate( width, height, payload )
+		elif encoding == ResultEncoding.YCoCgTiles:
+			pixels = self.decodeYCoCgTiles( width, height, payload )
+		else:
+			pixels = payload[:width * height * 4]
+
+		return width, height, pixels
+
+	def decodeDeltaDeflate( self, width, height, payload ):
+		rowsPerBand = struct.unpack_from( '=H', payload )[0]
+		offset = 2
+		bands = []
+		for firstRow in range( 0, height, rowsPerBand ):
+			sizeBytes = struct.unpack_from( '=I', payload, offset )[0]
+			offset += 4
+			band = numpy.frombuffer( zlib.decompress( payload[offset:offset + sizeBytes] ),
+									 dtype=numpy.uint8 ).reshape( -1, width * 4 )
+			offset += sizeBytes
+			# Each row was sent minus the row above it. Undo it.
+			bands.append( numpy.cumsum( band, axis=0, dtype=numpy.uint8 ) )
+		return numpy.concatenate( bands ).tobytes()
+
+	def decodeYCoCgTiles( self, width, height, payload ):
+		tileSize = self.TILE_SIZE
+		halfTile = tileSize // 2
+		numTilesX = (width + tileSize - 1) // tileSize
+		numTilesY = (height + tileSize - 1) // tileSize
+		numTiles = numTilesX * numTilesY
+
+		if self.tileFrame is None or self.tileFrame.shape[0] != numTilesY * tileSize or\
+			self.tileFrame.shape[1] != numTilesX * tileSize:
+			# The server sends all tiles when the resolution changes
+			self.tileFrame = numpy.zeros( (numTilesY * tileSize, numTilesX * tileSize, 4),\
+										  dtype=numpy.uint8 )
+			self.tileFrame[:, :, 3] = 255
+
+		maskSizeBytes = (numTiles + 7) // 8
+		mask = numpy.unpackbits( numpy.frombuffer( payload, dtype=numpy.uint8,\
+												   count=maskSizeBytes ) )[:numTiles]
+		dirtyTiles = numpy.nonzero( mask )[0]
+		numDirtyTiles = len( dirtyTiles )
+
+		if numDirtyTiles > 0:
+			tileSizeBytes = tileSize * tileSize + 2 * halfTile * halfTile
+			tiles = numpy.frombuffer( payload, dtype=numpy.uint8, count=numDirtyTiles * tileSizeBytes,\
+									  offset=maskSizeBytes ).reshape( numDirtyTiles, tileSizeBytes )
+
+			lumaEnd = tileSize * tileSize
+			chromaEnd = lumaEnd + halfTile * halfTile
+			y = tiles[:, :lumaEnd].reshape( numDirtyTiles, tileSize, tileSize ).astype( numpy.int16 )
+			co = tiles[:, lumaEnd:chromaEnd].reshape( numDirtyTiles, halfTile, halfTile ).astype( numpy.int16 ) - 128
+			cg = tiles[:, chromaEnd:].reshape( numDirtyTiles, halfTile, halfTile ).astype( numpy.int16 ) - 128
+			co = co.repeat( 2, axis=1 ).repeat( 2, axis=2 )
+			cg = cg.repeat( 2, axis=1 ).repeat( 2, axis=2 )
+
+			tmp = y - cg
+			rgba = numpy.empty( (numDirtyTiles, tileSize, tileSize, 4), dtype=numpy.uint8 )
+			rgba[..., 0] = numpy.clip( tmp + co, 0, 255 )
+			rgba[..., 1] = numpy.clip( y + cg, 0, 255 )
+			rgba[..., 2] = numpy.clip( tmp - co, 0, 255 )
+			rgba[..., 3] = 255
+
+			# View of tileFrame as [tileY][tileX][y][x][rgba]
+			tileView = self.tileFrame.reshape( numTilesY, tileSize, numTilesX, tileSize, 4 ).\
+						transpose( 0, 2, 1, 3, 4 )
+			tileView[dirtyTiles // numTilesX, dirtyTiles % numTilesX] = rgba
+
+		return self.tileFrame[:height, :width].tobytes()
@@ -684,6 +684,14 @@ class Dergo_PT_mesh(DergoButtonsPanel, bpy.types.Panel):
 		dmesh = context.mesh.dergo
 
 		layout.prop_search( dmesh, "tangent_uv_source", mesh, "uv_textures", text="UV for normal maps" )
+		layout.prop( dmesh, "vertex_format" )
+		layout.prop( dmesh, "vertex_cache" )
+
+		layout.prop( context.scene.dergo, "generate_lods" )
+		col = layout.column()
+		col.active = context.scene.dergo.generate_lods
+		col.prop( dmesh, "lod_levels" )
+		col.prop( dmesh, "lod_quality" )
 
 class DergoTexturePanel(DergoButtonsPanel):
 	bl_context = "texture"
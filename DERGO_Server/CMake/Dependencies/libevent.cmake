@@ -27,4 +27,9 @@ set( LIBEVENT_LIBRARIES
 	event_extra
 	)
 
+# NetworkSystem calls libevent from multiple threads
+if( NOT WIN32 )
+	set( LIBEVENT_LIBRARIES ${LIBEVENT_LIBRARIES} event_pthreads )
+endif()
+
 endmacro()
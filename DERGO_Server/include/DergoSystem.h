@@ -2,15 +2,26 @@
 #pragma once
 
 #include "GraphicsSystem.h"
+#include "VertexUtils.h"
+#include "ScalableTaskPool.h"
+#include "MeshLodBuilder.h"
+#include "FlatIdMap.h"
+#include "ResultEncoder.h"
 #include "OgreMesh2.h"
 #include "Vao/OgreVertexBufferPacked.h"
+#include "Vao/OgreIndexBufferPacked.h"
 #include "OgreIdString.h"
+#include "OgrePixelFormatGpu.h"
+#include "Threading/OgreLightweightMutex.h"
 
 #include "OgreSceneFormatBase.h"
 #include "OgreResourceGroupManager.h"
 
 #include "Utils/ShadowsUtils.h"
 
+#include <atomic>
+#include <set>
+
 namespace Ogre
 {
 	class InstantRadiosity;
@@ -20,6 +31,8 @@ namespace Ogre
 
 	class VctVoxelizer;
 	class VctLighting;
+
+	class AsyncTextureTicket;
 }
 
 namespace DERGO
@@ -40,16 +53,219 @@ namespace DERGO
 
 		typedef std::vector<BlenderItem> BlenderItemVec;
 
+		/// 128-bit hash of everything in a FromClient::Mesh that ends up in its GPU buffers.
+		struct MeshContentHash
+		{
+			uint64_t	value[2];
+
+			bool operator < ( const MeshContentHash &other ) const
+			{
+				if( value[0] != other.value[0] )
+					return value[0] < other.value[0];
+				return value[1] < other.value[1];
+			}
+			bool operator == ( const MeshContentHash &other ) const
+			{
+				return value[0] == other.value[0] && value[1] == other.value[1];
+			}
+		};
+
+		/// Parts of a FromClient::Mesh that get hashed on their own, so that prepareMesh
+		/// can tell which ones changed since the last build. See hashMeshSource.
+		enum MeshBlock
+		{
+			/// Counts and settings (vertex format, number of UVs, etc.)
+			MeshBlockHeader,
+			MeshBlockFaces,
+			MeshBlockFaceColour,
+			MeshBlockFaceUv,
+			MeshBlockRawVertices,
+			NumMeshBlocks
+		};
+
+		/// An object the client doesn't need to resend when resuming the session.
+		/// See FromServer::Hello.
+		struct SessionObjectKey
+		{
+			/// FromClient::Mesh, Item, Light, etc.
+			uint8_t		messageType;
+			/// Mesh ID for items, 0 otherwise.
+			uint32_t	parentId;
+			uint64_t	id;
+
+			bool operator < ( const SessionObjectKey &other ) const
+			{
+				if( messageType != other.messageType )
+					return messageType < other.messageType;
+				if( parentId != other.parentId )
+					return parentId < other.parentId;
+				return id < other.id;
+			}
+		};
+
+		/** Vertex & index buffers of a mesh. Meshes with the same content (e.g. copies of
+			the same object with modifiers, which the client sends as different meshes)
+			share them, each mesh with its own Vaos. See m_meshBufferCache.
+		*/
+		struct SharedMeshBuffers
+		{
+			/// Simplified version of the mesh. Uses the same vertex buffer.
+			struct Lod
+			{
+				/// Camera distance from which it's used
+				float									distance;
+				/// One per submesh.
+				std::vector<Ogre::IndexBufferPacked*>	indexBuffers;
+			};
+
+			/// Null if the mesh has no vertices.
+			Ogre::VertexBufferPacked				*vertexBuffer;
+			/// Vertices in use. The buffer may hold more, see createMeshBuffers.
+			uint32_t								numVertices;
+			/// Null unless vertexBuffer is BT_DYNAMIC_PERSISTENT (see setMeshBuffersDynamic),
+			/// in which case it holds the latest vertex data, since dynamic buffers
+			/// can't keep a shadow copy. Allocated with OGRE_MALLOC_SIMD.
+			void									*dynamicVertexData;
+			/// Dynamic buffers have one region per frame in flight; every map moves on to
+			/// the next one. Vertices [first; second) of each region are older than
+			/// dynamicVertexData. See refreshDynamicMeshBuffers.
+			std::vector< std::pair<uint32_t, uint32_t> >	staleVertices;
+			/// Region of a dynamic vertexBuffer that was mapped last, i.e. the one the GPU reads.
+			uint8_t									dynamicRegion;
+			/// One per submesh.
+			std::vector<Ogre::IndexBufferPacked*>	indexBuffers;
+			/// Indices in use, one per submesh. Buffers may hold more, see createMeshBuffers.
+			std::vector<uint32_t>					numIndices;
+			/// Empty until MeshLodBuilder is done with them. See attachFinishedLods.
+			std::vector<Lod>						lods;
+			/// MeshLodJob::jobId of the LODs being built for these buffers. 0 if none.
+			uint32_t								lodJobId;
+			/// Which entry of the material table each submesh uses.
+			std::vector<uint16_t>					uniqueMaterials;
+			Ogre::Aabb								aabb;
+			/// Number of meshes using these buffers.
+			uint32_t								refCount;
+			MeshContentHash							contentHash;
+			/// False if the buffers can't be found in m_meshBufferCache, e.g. because
+			/// they were patched and no longer match contentHash.
+			bool									isInCache;
+		};
+
 		struct BlenderMesh
 		{
 			BlenderItemVec	items;
 			Ogre::Mesh		*meshPtr;
+			SharedMeshBuffers *buffers;
 
 			Ogre::String	userFriendlyName;
 
-			BlenderItemVec::iterator findItem( uint32_t itemId );
+			/// Render sync in which the current edit window started. See noteMeshEdit.
+			uint32_t		editWindowStart;
+			/// Edits since editWindowStart.
+			uint32_t		numWindowEdits;
+		};
+
+		/// Where to find an item. See m_itemIndex.
+		struct BlenderItemLocation
+		{
+			BlenderMesh	*mesh;
+			/// Index into mesh->items
+			uint32_t	slot;
+
+			BlenderItemLocation() : mesh( 0 ), slot( 0 ) {}
+			BlenderItemLocation( BlenderMesh *_mesh, uint32_t _slot ) :
+				mesh( _mesh ), slot( _slot ) {}
+		};
+
+		/// Everything the client sent us in the last FromClient::Mesh (patched by every
+		/// FromClient::MeshDelta since), plus how it maps to the GPU vertex buffer.
+		struct BlenderMeshSource
+		{
+			Ogre::String					meshName;
+			bool							hasColour;
+			uint8_t							numUVs;
+			uint8_t							tangentUVSource;
+			/// See Network::VertexFormat
+			uint8_t							vertexFormat;
+			/// See Network::VertexCacheMode
+			uint8_t							vertexCacheMode;
+			/// Whether prepareMesh reorders for the vertex cache. Part of the content hash.
+			bool							optimizeVertexCache;
+			/// DergoSystem::m_numRenderSyncs when the mesh last changed.
+			uint32_t						lastChangeSync;
+			/// LODs to build on top of the full mesh. 0 for none.
+			uint8_t							numLods;
+			/// Percentage of the triangles of the previous level each LOD keeps.
+			uint8_t							lodQuality;
+			std::vector<BlenderFace>		faces;
+			std::vector<BlenderFaceColour>	faceColour;
+			std::vector<BlenderFaceUv>		faceUv;
+			std::vector<BlenderRawVertex>	rawVertices;
+			std::vector<uint32_t>			materialTable;
+			/// See hashMeshSource
+			MeshContentHash					contentHash;
+			MeshContentHash					blockHashes[NumMeshBlocks];
+
+			/// Derived from the last successful build. If empty, the mesh can't be patched.
+			Ogre::FastArray<uint32_t>		vertexConversionLut;
+			MeshPatchMap					patchMap;
+			Ogre::Aabb						aabb;
+			/// blockHashes of the data vertexConversionLut & aabb were derived from.
+			/// Lets prepareMesh skip what doesn't need to be redone.
+			MeshContentHash					derivedBlockHashes[NumMeshBlocks];
+			/// 0 if there are no tangents
+			uint32_t						tangentStride;
+			uint32_t						tangentUvStride;
+
+			BlenderMeshSource() :
+				hasColour( false ), numUVs( 0 ), tangentUVSource( 255 ),
+				vertexFormat( Network::VertexFormat::Full ),
+				vertexCacheMode( Network::VertexCacheMode::Auto ), optimizeVertexCache( false ),
+				lastChangeSync( 0 ), numLods( 0 ), lodQuality( 50u ), aabb( Ogre::Aabb::BOX_NULL ), tangentStride( 0 ), tangentUvStride( 0 )
+			{
+				contentHash.value[0] = 0;
+				contentHash.value[1] = 0;
+				memset( blockHashes, 0, sizeof(blockHashes) );
+				memset( derivedBlockHashes, 0, sizeof(derivedBlockHashes) );
+			}
+
+			void swap( BlenderMeshSource &other );
+		};
+
+		/// A FromClient::Mesh already parsed & prepared (by the decode thread),
+		/// waiting for commitMesh to hand it over to Ogre.
+		struct DecodedMesh : public DecodedMessage
+		{
+			uint32_t								meshId;
+			/// See FromServer::Hello
+			uint64_t								payloadDigest;
+			BlenderMeshSource						source;
+			/// False if prepareMesh was skipped because we expect to find the
+			/// buffers in m_meshBufferCache. Everything below is then empty.
+			bool									isPrepared;
+			Ogre::VertexElement2VecVec				vertexElements;
+			uint32_t								optimizedNumVertices;
+			Ogre::FreeOnDestructor					vertexData;
+			/// 32 bits only if optimizedNumVertices doesn't fit in 16 bits.
+			Ogre::IndexBufferPacked::IndexType		indexType;
+			/// Index data, one entry per submesh, already in indexType. We own the
+			/// pointers until createMeshBuffers hands them over to the index buffers.
+			std::vector<SubMeshIndices>				indices;
+			/// Holds references to source.materialTable[], one per submesh, each
+			/// entry is unique (i.e. no duplicates)
+			std::vector<uint16_t>					uniqueMaterials;
+			/// LODs to build for the buffers we're about to create. See createLodJob.
+			MeshLodJob								*lodJob;
+
+			DecodedMesh() : meshId( 0 ), payloadDigest( 0 ), isPrepared( false ), optimizedNumVertices( 0 ), vertexData( 0 ),
+				indexType( Ogre::IndexBufferPacked::IT_16BIT ), lodJob( 0 ) {}
+			virtual ~DecodedMesh()		{ freeIndices(); delete lodJob; }
+
+			void freeIndices();
 		};
 
+		class ItemTransformBatchTask;
+
 		struct BlenderLight
 		{
 			uint32_t	id;
@@ -155,11 +371,77 @@ namespace DERGO
 		typedef std::vector<BlenderEmpty> BlenderEmptyVec;
 		typedef std::vector<BlenderMaterial> BlenderMaterialVec;
 		typedef std::map<uint32_t, BlenderMesh> BlenderMeshMap;
+		typedef std::map<uint32_t, BlenderMeshSource> BlenderMeshSourceMap;
+		typedef std::map<MeshContentHash, SharedMeshBuffers*> MeshBufferCacheMap;
 		typedef std::vector<ItemData> ItemDataVec;
 		typedef std::map<Ogre::IdString, Ogre::String> TexAliasToFullPathMap;
 		typedef std::map<uint32_t, VctDirtyMode> VctDirtyModeMap;
+		typedef std::map<SessionObjectKey, uint64_t> SessionManifestMap;
 
 		BlenderMeshMap		m_meshes;
+		/// Index of every item in m_meshes, by getItemKey( meshId, itemId ). Avoids having to
+		/// scan BlenderMesh::items when a mesh has lots of instances (e.g. vegetation).
+		FlatIdMap<BlenderItemLocation> m_itemIndex;
+		/// Kept separate from m_meshes because BlenderMesh gets copied around by value.
+		BlenderMeshSourceMap m_meshSources;
+		/// Number of FromClient::Render received. See optimizeStaticMeshes.
+		uint32_t			m_numRenderSyncs;
+		/// Renders without changes after which a VertexCacheMode::Auto mesh gets optimised.
+		static const uint32_t c_vertexCacheStaticSyncs = 60u;
+		/// Max LODs per mesh, on top of the full mesh.
+		static const uint8_t c_maxMeshLods = 4u;
+		/// Meshes with fewer triangles are cheap enough without LODs.
+		static const uint32_t c_minLodTriangles = 4096u;
+		/// Extra room buffers get when a mesh outgrows them, in percent of what's needed.
+		/// Buffers are replaced once less than a fourth of them is in use.
+		static const uint32_t c_meshBufferGrowthPercent = 50u;
+		/// Meshes edited this many times within c_dynamicMeshEditWindow renders get dynamic
+		/// vertex buffers, so their edits skip the staging buffers. See noteMeshEdit.
+		static const uint32_t c_dynamicMeshMinEdits = 8u;
+		static const uint32_t c_dynamicMeshEditWindow = 16u;
+		/// Renders without changes after which dynamic vertex buffers go back to BT_DEFAULT.
+		static const uint32_t c_dynamicMeshIdleSyncs = 30u;
+		/// Buffers of every mesh, by content. Only modified from the main thread, with
+		/// m_meshBufferCacheMutex held since the decode thread looks it up too.
+		MeshBufferCacheMap	m_meshBufferCache;
+		Ogre::LightweightMutex m_meshBufferCacheMutex;
+		/// Decode thread only. Last meshes prepared, which may not have reached
+		/// m_meshBufferCache yet. Ring buffer.
+		static const size_t c_numRecentlyPreparedMeshes = 128u;
+		MeshContentHash		m_recentlyPreparedMeshes[c_numRecentlyPreparedMeshes];
+		size_t				m_nextRecentlyPreparedMesh;
+		/// What prepareMesh derived from a mesh, so the next version of it can start from there.
+		struct PreparedMeshHistory
+		{
+			uint32_t					meshId;
+			MeshContentHash				derivedBlockHashes[NumMeshBlocks];
+			Ogre::FastArray<uint32_t>	vertexConversionLut;
+			Ogre::Aabb					aabb;
+
+			PreparedMeshHistory() : meshId( 0 ), aabb( Ogre::Aabb::BOX_NULL )
+			{
+				memset( derivedBlockHashes, 0, sizeof(derivedBlockHashes) );
+			}
+		};
+		/// Decode thread only. Last meshes prepared, with their LUT (empty if the entry
+		/// is unused). Kept small since a user mostly edits one mesh at a time. Ring buffer.
+		static const size_t c_numPreparedMeshHistory = 4u;
+		PreparedMeshHistory	m_preparedMeshHistory[c_numPreparedMeshHistory];
+		size_t				m_nextPreparedMeshHistory;
+		/// Keeps prepared meshes on disk between runs, see loadMeshFromDiskCache.
+		/// Size cap of the disk cache, in bytes. 0 disables it (the default).
+		uint64_t			m_meshDiskCacheMaxBytes;
+		/// Decode thread only (after initialize). What the files in the disk cache add up to.
+		uint64_t			m_meshDiskCacheBytes;
+		/// Empty if the disk cache is disabled or the folder couldn't be created.
+		Ogre::String		m_meshDiskCacheFolder;
+		/// The disk cache folder, for listing and evicting its files. See trimMeshDiskCache.
+		Ogre::Archive		*m_meshDiskCacheArchive;
+		/// Meshes currently being edited, which aren't worth saving to the disk cache since
+		/// their next version is about to replace them. Only modified from the main thread,
+		/// with m_meshesUnderEditMutex held since the decode thread looks it up too.
+		std::set<uint32_t>	m_meshesUnderEdit;
+		Ogre::LightweightMutex m_meshesUnderEditMutex;
 		BlenderLightVec		m_lights;
 		BlenderEmptyVec		m_empties;
 		BlenderMaterialVec	m_materials;
@@ -191,6 +473,57 @@ namespace DERGO
 		WindowMap	m_renderWindows;
 		WindowEventListener	*m_windowEventListener;
 
+		/// Worker threads for preparing meshes outside the render thread.
+		ScalableTaskPool	*m_taskPool;
+
+		/// Builds mesh LODs in the background.
+		MeshLodBuilder		*m_lodBuilder;
+		/// Last MeshLodJob::jobId handed out.
+		uint32_t			m_nextLodJobId;
+
+		/// Staging memory a rendered frame gets downloaded to, and sent to the client from.
+		struct ReadbackSlot
+		{
+			Ogre::AsyncTextureTicket	*ticket;
+			uint32_t					width;
+			uint32_t					height;
+			Ogre::PixelFormatGpu		pixelFormat;
+			bool						isMapped;
+			/// True while the network may still be reading from the mapped memory.
+			/// Cleared from the network thread.
+			std::atomic<bool>			inFlight;
+		};
+
+		/// Lets us render the next frame while the previous one is still being sent.
+		static const size_t c_numReadbackSlots = 2u;
+		ReadbackSlot		m_readbackSlots[c_numReadbackSlots];
+		size_t				m_nextReadbackSlot;
+
+		/// Changes every time the scene gets reset. See FromClient::Hello.
+		uint64_t			m_sessionId;
+		/// Seconds we keep the scene after the last client disconnects. 0 to reset right away.
+		uint32_t			m_sessionGracePeriod;
+		/// Digest of the last message applied to each object since the last reset.
+		SessionManifestMap	m_sessionManifest;
+
+		/// See FromServer::Stats.
+		uint32_t			m_numItemsCreated;
+		uint32_t			m_numMeshesRecreated;
+		uint32_t			m_numMeshesRebound;
+		uint32_t			m_numMeshesUpdatedInPlace;
+
+		/// Compresses the rendered frames, if the client asked for it.
+		ResultEncoder		m_resultEncoder;
+
+		/** Sends the contents of the texture to the client as a FromServer::Result.
+			Waits for the download of the texture (but not for the whole GPU). Raw
+			pixels go to the socket straight from the mapped staging memory.
+		*/
+		void sendRenderResult( Ogre::TextureGpu *rtt, bufferevent *bev,
+							   NetworkSystem &networkSystem );
+		static void readbackSlotSent( void *userData );
+		void destroyReadbackSlots();
+
 		virtual void loadResources(void);
 
 		/** Reads the world data, and updates overall scene settings.
@@ -228,52 +561,230 @@ namespace DERGO
 		/// However in our particular case sharing the vertex buffer is very convenient and
 		/// efficient, thus we need to manually destroy the Vaos to prevent Ogre from trying
 		/// to delete the same vertex buffer multiple times.
-		void destroyMeshVaos( Ogre::Mesh *mesh );
+		/// The buffers themselves may be shared with other meshes, and are only destroyed
+		/// once no mesh uses them anymore.
+		void destroyMeshVaos( const BlenderMesh &meshEntry );
+
+		/** Hashes everything that ends up in the GPU buffers. The material table doesn't,
+			so the same mesh with different materials still gets the same hash. Thread safe.
+		@remarks
+			Fills source.blockHashes, then source.contentHash, which is the hash of those.
+		*/
+		static void hashMeshSource( BlenderMeshSource &source );
+
+		/// Decode thread only. True if we expect commitMesh to find this content in
+		/// m_meshBufferCache, in which case there's no need to prepare it.
+		bool isMeshBufferCached( const MeshContentHash &contentHash );
+
+		/// Makes buffers findable in m_meshBufferCache by their contentHash,
+		/// unless other buffers with the same content already are.
+		void cacheMeshBuffers( SharedMeshBuffers *buffers );
+		/// Makes buffers no longer findable in m_meshBufferCache. Call it before modifying them.
+		void uncacheMeshBuffers( SharedMeshBuffers *buffers );
+
+		/** Reads the mesh data, and hashes it. Thread safe.
+		@param smartData
+			Network data from client.
+		@param outMesh [out]
+			Where to store the mesh ID and its source data.
+		*/
+		void syncMesh( Network::SmartData &smartData, DecodedMesh &outMesh );
+		/// Same as syncMesh, for FromClient::MeshLoops. Each polygon becomes a BlenderFace,
+		/// so the result is indistinguishable from what syncMesh produces.
+		void syncMeshLoops( Network::SmartData &smartData, DecodedMesh &outMesh );
+
+		/** Deindexes, welds and splits the source data into submeshes, ready for commitMesh.
+			Thread safe; doesn't touch Ogre nor anything else in DergoSystem but m_taskPool.
+		*/
+		void prepareMesh( DecodedMesh &decodedMesh );
+
+		/// Decode thread only. Gives decodedMesh.source what we derived from its mesh the last
+		/// time we prepared it (if we remember it), so prepareMesh can skip stages.
+		void restorePreparedMeshHistory( DecodedMesh &decodedMesh );
+		/// Decode thread only. Remembers what prepareMesh derived from decodedMesh.
+		void storePreparedMeshHistory( const DecodedMesh &decodedMesh );
+
+		/// File where the prepared mesh with this content is kept. Thread safe.
+		Ogre::String getMeshDiskCacheFilename( const MeshContentHash &contentHash ) const;
+
+		/** Deletes the least recently used files of the disk cache (by modification time,
+			which loadMeshFromDiskCache refreshes) until they add up to no more than maxBytes.
+			Also recounts m_meshDiskCacheBytes. Decode thread only (after initialize).
+		*/
+		void trimMeshDiskCache( uint64_t maxBytes );
+
+		/// Main thread only. Flags or unflags a mesh as being edited. See m_meshesUnderEdit.
+		void setMeshUnderEdit( uint32_t meshId, bool underEdit );
+		/// Main thread only. Unflags meshes that stopped being edited (see
+		/// c_dynamicMeshIdleSyncs). Meant to be called once per render.
+		void expireMeshesUnderEdit();
+		/// Thread safe. See m_meshesUnderEdit.
+		bool isMeshUnderEdit( uint32_t meshId );
+
+		/** Does the job of prepareMesh by reading what a previous run (or connection)
+			saved with saveMeshToDiskCache. Decode thread only.
+		@remarks
+			The file is laid out like the buffers we upload, with every section 16-byte
+			aligned, so loading is a few straight reads into the vertex shadow copy.
+		@return
+			False if the mesh isn't in the disk cache (or the file is stale or damaged),
+			in which case decodedMesh is left untouched.
+		*/
+		bool loadMeshFromDiskCache( DecodedMesh &decodedMesh );
+
+		/** Fills decodedMesh.lodJob with what MeshLodBuilder needs to build the LODs of a
+			prepared mesh, if it asked for LODs and is heavy enough. Thread safe.
+		@remarks
+			Positions & indices are copied, since the vertex buffer may get patched while
+			the LODs are being built.
+		*/
+		static void createLodJob( DecodedMesh &decodedMesh );
+
+		/// Sends decodedMesh.lodJob (if any) to m_lodBuilder, to build the LODs of buffers.
+		/// Whatever was being built for them before gets discarded once done.
+		void queueLodJob( DecodedMesh &decodedMesh, SharedMeshBuffers *buffers );
+
+		/** Attaches the LODs m_lodBuilder finished since the last call to their buffers,
+			and recreates the meshes using them. Must be called from the main thread.
+		*/
+		void attachFinishedLods();
+
+		/// Saves the output of prepareMesh, so that loadMeshFromDiskCache finds it next time.
+		/// Skips meshes under edit, and trims the cache if it gets past its size cap.
+		/// Decode thread only. Failing to write is not an error.
+		void saveMeshToDiskCache( const DecodedMesh &decodedMesh );
+
+		/** Checks if we need to create a new Mesh or update an existing one, does so, then
+			keeps the mesh's source data in m_meshSources. Must be called from the main thread.
+			If another mesh has the same content, its buffers are shared instead.
+		@param decodedMesh
+			Mesh after syncMesh. It gets prepared if it wasn't and it needs to. Its data is consumed.
+		*/
+		void commitMesh( DecodedMesh &decodedMesh );
 
-		/** Reads the mesh data, prepares/compacts it, then checks if we need
-			to create a new Mesh or update an existing one.
+		/// Assigns the datablocks in the mesh's material table to its submeshes & items.
+		void setupMeshMaterials( const BlenderMesh &meshEntry,
+								 const std::vector<uint32_t> &materialTable );
+
+		/// Hashes & prepares m_meshSources[meshId] again and commits it. Blocks the main thread.
+		void buildMesh( uint32_t meshId );
+
+		/** Rebuilds, reordered for the vertex cache, one VertexCacheMode::Auto mesh that
+			hasn't changed in the last c_vertexCacheStaticSyncs renders. Only one per call
+			since it blocks the main thread; meant to be called once per render.
+		*/
+		void optimizeStaticMeshes();
+
+		/** Reads the dirty raw vertices & face normals of a mesh we already have, and
+			patches the GPU buffers in place. Rebuilds the mesh if it can't be patched.
 		@param smartData
 			Network data from client.
+		@return
+			False if failed to sync due to an error. e.g. the mesh ID does not exist or
+			the client's topology does not match ours.
 		*/
-		void syncMesh( Network::SmartData &smartData );
+		bool syncMeshDelta( Network::SmartData &smartData );
+
+		/** Updates the GPU vertices affected by the given raw vertices and faces (whose
+			data in 'source' must already be up to date), including tangents and bounds.
+		@return
+			False if the mesh can't be patched in place (e.g. an affected GPU vertex was
+			welded from raw vertices that are now different) and must be rebuilt.
+		*/
+		bool patchMesh( uint32_t meshId, BlenderMeshSource &source,
+						const std::vector<uint32_t> &dirtyRawVertices,
+						const std::vector<uint32_t> &dirtyFaces );
+
+		/** Creates the GPU buffers of a mesh, and adds them to m_meshBufferCache.
+		@param decodedMesh
+			Prepared mesh. Its vertex data is consumed.
+		@param reserveGrowth
+			True to make the buffers bigger than needed, so that further edits of the
+			mesh can go through updateMesh even if it grows a bit.
+			See c_meshBufferGrowthPercent.
+		@param dynamic
+			True to make the vertex buffer BT_DYNAMIC_PERSISTENT, for meshes being edited
+			at interactive rates. See setMeshBuffersDynamic.
+		@return
+			New buffers, not used by any mesh yet.
+		*/
+		SharedMeshBuffers* createMeshBuffers( DecodedMesh &decodedMesh, bool reserveGrowth,
+											  bool dynamic );
+
+		/** Counts an edit of an existing mesh (i.e. updated, patched or given new buffers).
+		@return
+			True if it got at least c_dynamicMeshMinEdits edits within the current window
+			of c_dynamicMeshEditWindow renders, i.e. it's being edited at interactive rates.
+		*/
+		bool noteMeshEdit( BlenderMesh &meshEntry );
+
+		/** Swaps the vertex buffer for a BT_DYNAMIC_PERSISTENT one (whose contents are then
+			kept in buffers->dynamicVertexData) or back to BT_DEFAULT, keeping its contents.
+			The meshes using the buffers are rebound to the new one.
+		*/
+		void setMeshBuffersDynamic( SharedMeshBuffers *buffers, bool dynamic );
+
+		/** Makes dynamic vertex buffers go back to BT_DEFAULT.
+		@param onlyIdle
+			True to only demote those of meshes that stopped being edited (see
+			c_dynamicMeshIdleSyncs) or that got shared. Meant to be called once per render.
+			False to demote all, e.g. so their contents can be read back.
+		*/
+		void demoteDynamicMeshBuffers( bool onlyIdle );
+
+		/** Brings the dynamic vertex buffers up to date, by mapping the next region of those
+			that changed and copying what it's missing. Must be called right before rendering.
+		@remarks
+			Dynamic buffers can only be mapped once per frame, thus each render
+			must be followed by the end of the frame (see RenderSystem::_update).
+		*/
+		void refreshDynamicMeshBuffers();
 
 		/** Creates a mesh.
 		@param meshName
 			Name of the mesh
-		@param optimizedNumVertices
-			Number of vertices, already shrunk down.
-		@param vertexElements
-			Vertex format for the mesh.
-		@param vertexDataPtrContainer [in/out]
-			Container holding the vertex data.
-		@param indices
-			Index data, one entry per submesh.
-		*/
-		void createMesh( uint32_t meshId, const Ogre::String &meshName, uint32_t optimizedNumVertices,
-						 const Ogre::VertexElement2VecVec &vertexElements,
-						 Ogre::FreeOnDestructor &vertexDataPtrContainer,
-						 const std::vector< std::vector<uint32_t> > &indices,
-						 const Ogre::Aabb &aabb );
+		@param buffers
+			Buffers to use. They may be shared with other meshes.
+		*/
+		void createMesh( uint32_t meshId, const Ogre::String &meshName,
+						 SharedMeshBuffers *buffers );
+
+		/// Creates the submeshes of meshPtr (which must have none), with their Vaos,
+		/// LOD values and bounds taken from the buffers.
+		void attachMeshBuffers( Ogre::Mesh *meshPtr, SharedMeshBuffers *buffers );
+
+		/// True if the decoded mesh fits in meshEntry's buffers, see updateMesh.
+		bool canUpdateMesh( const BlenderMesh &meshEntry, const DecodedMesh &decodedMesh ) const;
 
 		/** Updates an existing mesh with new content.
-			Assumes caller already knows we can do that.
+			Assumes caller already knows we can do that (i.e. its buffers aren't shared).
 		@param meshEntry
 			Existing mesh entry to update.
 		*/
-		void updateMesh( const BlenderMesh &meshEntry, uint32_t optimizedNumVertices,
-						 Ogre::FreeOnDestructor &vertexDataPtrContainer,
-						 const std::vector< std::vector<uint32_t> > &indices,
-						 const Ogre::Aabb &aabb );
+		void updateMesh( const BlenderMesh &meshEntry, DecodedMesh &decodedMesh );
 
 		/** Destroys existing mesh, creates it again, then restores all asociated items.
+			Only needed when the vertex format changes, see replaceMeshBuffers.
 		@param meshEntry
 			Existing mesh entry to update. Must be a hard copy.
+		@param buffers
+			See createMesh.
+		*/
+		void recreateMesh( uint32_t meshId, BlenderMesh meshEntry, SharedMeshBuffers *buffers );
+
+		/** Makes an existing mesh use other buffers. Keeps the Ogre::Mesh, its Items and
+			their SceneNodes; only their submeshes are rebuilt.
+		@param meshEntry
+			Existing mesh entry to update.
+		@param buffers
+			See createMesh. Must have the same vertex format as the current ones.
 		*/
-		void recreateMesh( uint32_t meshId, BlenderMesh meshEntry, uint32_t optimizedNumVertices,
-						   const Ogre::VertexElement2VecVec &vertexElements,
-						   Ogre::FreeOnDestructor &vertexDataPtrContainer,
-						   const std::vector< std::vector<uint32_t> > &indices,
-						   const Ogre::Aabb &aabb );
+		void rebindMesh( BlenderMesh &meshEntry, SharedMeshBuffers *buffers );
+
+		/// Calls rebindMesh, or recreateMesh if the vertex format changed.
+		/// Warning: invalidates iterators to m_meshes.
+		void replaceMeshBuffers( uint32_t meshId, BlenderMesh &meshEntry,
+								 SharedMeshBuffers *buffers );
 
 		/** Reads item data from network, and updates the existing one.
 			Creates a new one if doesn't exist.
@@ -284,11 +795,27 @@ namespace DERGO
 		*/
 		bool syncItem( Network::SmartData &smartData );
 
+		/** Reads the transforms of many items of the same mesh at once (in SoA form), and
+			applies them in parallel. Items must already exist.
+		@param smartData
+			Network data from client.
+		@return
+			False if failed to sync due to an error. e.g. an item does not exist.
+		*/
+		bool syncItemTransformBatch( Network::SmartData &smartData );
+
+		static uint64_t getItemKey( uint32_t meshId, uint32_t itemId )
+		{
+			return (static_cast<uint64_t>( meshId ) << 32u) | itemId;
+		}
+
 		/** Creates an Item at the given parameters
+		@param meshId
+			ID of blenderMesh
 		@param blenderMesh
 		@param itemData
 		*/
-		void createItem( BlenderMesh &blenderMesh, const ItemData &itemData );
+		void createItem( uint32_t meshId, BlenderMesh &blenderMesh, const ItemData &itemData );
 
 		/**
 		@param meshId
@@ -367,9 +894,22 @@ namespace DERGO
 		*/
 		void syncTexture( Network::SmartData &smartData );
 
-		/// Destroys everything. Useful for resync'ing
+		/// Destroys everything and starts a new session. Useful for resync'ing
 		void reset();
 
+		/// Keeps m_sessionManifest up to date with a message that is about to be processed.
+		void updateSessionManifest( const Network::MessageHeader &header,
+									const Network::SmartData &smartData,
+									DecodedMessage *decodedMessage );
+
+		/** Resumes the session the client asks for, if we still have it. Otherwise resets
+			and starts a new one. Either way, replies with a FromServer::Hello.
+		@param smartData
+			Network data from client.
+		*/
+		void syncHello( Network::SmartData &smartData, bufferevent *bev,
+						NetworkSystem &networkSystem );
+
 		void exportToFile( Network::SmartData &smartData );
 
 	public:
@@ -382,11 +922,26 @@ namespace DERGO
 		virtual void chooseSceneManager();
 		virtual Ogre::CompositorWorkspace* setupCompositor(void);
 
+		/// @coppydoc NetworkListener::decodeMessage
+		virtual DecodedMessage* decodeMessage( const Network::MessageHeader &header,
+											   Network::SmartData &smartData );
 		/// @coppydoc NetworkListener::processMessage
 		virtual void processMessage( const Network::MessageHeader &header, Network::SmartData &smartData,
+									 DecodedMessage *decodedMessage,
 									 bufferevent *bev, NetworkSystem &networkSystem );
 		/// @coppydoc NetworkListener::allConnectionsTerminated
 		virtual void allConnectionsTerminated();
+		/// @coppydoc NetworkListener::idleTimeout
+		virtual void idleTimeout();
+
+		/// See m_sessionGracePeriod. Use it as the NetworkSystem's idle timeout.
+		void setSessionGracePeriod( uint32_t seconds )		{ m_sessionGracePeriod = seconds; }
+		uint32_t getSessionGracePeriod() const				{ return m_sessionGracePeriod; }
+
+		/// Size cap of the disk cache of prepared meshes, in bytes. 0 disables it (the default).
+		/// Must be set before initialize.
+		void setMeshDiskCacheMaxSize( uint64_t bytes )		{ m_meshDiskCacheMaxBytes = bytes; }
+		uint64_t getMeshDiskCacheMaxSize() const			{ return m_meshDiskCacheMaxBytes; }
 
 		// HlmsJsonListener overload
 		virtual void savingChangeTextureName( Ogre::String &inOutAliasName, Ogre::String &inOutTexName );
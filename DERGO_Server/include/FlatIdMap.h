@@ -0,0 +1,138 @@
+#pragma once
+
+#include "DergoCommon.h"
+
+#include <stddef.h>
+#include <vector>
+
+namespace DERGO
+{
+	/** Hash map from a 64-bit id to T, stored in a single flat array.
+		Uses open addressing with linear probing, and backward shift deletion so
+		that lookups never have to skip over tombstones.
+	@remarks
+		Capacity is always a power of 2 and the table is kept at most half full.
+	*/
+	template <typename T>
+	class FlatIdMap
+	{
+		struct Entry
+		{
+			uint64_t	key;
+			T			value;
+			bool		used;
+
+			Entry() : key( 0 ), value(), used( false ) {}
+		};
+
+		std::vector<Entry>	m_entries;
+		size_t				m_size;
+
+		static size_t hashKey( uint64_t key )
+		{
+			//splitmix64 finalizer
+			key ^= key >> 30u;
+			key *= 0xBF58476D1CE4E5B9ull;
+			key ^= key >> 27u;
+			key *= 0x94D049BB133111EBull;
+			key ^= key >> 31u;
+			return static_cast<size_t>( key );
+		}
+
+		size_t findSlot( uint64_t key ) const
+		{
+			const size_t mask = m_entries.size() - 1u;
+			size_t slot = hashKey( key ) & mask;
+			while( m_entries[slot].used && m_entries[slot].key != key )
+				slot = (slot + 1u) & mask;
+			return slot;
+		}
+
+		void rehash( size_t newCapacity )
+		{
+			std::vector<Entry> oldEntries( newCapacity );
+			oldEntries.swap( m_entries );
+
+			typename std::vector<Entry>::const_iterator itor = oldEntries.begin();
+			typename std::vector<Entry>::const_iterator end  = oldEntries.end();
+
+			while( itor != end )
+			{
+				if( itor->used )
+					m_entries[findSlot( itor->key )] = *itor;
+				++itor;
+			}
+		}
+
+	public:
+		FlatIdMap() : m_entries( 16u ), m_size( 0 ) {}
+
+		size_t size() const		{ return m_size; }
+
+		/// @return Null if the key isn't in the map.
+		T* find( uint64_t key )
+		{
+			Entry &entry = m_entries[findSlot( key )];
+			return entry.used ? &entry.value : 0;
+		}
+
+		/// @return Null if the key isn't in the map.
+		const T* find( uint64_t key ) const
+		{
+			const Entry &entry = m_entries[findSlot( key )];
+			return entry.used ? &entry.value : 0;
+		}
+
+		/// Inserts the key, or overwrites its value if it was already there.
+		void insert( uint64_t key, const T &value )
+		{
+			if( (m_size + 1u) * 2u > m_entries.size() )
+				rehash( m_entries.size() * 2u );
+
+			Entry &entry = m_entries[findSlot( key )];
+			if( !entry.used )
+			{
+				entry.key	= key;
+				entry.used	= true;
+				++m_size;
+			}
+			entry.value = value;
+		}
+
+		/// @return False if the key wasn't in the map.
+		bool erase( uint64_t key )
+		{
+			const size_t mask = m_entries.size() - 1u;
+			size_t slot = findSlot( key );
+			if( !m_entries[slot].used )
+				return false;
+
+			//Move back the entries after the one we're removing that would
+			//otherwise become unreachable, until we find a free slot.
+			size_t next = (slot + 1u) & mask;
+			while( m_entries[next].used )
+			{
+				const size_t idealSlot = hashKey( m_entries[next].key ) & mask;
+				//Can the entry at 'next' be moved to 'slot'? Only if its ideal slot
+				//isn't cyclically inside (slot; next]
+				if( ((next - idealSlot) & mask) >= ((next - slot) & mask) )
+				{
+					m_entries[slot] = m_entries[next];
+					slot = next;
+				}
+				next = (next + 1u) & mask;
+			}
+
+			m_entries[slot] = Entry();
+			--m_size;
+
+			return true;
+		}
+
+		void clear()
+		{
+			std::vector<Entry>( 16u ).swap( m_entries );
+			m_size = 0;
+		}
+	};
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "VertexUtils.h"
+#include "Network/SpscQueue.h"
+#include "Threading/OgreThreads.h"
+#include "Threading/OgreLightweightMutex.h"
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+namespace DERGO
+{
+	/// Input & output of MeshLodBuilder for one mesh.
+	struct MeshLodJob
+	{
+		/// Tells which buffers the LODs are for. See DergoSystem::SharedMeshBuffers::lodJobId
+		uint32_t	jobId;
+		/// Max number of LODs to build, on top of the full mesh.
+		uint8_t		numLods;
+		/// Fraction of the triangles of the previous level each level keeps, in (0; 1).
+		float		reduction;
+		/// Of the mesh's bounds. Limits how far the simplification may go.
+		float		radius;
+		bool		use32BitIndices;
+
+		/// float3 per vertex
+		std::vector<float>					positions;
+		/// Triangle list of each submesh
+		std::vector< std::vector<uint32_t> >	subMeshIndices;
+
+		/// Output. One entry per LOD built (may be fewer than numLods),
+		/// each with one entry per submesh, in the index type the mesh uses.
+		std::vector< std::vector<SubMeshIndices> >	lods;
+		/// Output. Camera distance from which each LOD is used.
+		std::vector<float>					lodDistances;
+
+		MeshLodJob() : jobId( 0 ), numLods( 0 ), reduction( 0.5f ), radius( 0 ),
+			use32BitIndices( false ) {}
+		~MeshLodJob();
+	};
+
+	/** Simplifies meshes into LODs in a thread of its own, so that heavy meshes never
+		block the sync. Jobs are queued from the main thread, which collects them
+		back whenever it can (e.g. once per render).
+	@remarks
+		Jobs are processed in order, one at a time.
+	*/
+	class MeshLodBuilder
+	{
+		SpscQueue<MeshLodJob*>		m_pendingJobs;
+		/// Jobs that didn't fit in m_pendingJobs yet. Main thread only.
+		std::deque<MeshLodJob*>		m_backlog;
+		std::vector<MeshLodJob*>	m_finishedJobs;
+		Ogre::LightweightMutex		m_finishedJobsMutex;
+		std::atomic<bool>			m_exit;
+		Ogre::ThreadHandleVec		m_threads;
+
+		void flushBacklog();
+
+	public:
+		MeshLodBuilder();
+		/// Jobs not finished by then are discarded.
+		~MeshLodBuilder();
+
+		/// Takes ownership of the job. Never blocks.
+		void queueJob( MeshLodJob *job );
+
+		/// Appends every job finished since the last call to outJobs, which owns them now.
+		void collectFinishedJobs( std::vector<MeshLodJob*> &outJobs );
+
+		/// Does the actual work of a job. Thread safe.
+		static void buildLods( MeshLodJob &job );
+
+		void _builderThread();
+	};
+}
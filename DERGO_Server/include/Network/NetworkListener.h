@@ -14,20 +14,51 @@ namespace DERGO
 {
 	class NetworkSystem;
 
+	/// Whatever a NetworkListener prepared for a message in NetworkListener::decodeMessage
+	class DecodedMessage
+	{
+	public:
+		virtual ~DecodedMessage() {}
+	};
+
 	class NetworkListener
 	{
 	public:
 
+		/** Called from the decode thread, in order, before the message reaches processMessage.
+			Lets the listener do the CPU heavy part of a message (e.g. prepare a mesh) while
+			the previous messages are still being processed.
+		@remarks
+			Runs concurrently with processMessage, thus it must not touch any state that
+			processMessage may be using.
+			Only one listener may decode a given message. Listeners after the first one
+			returning non-null won't be asked.
+		@param header
+			The header of the message
+		@param smartData
+			It is guaranteed to hold header.sizeBytes data starting from smartData.getCurrentPtr()
+		@return
+			Data to hand over to processMessage, or null if there is nothing to decode.
+			NetworkSystem deletes it once processMessage returns.
+		*/
+		virtual DecodedMessage* decodeMessage( const Network::MessageHeader &header,
+											   Network::SmartData &smartData )		{ return 0; }
+
 		/**
 		@param header
 			The header of the message
 		@param smartData
 			It is guaranteed to hold header.sizeBytes data starting from smartData.getCurrentPtr()
+		@param decodedMessage
+			What this listener's decodeMessage returned for this message. May be null.
 		@param bev
 		@param networkSystem
 		*/
 		virtual void processMessage( const Network::MessageHeader &header, Network::SmartData &smartData,
+									 DecodedMessage *decodedMessage,
 									 bufferevent *bev, NetworkSystem &networkSystem ) = 0;
 		virtual void allConnectionsTerminated() {}
+		/// Called once nobody has been connected for as long as NetworkSystem::setIdleTimeout says.
+		virtual void idleTimeout() {}
 	};
 }
@@ -12,6 +12,9 @@ namespace Network
 		ConnectionTest,
 			//"Hello"
 		Init,
+			//Optional. Clients that don't send it get Raw results.
+			//uint8 numResultEncodings
+			//uint8 resultEncodings[numResultEncodings] (see ResultEncoding, most preferred first)
 		WorldParams,
 			//float3 skyColour
 			//float skyPower
@@ -71,6 +74,10 @@ namespace Network
 			//uint8 hasColour
 			//uint8 numUVs
 			//uint8 tangentUVSource (255 = disable tangents)
+			//uint8 vertexFormat (see VertexFormat)
+			//uint8 vertexCacheMode (see VertexCacheMode)
+			//uint8 numLods (LODs to build on top of the full mesh, up to 4. 0 = none)
+			//uint8 lodQuality (% of the triangles of the previous level each LOD keeps, 10-90)
 			//[
 			//	uint4	vertexIndices
 			//	float3	faceNormal
@@ -189,6 +196,75 @@ namespace Network
 		FinishAsync,
 		ReloadShaders,
 		Export,
+		MeshDelta,
+			//Only valid if the topology didn't change since the last Mesh or MeshLoops message
+			//(i.e. same faces, materials, colours & UVs); otherwise send a Mesh message.
+			//uint32 meshId
+			//uint32 numRawVertices (must match the last Mesh message)
+			//uint32 numFaces (must match the last Mesh message)
+			//uint32 numRawVertexRanges
+			//[
+			//	uint32 firstRawVertex
+			//	uint32 numRawVerticesInRange
+			//	[
+			//		float3 position
+			//		float3 normal
+			//	][numRawVerticesInRange]
+			//][numRawVertexRanges]
+			//uint32 numFaceNormalRanges
+			//[
+			//	uint32 firstFace
+			//	uint32 numFacesInRange
+			//	float3 faceNormal[numFacesInRange]
+			//][numFaceNormalRanges]
+		ItemTransformBatch,
+			//Updates the transform of items that already exist. Names aren't sent.
+			//uint32 meshId
+			//uint32 numItems
+			//uint32 itemIds[numItems]
+			//float3 positions[numItems]
+			//float4 quaternion/rotation[numItems]
+			//float3 scales[numItems]
+		Hello,
+			//Starts a session, or resumes the one the server kept alive since the client
+			//disconnected, see FromServer::Hello. The server answers it right away.
+			//uint64 sessionId (0 to start a new session, which resets the scene)
+		MeshLoops,
+			//Same as Mesh, but laid out the way Blender stores polygons & loops so the client
+			//can fill it with bulk copies, and corner data isn't padded to 4 per face.
+			//Polygons must be triangles or quads. They're the faces MeshDelta refers to.
+			//uint32 meshId
+			//string meshName (UTF-8)
+			//uint32 numPolygons
+			//uint32 numLoops (sum of numLoopsInPolygon)
+			//uint32 numRawVertices
+			//uint8 hasColour
+			//uint8 numUVs
+			//uint8 tangentUVSource (255 = disable tangents)
+			//uint8 vertexFormat (see VertexFormat)
+			//uint8 vertexCacheMode (see VertexCacheMode)
+			//uint8 numLods (LODs to build on top of the full mesh, up to 4. 0 = none)
+			//uint8 lodQuality (% of the triangles of the previous level each LOD keeps, 10-90)
+			//[
+			//	uint8	numLoopsInPolygon (3 or 4)
+			//	ushort	materialId -> Last bit is use_smooth
+			//	float3	polygonNormal
+			//][numPolygons]
+			//uint32 loopVertexIndex[numLoops]
+			//[
+			//	ubyte4 loopColour[numLoops] (RGBA)
+			//][hasColour]
+			//[
+			//	float2 loopUv[numLoops]
+			//][numUVs]
+			//[
+			//	float3 position
+			//	float3 normal
+			//][numRawVertices]
+			//uint16 numMaterials
+			//[uint32 materialIds]	(Table with size = numMaterials)
+		Stats,
+			//Asks for a FromServer::Stats. Meant for tests & diagnostics.
 		NumClientMessages
 	};
 	}
@@ -203,11 +279,90 @@ namespace Network
 		Result,
 			//uint16 width
 			//uint16 height
-			//[width * height * 3] Image data
+			//uint8 encoding (see ResultEncoding)
+			//Raw:
+			//	[width * height * 4] RGBA8 image data
+			//DeltaDeflate:
+			//	uint16 rowsPerBand
+			//	[
+			//		uint32 compressedSizeBytes
+			//		zlib stream of the RGBA8 rows in the band, each row minus the one above
+			//		it, byte by byte (modulo 256). The first row of each band is kept as is.
+			//	][ceil( height / rowsPerBand )]
+			//YCoCgTiles (lossy, alpha is always 255):
+			//	uint8 dirtyTiles[ceil( numTiles / 8 )]
+			//		One bit per 16x16 tile, tiles in row major order, MSB first.
+			//		numTiles = ceil( width / 16 ) * ceil( height / 16 )
+			//		Tiles not flagged didn't change since the last YCoCgTiles frame, unless
+			//		the resolution changed (in which case all tiles are sent).
+			//	[
+			//		uint8 y[16 * 16]
+			//		uint8 co[8 * 8]		(average of the 2x2 block) (r - b) / 2 + 128
+			//		uint8 cg[8 * 8]		(average of the 2x2 block) (2g - r - b) / 4 + 128
+			//	][numDirtyTiles]
+			//	Pixels outside the image repeat the last row/column.
+		Hello,
+			//Reply to FromClient::Hello. If the session was resumed, the server still has
+			//every object listed, as it was after applying the message with that digest.
+			//Resending an object whose message has the same digest is redundant.
+			//uint64 sessionId (send it in the next FromClient::Hello to resume)
+			//uint8 resumed (0 if the scene was reset)
+			//uint32 numObjects (0 if not resumed)
+			//[
+			//	uint8 messageType (FromClient::Mesh, Item, Light, Empty, Material, Texture,
+			//		WorldParams, InstantRadiosity, ParallaxCorrectedCubemaps or ShadowsSettings)
+			//	uint32 parentId (meshId for items, 0 otherwise)
+			//	uint64 id (the one the message starts with. 0 for world settings)
+			//	uint64 digest (zlib's crc32 << 32 | zlib's adler32, of the whole payload)
+			//][numObjects]
+		Stats,
+			//Reply to FromClient::Stats. Counters since the server started.
+			//uint32 numItemsCreated (including those recreated along with their mesh)
+			//uint32 numMeshesRecreated (the mesh and all its Items were destroyed & created again)
+			//uint32 numMeshesRebound (the mesh got new buffers; its Items were kept)
+			//uint32 numMeshesUpdatedInPlace (new contents uploaded to the buffers it had)
 		NumServerMessages
 	};
 	}
 
+	namespace ResultEncoding
+	{
+	enum ResultEncoding
+	{
+		Raw,
+		DeltaDeflate,
+		YCoCgTiles,
+		NumResultEncodings
+	};
+	}
+
+	namespace VertexFormat
+	{
+	enum VertexFormat
+	{
+		/// float3 position, float3 normal, ubyte4 colour, float2 uvs, float4 tangent
+		Full,
+		/// half4 position (float3 if it doesn't fit), short4 QTangent (normal + tangent),
+		/// ubyte4 colour, half2 uvs. Meshes can't be patched with MeshDelta.
+		Compact,
+		NumVertexFormats
+	};
+	}
+
+	/// Whether the server reorders a mesh's triangles & vertices for the GPU's vertex
+	/// cache. It takes a while on big meshes, so it's best skipped while editing them.
+	namespace VertexCacheMode
+	{
+	enum VertexCacheMode
+	{
+		/// Only once the mesh stops changing for a while.
+		Auto,
+		Always,
+		Never,
+		NumVertexCacheModes
+	};
+	}
+
 #define HEADER_SIZE 5
 #pragma pack( push, 1 )
 	struct MessageHeader
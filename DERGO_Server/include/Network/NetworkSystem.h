@@ -3,15 +3,24 @@
 
 #include "OgrePrerequisites.h"
 #include "Network/NetworkListener.h"
+#include "Network/SpscQueue.h"
+#include "Threading/OgreThreads.h"
+#include "OgreTimer.h"
 #include <event2/util.h>
 
+#include <atomic>
+#include <deque>
+#include <set>
+
 namespace Network
 {
 	class SmartData;
 }
 
 struct event_base;
+struct event;
 struct bufferevent;
+struct evbuffer;
 struct sockaddr;
 struct evconnlistener;
 
@@ -19,38 +28,227 @@ namespace DERGO
 {
 	/// Single-connection network manager. Process reads, creates packets for sending.
 	///	Encapusaltes libevent
+	///
+	/// Incoming messages go through a three stage pipeline so that receiving, decoding
+	/// and committing consecutive messages overlap:
+	///		1. The network thread runs libevent and only splits the stream into messages.
+	///		2. The decode thread calls NetworkListener::decodeMessage (CPU heavy work).
+	///		3. The thread that called start() calls NetworkListener::processMessage
+	///		   (i.e. everything touching Ogre) and is the only one allowed to call send.
 	class NetworkSystem
 	{
+		struct PendingMessage
+		{
+			enum Type
+			{
+				Message,
+				/// The connection is gone. 'bev' can be freed once all the
+				/// messages before this one have been processed.
+				ConnectionTerminated,
+				/// Nobody reconnected in time. See setIdleTimeout.
+				IdleTimeout,
+				/// libevent's loop is over. Nothing comes after this.
+				Quit
+			};
+
+			Type					type;
+			Network::MessageHeader	header;
+			/// Message contents (without header)
+			evbuffer				*payload;
+			bufferevent				*bev;
+			DecodedMessage			*decodedMessage;
+			/// Listener whose decodeMessage returned decodedMessage
+			NetworkListener			*decodedBy;
+			/// For ConnectionTerminated
+			bool					lastConnection;
+
+			PendingMessage() :
+				type( Quit ), payload( 0 ), bev( 0 ), decodedMessage( 0 ),
+				decodedBy( 0 ), lastConnection( false ) {}
+		};
+
+		/// Identifies the object a FromClient::Item/Light/Empty (or their
+		/// *Remove counterparts) message refers to.
+		struct CoalescingKey
+		{
+			bufferevent		*bev;
+			/// FromClient::Item, Light or Empty
+			Ogre::uint8		objectType;
+			/// Only for items
+			Ogre::uint32	meshId;
+			Ogre::uint32	id;
+
+			bool operator < ( const CoalescingKey &other ) const
+			{
+				if( bev != other.bev )
+					return bev < other.bev;
+				if( objectType != other.objectType )
+					return objectType < other.objectType;
+				if( meshId != other.meshId )
+					return meshId < other.meshId;
+				return id < other.id;
+			}
+		};
+
 		event_base *m_eventBase;
+		/// Armed while nobody is connected. Null if there's no idle timeout.
+		event		*m_idleTimeoutEvent;
+		Ogre::uint32 m_idleTimeoutSeconds;
 
-		std::vector<Ogre::uint8>		m_currentStream;
 		std::vector<Ogre::uint8>		m_stashData;
-		std::vector<Ogre::uint8>		m_rcvBuffer;
 		std::vector<NetworkListener*>	m_listeners;
 
+		/// Only accessed from the network thread
 		Ogre::uint32 m_numActiveConnections;
 
+		/// Network thread -> decode thread
+		SpscQueue<PendingMessage>	m_receivedQueue;
+		/// Network thread only. Messages that didn't fit in m_receivedQueue yet, in order.
+		/// The network thread must never block: libevent holds the bufferevent's lock
+		/// during its callbacks, and the main thread needs it to send.
+		std::deque<PendingMessage>	m_receivedBacklog;
+		/// Network thread only. Connections we stopped reading from until the backlog is gone.
+		std::set<bufferevent*>		m_pausedBevs;
+		/// Set by the network thread when m_receivedQueue is full. The decode thread
+		/// clears it and activates m_queueSpaceEvent once it makes room.
+		std::atomic<bool>			m_receiveStalled;
+		event						*m_queueSpaceEvent;
+		/// Decode thread -> main thread
+		SpscQueue<PendingMessage>	m_decodedQueue;
+
+		/// Messages the main thread grabbed from m_decodedQueue in one go.
+		std::vector<PendingMessage>	m_pendingBatch;
+		std::set<CoalescingKey>		m_coalescingKeys;
+		/// Number of messages skipped by coalescePendingBatch, per message type.
+		Ogre::uint64				m_numDroppedMessages[Network::FromClient::NumClientMessages];
+		/// m_numDroppedMessages as of the last reportDroppedMessages that printed them.
+		Ogre::uint64				m_numReportedDroppedMessages[Network::FromClient::NumClientMessages];
+		Ogre::Timer					m_timer;
+		Ogre::uint64				m_lastReportMicroseconds;
+
+		/// Stops listening to bev and tells the main thread to get rid of it.
+		void terminateConnection( bufferevent *bev );
+
+		/** Sends a message to the decode thread without blocking. Network thread only.
+		@return
+			False if it had to wait in m_receivedBacklog, in which case the caller must
+			stop reading until _queue_space_cb says there's room again.
+		*/
+		bool queueReceived( const PendingMessage &message );
+		/// Moves as much of m_receivedBacklog as fits into m_receivedQueue. If something is
+		/// left, asks the decode thread for a wake up. @return True if nothing is left.
+		bool flushReceivedBacklog();
+
+		/// Hands the message to the listeners and releases it
+		/// @return False if there won't be more messages (i.e. PendingMessage::Quit)
+		bool processPendingMessage( PendingMessage &message );
+		void destroyPendingMessage( PendingMessage &message );
+
+		/** Item, Light & Empty messages carry the whole state of the object, thus an update
+			is redundant when the same object gets updated or removed again later on.
+			Drops those from m_pendingBatch, so we don't fall behind while the client sends
+			them as fast as it can (e.g. when dragging objects or playing animations).
+		@remarks
+			Only looks at messages that were already waiting; never delays anything.
+			Updates are never skipped across a barrier, see getCoalescingBarrier.
+		*/
+		void coalescePendingBatch();
+
+		/// Prints how many updates coalescePendingBatch dropped since the last
+		/// report, if any, once every few seconds. Main thread only.
+		void reportDroppedMessages();
+
+		/**
+		@param outIsRemoval [out]
+			True if the message is ItemRemove, LightRemove or EmptyRemove.
+		@return
+			False if the message isn't eligible for coalescing.
+		*/
+		static bool getCoalescingKey( const PendingMessage &message, CoalescingKey &outKey,
+									  bool &outIsRemoval );
+
+		/** Messages that change what the Item, Light & Empty messages after them apply to,
+			thus updates before them must be kept even if the same object gets updated after:
+				Reset, Hello (and IdleTimeout, etc) may start over with an empty scene.
+				Mesh & MeshLoops may recreate the mesh, along with its items.
+				ItemTransformBatch needs its items to exist.
+		@param outAllObjects [out]
+			True if every object is affected. Otherwise only the items of outMeshId are.
+		@return
+			False if the message isn't a barrier.
+		*/
+		static bool getCoalescingBarrier( const PendingMessage &message, bool &outAllObjects,
+										  Ogre::uint32 &outMeshId );
+
 	public:
 		NetworkSystem();
 		~NetworkSystem();
 
 		void addListener( NetworkListener *listener );
 
+		/** Makes listeners get NetworkListener::idleTimeout once the last client has been
+			disconnected for this long, unless someone connects again before that.
+			Must be called before start.
+		@param seconds
+			0 to disable.
+		*/
+		void setIdleTimeout( Ogre::uint32 seconds );
+
+		/// Starts listening to connections and processes messages until interrupted.
 		int start();
 
 		void send( bufferevent *bev, Network::FromServer::FromServer msg,
 				   const void *data, Ogre::uint32 sizeBytes );
 
+		struct DataChunk
+		{
+			const void	*data;
+			size_t		sizeBytes;
+		};
+
+		/// Called once libevent no longer needs the chunks. May be called from any thread.
+		typedef void (*SentCallback)( void *userData );
+
+		/** Like send, but the payload continues with the given chunks, which are written
+			to the socket straight from where they are instead of being copied.
+		@param data
+			Start of the payload. Gets copied.
+		@param chunks
+			Rest of the payload, in order. Must stay valid until onSent is called.
+		@param onSent
+			Called when libevent is done with all the chunks (i.e. once they've been written
+			to the socket, or the connection is gone). Can be called before returning.
+		*/
+		void sendReferenced( bufferevent *bev, Network::FromServer::FromServer msg,
+							 const void *data, Ogre::uint32 sizeBytes,
+							 const DataChunk *chunks, size_t numChunks,
+							 SentCallback onSent, void *userData );
+
+		/// Must be called from the network thread
 		void abortConnection( const char *msg, bufferevent *bev );
 
+		/// Number of messages of the given type that got dropped because
+		/// a newer one superseded them. See coalescePendingBatch.
+		Ogre::uint64 getNumDroppedMessages( Network::FromClient::FromClient messageType ) const;
+
+		/// Runs libevent's loop
+		void _networkThread();
+		/// Calls NetworkListener::decodeMessage on everything the network thread received
+		void _decodeThread();
+
 		/// Called when a new client connection arrives
 		void _listener_cb( evconnlistener *listener, evutil_socket_t fd,
 						   sockaddr *sa, int socklen );
-		/// Called every time we receive more data
+		/// Called every time we receive more data. Moves every complete message to
+		/// the decode thread (without copying, whenever libevent can)
 		void _buffered_on_read( bufferevent *bev );
 		/// Called when a special event happened (i.e. connection terminated)
 		void _conn_eventcb( bufferevent *bev, short events );
 		/// Called on interrupts (e.g. Ctrl+C)
 		void _signal_cb( evutil_socket_t sig, short events );
+		/// Called when m_idleTimeoutEvent fires
+		void _idle_timeout_cb();
+		/// Called when the decode thread made room in m_receivedQueue after a stall
+		void _queue_space_cb();
 	};
 }
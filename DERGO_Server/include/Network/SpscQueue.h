@@ -0,0 +1,100 @@
+
+#pragma once
+
+#include "OgrePrerequisites.h"
+#include "Threading/OgreWaitableEvent.h"
+
+#include <atomic>
+#include <vector>
+
+namespace DERGO
+{
+	/** Bounded single producer / single consumer ring buffer.
+		Pushing and popping never take a lock; the events are only touched to put a
+		thread to sleep when the queue is full (producer) or empty (consumer).
+	@remarks
+		Exactly one thread may call push, and exactly one other thread may call pop.
+	*/
+	template <typename T>
+	class SpscQueue
+	{
+		std::vector<T>		m_slots;
+		size_t				m_mask;
+		/// Next slot to pop. Only written by the consumer.
+		std::atomic<size_t>	m_head;
+		/// Next slot to push. Only written by the producer.
+		std::atomic<size_t>	m_tail;
+		Ogre::WaitableEvent	m_notEmpty;
+		Ogre::WaitableEvent	m_notFull;
+
+	public:
+		/**
+		@param capacity
+			Max number of elements in flight. Must be a power of 2.
+		*/
+		SpscQueue( size_t capacity ) :
+			m_slots( capacity ),
+			m_mask( capacity - 1u ),
+			m_head( 0 ),
+			m_tail( 0 )
+		{
+			assert( capacity && !(capacity & (capacity - 1u)) && "Capacity must be power of 2" );
+		}
+
+		/// Blocks while the queue is full.
+		void push( const T &value )
+		{
+			const size_t tail = m_tail.load( std::memory_order_relaxed );
+			while( tail - m_head.load( std::memory_order_acquire ) == m_slots.size() )
+				m_notFull.wait();
+
+			m_slots[tail & m_mask] = value;
+			m_tail.store( tail + 1u, std::memory_order_release );
+			m_notEmpty.wake();
+		}
+
+		/// Never blocks.
+		/// @return False if the queue was full, in which case value wasn't pushed.
+		bool tryPush( const T &value )
+		{
+			const size_t tail = m_tail.load( std::memory_order_relaxed );
+			if( tail - m_head.load( std::memory_order_acquire ) == m_slots.size() )
+				return false;
+
+			m_slots[tail & m_mask] = value;
+			m_tail.store( tail + 1u, std::memory_order_release );
+			m_notEmpty.wake();
+
+			return true;
+		}
+
+		/// Blocks while the queue is empty.
+		T pop()
+		{
+			const size_t head = m_head.load( std::memory_order_relaxed );
+			while( m_tail.load( std::memory_order_acquire ) == head )
+				m_notEmpty.wait();
+
+			T retVal = m_slots[head & m_mask];
+			m_head.store( head + 1u, std::memory_order_release );
+			m_notFull.wake();
+
+			return retVal;
+		}
+
+		/// Never blocks.
+		/// @return False if the queue was empty, in which case outValue is left untouched.
+		bool tryPop( T &outValue )
+		{
+			const size_t head = m_head.load( std::memory_order_relaxed );
+			if( m_tail.load( std::memory_order_acquire ) == head )
+				return false;
+
+			outValue = m_slots[head & m_mask];
+			m_head.store( head + 1u, std::memory_order_release );
+			m_notFull.wake();
+
+			return true;
+		}
+	};
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "OgrePrerequisites.h"
+#include "OgreTimer.h"
+#include "Network/NetworkMessage.h"
+
+#include <vector>
+
+namespace Ogre
+{
+	struct TextureBox;
+}
+
+namespace DERGO
+{
+	/** Encodes the rendered viewport into a FromServer::Result message, using the best
+		encoding the client told us it supports (see FromClient::Init).
+	@remarks
+		Raw frames are not encoded here; they are sent straight from the staging memory.
+		Every few seconds, the frame rate and bandwidth of each encoding in use is printed.
+	*/
+	class ResultEncoder
+	{
+		class DeltaDeflateTask;
+		class YCoCgTilesTask;
+
+		struct EncodingStats
+		{
+			size_t	numFrames;
+			size_t	numRawBytes;
+			size_t	numSentBytes;
+			Ogre::uint64 encodeMicroseconds;
+		};
+
+		Network::ResultEncoding::ResultEncoding	m_encoding;
+
+		/// Message to send, starting with the uint16 width, uint16 height, uint8 encoding.
+		std::vector<Ogre::uint8>	m_encoded;
+
+		/// DeltaDeflate. One compressed band of rows at a time per thread.
+		std::vector< std::vector<Ogre::uint8> >	m_bands;
+		std::vector< std::vector<Ogre::uint8> >	m_threadScratch;
+
+		/// YCoCgTiles. The last frame we sent, tightly packed RGBA8, to skip unchanged tiles.
+		std::vector<Ogre::uint8>	m_previousFrame;
+		Ogre::uint32				m_previousWidth;
+		Ogre::uint32				m_previousHeight;
+		bool						m_forceKeyframe;
+		/// One per row of tiles.
+		std::vector< std::vector<Ogre::uint8> >	m_tileRows;
+		/// One byte per tile, so threads never write to the same byte.
+		std::vector<Ogre::uint8>	m_dirtyTiles;
+
+		EncodingStats	m_stats[Network::ResultEncoding::NumResultEncodings];
+		Ogre::Timer		m_timer;
+		Ogre::uint64	m_lastReportMicroseconds;
+
+		void encodeDeltaDeflate( const Ogre::TextureBox &box, Ogre::SceneManager *sceneManager );
+		void encodeYCoCgTiles( const Ogre::TextureBox &box, Ogre::SceneManager *sceneManager );
+
+		void addFrameStats( Network::ResultEncoding::ResultEncoding encoding, size_t numRawBytes,
+							size_t numSentBytes, Ogre::uint64 encodeMicroseconds );
+
+	public:
+		ResultEncoder();
+
+		/** Picks the first encoding in the list we know about. Encodings missing
+			from the list are never used. Raw is picked if none is known.
+		@param encodings
+			Array of Network::ResultEncoding, ordered by preference (most preferred first).
+		*/
+		void setSupportedEncodings( const Ogre::uint8 *encodings, size_t numEncodings );
+
+		/// Goes back to Raw, which is what clients that don't send FromClient::Init get.
+		void reset();
+
+		Network::ResultEncoding::ResultEncoding getEncoding() const	{ return m_encoding; }
+
+		/** Encodes the image in box into a Result message, if the current encoding isn't Raw.
+		@param box
+			RGBA8 image. Other formats can only be sent Raw.
+		@param sceneManager
+			Whose worker threads do the encoding. Must be called from the render thread.
+		@return
+			False if the image must be sent as Raw. True if getEncoded() has the message.
+		*/
+		bool encode( const Ogre::TextureBox &box, Ogre::SceneManager *sceneManager );
+
+		const std::vector<Ogre::uint8>& getEncoded() const			{ return m_encoded; }
+
+		/// Must be called whenever a Raw frame is sent, to keep the stats complete.
+		void rawFrameSent( size_t sizeBytes );
+	};
+}
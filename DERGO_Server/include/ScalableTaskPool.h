@@ -0,0 +1,52 @@
+#pragma once
+
+#include "OgrePrerequisites.h"
+#include "Threading/OgreThreads.h"
+#include "Threading/OgreLightweightMutex.h"
+
+namespace Ogre
+{
+	class Barrier;
+	class UniformScalableTask;
+}
+
+namespace DERGO
+{
+	/** Runs UniformScalableTasks on its own worker threads.
+		SceneManager::executeUserScalableTask may only be called from the thread that
+		renders, so any other thread doing heavy lifting (e.g. decoding meshes while the
+		previous message is being committed to Ogre) needs a pool of its own.
+	@remarks
+		Can be used from any thread, but only one task runs at a time. A caller that
+		launched a non-blocking task keeps the pool to itself until waitForPendingTask.
+	*/
+	class ScalableTaskPool
+	{
+		Ogre::ThreadHandleVec		m_threads;
+		size_t						m_numThreads;
+		Ogre::Barrier				*m_barrier;
+		Ogre::UniformScalableTask	*m_task;
+		Ogre::LightweightMutex		m_mutex;
+		bool						m_exit;
+
+	public:
+		ScalableTaskPool( size_t numThreads );
+		~ScalableTaskPool();
+
+		size_t getNumThreads() const		{ return m_numThreads; }
+
+		/**
+		@param task
+			Task to run. Will be called with threadId in range [0; getNumThreads())
+		@param bBlock
+			When false, returns immediately. The caller must then call waitForPendingTask
+			before the task goes out of scope or the pool can be used again.
+		*/
+		void executeTask( Ogre::UniformScalableTask *task, bool bBlock );
+
+		/// Waits for the task launched with executeTask( task, false ) to finish.
+		void waitForPendingTask();
+
+		void _workerThread( size_t threadIdx );
+	};
+}
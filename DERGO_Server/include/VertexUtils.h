@@ -4,10 +4,13 @@
 #include "DergoCommon.h"
 #include "OgreVector2.h"
 #include "OgreVector3.h"
+#include "Math/Simple/OgreAabb.h"
 #include "Vao/OgreVertexBufferPacked.h"
 #include "Threading/OgreBarrier.h"
 #include "Threading/OgreUniformScalableTask.h"
 
+#include <limits>
+
 namespace DERGO
 {
 	struct BlenderFace
@@ -19,6 +22,9 @@ namespace DERGO
 	};
 	static const uint32_t c_sizeOfBlenderFace = sizeof(uint32_t) * 4 + sizeof(Ogre::Vector3) +
 												sizeof(uint16_t) + sizeof(uint8_t);
+	/// Compact vertices keep float positions when half floats would move them further than
+	/// this (in Blender units). See VertexUtils::getMaxHalfError.
+	static const float c_maxHalfPositionError = 0.001f;
 	struct BlenderFaceUv
 	{
 		Ogre::Vector2	uv[4];
@@ -33,11 +39,66 @@ namespace DERGO
 		Ogre::Vector3	vNormal;
 	};
 
+	/** Keeps track of where each of Blender's raw vertices and faces ended up in the GPU
+		vertex buffer after deindexing and welding, so that small edits (e.g. sculpting)
+		can be patched in place instead of rebuilding the whole mesh.
+	*/
+	struct MeshPatchMap
+	{
+		enum GpuVertexFlags
+		{
+			/// The vertex takes its normal from the raw vertex (use_smooth), not from its face.
+			GpuVertexSmooth		= 1u << 0u,
+			/// The vertex was welded from vertices that would diverge if edited (i.e. different
+			/// raw vertices or different flat faces). It can't be patched in place.
+			GpuVertexAmbiguous	= 1u << 1u
+		};
+
+		/// First deindexed vertex of each face. Size = numFaces + 1
+		std::vector<uint32_t>	faceFirstVertex;
+		/// The GPU vertices that got their position from raw vertex i are
+		/// rawToGpu[rawToGpuOffsets[i]] through rawToGpu[rawToGpuOffsets[i+1] - 1]
+		std::vector<uint32_t>	rawToGpuOffsets;
+		std::vector<uint32_t>	rawToGpu;
+		/// See GpuVertexFlags
+		std::vector<uint8_t>	gpuVertexFlags;
+		/// Non-zero if the raw vertex was welded into a GpuVertexAmbiguous vertex.
+		std::vector<uint8_t>	rawVertexAmbiguous;
+
+		/**
+		@param vertexConversionLut
+			Deindexed vertex -> GPU vertex. See VertexUtils::shrinkVertexBuffer.
+		@param numGpuVertices
+			Number of vertices after welding.
+		*/
+		void build( const BlenderFace *faces, uint32_t numFaces, uint32_t numRawVertices,
+					const uint32_t *vertexConversionLut, uint32_t numGpuVertices );
+		void clear();
+		void swap( MeshPatchMap &other );
+
+		bool empty() const							{ return faceFirstVertex.empty(); }
+	};
+
+	/// Index data of one submesh, already in the type its index buffer will use.
+	struct SubMeshIndices
+	{
+		/// Allocated with OGRE_MALLOC_SIMD. uint32_t if use32BitIndices, uint16_t otherwise.
+		void		*data;
+		uint32_t	numIndices;
+	};
+
 	class VertexUtils
 	{
 	public:
-		/** Deindexes all vertex positions & normals from Blender's representation
-			into 3 vertices per triangle.
+		/** Deindexes all vertex positions, normals, colours & UVs from Blender's
+			representation into 3 vertices per triangle.
+		@remarks
+			Each output vertex is written completely in a single pass. The layout is:
+				float3 position
+				float3 normal
+				ubyte4 colour (if facesColour isn't null)
+				float2 uv[numUVs] (V is mirrored)
+				whatever is left until bytesPerVertex (i.e. the tangent) is zeroed
 		@param dstData [out]
 			Destination pointer to store the deindexed data.
 			Size must be calculated as:
@@ -63,26 +124,39 @@ namespace DERGO
 		@param blenderRawVertices
 			Blender's unique vertices. Each faces[i].vertexIndex[j] must be low enough
 			to dereference blenderRawVertices correctly
+		@param facesColour
+			One per face. Null if there are no colours.
+		@param faceUv
+			UVs of UV set j for faces[i] are at faceUv[uvSetStride * j + i]
+		@param uvSetStride
+			Number of faces between each UV set.
+		@param numUVs
+			Number of UV sets.
 		@param materialIds [out]
 			Pointer to the material ID of each triangle. Must be:
 				uint16_t *materialIds = new uint16_t[numVertices / 3u];
 			See dstData on how to calculate numVertices.
+		@param inOutMin [in/out]
+			Optional. Grown to include the position of every vertex the faces use.
+		@param inOutMax [in/out]
+			Must be null if inOutMin is, and vice versa.
 		*/
 		static void deindex( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
 							 const BlenderFace *faces, uint32_t numFaces,
 							 const BlenderRawVertex *blenderRawVertices,
-							 uint16_t * RESTRICT_ALIAS materialIds );
-
-		static void deindex( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
-							 const BlenderFace *faces, uint32_t numFaces,
-							 const BlenderFaceColour *facesColour );
+							 const BlenderFaceColour *facesColour,
+							 const BlenderFaceUv *faceUv, uint32_t uvSetStride, uint8_t numUVs,
+							 uint16_t * RESTRICT_ALIAS materialIds,
+							 Ogre::Vector3 *inOutMin=0, Ogre::Vector3 *inOutMax=0 );
 
-		static void deindex( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
-							 const BlenderFace *faces, uint32_t numFaces,
-							 const BlenderFaceUv *faceUv, uint32_t uvStride );
+		/// Where UV set uvSet starts (in bytes) in the vertex layout deindex produces.
+		static uint32_t getUvOffset( bool hasColour, uint8_t uvSet );
 
 		/** Shrinks vertex buffer by removing duplicates and converting from tri list to
 			indexed tri list.
+		@remarks
+			Vertices are welded using a hash table over their raw bytes, thus this runs in
+			linear expected time. Unique vertices keep the order of their first occurrence.
 		@param dstData [in/out]
 			Vertex buffer data to shrink
 		@param vertexConversionLut
@@ -100,101 +174,440 @@ namespace DERGO
 											uint32_t bytesPerVertex,
 											uint32_t numVertices );
 
-		/// Non-indexed lists
-		static void generateTangents( uint8_t *vertexData, uint32_t bytesPerVertex,
-									  uint32_t numVertices, uint32_t posStride, uint32_t normalStride,
-									  uint32_t tangentStride, uint32_t uvStride );
+		/** Regenerates tangents for indexed lists, but only for the vertices that share a
+			triangle with a vertex whose position or normal changed. Produces the same
+			result as GenerateTangentsTask for those vertices, assuming the UVs didn't
+			change (so no vertex needs to be split apart).
+		@param inOutDirtyVertices [in/out]
+			One entry per vertex. On input, non-zero if the position or normal changed.
+			On output, also non-zero for every vertex whose tangent was recalculated.
+		*/
+		static void generateTangentsPartial( uint8_t *vertexData, const uint32_t *indexData,
+											 uint32_t bytesPerVertex, uint32_t numVertices,
+											 uint32_t numIndices, uint32_t posStride,
+											 uint32_t normalStride, uint32_t tangentStride,
+											 uint32_t uvStride, uint8_t *inOutDirtyVertices );
+
+		/** Converts 4 floats to half floats, rounding to nearest even (like GPUs do).
+			Overflows become infinity, NaNs stay NaNs. Uses SSE2 when available.
+		@param dst [out]
+			Can be unaligned.
+		@param src
+			Can be unaligned.
+		*/
+		static void floatToHalf4( uint16_t * RESTRICT_ALIAS dst, const float * RESTRICT_ALIAS src );
 
-		/** Generates tangents for normal mapping for indexed lists version. Step 01.
-			The data will be stored into outData.
+		/** Converts vertices in the Network::VertexFormat::Full layout (what deindex and
+			GenerateTangentsTask produce) to the Network::VertexFormat::Compact layout:
+				half4 or float3 position (see halfPositions)
+				short4 normalized QTangent, which holds the normal, tangent & parity
+				ubyte4 colour (if hasColour)
+				half2 uv[numUVs]
 		@remarks
-			Tangent generation for indexed lists is split in two steps to allow some degree
-			of threading, since step 01 can be done concurrently, while step 02 cannot.
-			To generate tangents on a single threading app, do the following:
-				Ogre::Vector3 *tuvData = new Ogre::Vector3[numVertices * 2u]
-				generateTanUV( vertexData, indexData, bytesPerVertex,
-								numVertices, numIndices, posStride,
-								normalStride, tangentStride, uvStride,
-								outData );
-				generateTangetsMergeTUV( vertexData, bytesPerVertex, numVertices,
-										 normalStride, tangentStride, outData, 1 );
-				delete [] outData;
-		@param vertexData
-		@param indexData
-		@param bytesPerVertex
-		@param numVertices
+			The QTangent is encoded the same way Ogre does, so Hlms picks it up on its own.
+			When hasTangents is false an arbitrary tangent, perpendicular to the normal,
+			is encoded instead.
+		@param dstData [out]
+			Must hold numVertices * dstBytesPerVertex bytes. Must not overlap srcData.
+		@param halfPositions
+			When false, positions are copied as float3.
+		*/
+		static void compactVertices( uint8_t * RESTRICT_ALIAS dstData, uint32_t dstBytesPerVertex,
+									 const uint8_t * RESTRICT_ALIAS srcData,
+									 uint32_t srcBytesPerVertex, uint32_t numVertices,
+									 bool halfPositions, bool hasColour, uint8_t numUVs,
+									 bool hasTangents );
+
+		/** Reorders the triangles of a triangle list so the GPU's post-transform vertex
+			cache gets more hits, using Tom Forsyth's "Linear-Speed Vertex Cache Optimisation".
+		@remarks
+			Only the order of triangles changes; vertices aren't touched.
+		@param indices [in/out]
+			Triangle list to reorder in place.
 		@param numIndices
-		@param posStride
-		@param normalStride
-		@param tangentStride
-		@param uvStride
-		@param outData
-			Buffer to store the result of this step. It generates vectors 'tsU' and 'tsV', one
-			pair for each vertex. outData must be at least outData = new Vector3[numVertices*2u]
+			Must be a multiple of 3.
+		@param globalToLocal
+			Scratch memory, one entry per vertex indices can refer to. All entries must be
+			0xFFFFFFFF, and are left that way on return.
 		*/
-		static void generateTanUV( const uint8_t *vertexData, const uint32_t *indexData,
-								   uint32_t bytesPerVertex,
-								   uint32_t numVertices, uint32_t numIndices, uint32_t posStride,
-								   uint32_t normalStride, uint32_t tangentStride, uint32_t uvStride,
-								   Ogre::Vector3 * RESTRICT_ALIAS outData );
-
-		/** Generates tangents for normal mapping for indexed lists version. Step 02 and final step.
-			Takes the data in inOutUvBuffer (which was the output of generateTanTUV) and fills
-			the vertexData.
-		@param vertexData
-		@param bytesPerVertex
-		@param numVertices
-		@param normalStride
-		@param tangentStride
-		@param inOutUvBuffer
-			The buffer filled with tsU & tsV by generateTanUV. Assumes all threads are consecutive.
-			This means the buffer must be at least new Vector3[numVertices*2u*numThreads]
-		@param numThreads
-			The number of threads that processed generateTanUV.
+		static void optimizeVertexCache( uint16_t *indices, uint32_t numIndices,
+										 uint32_t *globalToLocal );
+		static void optimizeVertexCache( uint32_t *indices, uint32_t numIndices,
+										 uint32_t *globalToLocal );
+
+		/// Converts a half float back to float. Exact; denormals, infinity & NaNs included.
+		static float halfToFloat( uint16_t value );
+
+		/** Worst error of rounding any value in [-maxAbs; maxAbs] to half float, i.e. half
+			the distance between two halves around maxAbs. Infinity if maxAbs can't be
+			represented (>= 65520).
 		*/
-		static void generateTangetsMergeTUV( uint8_t *vertexData, uint32_t bytesPerVertex,
-											 uint32_t numVertices, uint32_t normalStride,
-											 uint32_t tangentStride,
-											 Ogre::Vector3 * RESTRICT_ALIAS inOutUvBuffer,
-											 size_t numThreads );
+		static float getMaxHalfError( float maxAbs );
+
+		/** Simplifies a triangle list for a LOD by collapsing edges, cheapest first according
+			to the quadric error metric (Garland & Heckbert).
+		@remarks
+			Vertices are only ever collapsed onto existing ones, so the result indexes a
+			subset of the same vertices and can share their vertex buffer.
+			Vertices on open borders only slide along the border, and vertices that share
+			their position with others (UV, normal or material seams) never move, so
+			neither borders nor seams open up.
+		@param indices [in/out]
+			Triangle list to simplify in place. The order of the triangles left is kept.
+		@param numIndices
+			Must be a multiple of 3.
+		@param triangleTags [in/out]
+			Optional, one per triangle. Compacted along with the triangles that are left
+			(e.g. to tell which submesh each of them came from).
+		@param positions
+			float3 per vertex.
+		@param targetNumIndices
+			Stops once the triangle list is this small, or no edge can be collapsed anymore.
+		@param maxError
+			Collapses that would move the surface further than this aren't done.
+			Same units as positions.
+		@param outError [out]
+			Largest error of all the collapses done. Same units as positions.
+		@return
+			Number of indices left.
+		*/
+		static uint32_t simplify( uint32_t *indices, uint32_t numIndices, uint32_t *triangleTags,
+								  const float *positions, uint32_t numVertices,
+								  uint32_t targetNumIndices, float maxError, float *outError );
 	};
 
+	/** Generates tangents for normal mapping for indexed lists, the way MikkTSpace does
+		(which is what Blender bakes normal maps with):
+			* Corners sharing position, normal & UV form a vertex, no matter what else
+			  (e.g. colour) tells them apart.
+			* Each vertex averages the tangents of its triangles weighted by the angle
+			  they have at that corner, separately for triangles with mirrored UVs.
+			* Vertices used by both mirrored & non mirrored triangles are split in two.
+			* Triangles with null UV area join whatever group their vertices are in.
+	@remarks
+		Corners are split into buckets based on the hash of their vertex (all the corners
+		of a vertex always land on the same bucket) and each worker thread solves one bucket
+		on its own, so threads never write to the same vertex. Vertices that need to be
+		split are appended at the end, after a prefix sum.
+		Quads are not known to us, so unlike MikkTSpace the two triangles of a quad
+		aren't forced to have the same orientation.
+	*/
 	class GenerateTangentsTask : public Ogre::UniformScalableTask
 	{
+	public:
+		/// A copy of srcVertex that gets a different tangent.
+		struct TangentSplit
+		{
+			uint32_t		srcVertex;
+			Ogre::Vector3	tangent;
+			float			parity;
+		};
+
+	private:
 		uint8_t *vertexData;
 		uint32_t bytesPerVertex;
 		uint32_t numVertices;
+		uint32_t numOutVertices;
 		uint32_t posStride;
 		uint32_t normalStride;
 		uint32_t tangentStride;
 		uint32_t uvStride;
-		uint32_t *indexData; /// Can be null.
-		uint32_t numIndices; /// Can be 0.
+		uint32_t *indexData;
+		uint32_t numIndices;
 
-		std::vector<Ogre::Vector3>	tuvBuffer;
+		/// MikkTSpace's per triangle tangent (vOs) & flags.
+		std::vector<Ogre::Vector3>	triTangents;
+		std::vector<uint8_t>		triFlags;
+		/// Hash of the position, normal & UV of each vertex.
+		std::vector<uint32_t>		hashes;
+		/// Corners (index into indexData) sorted by bucket.
+		std::vector<uint32_t>		bucketCorners;
+		/// bucketCounts[threadId * numThreads + bucketIdx]
+		std::vector<uint32_t>		bucketCounts;
+		/// Scratch memory for VertexUtils.cpp's groupTangentCorners & solveTangentCorners.
+		std::vector<uint32_t>		vertexLeaders;
+		std::vector<uint8_t>		vertexGroups;
+		std::vector< std::vector<TangentSplit> >	threadSplits;
+		/// (corner, index into threadSplits[threadId]) of the corners using a split.
+		std::vector< std::vector< std::pair<uint32_t, uint32_t> > >	threadSplitCorners;
 		Ogre::Barrier				*barrier;
 
 	public:
+		/**
+		@param _vertexData [in/out]
+			Welded vertices. Must have room for _numIndices vertices, since split vertices
+			are appended after the first _numVertices.
+		@param _indexData [in/out]
+			Triangle list. Corners that now use a split vertex are updated.
+		@param numThreads
+			Number of threads that will execute this task.
+		*/
 		GenerateTangentsTask( uint8_t *_vertexData, uint32_t _bytesPerVertex,
 							  uint32_t _numVertices, uint32_t _posStride, uint32_t _normalStride,
 							  uint32_t _tangentStride, uint32_t _uvStride,
 							  uint32_t *_indexData, uint32_t _numIndices,
-							  size_t numThreads ) :
-			vertexData( _vertexData ), bytesPerVertex( _bytesPerVertex ),
-			numVertices( _numVertices ), posStride( _posStride ),
-			normalStride( _normalStride ), tangentStride( _tangentStride ),
-			uvStride( _uvStride ), indexData( _indexData ), numIndices( _numIndices )
+							  size_t numThreads );
+		virtual ~GenerateTangentsTask();
+
+		virtual void execute( size_t threadId, size_t numThreads );
+
+		/// Valid after the task has been executed. Includes the split vertices.
+		uint32_t getNumVertices() const				{ return numOutVertices; }
+	};
+
+	/** Threaded version of VertexUtils::shrinkVertexBuffer.
+		Vertices are split into buckets based on the hash of their bytes (duplicates always
+		land on the same bucket) and each worker thread welds one bucket on its own. The
+		surviving vertices are then compacted into dstVertexData using a parallel prefix sum.
+	@remarks
+		Compaction happens out of place, since threads would otherwise overwrite vertices
+		other threads haven't read yet. The result has the exact same layout and
+		vertexConversionLut as the single threaded version.
+	*/
+	class ShrinkVertexBufferTask : public Ogre::UniformScalableTask
+	{
+		uint8_t const *srcVertexData;
+		uint8_t *dstVertexData;
+		uint32_t bytesPerVertex;
+		uint32_t numVertices;
+		uint32_t numUniqueVertices;
+
+		Ogre::FastArray<uint32_t>	*vertexConversionLut;
+
+		std::vector<uint32_t>	hashes;
+		/// Index of the first vertex that is bitwise equal to this one (itself if unique).
+		std::vector<uint32_t>	leaders;
+		/// Vertex indices sorted by bucket, preserving their original order within the bucket.
+		std::vector<uint32_t>	bucketVertices;
+		/// bucketCounts[threadId * numThreads + bucketIdx]
+		std::vector<uint32_t>	bucketCounts;
+		std::vector<uint32_t>	uniqueCounts;
+		Ogre::Barrier			*barrier;
+
+		void getThreadRange( size_t threadId, size_t numThreads,
+							 uint32_t &outStart, uint32_t &outEnd ) const;
+
+	public:
+		/**
+		@param _srcVertexData
+			Vertex data to shrink. Not modified.
+		@param _dstVertexData
+			Where to store the shrunk buffer. Must be able to hold at least
+			_numVertices * _bytesPerVertex bytes. Must not overlap _srcVertexData.
+		@param _vertexConversionLut [out]
+			See VertexUtils::shrinkVertexBuffer.
+		@param numThreads
+			Number of threads that will execute this task.
+		*/
+		ShrinkVertexBufferTask( const uint8_t *_srcVertexData, uint8_t *_dstVertexData,
+								uint32_t _bytesPerVertex, uint32_t _numVertices,
+								Ogre::FastArray<uint32_t> *_vertexConversionLut,
+								size_t numThreads );
+		virtual ~ShrinkVertexBufferTask();
+
+		virtual void execute( size_t threadId, size_t numThreads );
+
+		/// Valid after the task has been executed.
+		uint32_t getNumUniqueVertices() const		{ return numUniqueVertices; }
+	};
+
+	/** Same output as ShrinkVertexBufferTask, but welds the vertices the way a previous
+		vertexConversionLut says instead of hashing them. That's what a mesh re-exported
+		with the same topology and vertex data (e.g. only its UVs of some faces changed)
+		needs, and it's much cheaper than welding from scratch.
+	@remarks
+		The LUT is validated while welding: every vertex must be bitwise equal to the
+		others that weld into the same unique vertex, and every unique vertex must be used.
+		If it isn't, getNumUniqueVertices returns 0 and the caller must weld from scratch.
+		Vertices that became equal since the LUT was built stay apart; which is harmless.
+		Unique vertices are partitioned across threads, like ShrinkVertexBufferTask's buckets.
+	*/
+	class ReweldVertexBufferTask : public Ogre::UniformScalableTask
+	{
+		uint8_t const *srcVertexData;
+		uint8_t *dstVertexData;
+		uint32_t bytesPerVertex;
+		uint32_t numVertices;
+		uint32_t numUniqueVertices;
+
+		uint32_t const *vertexConversionLut;
+
+		/// Highest vertexConversionLut entry in each thread's range.
+		std::vector<uint32_t>	threadMaxUnique;
+		/// Vertex indices sorted by the thread owning the unique vertex they weld into,
+		/// preserving their original order within the bucket.
+		std::vector<uint32_t>	bucketVertices;
+		/// bucketCounts[threadId * numThreads + bucketIdx]
+		std::vector<uint32_t>	bucketCounts;
+		/// First vertex that welds into each unique vertex.
+		std::vector<uint32_t>	representatives;
+		std::vector<uint8_t>	threadMismatches;
+		Ogre::Barrier			*barrier;
+
+		void getThreadRange( size_t threadId, size_t numThreads,
+							 uint32_t &outStart, uint32_t &outEnd ) const;
+
+	public:
+		/**
+		@param _srcVertexData
+			Vertex data to shrink. Not modified.
+		@param _dstVertexData
+			Where to store the shrunk buffer. Must be able to hold at least
+			_numVertices * _bytesPerVertex bytes. Must not overlap _srcVertexData.
+		@param _vertexConversionLut
+			_numVertices entries. The LUT of a previous build of the same mesh.
+		@param numThreads
+			Number of threads that will execute this task.
+		*/
+		ReweldVertexBufferTask( const uint8_t *_srcVertexData, uint8_t *_dstVertexData,
+								uint32_t _bytesPerVertex, uint32_t _numVertices,
+								const uint32_t *_vertexConversionLut, size_t numThreads );
+		virtual ~ReweldVertexBufferTask();
+
+		virtual void execute( size_t threadId, size_t numThreads );
+
+		/// Valid after the task has been executed. 0 if the LUT no longer fits the vertices.
+		uint32_t getNumUniqueVertices() const;
+	};
+
+	/// Threaded version of VertexUtils::compactVertices. Each thread converts a range of vertices.
+	class CompactVerticesTask : public Ogre::UniformScalableTask
+	{
+		uint8_t *dstData;
+		uint32_t dstBytesPerVertex;
+		uint8_t const *srcData;
+		uint32_t srcBytesPerVertex;
+		uint32_t numVertices;
+		bool halfPositions;
+		bool hasColour;
+		uint8_t numUVs;
+		bool hasTangents;
+
+	public:
+		CompactVerticesTask( uint8_t *_dstData, uint32_t _dstBytesPerVertex,
+							 const uint8_t *_srcData, uint32_t _srcBytesPerVertex,
+							 uint32_t _numVertices, bool _halfPositions, bool _hasColour,
+							 uint8_t _numUVs, bool _hasTangents ) :
+			dstData( _dstData ), dstBytesPerVertex( _dstBytesPerVertex ),
+			srcData( _srcData ), srcBytesPerVertex( _srcBytesPerVertex ),
+			numVertices( _numVertices ), halfPositions( _halfPositions ),
+			hasColour( _hasColour ), numUVs( _numUVs ), hasTangents( _hasTangents )
 		{
-			if( indexData )
-			{
-				tuvBuffer.resize( numVertices * 2u * numThreads, Ogre::Vector3::ZERO );
-				barrier = new Ogre::Barrier( numThreads );
-			}
 		}
 
 		virtual void execute( size_t threadId, size_t numThreads );
 	};
 
+	/** Splits the deindexed triangles into one submesh per material, using a counting sort.
+		Each thread counts how many triangles of each material it has, then writes its
+		triangles' indices straight into the final (exact sized) storage of each submesh.
+	@remarks
+		Submeshes are sorted by the first triangle that uses their material, and within a
+		submesh triangles keep their original order; just like a sequential split would.
+	*/
+	class SplitSubMeshesTask : public Ogre::UniformScalableTask
+	{
+		uint16_t const *materialIds;
+		uint32_t numTriangles;
+		uint32_t const *vertexConversionLut;
+		bool use32BitIndices;
+
+		std::vector<uint16_t>		*uniqueMaterials;
+		std::vector<SubMeshIndices>	*indices;
+
+		/// threadCounts[threadId][materialId] = number of triangles. Grown on demand.
+		std::vector< std::vector<uint32_t> >	threadCounts;
+		/// Materials found by each thread, in the order they first appeared.
+		std::vector< std::vector<uint16_t> >	threadMaterials;
+		/// materialId -> submesh index
+		std::vector<uint16_t>	materialToSubMesh;
+		/// threadOffsets[threadId * numSubMeshes + subMeshIdx] = first index to write.
+		std::vector<uint32_t>	threadOffsets;
+		Ogre::Barrier			*barrier;
+
+		void getThreadRange( size_t threadId, size_t numThreads,
+							 uint32_t &outStart, uint32_t &outEnd ) const;
+		void allocateSubMeshes( size_t numThreads );
+		template <typename T>
+		void scatter( uint32_t triStart, uint32_t triEnd, const uint32_t *offsets );
+
+	public:
+		/**
+		@param _materialIds
+			Material of each triangle, see VertexUtils::deindex.
+		@param _vertexConversionLut
+			Deindexed vertex -> welded vertex. See VertexUtils::shrinkVertexBuffer.
+			Must hold _numTriangles * 3 entries.
+		@param _use32BitIndices
+			Whether to output uint32_t or uint16_t indices.
+		@param _uniqueMaterials [out]
+			Material of each submesh.
+		@param _indices [out]
+			Index data of each submesh. The caller owns the pointers (OGRE_FREE_SIMD).
+		@param numThreads
+			Number of threads that will execute this task.
+		*/
+		SplitSubMeshesTask( const uint16_t *_materialIds, uint32_t _numTriangles,
+							const uint32_t *_vertexConversionLut, bool _use32BitIndices,
+							std::vector<uint16_t> *_uniqueMaterials,
+							std::vector<SubMeshIndices> *_indices, size_t numThreads );
+		virtual ~SplitSubMeshesTask();
+
+		virtual void execute( size_t threadId, size_t numThreads );
+	};
+
+	/** Threaded version of VertexUtils::optimizeVertexCache, which then sorts the vertices
+		in the order the triangles first use them, so fetching them is cache friendly too.
+	@remarks
+		Large submeshes are split into one chunk per thread, each optimised on its own.
+		The vertex buffer is reordered out of place, and the indices & vertexConversionLut
+		are updated to match.
+	*/
+	class OptimizeVertexCacheTask : public Ogre::UniformScalableTask
+	{
+		std::vector<SubMeshIndices> *indices;
+		bool use32BitIndices;
+		uint8_t const *srcVertexData;
+		uint8_t *dstVertexData;
+		uint32_t bytesPerVertex;
+		uint32_t numVertices;
+		Ogre::FastArray<uint32_t>	*vertexConversionLut;
+
+		/// Old vertex index -> new vertex index
+		std::vector<uint32_t>		vertexRemap;
+		Ogre::Barrier				*barrier;
+
+		/// Triangles [outStart; outEnd) of the given submesh belong to threadId.
+		void getChunk( const SubMeshIndices &subMesh, size_t threadId, size_t numThreads,
+					   uint32_t &outStart, uint32_t &outEnd ) const;
+		void buildVertexRemap();
+		template <typename T>
+		void remapIndices( size_t threadId, size_t numThreads );
+
+	public:
+		/**
+		@param _indices [in/out]
+			Index data of each submesh. See SplitSubMeshesTask.
+		@param _srcVertexData
+			Vertex data. Not modified.
+		@param _dstVertexData
+			Where to store the reordered vertices. Must be able to hold
+			_numVertices * _bytesPerVertex bytes. Must not overlap _srcVertexData.
+		@param _vertexConversionLut [in/out]
+			See VertexUtils::shrinkVertexBuffer.
+		@param numThreads
+			Number of threads that will execute this task.
+		*/
+		OptimizeVertexCacheTask( std::vector<SubMeshIndices> *_indices, bool _use32BitIndices,
+								 const uint8_t *_srcVertexData, uint8_t *_dstVertexData,
+								 uint32_t _bytesPerVertex, uint32_t _numVertices,
+								 Ogre::FastArray<uint32_t> *_vertexConversionLut,
+								 size_t numThreads );
+		virtual ~OptimizeVertexCacheTask();
+
+		virtual void execute( size_t threadId, size_t numThreads );
+	};
+
 	class DeindexTask : public Ogre::UniformScalableTask
 	{
 		uint8_t *vertexData;
@@ -211,26 +624,49 @@ namespace DERGO
 		const std::vector<BlenderRawVertex>		*blenderRawVertices;
 		Ogre::FastArray<uint16_t>				*materialIds;
 
+		bool						computeAabb;
+		/// Bounds of the vertices each thread deindexed
+		std::vector<Ogre::Vector3>	threadMin;
+		std::vector<Ogre::Vector3>	threadMax;
+
 	public:
+		/**
+		@param _computeAabb
+			Whether to compute the bounds of the vertices used by the faces while
+			deindexing, see getAabb. It's almost free, since they're already in cache.
+		*/
 		DeindexTask( uint8_t *_vertexData, uint32_t _bytesPerVertex, uint32_t _numVertices,
 					 uint8_t _numUVs, const std::vector<uint32_t> &_vertexStartThreadIdx,
 					 const std::vector<BlenderFace>			*_faces,
 					 const std::vector<BlenderFaceColour>	*_facesColour,
 					 const std::vector<BlenderFaceUv>		*_faceUv,
 					 const std::vector<BlenderRawVertex>	*_blenderRawVertices,
-					 Ogre::FastArray<uint16_t>				*_materialIds ) :
+					 Ogre::FastArray<uint16_t>				*_materialIds,
+					 bool _computeAabb=false ) :
 			vertexData( _vertexData ), bytesPerVertex( _bytesPerVertex ),
 			numVertices( _numVertices ), numUVs( _numUVs ),
 			vertexStartThreadIdx( _vertexStartThreadIdx ),
 			faces( _faces ), facesColour( _facesColour ),
 			faceUv( _faceUv ), blenderRawVertices( _blenderRawVertices ),
-			materialIds( _materialIds )
+			materialIds( _materialIds ),
+			computeAabb( _computeAabb )
 		{
 			assert( materialIds->size() == numVertices / 3u );
 			assert( faceUv->size() == faces->size() * numUVs );
 			assert( facesColour->empty() || facesColour->size() == faces->size() );
+
+			if( computeAabb )
+			{
+				const size_t numThreads = vertexStartThreadIdx.size() - 1u;
+				threadMin.resize( numThreads, Ogre::Vector3(  std::numeric_limits<float>::max() ) );
+				threadMax.resize( numThreads, Ogre::Vector3( -std::numeric_limits<float>::max() ) );
+			}
 		}
 
 		virtual void execute( size_t threadId, size_t numThreads );
+
+		/// Valid after the task has been executed with _computeAabb = true.
+		/// Null if there were no faces.
+		Ogre::Aabb getAabb() const;
 	};
 }
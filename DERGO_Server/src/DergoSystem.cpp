@@ -33,6 +33,9 @@
 #include "Vao/OgreIndexBufferPacked.h"
 #include "Vao/OgreStagingBuffer.h"
 #include "Vao/OgreVaoManager.h"
+#include "Hash/MurmurHash3.h"
+#include "OgreLodStrategyManager.h"
+#include "OgreLodStrategy.h"
 
 #include "InstantRadiosity/OgreInstantRadiosity.h"
 #include "OgreIrradianceVolume.h"
@@ -45,14 +48,28 @@
 #include "OgreSceneFormatExporter.h"
 
 #include "OgreTextureGpuManager.h"
+#include "OgreAsyncTextureTicket.h"
 #include "OgreWindowEventUtilities.h"
+#include "OgreFileSystemLayer.h"
+#include "OgreArchive.h"
+#include "OgreArchiveManager.h"
 
 #include "OgreImage2.h"
 #include "OgreGpuProgramManager.h"
 
 #include "Utils/HdrUtils.h"
 
+#include <algorithm>
 #include <sstream>
+#include <fstream>
+#include <stdio.h>
+#include <time.h>
+#include <zlib.h>
+#if OGRE_PLATFORM == OGRE_PLATFORM_WIN32
+	#include <sys/utime.h>
+#else
+	#include <utime.h>
+#endif
 
 namespace DERGO
 {
@@ -64,19 +81,54 @@ namespace DERGO
 		return stream.str();
 	}
 
-	DergoSystem::BlenderItemVec::iterator DergoSystem::BlenderMesh::findItem( uint32_t itemId )
+	void DergoSystem::BlenderMeshSource::swap( BlenderMeshSource &other )
 	{
-		BlenderItemVec::iterator itor = items.begin();
-		BlenderItemVec::iterator end  = items.end();
+		meshName.swap( other.meshName );
+		std::swap( hasColour, other.hasColour );
+		std::swap( numUVs, other.numUVs );
+		std::swap( tangentUVSource, other.tangentUVSource );
+		std::swap( vertexFormat, other.vertexFormat );
+		std::swap( vertexCacheMode, other.vertexCacheMode );
+		std::swap( optimizeVertexCache, other.optimizeVertexCache );
+		std::swap( lastChangeSync, other.lastChangeSync );
+		std::swap( numLods, other.numLods );
+		std::swap( lodQuality, other.lodQuality );
+		faces.swap( other.faces );
+		faceColour.swap( other.faceColour );
+		faceUv.swap( other.faceUv );
+		rawVertices.swap( other.rawVertices );
+		materialTable.swap( other.materialTable );
+		vertexConversionLut.swap( other.vertexConversionLut );
+		patchMap.swap( other.patchMap );
+		std::swap( aabb, other.aabb );
+		std::swap( tangentStride, other.tangentStride );
+		std::swap( tangentUvStride, other.tangentUvStride );
+		std::swap( contentHash, other.contentHash );
+		std::swap_ranges( blockHashes, blockHashes + NumMeshBlocks, other.blockHashes );
+		std::swap_ranges( derivedBlockHashes, derivedBlockHashes + NumMeshBlocks,
+						  other.derivedBlockHashes );
+	}
 
-		while( itor != end && itor->id != itemId )
+	void DergoSystem::DecodedMesh::freeIndices()
+	{
+		std::vector<SubMeshIndices>::const_iterator itor = indices.begin();
+		std::vector<SubMeshIndices>::const_iterator end  = indices.end();
+		while( itor != end )
+		{
+			OGRE_FREE_SIMD( itor->data, Ogre::MEMCATEGORY_GEOMETRY );
 			++itor;
-
-		return itor;
+		}
+		indices.clear();
 	}
 
 	DergoSystem::DergoSystem( Ogre::ColourValue backgroundColour ) :
 		GraphicsSystem( backgroundColour ),
+		m_numRenderSyncs( 0 ),
+		m_nextRecentlyPreparedMesh( 0 ),
+		m_nextPreparedMeshHistory( 0 ),
+		m_meshDiskCacheMaxBytes( 0 ),
+		m_meshDiskCacheBytes( 0 ),
+		m_meshDiskCacheArchive( 0 ),
 		m_enableInstantRadiosity( false ),
 		m_instantRadiosity( 0 ),
 		m_irradianceVolume( 0 ),
@@ -85,10 +137,32 @@ namespace DERGO
 		m_parallaxCorrectedCubemap( 0 ),
 		m_pccVctMinDistance( 1.0f ),
 		m_pccVctMaxDistance( 2.0f ),
-		m_windowEventListener( 0 )
+		m_windowEventListener( 0 ),
+		m_taskPool( 0 ),
+		m_lodBuilder( 0 ),
+		m_nextLodJobId( 0 ),
+		m_nextReadbackSlot( 0 ),
+		m_sessionId( static_cast<uint64_t>( time( 0 ) ) << 20u ),
+		m_sessionGracePeriod( 300u ),
+		m_numItemsCreated( 0 ),
+		m_numMeshesRecreated( 0 ),
+		m_numMeshesRebound( 0 ),
+		m_numMeshesUpdatedInPlace( 0 )
 	{
 		m_windowEventListener = new WindowEventListener();
 		mAlwaysAskForConfig = false;
+
+		memset( m_recentlyPreparedMeshes, 0, sizeof(m_recentlyPreparedMeshes) );
+
+		for( size_t i=0; i<c_numReadbackSlots; ++i )
+		{
+			m_readbackSlots[i].ticket		= 0;
+			m_readbackSlots[i].width		= 0;
+			m_readbackSlots[i].height		= 0;
+			m_readbackSlots[i].pixelFormat	= Ogre::PFG_UNKNOWN;
+			m_readbackSlots[i].isMapped		= false;
+			m_readbackSlots[i].inFlight.store( false );
+		}
 	}
 	//-----------------------------------------------------------------------------------
 	DergoSystem::~DergoSystem()
@@ -160,6 +234,21 @@ namespace DERGO
 		//Enable LTC area lights (up to 16 for now)
 		hlmsPbs->setAreaLightForwardSettings( 0u, 64u );
 		hlmsPbs->setUseObbRestraints( true, true );
+
+		m_taskPool = new ScalableTaskPool( mSceneManager->getNumWorkerThreads() );
+		m_lodBuilder = new MeshLodBuilder();
+
+		//Next to the Hlms caches, so that reconnecting doesn't have to prepare every mesh again
+		m_meshDiskCacheFolder.clear();
+		if( m_meshDiskCacheMaxBytes != 0 &&
+			Ogre::FileSystemLayer::createDirectory( mWriteAccessFolder + "meshCache/" ) )
+		{
+			m_meshDiskCacheFolder = mWriteAccessFolder + "meshCache/";
+			m_meshDiskCacheArchive = Ogre::ArchiveManager::getSingleton().load(
+										 m_meshDiskCacheFolder, "FileSystem", false );
+			//Also counts what previous runs left, and honours a cap lowered since then
+			trimMeshDiskCache( m_meshDiskCacheMaxBytes );
+		}
 	}
 	//-----------------------------------------------------------------------------------
 	void DergoSystem::loadResources()
@@ -176,12 +265,26 @@ namespace DERGO
 	{
 		reset();
 
+		destroyReadbackSlots();
+
+		delete m_lodBuilder;
+		m_lodBuilder = 0;
+
+		delete m_taskPool;
+		m_taskPool = 0;
+
 		delete m_parallaxCorrectedCubemap;
 		m_parallaxCorrectedCubemap = 0;
 
 		delete m_instantRadiosity;
 		m_instantRadiosity = 0;
 
+		if( m_meshDiskCacheArchive )
+		{
+			Ogre::ArchiveManager::getSingleton().unload( m_meshDiskCacheArchive );
+			m_meshDiskCacheArchive = 0;
+		}
+
 		if( mWorkspace )
 		{
 			Ogre::CompositorManager2 *compositorManager = mRoot->getCompositorManager2();
@@ -638,13 +741,11 @@ namespace DERGO
 		}
 	}
 	//-----------------------------------------------------------------------------------
-	void DergoSystem::destroyMeshVaos( Ogre::Mesh *mesh )
+	void DergoSystem::destroyMeshVaos( const BlenderMesh &meshEntry )
 	{
-		Ogre::VertexBufferPacked *vertexBuffer = 0;
-
 		Ogre::VaoManager *vaoManager = mRoot->getRenderSystem()->getVaoManager();
 
-		const Ogre::Mesh::SubMeshVec &subMeshes = mesh->getSubMeshes();
+		const Ogre::Mesh::SubMeshVec &subMeshes = meshEntry.meshPtr->getSubMeshes();
 		Ogre::Mesh::SubMeshVec::const_iterator itor = subMeshes.begin();
 		Ogre::Mesh::SubMeshVec::const_iterator end  = subMeshes.end();
 
@@ -666,8 +767,6 @@ namespace DERGO
 				assert( vao->getVertexBuffers().size() == 1 );
 				assert( vao->getIndexBuffer() );
 
-				vertexBuffer = vao->getVertexBuffers()[0];
-				vaoManager->destroyIndexBuffer( vao->getIndexBuffer() );
 				vaoManager->destroyVertexArrayObject( vao );
 				++it;
 			}
@@ -677,22 +776,378 @@ namespace DERGO
 			++itor;
 		}
 
-		if( vertexBuffer )
-			vaoManager->destroyVertexBuffer( vertexBuffer );
+		SharedMeshBuffers *buffers = meshEntry.buffers;
+		assert( buffers && buffers->refCount > 0 );
+		--buffers->refCount;
+
+		if( !buffers->refCount )
+		{
+			uncacheMeshBuffers( buffers );
+
+			std::vector<Ogre::IndexBufferPacked*>::const_iterator itIndex = buffers->indexBuffers.begin();
+			std::vector<Ogre::IndexBufferPacked*>::const_iterator enIndex = buffers->indexBuffers.end();
+
+			while( itIndex != enIndex )
+			{
+				vaoManager->destroyIndexBuffer( *itIndex );
+				++itIndex;
+			}
+
+			std::vector<SharedMeshBuffers::Lod>::const_iterator itLod = buffers->lods.begin();
+			std::vector<SharedMeshBuffers::Lod>::const_iterator enLod = buffers->lods.end();
+
+			while( itLod != enLod )
+			{
+				itIndex = itLod->indexBuffers.begin();
+				enIndex = itLod->indexBuffers.end();
+				while( itIndex != enIndex )
+				{
+					vaoManager->destroyIndexBuffer( *itIndex );
+					++itIndex;
+				}
+				++itLod;
+			}
+
+			if( buffers->vertexBuffer )
+				vaoManager->destroyVertexBuffer( buffers->vertexBuffer );
+			if( buffers->dynamicVertexData )
+				OGRE_FREE_SIMD( buffers->dynamicVertexData, Ogre::MEMCATEGORY_GEOMETRY );
+
+			delete buffers;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	template <typename T>
+	static void hashVector( const std::vector<T> &data, uint64_t outHash[2] )
+	{
+		Ogre::MurmurHash3_x64_128( data.empty() ? 0 : &data[0], data.size() * sizeof(T),
+								   0, outHash );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::hashMeshSource( BlenderMeshSource &source )
+	{
+		const uint32_t numFaces			= static_cast<uint32_t>( source.faces.size() );
+		const uint32_t numRawVertices	= static_cast<uint32_t>( source.rawVertices.size() );
+		uint8_t header[sizeof(uint32_t) * 2u + 7u];
+		memcpy( header, &numFaces, sizeof(numFaces) );
+		memcpy( header + sizeof(uint32_t), &numRawVertices, sizeof(numRawVertices) );
+		header[sizeof(uint32_t) * 2u + 0u] = source.hasColour ? 1u : 0u;
+		header[sizeof(uint32_t) * 2u + 1u] = source.numUVs;
+		header[sizeof(uint32_t) * 2u + 2u] = source.tangentUVSource;
+		header[sizeof(uint32_t) * 2u + 3u] = source.vertexFormat;
+		header[sizeof(uint32_t) * 2u + 4u] = source.optimizeVertexCache ? 1u : 0u;
+		header[sizeof(uint32_t) * 2u + 5u] = source.numLods;
+		header[sizeof(uint32_t) * 2u + 6u] = source.lodQuality;
+
+		//Hash every block, then the hashes. BlenderFace has padding, but it's
+		//zero because std::vector::resize value-initializes the faces.
+		MeshContentHash *blockHashes = source.blockHashes;
+		Ogre::MurmurHash3_x64_128( header, sizeof(header), 0,
+								   blockHashes[MeshBlockHeader].value );
+		hashVector( source.faces, blockHashes[MeshBlockFaces].value );
+		hashVector( source.faceColour, blockHashes[MeshBlockFaceColour].value );
+		hashVector( source.faceUv, blockHashes[MeshBlockFaceUv].value );
+		hashVector( source.rawVertices, blockHashes[MeshBlockRawVertices].value );
+
+		Ogre::MurmurHash3_x64_128( source.blockHashes, sizeof(source.blockHashes), 0,
+								   source.contentHash.value );
+	}
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::isMeshBufferCached( const MeshContentHash &contentHash )
+	{
+		//Identical meshes usually arrive in a row, before the first one gets committed.
+		for( size_t i=0; i<c_numRecentlyPreparedMeshes; ++i )
+		{
+			if( m_recentlyPreparedMeshes[i] == contentHash )
+				return true;
+		}
+
+		m_meshBufferCacheMutex.lock();
+		const bool retVal = m_meshBufferCache.find( contentHash ) != m_meshBufferCache.end();
+		m_meshBufferCacheMutex.unlock();
+
+		return retVal;
 	}
 	//-----------------------------------------------------------------------------------
-	void DergoSystem::syncMesh( Network::SmartData &smartData )
+	void DergoSystem::cacheMeshBuffers( SharedMeshBuffers *buffers )
 	{
-		uint32_t meshId = smartData.read<uint32_t>();
-		Ogre::String meshName = smartData.getString();
+		assert( !buffers->isInCache );
+
+		m_meshBufferCacheMutex.lock();
+		buffers->isInCache = m_meshBufferCache.insert(
+								 std::make_pair( buffers->contentHash, buffers ) ).second;
+		m_meshBufferCacheMutex.unlock();
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::uncacheMeshBuffers( SharedMeshBuffers *buffers )
+	{
+		if( !buffers->isInCache )
+			return;
+
+		m_meshBufferCacheMutex.lock();
+		m_meshBufferCache.erase( buffers->contentHash );
+		m_meshBufferCacheMutex.unlock();
+
+		buffers->isInCache = false;
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::syncMesh( Network::SmartData &smartData, DecodedMesh &outMesh )
+	{
+		outMesh.meshId = smartData.read<uint32_t>();
+
+		BlenderMeshSource &source = outMesh.source;
+		source.meshName = smartData.getString();
 
 		const Ogre::uint32 numFaces			= smartData.read<Ogre::uint32>();
 		const Ogre::uint32 numRawVertices	= smartData.read<Ogre::uint32>();
-		const bool hasColour				= smartData.read<Ogre::uint8>() != 0;
-		const Ogre::uint8 numUVs			= smartData.read<Ogre::uint8>();
-		uint8_t tangentUVSource				= smartData.read<uint8_t>();
+		source.hasColour					= smartData.read<Ogre::uint8>() != 0;
+		source.numUVs						= smartData.read<Ogre::uint8>();
+		source.tangentUVSource				= smartData.read<uint8_t>();
+		source.vertexFormat					= smartData.read<uint8_t>();
+		source.vertexCacheMode				= smartData.read<uint8_t>();
+		source.numLods						= smartData.read<uint8_t>();
+		source.lodQuality					= smartData.read<uint8_t>();
+
+		if( source.vertexFormat >= Network::VertexFormat::NumVertexFormats )
+			source.vertexFormat = Network::VertexFormat::Full;
+		if( source.vertexCacheMode >= Network::VertexCacheMode::NumVertexCacheModes )
+			source.vertexCacheMode = Network::VertexCacheMode::Auto;
+		if( source.numLods > c_maxMeshLods )
+			source.numLods = c_maxMeshLods;
+		source.lodQuality = Ogre::Math::Clamp<uint8_t>( source.lodQuality, 10u, 90u );
+		//Auto meshes are optimised later, if they stop changing. See optimizeStaticMeshes
+		source.optimizeVertexCache = source.vertexCacheMode == Network::VertexCacheMode::Always;
 
-		Ogre::VertexElement2VecVec vertexElements( 1 );
+		//Read face data
+		source.faces.resize( numFaces );
+		if( source.hasColour )
+			source.faceColour.resize( numFaces );
+		source.faceUv.resize( numFaces * source.numUVs );
+		source.rawVertices.resize( numRawVertices );
+
+		for( uint32_t i=0; i<numFaces; ++i )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>(&source.faces[i]), c_sizeOfBlenderFace );
+		}
+
+		if( !source.faceColour.empty() )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>(&source.faceColour[0]),
+							sizeof(BlenderFaceColour) * numFaces );
+		}
+		if( !source.faceUv.empty() )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>(&source.faceUv[0]),
+							sizeof(BlenderFaceUv) * numFaces * source.numUVs );
+		}
+		if( !source.rawVertices.empty() )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>(&source.rawVertices[0]),
+							sizeof(BlenderRawVertex) * numRawVertices );
+		}
+
+		//Read material table
+		const uint16_t materialTableSize = smartData.read<uint16_t>();
+		source.materialTable.resize( materialTableSize );
+
+		if( !source.materialTable.empty() )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>( &source.materialTable[0] ),
+							sizeof(uint32_t) * source.materialTable.size() );
+		}
+
+		hashMeshSource( source );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::syncMeshLoops( Network::SmartData &smartData, DecodedMesh &outMesh )
+	{
+		outMesh.meshId = smartData.read<uint32_t>();
+
+		BlenderMeshSource &source = outMesh.source;
+		source.meshName = smartData.getString();
+
+		const uint32_t numPolygons		= smartData.read<uint32_t>();
+		const uint32_t numLoops			= smartData.read<uint32_t>();
+		const uint32_t numRawVertices	= smartData.read<uint32_t>();
+		source.hasColour				= smartData.read<uint8_t>() != 0;
+		source.numUVs					= smartData.read<uint8_t>();
+		source.tangentUVSource			= smartData.read<uint8_t>();
+		source.vertexFormat				= smartData.read<uint8_t>();
+		source.vertexCacheMode			= smartData.read<uint8_t>();
+		source.numLods					= smartData.read<uint8_t>();
+		source.lodQuality				= smartData.read<uint8_t>();
+
+		if( source.vertexFormat >= Network::VertexFormat::NumVertexFormats )
+			source.vertexFormat = Network::VertexFormat::Full;
+		if( source.vertexCacheMode >= Network::VertexCacheMode::NumVertexCacheModes )
+			source.vertexCacheMode = Network::VertexCacheMode::Auto;
+		if( source.numLods > c_maxMeshLods )
+			source.numLods = c_maxMeshLods;
+		source.lodQuality = Ogre::Math::Clamp<uint8_t>( source.lodQuality, 10u, 90u );
+		source.optimizeVertexCache = source.vertexCacheMode == Network::VertexCacheMode::Always;
+
+		source.faces.resize( numPolygons );
+		for( uint32_t i=0; i<numPolygons; ++i )
+		{
+			BlenderFace &face = source.faces[i];
+			face.numIndicesInFace	= smartData.read<uint8_t>() == 4u ? 4u : 3u;
+			face.materialId			= smartData.read<uint16_t>();
+			face.faceNormal			= smartData.read<Ogre::Vector3>();
+		}
+
+		std::vector<uint32_t> loopVertices( numLoops );
+		if( !loopVertices.empty() )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>( &loopVertices[0] ),
+							sizeof(uint32_t) * numLoops );
+		}
+
+		//Gather the loops' data into each face's corners
+		std::vector<uint32_t> firstLoops( numPolygons );
+		{
+			uint32_t loopIdx = 0;
+			for( uint32_t i=0; i<numPolygons; ++i )
+			{
+				BlenderFace &face = source.faces[i];
+				if( loopIdx + face.numIndicesInFace > numLoops )
+				{
+					//Malformed. Drop the faces we don't have loops for.
+					source.faces.resize( i );
+					break;
+				}
+
+				firstLoops[i] = loopIdx;
+				for( uint8_t j=0; j<face.numIndicesInFace; ++j )
+					face.vertexIndex[j] = loopVertices[loopIdx++];
+			}
+		}
+
+		const size_t numFaces = source.faces.size();
+
+		if( source.hasColour )
+		{
+			std::vector<uint8_t> loopColours( numLoops * 4u );
+			if( !loopColours.empty() )
+			{
+				smartData.read( &loopColours[0], loopColours.size() );
+			}
+
+			source.faceColour.resize( numFaces );
+			for( size_t i=0; i<numFaces; ++i )
+			{
+				const uint8_t *colour = &loopColours[firstLoops[i] * 4u];
+				for( uint8_t j=0; j<source.faces[i].numIndicesInFace; ++j )
+				{
+					source.faceColour[i].colour[j] = Ogre::Vector3( colour[0] / 255.0f,
+																	colour[1] / 255.0f,
+																	colour[2] / 255.0f );
+					colour += 4u;
+				}
+			}
+		}
+
+		if( source.numUVs )
+		{
+			std::vector<Ogre::Vector2> loopUvs( numLoops );
+			source.faceUv.resize( numFaces * source.numUVs );
+			for( uint8_t uvSet=0; uvSet<source.numUVs; ++uvSet )
+			{
+				if( !loopUvs.empty() )
+				{
+					smartData.read( reinterpret_cast<uint8_t*>( &loopUvs[0] ),
+									sizeof(Ogre::Vector2) * numLoops );
+				}
+
+				for( size_t i=0; i<numFaces; ++i )
+				{
+					BlenderFaceUv &faceUv = source.faceUv[uvSet * numFaces + i];
+					for( uint8_t j=0; j<source.faces[i].numIndicesInFace; ++j )
+						faceUv.uv[j] = loopUvs[firstLoops[i] + j];
+				}
+			}
+		}
+
+		source.rawVertices.resize( numRawVertices );
+		if( !source.rawVertices.empty() )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>(&source.rawVertices[0]),
+							sizeof(BlenderRawVertex) * numRawVertices );
+		}
+
+		const uint16_t materialTableSize = smartData.read<uint16_t>();
+		source.materialTable.resize( materialTableSize );
+
+		if( !source.materialTable.empty() )
+		{
+			smartData.read( reinterpret_cast<uint8_t*>( &source.materialTable[0] ),
+							sizeof(uint32_t) * source.materialTable.size() );
+		}
+
+		hashMeshSource( source );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::buildMesh( uint32_t meshId )
+	{
+		DecodedMesh decodedMesh;
+		decodedMesh.meshId = meshId;
+		decodedMesh.source.swap( m_meshSources[meshId] );
+		hashMeshSource( decodedMesh.source );
+
+		commitMesh( decodedMesh );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::optimizeStaticMeshes()
+	{
+		BlenderMeshSourceMap::iterator itor = m_meshSources.begin();
+		BlenderMeshSourceMap::iterator end  = m_meshSources.end();
+
+		while( itor != end )
+		{
+			BlenderMeshSource &source = itor->second;
+			if( source.vertexCacheMode == Network::VertexCacheMode::Auto &&
+				!source.optimizeVertexCache && !source.faces.empty() &&
+				m_numRenderSyncs - source.lastChangeSync >= c_vertexCacheStaticSyncs &&
+				m_meshes.find( itor->first ) != m_meshes.end() )
+			{
+				source.optimizeVertexCache = true;
+				buildMesh( itor->first );
+				return;
+			}
+
+			++itor;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::prepareMesh( DecodedMesh &decodedMesh )
+	{
+		BlenderMeshSource &source = decodedMesh.source;
+
+		//Stages whose input didn't change since the last build can reuse its results.
+		Ogre::FastArray<uint32_t> previousLut;
+		previousLut.swap( source.vertexConversionLut );
+		//The AABB covers the vertices used by the faces. It's only
+		//calculated if there are triangles, i.e. if there's a LUT.
+		const bool sameAabb = !previousLut.empty() &&
+							  source.derivedBlockHashes[MeshBlockFaces] ==
+							  source.blockHashes[MeshBlockFaces] &&
+							  source.derivedBlockHashes[MeshBlockRawVertices] ==
+							  source.blockHashes[MeshBlockRawVertices];
+
+		//Until we're done, whatever we had no longer describes the GPU buffers.
+		memset( source.derivedBlockHashes, 0, sizeof(source.derivedBlockHashes) );
+		source.patchMap.clear();
+		source.tangentStride = 0;
+		source.tangentUvStride = 0;
+
+		const size_t numThreads				= m_taskPool->getNumThreads();
+		const Ogre::uint32 numFaces			= static_cast<Ogre::uint32>( source.faces.size() );
+		const bool hasColour				= source.hasColour;
+		const Ogre::uint8 numUVs			= source.numUVs;
+		uint8_t tangentUVSource				= source.tangentUVSource;
+
+		Ogre::VertexElement2VecVec &vertexElements = decodedMesh.vertexElements;
+		vertexElements.clear();
+		vertexElements.resize( 1 );
 		vertexElements[0].push_back( Ogre::VertexElement2( Ogre::VET_FLOAT3, Ogre::VES_POSITION ) );
 		vertexElements[0].push_back( Ogre::VertexElement2( Ogre::VET_FLOAT3, Ogre::VES_NORMAL ) );
 		if( hasColour )
@@ -715,37 +1170,10 @@ namespace DERGO
 			tangentUVSource = std::min<uint8_t>( numUVs - 1u, tangentUVSource );
 		}
 
-		//Read face data
-		std::vector<BlenderFace> blenderFaces;
-		std::vector<BlenderFaceColour> blenderFaceColour;
-		std::vector<BlenderFaceUv> blenderFaceUv;
-		std::vector<BlenderRawVertex> blenderRawVertices;
-		blenderFaces.resize( numFaces );
-		if( hasColour )
-			blenderFaceColour.resize( numFaces );
-		blenderFaceUv.resize( numFaces * numUVs );
-		blenderRawVertices.resize( numRawVertices );
-
-		for( uint32_t i=0; i<numFaces; ++i )
-		{
-			smartData.read( reinterpret_cast<uint8_t*>(&blenderFaces[i]), c_sizeOfBlenderFace );
-		}
-
-		if( !blenderFaceColour.empty() )
-		{
-			smartData.read( reinterpret_cast<uint8_t*>(&blenderFaceColour[0]),
-							sizeof(BlenderFaceColour) * numFaces );
-		}
-		if( !blenderFaceUv.empty() )
-		{
-			smartData.read( reinterpret_cast<uint8_t*>(&blenderFaceUv[0]),
-							sizeof(BlenderFaceUv) * numFaces * numUVs );
-		}
-		if( !blenderRawVertices.empty() )
-		{
-			smartData.read( reinterpret_cast<uint8_t*>(&blenderRawVertices[0]),
-							sizeof(BlenderRawVertex) * numRawVertices );
-		}
+		const std::vector<BlenderFace> &blenderFaces			= source.faces;
+		const std::vector<BlenderFaceColour> &blenderFaceColour	= source.faceColour;
+		const std::vector<BlenderFaceUv> &blenderFaceUv			= source.faceUv;
+		const std::vector<BlenderRawVertex> &blenderRawVertices	= source.rawVertices;
 
 		// A face can either be 3 vertices (1 tri) or 6 vertices (2 tris).
 		//Go through the faces and calculate the actual number of vertices
@@ -753,10 +1181,9 @@ namespace DERGO
 		uint32_t numVertices = 0;
 		std::vector<uint32_t> vertexStartThreadIdx;
 
-		vertexStartThreadIdx.resize( mSceneManager->getNumWorkerThreads() + 1, 0 );
+		vertexStartThreadIdx.resize( numThreads + 1, 0 );
 
 		{
-			const size_t numThreads = mSceneManager->getNumWorkerThreads();
 			const uint32_t numFacesPerThread = Ogre::alignToNextMultiple( numFaces,
 																		  numThreads ) / numThreads;
 
@@ -795,9 +1222,9 @@ namespace DERGO
 		DeindexTask deindexTask( vertexData, bytesPerVertex, numVertices,
 								 numUVs, vertexStartThreadIdx, &blenderFaces,
 								 &blenderFaceColour, &blenderFaceUv, &blenderRawVertices,
-								 &materialIds );
+								 &materialIds, !sameAabb );
 
-		mSceneManager->executeUserScalableTask( &deindexTask, true );
+		m_taskPool->executeTask( &deindexTask, true );
 
 		//Remove duplicates (we now have 3 vertices per triangle!)
 		Ogre::FastArray<uint32_t> vertexConversionLut;
@@ -805,337 +1232,1691 @@ namespace DERGO
 
 		Ogre::Aabb aabb( Ogre::Aabb::BOX_NULL );
 
+		decodedMesh.freeIndices();
+		decodedMesh.uniqueMaterials.clear();
+
 		if( numVertices != 0 )
 		{
-			if( numVertices < 40000 )
+			//Optimize memory and GPU performance. Welding is done out of place
+			//so all threads can read the source while others write the result.
+			unsigned char *shrunkVertexData = reinterpret_cast<unsigned char*>(
+						OGRE_MALLOC_SIMD( numVertices * bytesPerVertex, Ogre::MEMCATEGORY_GEOMETRY ) );
+			Ogre::FreeOnDestructor shrunkPtrContainer( shrunkVertexData );
+
+			//Most edits don't change which corners are equal (e.g. moving vertices comes
+			//as a MeshDelta, editing UVs only splits or merges at the edited faces), so
+			//try welding like last time first. It also keeps the vertex order.
+			if( previousLut.size() == numVertices )
 			{
-				//Optimize memory and GPU performance.
-				optimizedNumVertices = VertexUtils::shrinkVertexBuffer( vertexData, vertexConversionLut,
-																		bytesPerVertex, numVertices );
-
-				if( hasNormalMapping )
-				{
-					tangentTask = new GenerateTangentsTask( vertexData, bytesPerVertex,
-															optimizedNumVertices, 0, sizeof(float)*3,
-															bytesPerVertexWithoutTangent,
-															sizeof(float)*3*2 +
-																sizeof(float) * 2 * tangentUVSource,
-															vertexConversionLut.begin(),
-															vertexConversionLut.size(),
-															mSceneManager->getNumWorkerThreads() );
-					mSceneManager->executeUserScalableTask( tangentTask, false );
-				}
+				ReweldVertexBufferTask reweldTask( vertexData, shrunkVertexData, bytesPerVertex,
+												   numVertices, previousLut.begin(),
+												   numThreads );
+				m_taskPool->executeTask( &reweldTask, true );
+				optimizedNumVertices = reweldTask.getNumUniqueVertices();
+				if( optimizedNumVertices != 0 )
+					vertexConversionLut.swap( previousLut );
 			}
-			else
-			{
-				if( hasNormalMapping )
-				{
-					tangentTask = new GenerateTangentsTask( vertexData, bytesPerVertex, numVertices, 0,
-															sizeof(float)*3,
-															bytesPerVertexWithoutTangent,
-															sizeof(float)*3*2 +
-																sizeof(float) * 2 * tangentUVSource,
-															(uint32_t*)0, 0,
-															mSceneManager->getNumWorkerThreads() );
-					mSceneManager->executeUserScalableTask( tangentTask, false );
-				}
 
-				//Mesh is too big. O(N!) complexity. Just rely on the sheer power of the GPU.
-				//TODO: Client option to force optimized or force non-optimized, or auto)
-				optimizedNumVertices = numVertices;
-				vertexConversionLut.resize( numVertices );
-				for( uint32_t i=0; i<numVertices; ++i )
-					vertexConversionLut[i] = i;
+			if( optimizedNumVertices == 0 )
+			{
+				ShrinkVertexBufferTask shrinkTask( vertexData, shrunkVertexData, bytesPerVertex,
+												   numVertices, &vertexConversionLut,
+												   numThreads );
+				m_taskPool->executeTask( &shrinkTask, true );
+				optimizedNumVertices = shrinkTask.getNumUniqueVertices();
 			}
 
-			//Calculate AABB
-			Ogre::Vector3 vMin(  std::numeric_limits<Ogre::Real>::max() );
-			Ogre::Vector3 vMax( -std::numeric_limits<Ogre::Real>::max() );
+			//Swap the buffers: dataPtrContainer now owns the shrunk data.
+			std::swap( dataPtrContainer.ptr, shrunkPtrContainer.ptr );
+			vertexData = shrunkVertexData;
 
-			std::vector<BlenderRawVertex>::const_iterator rawVerticesIt = blenderRawVertices.begin();
-			std::vector<BlenderRawVertex>::const_iterator rawVerticesEn = blenderRawVertices.end();
-
-			while( rawVerticesIt != rawVerticesEn )
+			//Tangents may split vertices, thus they go before the submeshes. The shrunk
+			//buffer has room for the split vertices, since it was sized for all corners.
+			if( hasNormalMapping )
 			{
-				vMax.makeCeil( rawVerticesIt->vPos );
-				vMin.makeFloor( rawVerticesIt->vPos );
-				++rawVerticesIt;
+				source.tangentStride	= bytesPerVertexWithoutTangent;
+				source.tangentUvStride	= VertexUtils::getUvOffset( hasColour, tangentUVSource );
+				tangentTask = new GenerateTangentsTask( vertexData, bytesPerVertex,
+														optimizedNumVertices, 0, sizeof(float)*3,
+														source.tangentStride, source.tangentUvStride,
+														vertexConversionLut.begin(),
+														vertexConversionLut.size(),
+														numThreads );
+				m_taskPool->executeTask( tangentTask, false );
 			}
 
-			aabb.setExtents( vMin, vMax );
-		}
+			aabb = sameAabb ? source.aabb : deindexTask.getAabb();
 
-		//Read material table
-		const uint16_t materialTableSize = smartData.read<uint16_t>();
-		std::vector<uint32_t> materialTable;
-		materialTable.resize( materialTableSize );
+			if( tangentTask )
+			{
+				m_taskPool->waitForPendingTask();
+				optimizedNumVertices = tangentTask->getNumVertices();
+				delete tangentTask;
+				tangentTask = 0;
+			}
 
-		if( !materialTable.empty() )
-		{
-			smartData.read( reinterpret_cast<uint8_t*>( &materialTable[0] ),
-							sizeof(uint32_t) * materialTable.size() );
+			//Split into submeshes based on material assignment. Indices are written
+			//straight in the format the index buffers will use.
+			decodedMesh.indexType = optimizedNumVertices > 0xffff ?
+										Ogre::IndexBufferPacked::IT_32BIT :
+										Ogre::IndexBufferPacked::IT_16BIT;
+			{
+				SplitSubMeshesTask splitTask( materialIds.begin(), numVertices / 3u,
+											  vertexConversionLut.begin(),
+											  decodedMesh.indexType ==
+											  Ogre::IndexBufferPacked::IT_32BIT,
+											  &decodedMesh.uniqueMaterials, &decodedMesh.indices,
+											  numThreads );
+				m_taskPool->executeTask( &splitTask, true );
+			}
 		}
 
-		//Holds references to materialTable[], each entry is unique (i.e. no duplicates)
-		std::vector<uint16_t> uniqueMaterials;
+		source.aabb = aabb;
 
-		//Split into submeshes based on material assignment.
-		std::vector< std::vector<uint32_t> > indices;
-		if( numVertices != 0 )
+		if( source.optimizeVertexCache && numVertices != 0 )
 		{
-			uint32_t currentVertex = 0;
-			Ogre::FastArray<uint16_t>::const_iterator itor = materialIds.begin();
-			Ogre::FastArray<uint16_t>::const_iterator end  = materialIds.end();
+			//Reorder triangles, then vertices in the order triangles use them. Vertices
+			//are moved out of place, like welding does.
+			unsigned char *reorderedVertexData = reinterpret_cast<unsigned char*>(
+						OGRE_MALLOC_SIMD( optimizedNumVertices * bytesPerVertex,
+										  Ogre::MEMCATEGORY_GEOMETRY ) );
+			Ogre::FreeOnDestructor reorderedPtrContainer( reorderedVertexData );
 
-			while( itor != end )
 			{
-				std::vector<uint16_t>::const_iterator itSubMesh = std::find( uniqueMaterials.begin(),
-																			 uniqueMaterials.end(),
-																			 *itor );
-				if( itSubMesh == uniqueMaterials.end() )
-				{
-					//New material found. Need to split another submesh.
-					uniqueMaterials.push_back( *itor );
-					itSubMesh = uniqueMaterials.end() - 1;
-					indices.push_back( std::vector<uint32_t>() );
-				}
-
-				size_t subMeshIdx = itSubMesh - uniqueMaterials.begin();
-
-				indices[subMeshIdx].push_back( vertexConversionLut[currentVertex++] );
-				indices[subMeshIdx].push_back( vertexConversionLut[currentVertex++] );
-				indices[subMeshIdx].push_back( vertexConversionLut[currentVertex++] );
-
-				++itor;
+				OptimizeVertexCacheTask optimizeTask( &decodedMesh.indices,
+													  decodedMesh.indexType ==
+													  Ogre::IndexBufferPacked::IT_32BIT,
+													  vertexData, reorderedVertexData,
+													  bytesPerVertex,
+													  static_cast<uint32_t>( optimizedNumVertices ),
+													  &vertexConversionLut, numThreads );
+				m_taskPool->executeTask( &optimizeTask, true );
 			}
-		}
 
-		if( tangentTask )
-		{
-			mSceneManager->waitForPendingUserScalableTask();
-			delete tangentTask;
-			tangentTask = 0;
+			std::swap( dataPtrContainer.ptr, reorderedPtrContainer.ptr );
+			vertexData = reorderedVertexData;
 		}
 
-		//We've got all the data the way we want/need. Now deal with Ogre.
-		BlenderMeshMap::const_iterator meshEntryIt = m_meshes.find( meshId );
-		if( meshEntryIt == m_meshes.end() )
+		if( source.vertexFormat == Network::VertexFormat::Compact && numVertices != 0 )
 		{
-			//We don't have this mesh.
-			createMesh( meshId, meshName, optimizedNumVertices, vertexElements,
-						dataPtrContainer, indices, aabb );
-		}
-		else
-		{
-			//Check if we can update it (i.e. reuse existing buffers).
-			Ogre::Mesh *meshPtr = meshEntryIt->second.meshPtr;
-			bool canReuse = true;
-
-			if( indices.size() != meshPtr->getNumSubMeshes() )
-				canReuse = false;
-
-			for( uint16_t i=0; i<meshPtr->getNumSubMeshes() && canReuse; ++i )
+			//Half floats have 11 bits of precision. Keep float positions if rounding would
+			//move vertices by more than c_maxHalfPositionError (i.e. big meshes), or if the
+			//mesh is far from its origin compared to its size; it'd get visibly distorted.
+			const Ogre::Vector3 vMin = aabb.getMinimum();
+			const Ogre::Vector3 vMax = aabb.getMaximum();
+			Ogre::Real maxAbs = 0;
+			for( size_t i=0; i<3u; ++i )
 			{
-				Ogre::SubMesh *subMesh = meshPtr->getSubMesh( i );
-
-				const Ogre::VertexBufferPackedVec &vertexBuffers =
-						subMesh->mVao[0][0]->getVertexBuffers();
-
-				//Vertex format changed! (e.g. added or removed UVs)
-				if( vertexElements[0] != vertexBuffers[0]->getVertexElements() )
-					canReuse = false;
-
-				//Current buffer can't hold it, or it's too big
-				if( optimizedNumVertices > vertexBuffers[0]->getNumElements() ||
-					optimizedNumVertices < (vertexBuffers[0]->getNumElements() >> 2) )
-				{
-					canReuse = false;
-				}
-
-				Ogre::IndexBufferPacked *indexBuffer = subMesh->mVao[0][0]->getIndexBuffer();
-				if( indices[i].size() > indexBuffer->getNumElements() ||
-					indices[i].size() < (indexBuffer->getNumElements() >> 2u) )
-				{
-					canReuse = false;
-				}
+				maxAbs = std::max( maxAbs, std::max( Ogre::Math::Abs( vMin[i] ),
+													 Ogre::Math::Abs( vMax[i] ) ) );
 			}
-
-			if( canReuse )
+			const bool halfPositions = VertexUtils::getMaxHalfError( maxAbs ) <=
+									   c_maxHalfPositionError &&
+									   maxAbs <= aabb.getRadius() * 2.0f;
+
+			Ogre::VertexElement2Vec compactElements;
+			compactElements.push_back( Ogre::VertexElement2( halfPositions ? Ogre::VET_HALF4 :
+																			 Ogre::VET_FLOAT3,
+															 Ogre::VES_POSITION ) );
+			//QTangent
+			compactElements.push_back( Ogre::VertexElement2( Ogre::VET_SHORT4_SNORM,
+															 Ogre::VES_NORMAL ) );
+			if( hasColour )
 			{
-				updateMesh( meshEntryIt->second, optimizedNumVertices,
-							dataPtrContainer, indices, aabb );
+				compactElements.push_back( Ogre::VertexElement2( Ogre::VET_UBYTE4_NORM,
+																 Ogre::VES_DIFFUSE ) );
 			}
-			else
+			for( Ogre::uint8 i=0; i<numUVs; ++i )
 			{
-				//Warning: meshEntryIt gets invalidated
-				recreateMesh( meshEntryIt->first, meshEntryIt->second, optimizedNumVertices,
-							  vertexElements, dataPtrContainer, indices, aabb );
+				compactElements.push_back( Ogre::VertexElement2( Ogre::VET_HALF2,
+																 Ogre::VES_TEXTURE_COORDINATES ) );
 			}
-		}
 
-		//Now setup/update the materials
-		meshEntryIt = m_meshes.find( meshId );
-		const BlenderMesh &meshEntry = meshEntryIt->second;
-		Ogre::Mesh *meshPtr = meshEntry.meshPtr;
-		for( size_t i=0; i<meshPtr->getNumSubMeshes(); ++i )
-		{
-			const uint16_t tableIdx = uniqueMaterials[i];
-			Ogre::String materialIdStr;
-			if( tableIdx < materialTable.size() )
+			const Ogre::uint32 compactBytesPerVertex =
+					Ogre::VaoManager::calculateVertexSize( compactElements );
+			unsigned char *compactVertexData = reinterpret_cast<unsigned char*>(
+						OGRE_MALLOC_SIMD( optimizedNumVertices * compactBytesPerVertex,
+										  Ogre::MEMCATEGORY_GEOMETRY ) );
+			Ogre::FreeOnDestructor compactPtrContainer( compactVertexData );
+
 			{
-				const uint32_t materialId = materialTable[tableIdx];
-				materialIdStr = Ogre::StringConverter::toString( materialId );
+				CompactVerticesTask compactTask( compactVertexData, compactBytesPerVertex,
+												 vertexData, bytesPerVertex,
+												 static_cast<uint32_t>( optimizedNumVertices ),
+												 halfPositions, hasColour, numUVs,
+												 hasNormalMapping );
+				m_taskPool->executeTask( &compactTask, true );
 			}
-			meshPtr->getSubMesh( i )->setMaterialName( materialIdStr );
 
-			BlenderItemVec::const_iterator itItem = meshEntry.items.begin();
-			BlenderItemVec::const_iterator enItem = meshEntry.items.end();
+			std::swap( dataPtrContainer.ptr, compactPtrContainer.ptr );
+			vertexElements[0].swap( compactElements );
 
-			const Ogre::IdString materialIdHash = materialIdStr;
-			while( itItem != enItem )
+			//The tangents are now inside the QTangents
+			source.tangentStride = 0;
+			source.tangentUvStride = 0;
+		}
+
+		//Remember where everything went, to patch it when we get a FromClient::MeshDelta.
+		//Compact vertices can't be patched (we'd have to convert them back).
+		MeshPatchMap patchMap;
+		if( numVertices != 0 && source.vertexFormat == Network::VertexFormat::Full )
+		{
+			patchMap.build( &blenderFaces[0], numFaces,
+							static_cast<uint32_t>( blenderRawVertices.size() ),
+							vertexConversionLut.begin(),
+							static_cast<uint32_t>( optimizedNumVertices ) );
+		}
+
+		source.vertexConversionLut.swap( vertexConversionLut );
+		source.patchMap.swap( patchMap );
+		memcpy( source.derivedBlockHashes, source.blockHashes, sizeof(source.blockHashes) );
+
+		decodedMesh.optimizedNumVertices = static_cast<uint32_t>( optimizedNumVertices );
+		std::swap( decodedMesh.vertexData.ptr, dataPtrContainer.ptr );
+		decodedMesh.isPrepared = true;
+
+		createLodJob( decodedMesh );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::restorePreparedMeshHistory( DecodedMesh &decodedMesh )
+	{
+		for( size_t i=0; i<c_numPreparedMeshHistory; ++i )
+		{
+			PreparedMeshHistory &history = m_preparedMeshHistory[i];
+			if( history.meshId == decodedMesh.meshId && !history.vertexConversionLut.empty() )
 			{
-				itItem->item->getSubItem( i )->setDatablock( materialIdHash );
-				++itItem;
+				BlenderMeshSource &source = decodedMesh.source;
+				source.vertexConversionLut.swap( history.vertexConversionLut );
+				source.aabb = history.aabb;
+				memcpy( source.derivedBlockHashes, history.derivedBlockHashes,
+						sizeof(source.derivedBlockHashes) );
+				history.vertexConversionLut.clear();
+				return;
 			}
 		}
 	}
 	//-----------------------------------------------------------------------------------
-	void DergoSystem::createMesh( uint32_t meshId, const Ogre::String &meshName,
-								  uint32_t optimizedNumVertices,
-								  const Ogre::VertexElement2VecVec &vertexElements,
-								  Ogre::FreeOnDestructor &vertexDataPtrContainer,
-								  const std::vector< std::vector<uint32_t> > &indices,
-								  const Ogre::Aabb &aabb )
+	void DergoSystem::storePreparedMeshHistory( const DecodedMesh &decodedMesh )
 	{
-		Ogre::MeshPtr meshPtr = Ogre::MeshManager::getSingleton().createManual(
-					toStr64(meshId), Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME );
-
-		Ogre::RenderSystem *renderSystem = mRoot->getRenderSystem();
-		Ogre::VaoManager *vaoManager = renderSystem->getVaoManager();
-
-		Ogre::VertexBufferPackedVec vertexBuffers;
-
-		if( optimizedNumVertices != 0 )
+		//Keep the slot this mesh had, if any. Otherwise take the oldest one.
+		size_t slot = m_nextPreparedMeshHistory;
+		for( size_t i=0; i<c_numPreparedMeshHistory; ++i )
 		{
-			//Create actual GPU buffers.
-			Ogre::VertexBufferPacked *vertexBuffer = vaoManager->createVertexBuffer(
-						vertexElements[0], optimizedNumVertices, Ogre::BT_DEFAULT,
-					vertexDataPtrContainer.ptr, true );
-			vertexDataPtrContainer.ptr = 0;
-			vertexBuffers.push_back( vertexBuffer );
+			if( m_preparedMeshHistory[i].meshId == decodedMesh.meshId )
+				slot = i;
 		}
 
-		const Ogre::IndexBufferPacked::IndexType indexType = optimizedNumVertices > 0xffff ?
-					Ogre::IndexBufferPacked::IT_32BIT : Ogre::IndexBufferPacked::IT_16BIT;
-
-		std::vector< std::vector<uint32_t> >::const_iterator itor = indices.begin();
-		std::vector< std::vector<uint32_t> >::const_iterator end  = indices.end();
-		while( itor != end )
+		if( slot == m_nextPreparedMeshHistory )
 		{
-			const size_t indexBytes =
-					itor->size() * (indexType == Ogre::IndexBufferPacked::IT_16BIT ? 2 : 4);
-			uint16_t *indexData = reinterpret_cast<uint16_t*>(
-						OGRE_MALLOC_SIMD( indexBytes, Ogre::MEMCATEGORY_GEOMETRY ) );
-			Ogre::FreeOnDestructor safeIndexPtr( indexData );
+			m_nextPreparedMeshHistory = (m_nextPreparedMeshHistory + 1u) %
+										c_numPreparedMeshHistory;
+		}
 
-			if( indexType == Ogre::IndexBufferPacked::IT_32BIT )
-				memcpy( indexData, &(*itor)[0], itor->size() * sizeof(uint32_t) );
-			else
-			{
-				for( size_t i=0; i<itor->size(); ++i )
-					indexData[i] = static_cast<uint16_t>( (*itor)[i] );
+		const BlenderMeshSource &source = decodedMesh.source;
+		PreparedMeshHistory &history = m_preparedMeshHistory[slot];
+		history.meshId = decodedMesh.meshId;
+		history.vertexConversionLut = source.vertexConversionLut;
+		history.aabb = source.aabb;
+		memcpy( history.derivedBlockHashes, source.derivedBlockHashes,
+				sizeof(history.derivedBlockHashes) );
+	}
+	//-----------------------------------------------------------------------------------
+	/// Bump it whenever prepareMesh changes what it outputs, so old files get ignored.
+	static const uint32_t c_meshDiskCacheMagic		= 0x48534D44u; //"DMSH"
+	static const uint32_t c_meshDiskCacheVersion	= 5u;
+	static const size_t c_meshDiskCacheAlignment	= 16u;
+
+	/** Mesh disk cache file layout:
+			MeshDiskCacheHeader
+			uint32 vertexElements[numVertexElements]; //type | semantic << 16
+			uint32 subMeshes[numSubMeshes][2]; //numIndices, uniqueMaterial
+			<padding> uint8 vertexData[numVertices * bytesPerVertex]
+			<padding> uint16/32 indices[subMeshes[0][0]] (...one array per submesh,
+												uint32 only if numVertices > 0xffff)
+			<padding> uint32 vertexConversionLut[numDeindexedVertices]
+		All padding is up to c_meshDiskCacheAlignment bytes, from the start of the file.
+	*/
+	struct MeshDiskCacheHeader
+	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint64_t	contentHash[2];
+		uint32_t	numVertices;
+		uint32_t	bytesPerVertex;
+		uint32_t	numVertexElements;
+		uint32_t	numSubMeshes;
+		uint32_t	numDeindexedVertices;
+		uint32_t	tangentStride;
+		uint32_t	tangentUvStride;
+		float		aabbCenter[3];
+		float		aabbHalfSize[3];
+	};
+
+	static void skipMeshDiskCachePadding( std::istream &file )
+	{
+		const std::streamoff offset = file.tellg();
+		const std::streamoff alignment = static_cast<std::streamoff>( c_meshDiskCacheAlignment );
+		file.seekg( ((offset + alignment - 1) / alignment) * alignment );
+	}
+
+	static void writeMeshDiskCachePadding( std::ostream &file )
+	{
+		const char zeroes[c_meshDiskCacheAlignment] = { 0 };
+		const size_t offset = static_cast<size_t>( file.tellp() );
+		const size_t remainder = offset % c_meshDiskCacheAlignment;
+		if( remainder )
+			file.write( zeroes, static_cast<std::streamsize>( c_meshDiskCacheAlignment - remainder ) );
+	}
+	//-----------------------------------------------------------------------------------
+	Ogre::String DergoSystem::getMeshDiskCacheFilename( const MeshContentHash &contentHash ) const
+	{
+		char filename[48];
+		sprintf( filename, "%016llx%016llx.mesh",
+				 static_cast<unsigned long long>( contentHash.value[0] ),
+				 static_cast<unsigned long long>( contentHash.value[1] ) );
+		return m_meshDiskCacheFolder + filename;
+	}
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::loadMeshFromDiskCache( DecodedMesh &decodedMesh )
+	{
+		if( m_meshDiskCacheFolder.empty() )
+			return false;
+
+		BlenderMeshSource &source = decodedMesh.source;
+
+		const Ogre::String filename = getMeshDiskCacheFilename( source.contentHash );
+		std::ifstream file( filename.c_str(), std::ios::in | std::ios::binary );
+		if( !file )
+			return false;
+
+		MeshDiskCacheHeader header;
+		file.read( reinterpret_cast<char*>( &header ), sizeof(header) );
+		if( !file || header.magic != c_meshDiskCacheMagic ||
+			header.version != c_meshDiskCacheVersion ||
+			header.contentHash[0] != source.contentHash.value[0] ||
+			header.contentHash[1] != source.contentHash.value[1] )
+		{
+			return false;
+		}
+
+		//The hash covers the faces, but a damaged file must not make us read out of bounds.
+		uint32_t numDeindexedVertices = 0;
+		{
+			std::vector<BlenderFace>::const_iterator itor = source.faces.begin();
+			std::vector<BlenderFace>::const_iterator end  = source.faces.end();
+			while( itor != end )
+			{
+				numDeindexedVertices += itor->numIndicesInFace == 4 ? 6u : 3u;
+				++itor;
+			}
+		}
+		if( header.numDeindexedVertices != numDeindexedVertices ||
+			header.numSubMeshes > numDeindexedVertices / 3u + 1u ||
+			header.numVertexElements > 32u )
+		{
+			return false;
+		}
+
+		Ogre::VertexElement2VecVec vertexElements( 1 );
+		for( uint32_t i=0; i<header.numVertexElements; ++i )
+		{
+			uint32_t element = 0;
+			file.read( reinterpret_cast<char*>( &element ), sizeof(element) );
+			vertexElements[0].push_back(
+						Ogre::VertexElement2( static_cast<Ogre::VertexElementType>( element & 0xFFFF ),
+											  static_cast<Ogre::VertexElementSemantic>( element >> 16u ) ) );
+		}
+
+		std::vector<uint32_t> subMeshes( header.numSubMeshes * 2u );
+		if( !subMeshes.empty() )
+		{
+			file.read( reinterpret_cast<char*>( &subMeshes[0] ),
+					   static_cast<std::streamsize>( subMeshes.size() * sizeof(uint32_t) ) );
+		}
+
+		if( !file || header.numVertices > numDeindexedVertices ||
+			Ogre::VaoManager::calculateVertexSize( vertexElements[0] ) != header.bytesPerVertex )
+		{
+			return false;
+		}
+
+		Ogre::FreeOnDestructor vertexData( 0 );
+		if( header.numVertices != 0 )
+		{
+			const size_t sizeBytes = header.numVertices * header.bytesPerVertex;
+			vertexData.ptr = OGRE_MALLOC_SIMD( sizeBytes, Ogre::MEMCATEGORY_GEOMETRY );
+			skipMeshDiskCachePadding( file );
+			file.read( reinterpret_cast<char*>( vertexData.ptr ),
+					   static_cast<std::streamsize>( sizeBytes ) );
+		}
+
+		const Ogre::IndexBufferPacked::IndexType indexType = header.numVertices > 0xffff ?
+					Ogre::IndexBufferPacked::IT_32BIT : Ogre::IndexBufferPacked::IT_16BIT;
+		const size_t bytesPerIndex = indexType == Ogre::IndexBufferPacked::IT_32BIT ?
+										 sizeof(uint32_t) : sizeof(uint16_t);
+
+		//Read straight into decodedMesh, which frees them if we bail out.
+		decodedMesh.freeIndices();
+		decodedMesh.indices.reserve( header.numSubMeshes );
+		std::vector<uint16_t> uniqueMaterials( header.numSubMeshes );
+		for( uint32_t i=0; i<header.numSubMeshes; ++i )
+		{
+			const uint32_t numIndices = subMeshes[i * 2u + 0u];
+			if( numIndices > numDeindexedVertices )
+				return false;
+
+			uniqueMaterials[i] = static_cast<uint16_t>( subMeshes[i * 2u + 1u] );
+
+			SubMeshIndices subMeshIndices;
+			subMeshIndices.numIndices = numIndices;
+			subMeshIndices.data = OGRE_MALLOC_SIMD( numIndices * bytesPerIndex,
+													Ogre::MEMCATEGORY_GEOMETRY );
+			decodedMesh.indices.push_back( subMeshIndices );
+			if( numIndices != 0 )
+			{
+				skipMeshDiskCachePadding( file );
+				file.read( reinterpret_cast<char*>( subMeshIndices.data ),
+						   static_cast<std::streamsize>( numIndices * bytesPerIndex ) );
+			}
+		}
+
+		Ogre::FastArray<uint32_t> vertexConversionLut;
+		vertexConversionLut.resize( numDeindexedVertices );
+		if( numDeindexedVertices != 0 )
+		{
+			skipMeshDiskCachePadding( file );
+			file.read( reinterpret_cast<char*>( vertexConversionLut.begin() ),
+					   static_cast<std::streamsize>( numDeindexedVertices * sizeof(uint32_t) ) );
+		}
+
+		if( !file )
+			return false;
+
+		for( size_t i=0; i<decodedMesh.indices.size(); ++i )
+		{
+			const SubMeshIndices &subMeshIndices = decodedMesh.indices[i];
+			for( uint32_t j=0; j<subMeshIndices.numIndices; ++j )
+			{
+				const uint32_t index = indexType == Ogre::IndexBufferPacked::IT_32BIT ?
+						reinterpret_cast<const uint32_t*>( subMeshIndices.data )[j] :
+						reinterpret_cast<const uint16_t*>( subMeshIndices.data )[j];
+				if( index >= header.numVertices )
+					return false;
+			}
+		}
+		for( size_t i=0; i<vertexConversionLut.size(); ++i )
+		{
+			if( vertexConversionLut[i] >= header.numVertices )
+				return false;
+		}
+
+		//Everything checks out. Fill decodedMesh as prepareMesh would have.
+		MeshPatchMap patchMap;
+		if( numDeindexedVertices != 0 && source.vertexFormat == Network::VertexFormat::Full )
+		{
+			patchMap.build( &source.faces[0], static_cast<uint32_t>( source.faces.size() ),
+							static_cast<uint32_t>( source.rawVertices.size() ),
+							vertexConversionLut.begin(), header.numVertices );
+		}
+
+		source.vertexConversionLut.swap( vertexConversionLut );
+		source.patchMap.swap( patchMap );
+		source.aabb = Ogre::Aabb( Ogre::Vector3( header.aabbCenter[0], header.aabbCenter[1],
+												 header.aabbCenter[2] ),
+								  Ogre::Vector3( header.aabbHalfSize[0], header.aabbHalfSize[1],
+												 header.aabbHalfSize[2] ) );
+		source.tangentStride	= header.tangentStride;
+		source.tangentUvStride	= header.tangentUvStride;
+		memcpy( source.derivedBlockHashes, source.blockHashes, sizeof(source.blockHashes) );
+
+		decodedMesh.vertexElements.swap( vertexElements );
+		decodedMesh.optimizedNumVertices = header.numVertices;
+		std::swap( decodedMesh.vertexData.ptr, vertexData.ptr );
+		decodedMesh.indexType = indexType;
+		decodedMesh.uniqueMaterials.swap( uniqueMaterials );
+		decodedMesh.isPrepared = true;
+
+		createLodJob( decodedMesh );
+
+		//Mark it as recently used, so trimMeshDiskCache evicts it last
+		file.close();
+		utime( filename.c_str(), 0 );
+
+		return true;
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::createLodJob( DecodedMesh &decodedMesh )
+	{
+		delete decodedMesh.lodJob;
+		decodedMesh.lodJob = 0;
+
+		const BlenderMeshSource &source = decodedMesh.source;
+		const uint32_t numVertices = decodedMesh.optimizedNumVertices;
+		if( !source.numLods || !numVertices )
+			return;
+
+		size_t numIndices = 0;
+		std::vector<SubMeshIndices>::const_iterator itor = decodedMesh.indices.begin();
+		std::vector<SubMeshIndices>::const_iterator end  = decodedMesh.indices.end();
+		while( itor != end )
+		{
+			numIndices += itor->numIndices;
+			++itor;
+		}
+
+		if( numIndices / 3u < c_minLodTriangles )
+			return;
+
+		const bool use32BitIndices = decodedMesh.indexType == Ogre::IndexBufferPacked::IT_32BIT;
+
+		MeshLodJob *job = new MeshLodJob();
+		job->numLods			= source.numLods;
+		job->reduction			= source.lodQuality / 100.0f;
+		job->radius				= source.aabb.getRadius();
+		job->use32BitIndices	= use32BitIndices;
+
+		//Position always comes first. Compact vertices may have it as half floats.
+		const Ogre::VertexElement2Vec &vertexElements = decodedMesh.vertexElements[0];
+		const uint32_t bytesPerVertex = Ogre::VaoManager::calculateVertexSize( vertexElements );
+		const bool halfPositions = vertexElements[0].mType == Ogre::VET_HALF4;
+		const uint8_t *vertexData = reinterpret_cast<const uint8_t*>( decodedMesh.vertexData.ptr );
+
+		job->positions.resize( numVertices * 3u );
+		float *positions = &job->positions[0];
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			if( halfPositions )
+			{
+				const uint16_t *src = reinterpret_cast<const uint16_t*>( vertexData );
+				for( size_t j=0; j<3u; ++j )
+					positions[j] = VertexUtils::halfToFloat( src[j] );
+			}
+			else
+			{
+				memcpy( positions, vertexData, sizeof(float) * 3u );
+			}
+			positions += 3u;
+			vertexData += bytesPerVertex;
+		}
+
+		job->subMeshIndices.resize( decodedMesh.indices.size() );
+		for( size_t i=0; i<decodedMesh.indices.size(); ++i )
+		{
+			const SubMeshIndices &src = decodedMesh.indices[i];
+			std::vector<uint32_t> &dst = job->subMeshIndices[i];
+			if( use32BitIndices )
+			{
+				const uint32_t *srcData = reinterpret_cast<const uint32_t*>( src.data );
+				dst.assign( srcData, srcData + src.numIndices );
+			}
+			else
+			{
+				const uint16_t *srcData = reinterpret_cast<const uint16_t*>( src.data );
+				dst.assign( srcData, srcData + src.numIndices );
+			}
+		}
+
+		decodedMesh.lodJob = job;
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::queueLodJob( DecodedMesh &decodedMesh, SharedMeshBuffers *buffers )
+	{
+		buffers->lodJobId = 0;
+
+		if( decodedMesh.lodJob )
+		{
+			if( !++m_nextLodJobId )
+				++m_nextLodJobId; //0 means no job
+			buffers->lodJobId = m_nextLodJobId;
+			decodedMesh.lodJob->jobId = m_nextLodJobId;
+			m_lodBuilder->queueJob( decodedMesh.lodJob );
+			decodedMesh.lodJob = 0;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::attachFinishedLods()
+	{
+		std::vector<MeshLodJob*> finishedJobs;
+		m_lodBuilder->collectFinishedJobs( finishedJobs );
+
+		Ogre::VaoManager *vaoManager = mRoot->getRenderSystem()->getVaoManager();
+
+		std::vector<MeshLodJob*>::const_iterator itor = finishedJobs.begin();
+		std::vector<MeshLodJob*>::const_iterator end  = finishedJobs.end();
+
+		while( itor != end )
+		{
+			MeshLodJob *job = *itor;
+
+			//Find who's waiting for it. If nobody is, the buffers are gone
+			//or their content got replaced while the LODs were being built.
+			SharedMeshBuffers *buffers = 0;
+			std::vector<uint32_t> meshIds;
+			BlenderMeshMap::const_iterator itMesh = m_meshes.begin();
+			BlenderMeshMap::const_iterator enMesh = m_meshes.end();
+			while( itMesh != enMesh )
+			{
+				if( itMesh->second.buffers->lodJobId == job->jobId )
+				{
+					buffers = itMesh->second.buffers;
+					meshIds.push_back( itMesh->first );
+				}
+				++itMesh;
+			}
+
+			if( buffers && !job->lods.empty() )
+			{
+				buffers->lodJobId = 0;
+
+				const Ogre::IndexBufferPacked::IndexType indexType =
+						job->use32BitIndices ? Ogre::IndexBufferPacked::IT_32BIT :
+											   Ogre::IndexBufferPacked::IT_16BIT;
+
+				for( size_t i=0; i<job->lods.size(); ++i )
+				{
+					SharedMeshBuffers::Lod lod;
+					lod.distance = job->lodDistances[i];
+
+					std::vector<SubMeshIndices>::const_iterator itIndices = job->lods[i].begin();
+					std::vector<SubMeshIndices>::const_iterator enIndices = job->lods[i].end();
+					while( itIndices != enIndices )
+					{
+						lod.indexBuffers.push_back( vaoManager->createIndexBuffer(
+														indexType, itIndices->numIndices,
+														Ogre::BT_IMMUTABLE, itIndices->data,
+														false ) );
+						++itIndices;
+					}
+
+					buffers->lods.push_back( lod );
+				}
+
+				//The meshes need new Vaos for the LODs.
+				std::vector<uint32_t>::const_iterator itMeshId = meshIds.begin();
+				std::vector<uint32_t>::const_iterator enMeshId = meshIds.end();
+				while( itMeshId != enMeshId )
+				{
+					replaceMeshBuffers( *itMeshId, m_meshes[*itMeshId], buffers );
+					setupMeshMaterials( m_meshes[*itMeshId], m_meshSources[*itMeshId].materialTable );
+					++itMeshId;
+				}
+			}
+
+			delete job;
+			++itor;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::saveMeshToDiskCache( const DecodedMesh &decodedMesh )
+	{
+		//Meshes being edited get a new version (and content hash) every few frames.
+		//Saving each one would only fill the cache with versions nobody asks for again.
+		if( m_meshDiskCacheFolder.empty() || !decodedMesh.isPrepared ||
+			isMeshUnderEdit( decodedMesh.meshId ) )
+		{
+			return;
+		}
+
+		const BlenderMeshSource &source = decodedMesh.source;
+		const Ogre::VertexElement2Vec &vertexElements = decodedMesh.vertexElements[0];
+
+		MeshDiskCacheHeader header;
+		memset( &header, 0, sizeof(header) );
+		header.magic				= c_meshDiskCacheMagic;
+		header.version				= c_meshDiskCacheVersion;
+		header.contentHash[0]		= source.contentHash.value[0];
+		header.contentHash[1]		= source.contentHash.value[1];
+		header.numVertices			= decodedMesh.optimizedNumVertices;
+		header.bytesPerVertex		= Ogre::VaoManager::calculateVertexSize( vertexElements );
+		header.numVertexElements	= static_cast<uint32_t>( vertexElements.size() );
+		header.numSubMeshes			= static_cast<uint32_t>( decodedMesh.indices.size() );
+		header.numDeindexedVertices	= static_cast<uint32_t>( source.vertexConversionLut.size() );
+		header.tangentStride		= source.tangentStride;
+		header.tangentUvStride		= source.tangentUvStride;
+		for( size_t i=0; i<3u; ++i )
+		{
+			header.aabbCenter[i]	= source.aabb.mCenter[i];
+			header.aabbHalfSize[i]	= source.aabb.mHalfSize[i];
+		}
+
+		//Write to a temporary file first, so that a half-written file is never found
+		const Ogre::String filename = getMeshDiskCacheFilename( source.contentHash );
+		const Ogre::String tmpFilename = filename + ".tmp";
+
+		bool success = false;
+		uint64_t fileSize = 0;
+		{
+			std::ofstream file( tmpFilename.c_str(),
+								std::ios::out | std::ios::binary | std::ios::trunc );
+			if( !file )
+				return;
+
+			file.write( reinterpret_cast<const char*>( &header ), sizeof(header) );
+
+			Ogre::VertexElement2Vec::const_iterator itor = vertexElements.begin();
+			Ogre::VertexElement2Vec::const_iterator end  = vertexElements.end();
+			while( itor != end )
+			{
+				const uint32_t element = static_cast<uint32_t>( itor->mType ) |
+										 (static_cast<uint32_t>( itor->mSemantic ) << 16u);
+				file.write( reinterpret_cast<const char*>( &element ), sizeof(element) );
+				++itor;
+			}
+
+			for( size_t i=0; i<decodedMesh.indices.size(); ++i )
+			{
+				const uint32_t subMesh[2] =
+				{
+					decodedMesh.indices[i].numIndices,
+					decodedMesh.uniqueMaterials[i]
+				};
+				file.write( reinterpret_cast<const char*>( subMesh ), sizeof(subMesh) );
+			}
+
+			if( header.numVertices != 0 )
+			{
+				writeMeshDiskCachePadding( file );
+				file.write( reinterpret_cast<const char*>( decodedMesh.vertexData.ptr ),
+							static_cast<std::streamsize>( header.numVertices *
+														  header.bytesPerVertex ) );
+			}
+
+			const size_t bytesPerIndex =
+					decodedMesh.indexType == Ogre::IndexBufferPacked::IT_32BIT ?
+						sizeof(uint32_t) : sizeof(uint16_t);
+			for( size_t i=0; i<decodedMesh.indices.size(); ++i )
+			{
+				if( decodedMesh.indices[i].numIndices != 0 )
+				{
+					writeMeshDiskCachePadding( file );
+					file.write( reinterpret_cast<const char*>( decodedMesh.indices[i].data ),
+								static_cast<std::streamsize>( decodedMesh.indices[i].numIndices *
+															  bytesPerIndex ) );
+				}
+			}
+
+			if( header.numDeindexedVertices != 0 )
+			{
+				writeMeshDiskCachePadding( file );
+				file.write( reinterpret_cast<const char*>( source.vertexConversionLut.begin() ),
+							static_cast<std::streamsize>( header.numDeindexedVertices *
+														  sizeof(uint32_t) ) );
+			}
+
+			file.flush();
+			success = file.good();
+			fileSize = static_cast<uint64_t>( file.tellp() );
+		}
+
+		if( success )
+		{
+			//rename() won't overwrite on Windows
+			remove( filename.c_str() );
+			success = rename( tmpFilename.c_str(), filename.c_str() ) == 0;
+		}
+
+		if( !success )
+		{
+			remove( tmpFilename.c_str() );
+			return;
+		}
+
+		//Trim below the cap, so we don't have to list the folder on every save
+		m_meshDiskCacheBytes += fileSize;
+		if( m_meshDiskCacheBytes > m_meshDiskCacheMaxBytes )
+			trimMeshDiskCache( m_meshDiskCacheMaxBytes - m_meshDiskCacheMaxBytes / 4u );
+	}
+	//-----------------------------------------------------------------------------------
+	/// A file in the disk cache, see trimMeshDiskCache.
+	struct MeshDiskCacheFile
+	{
+		Ogre::String	filename;
+		time_t			lastUsed;
+		uint64_t		sizeBytes;
+
+		bool operator < ( const MeshDiskCacheFile &other ) const
+		{
+			return lastUsed < other.lastUsed;
+		}
+	};
+	void DergoSystem::trimMeshDiskCache( uint64_t maxBytes )
+	{
+		std::vector<MeshDiskCacheFile> files;
+		uint64_t totalBytes = 0;
+
+		{
+			Ogre::FileInfoListPtr fileInfoList =
+					m_meshDiskCacheArchive->findFileInfo( "*.mesh", false, false );
+			files.reserve( fileInfoList->size() );
+
+			Ogre::FileInfoList::const_iterator itor = fileInfoList->begin();
+			Ogre::FileInfoList::const_iterator end  = fileInfoList->end();
+			while( itor != end )
+			{
+				MeshDiskCacheFile file;
+				file.filename	= itor->filename;
+				file.lastUsed	= m_meshDiskCacheArchive->getModifiedTime( itor->filename );
+				file.sizeBytes	= itor->uncompressedSize;
+				files.push_back( file );
+				totalBytes += file.sizeBytes;
+				++itor;
+			}
+		}
+
+		//Least recently used first
+		std::sort( files.begin(), files.end() );
+
+		std::vector<MeshDiskCacheFile>::const_iterator itor = files.begin();
+		std::vector<MeshDiskCacheFile>::const_iterator end  = files.end();
+		while( itor != end && totalBytes > maxBytes )
+		{
+			m_meshDiskCacheArchive->remove( itor->filename );
+			totalBytes -= itor->sizeBytes;
+			++itor;
+		}
+
+		m_meshDiskCacheBytes = totalBytes;
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::setMeshUnderEdit( uint32_t meshId, bool underEdit )
+	{
+		m_meshesUnderEditMutex.lock();
+		if( underEdit )
+			m_meshesUnderEdit.insert( meshId );
+		else
+			m_meshesUnderEdit.erase( meshId );
+		m_meshesUnderEditMutex.unlock();
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::expireMeshesUnderEdit()
+	{
+		m_meshesUnderEditMutex.lock();
+		std::set<uint32_t>::iterator itor = m_meshesUnderEdit.begin();
+		std::set<uint32_t>::iterator end  = m_meshesUnderEdit.end();
+		while( itor != end )
+		{
+			BlenderMeshSourceMap::const_iterator itSource = m_meshSources.find( *itor );
+			if( itSource == m_meshSources.end() ||
+				m_numRenderSyncs - itSource->second.lastChangeSync >= c_dynamicMeshIdleSyncs )
+			{
+				m_meshesUnderEdit.erase( itor++ );
+			}
+			else
+			{
+				++itor;
+			}
+		}
+		m_meshesUnderEditMutex.unlock();
+	}
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::isMeshUnderEdit( uint32_t meshId )
+	{
+		m_meshesUnderEditMutex.lock();
+		const bool underEdit = m_meshesUnderEdit.find( meshId ) != m_meshesUnderEdit.end();
+		m_meshesUnderEditMutex.unlock();
+		return underEdit;
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::commitMesh( DecodedMesh &decodedMesh )
+	{
+		const uint32_t meshId = decodedMesh.meshId;
+		BlenderMeshSource &source = decodedMesh.source;
+
+		const std::vector<uint32_t> &materialTable = source.materialTable;
+
+		BlenderMeshMap::const_iterator meshEntryIt = m_meshes.find( meshId );
+
+		MeshBufferCacheMap::const_iterator itCache = m_meshBufferCache.find( source.contentHash );
+		if( itCache != m_meshBufferCache.end() )
+		{
+			//Some mesh already has this content. Share its buffers.
+			SharedMeshBuffers *buffers = itCache->second;
+			const bool ownBuffers = meshEntryIt != m_meshes.end() &&
+									meshEntryIt->second.buffers == buffers;
+			if( meshEntryIt == m_meshes.end() )
+				createMesh( meshId, source.meshName, buffers );
+			else if( !ownBuffers )
+				replaceMeshBuffers( meshId, m_meshes[meshId], buffers );
+			source.aabb = buffers->aabb;
+
+			if( !ownBuffers )
+			{
+				//Whatever the source derived from its last build describes other buffers.
+				//The same content may have been welded differently, see prepareMesh.
+				source.vertexConversionLut.clear();
+				source.patchMap.clear();
+				source.tangentStride = 0;
+				source.tangentUvStride = 0;
+				memset( source.derivedBlockHashes, 0, sizeof(source.derivedBlockHashes) );
+			}
+		}
+		else
+		{
+			//The decode thread expected the buffers to be in the
+			//cache by now, but they're gone. Do it ourselves.
+			if( !decodedMesh.isPrepared )
+				prepareMesh( decodedMesh );
+
+			//We've got all the data the way we want/need. Now deal with Ogre.
+			if( meshEntryIt == m_meshes.end() )
+			{
+				//We don't have this mesh.
+				createMesh( meshId, source.meshName, createMeshBuffers( decodedMesh, false, false ) );
+			}
+			else
+			{
+				BlenderMesh &meshEntry = m_meshes[meshId];
+
+				//Meshes with LODs drop them (and get new buffers) on every edit.
+				//Those don't benefit from the room to grow, nor from dynamic buffers.
+				const bool reserveGrowth = decodedMesh.lodJob == 0;
+				const bool underEdit = noteMeshEdit( meshEntry ) ||
+									   meshEntry.buffers->dynamicVertexData != 0;
+				const bool dynamic = reserveGrowth && underEdit;
+				if( underEdit )
+					setMeshUnderEdit( meshId, true );
+
+				if( canUpdateMesh( meshEntry, decodedMesh ) &&
+					(!dynamic || meshEntry.buffers->dynamicVertexData) )
+				{
+					updateMesh( meshEntry, decodedMesh );
+				}
+				else
+				{
+					//It outgrew its buffers (or shrank a lot), or it's about to become
+					//dynamic. It's being edited, so give the new buffers room to grow;
+					//or the next edit would have to replace them too.
+					replaceMeshBuffers( meshId, meshEntry,
+										createMeshBuffers( decodedMesh, reserveGrowth, dynamic ) );
+				}
+			}
+		}
+
+		//Now setup/update the materials
+		setupMeshMaterials( m_meshes.find( meshId )->second, materialTable );
+
+		//Keep the data around so we can apply FromClient::MeshDelta to it later.
+		source.lastChangeSync = m_numRenderSyncs;
+		m_meshSources[meshId].swap( source );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::setupMeshMaterials( const BlenderMesh &meshEntry,
+										  const std::vector<uint32_t> &materialTable )
+	{
+		const std::vector<uint16_t> &uniqueMaterials = meshEntry.buffers->uniqueMaterials;
+		Ogre::Mesh *meshPtr = meshEntry.meshPtr;
+		for( size_t i=0; i<meshPtr->getNumSubMeshes(); ++i )
+		{
+			const uint16_t tableIdx = uniqueMaterials[i];
+			Ogre::String materialIdStr;
+			if( tableIdx < materialTable.size() )
+			{
+				const uint32_t materialId = materialTable[tableIdx];
+				materialIdStr = Ogre::StringConverter::toString( materialId );
+			}
+			meshPtr->getSubMesh( i )->setMaterialName( materialIdStr );
+
+			BlenderItemVec::const_iterator itItem = meshEntry.items.begin();
+			BlenderItemVec::const_iterator enItem = meshEntry.items.end();
+
+			const Ogre::IdString materialIdHash = materialIdStr;
+			while( itItem != enItem )
+			{
+				itItem->item->getSubItem( i )->setDatablock( materialIdHash );
+				++itItem;
+			}
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::syncMeshDelta( Network::SmartData &smartData )
+	{
+		const uint32_t meshId			= smartData.read<uint32_t>();
+		const uint32_t numRawVertices	= smartData.read<uint32_t>();
+		const uint32_t numFaces			= smartData.read<uint32_t>();
+
+		BlenderMeshSourceMap::iterator itSource = m_meshSources.find( meshId );
+		if( itSource == m_meshSources.end() || m_meshes.find( meshId ) == m_meshes.end() ||
+			itSource->second.rawVertices.size() != numRawVertices ||
+			itSource->second.faces.size() != numFaces )
+		{
+			//The client is patching something we don't have. Tell client to resync
+			return false;
+		}
+
+		BlenderMeshSource &source = itSource->second;
+
+		std::vector<uint32_t> dirtyRawVertices;
+		std::vector<uint32_t> dirtyFaces;
+
+		const uint32_t numRawVertexRanges = smartData.read<uint32_t>();
+		for( uint32_t i=0; i<numRawVertexRanges; ++i )
+		{
+			const uint32_t start = smartData.read<uint32_t>();
+			const uint32_t count = smartData.read<uint32_t>();
+
+			if( start > numRawVertices || count > numRawVertices - start ||
+				count * sizeof(BlenderRawVertex) > smartData.getCapacity() - smartData.getOffset() )
+			{
+				return false;
+			}
+
+			if( count )
+			{
+				smartData.read( reinterpret_cast<uint8_t*>( &source.rawVertices[start] ),
+								sizeof(BlenderRawVertex) * count );
+			}
+
+			for( uint32_t j=start; j<start + count; ++j )
+				dirtyRawVertices.push_back( j );
+		}
+
+		const uint32_t numFaceNormalRanges = smartData.read<uint32_t>();
+		for( uint32_t i=0; i<numFaceNormalRanges; ++i )
+		{
+			const uint32_t start = smartData.read<uint32_t>();
+			const uint32_t count = smartData.read<uint32_t>();
+
+			if( start > numFaces || count > numFaces - start ||
+				count * sizeof(Ogre::Vector3) > smartData.getCapacity() - smartData.getOffset() )
+			{
+				return false;
+			}
+
+			for( uint32_t j=start; j<start + count; ++j )
+			{
+				smartData.read( reinterpret_cast<uint8_t*>( &source.faces[j].faceNormal ),
+								sizeof(Ogre::Vector3) );
+				dirtyFaces.push_back( j );
 			}
+		}
 
-			Ogre::IndexBufferPacked *indexBuffer = vaoManager->createIndexBuffer( indexType,
-																				  itor->size(),
-																				  Ogre::BT_DEFAULT,
-																				  indexData, true );
-			safeIndexPtr.ptr = 0;
+		source.lastChangeSync = m_numRenderSyncs;
 
-			Ogre::VertexArrayObject *vao = vaoManager->createVertexArrayObject( vertexBuffers,
-																				indexBuffer,
-																				Ogre::OT_TRIANGLE_LIST );
-			Ogre::SubMesh *subMesh = meshPtr->createSubMesh();
-			subMesh->mVao[0].push_back( vao );
-			subMesh->mVao[1].push_back( vao );
+		if( !patchMesh( meshId, source, dirtyRawVertices, dirtyFaces ) )
+		{
+			//Welded vertices would have to be split apart. Rebuild from what we have,
+			//which is still much cheaper than having the client send everything again.
+			//The mesh is being edited: don't spend time on the vertex cache until it stops.
+			if( source.vertexCacheMode == Network::VertexCacheMode::Auto )
+				source.optimizeVertexCache = false;
+			buildMesh( meshId );
+		}
 
-			subMesh->setMaterialName( "##INTERNAL## DEFAULT" );
+		return true;
+	}
+	//-----------------------------------------------------------------------------------
+	/// Flags vertices [firstVertex; endVertex) as stale in every region of a dynamic vertex buffer.
+	static void markDynamicVerticesStale( std::vector< std::pair<uint32_t, uint32_t> > &staleVertices,
+										  uint32_t firstVertex, uint32_t endVertex )
+	{
+		std::vector< std::pair<uint32_t, uint32_t> >::iterator itor = staleVertices.begin();
+		std::vector< std::pair<uint32_t, uint32_t> >::iterator end  = staleVertices.end();
 
+		while( itor != end )
+		{
+			if( itor->first >= itor->second )
+			{
+				*itor = std::pair<uint32_t, uint32_t>( firstVertex, endVertex );
+			}
+			else
+			{
+				itor->first		= std::min( itor->first, firstVertex );
+				itor->second	= std::max( itor->second, endVertex );
+			}
 			++itor;
 		}
+	}
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::patchMesh( uint32_t meshId, BlenderMeshSource &source,
+								 const std::vector<uint32_t> &dirtyRawVertices,
+								 const std::vector<uint32_t> &dirtyFaces )
+	{
+		const MeshPatchMap &patchMap = source.patchMap;
+		if( patchMap.empty() )
+			return false;
 
-		meshPtr->_setBounds( aabb );
+		BlenderMesh &meshEntry = m_meshes[meshId];
+		Ogre::Mesh *meshPtr = meshEntry.meshPtr;
+		if( meshPtr->getNumSubMeshes() == 0 )
+			return false;
+
+		//Patching would change the other meshes using these buffers too.
+		SharedMeshBuffers *buffers = meshEntry.buffers;
+		if( buffers->refCount > 1u || !buffers->vertexBuffer )
+			return false;
+
+		const uint32_t numGpuVertices = static_cast<uint32_t>( patchMap.gpuVertexFlags.size() );
+		const Ogre::FastArray<uint32_t> &vertexConversionLut = source.vertexConversionLut;
+
+		//Check everything can be patched before touching anything.
+		{
+			std::vector<uint32_t>::const_iterator itor = dirtyRawVertices.begin();
+			std::vector<uint32_t>::const_iterator end  = dirtyRawVertices.end();
+			while( itor != end )
+			{
+				if( patchMap.rawVertexAmbiguous[*itor] )
+					return false;
+				++itor;
+			}
+		}
+		{
+			std::vector<uint32_t>::const_iterator itor = dirtyFaces.begin();
+			std::vector<uint32_t>::const_iterator end  = dirtyFaces.end();
+			while( itor != end )
+			{
+				for( uint32_t i=patchMap.faceFirstVertex[*itor];
+					 i<patchMap.faceFirstVertex[*itor + 1u]; ++i )
+				{
+					const uint32_t gpuIdx = vertexConversionLut[i];
+					if( patchMap.gpuVertexFlags[gpuIdx] & MeshPatchMap::GpuVertexAmbiguous )
+						return false;
+				}
+				++itor;
+			}
+		}
+
+		//The buffers will no longer match their hash. We don't hash them again since
+		//it would make every small edit as expensive as hashing the whole mesh.
+		uncacheMeshBuffers( buffers );
+
+		if( noteMeshEdit( meshEntry ) )
+		{
+			setMeshUnderEdit( meshId, true );
+			if( !buffers->dynamicVertexData )
+				setMeshBuffersDynamic( buffers, true );
+		}
+
+		Ogre::VertexBufferPacked *vertexBuffer = buffers->vertexBuffer;
+
+		//Patch our copy of the data in place (or the shadow copy, thus the
+		//const_cast), then upload from it.
+		uint8_t *vertexData = reinterpret_cast<uint8_t*>( buffers->dynamicVertexData );
+		if( !vertexData )
+		{
+			vertexData = reinterpret_cast<uint8_t*>(
+							 const_cast<void*>( vertexBuffer->getShadowCopy() ) );
+		}
+
+		const uint32_t bytesPerVertex = vertexBuffer->getBytesPerElement();
+
+		std::vector<uint8_t> dirtyGpuVertices( numGpuVertices, 0 );
+
+		{
+			std::vector<uint32_t>::const_iterator itor = dirtyRawVertices.begin();
+			std::vector<uint32_t>::const_iterator end  = dirtyRawVertices.end();
+			while( itor != end )
+			{
+				const BlenderRawVertex &rawVertex = source.rawVertices[*itor];
+
+				//Only grows. Shrinking would need to look at all the vertices.
+				//Since it's no longer exact, prepareMesh must not reuse it.
+				source.aabb.merge( rawVertex.vPos );
+				source.derivedBlockHashes[MeshBlockRawVertices].value[0] = 0;
+				source.derivedBlockHashes[MeshBlockRawVertices].value[1] = 0;
+
+				for( uint32_t i=patchMap.rawToGpuOffsets[*itor];
+					 i<patchMap.rawToGpuOffsets[*itor + 1u]; ++i )
+				{
+					const uint32_t gpuIdx = patchMap.rawToGpu[i];
+					uint8_t *vertex = vertexData + gpuIdx * bytesPerVertex;
+
+					*reinterpret_cast<Ogre::Vector3*>( vertex ) = rawVertex.vPos;
+					if( patchMap.gpuVertexFlags[gpuIdx] & MeshPatchMap::GpuVertexSmooth )
+					{
+						*reinterpret_cast<Ogre::Vector3*>( vertex + sizeof(Ogre::Vector3) ) =
+								rawVertex.vNormal;
+					}
+					dirtyGpuVertices[gpuIdx] = 1u;
+				}
+				++itor;
+			}
+		}
+		{
+			std::vector<uint32_t>::const_iterator itor = dirtyFaces.begin();
+			std::vector<uint32_t>::const_iterator end  = dirtyFaces.end();
+			while( itor != end )
+			{
+				const BlenderFace &face = source.faces[*itor];
+				const bool useSmooth = (face.materialId & 0x8000) != 0;
+
+				for( uint32_t i=patchMap.faceFirstVertex[*itor];
+					 i<patchMap.faceFirstVertex[*itor + 1u] && !useSmooth; ++i )
+				{
+					const uint32_t gpuIdx = vertexConversionLut[i];
+					uint8_t *vertex = vertexData + gpuIdx * bytesPerVertex;
+					*reinterpret_cast<Ogre::Vector3*>( vertex + sizeof(Ogre::Vector3) ) =
+							face.faceNormal;
+					dirtyGpuVertices[gpuIdx] = 1u;
+				}
+				++itor;
+			}
+		}
+
+		if( source.tangentStride )
+		{
+			VertexUtils::generateTangentsPartial( vertexData, vertexConversionLut.begin(),
+												  bytesPerVertex, numGpuVertices,
+												  static_cast<uint32_t>( vertexConversionLut.size() ),
+												  0, sizeof(float) * 3u,
+												  source.tangentStride, source.tangentUvStride,
+												  &dirtyGpuVertices[0] );
+		}
+
+		//Upload the patched vertices. Runs separated by small gaps are merged, since
+		//uploading a few untouched vertices is cheaper than issuing another copy.
+		const uint32_t c_maxGapVertices = 8u;
+		Ogre::StagingBuffer::DestinationVec destinations;
+		size_t totalBytes = 0;
+
+		uint32_t runStart = 0;
+		while( runStart < numGpuVertices )
+		{
+			if( !dirtyGpuVertices[runStart] )
+			{
+				++runStart;
+				continue;
+			}
+
+			uint32_t runEnd = runStart + 1u;
+			for( uint32_t i=runEnd; i<numGpuVertices && i - runEnd <= c_maxGapVertices; ++i )
+			{
+				if( dirtyGpuVertices[i] )
+					runEnd = i + 1u;
+			}
+
+			const size_t runBytes = (runEnd - runStart) * bytesPerVertex;
+			destinations.push_back( Ogre::StagingBuffer::Destination(
+										vertexBuffer, runStart * bytesPerVertex,
+										totalBytes, runBytes ) );
+			totalBytes += runBytes;
+			runStart = runEnd;
+		}
+
+		if( !destinations.empty() && buffers->dynamicVertexData )
+		{
+			//refreshDynamicMeshBuffers copies them straight into mapped memory.
+			const Ogre::StagingBuffer::Destination &lastRun = destinations.back();
+			markDynamicVerticesStale( buffers->staleVertices,
+									  static_cast<uint32_t>( destinations.front().dstOffset /
+															 bytesPerVertex ),
+									  static_cast<uint32_t>( (lastRun.dstOffset + lastRun.length) /
+															 bytesPerVertex ) );
+		}
+		else if( !destinations.empty() )
+		{
+			Ogre::VaoManager *vaoManager = mRoot->getRenderSystem()->getVaoManager();
+			Ogre::StagingBuffer *stagingBuffer = vaoManager->getStagingBuffer( totalBytes, true );
+
+			uint8_t *stagingData = reinterpret_cast<uint8_t*>( stagingBuffer->map( totalBytes ) );
+
+			Ogre::StagingBuffer::DestinationVec::const_iterator itor = destinations.begin();
+			Ogre::StagingBuffer::DestinationVec::const_iterator end  = destinations.end();
+			while( itor != end )
+			{
+				memcpy( stagingData + itor->srcOffset, vertexData + itor->dstOffset, itor->length );
+				++itor;
+			}
+
+			stagingBuffer->unmap( destinations );
+			stagingBuffer->removeReferenceCount();
+		}
+
+		meshPtr->_setBounds( source.aabb );
+
+		//Items copied the Aabb when they were created.
+		BlenderItemVec::const_iterator itItem = meshEntry.items.begin();
+		BlenderItemVec::const_iterator enItem = meshEntry.items.end();
+		while( itItem != enItem )
+		{
+			itItem->item->setLocalAabb( meshPtr->getAabb() );
+			++itItem;
+		}
+
+		return true;
+	}
+	//-----------------------------------------------------------------------------------
+	/// Moves data into a bigger OGRE_MALLOC_SIMD allocation, zeroing the rest.
+	static void* growBufferData( void *data, size_t sizeBytes, size_t newSizeBytes )
+	{
+		void *retVal = OGRE_MALLOC_SIMD( newSizeBytes, Ogre::MEMCATEGORY_GEOMETRY );
+		memcpy( retVal, data, sizeBytes );
+		memset( reinterpret_cast<uint8_t*>( retVal ) + sizeBytes, 0, newSizeBytes - sizeBytes );
+		OGRE_FREE_SIMD( data, Ogre::MEMCATEGORY_GEOMETRY );
+		return retVal;
+	}
+	//-----------------------------------------------------------------------------------
+	/// Number of elements to allocate to hold numElements, plus growthPercent more.
+	static uint32_t addGrowth( uint32_t numElements, uint32_t growthPercent )
+	{
+		return numElements + static_cast<uint32_t>( static_cast<uint64_t>( numElements ) *
+													growthPercent / 100u );
+	}
+	//-----------------------------------------------------------------------------------
+	DergoSystem::SharedMeshBuffers* DergoSystem::createMeshBuffers( DecodedMesh &decodedMesh,
+																	 bool reserveGrowth,
+																	 bool dynamic )
+	{
+		const uint32_t optimizedNumVertices		= decodedMesh.optimizedNumVertices;
+		std::vector<SubMeshIndices> &indices	= decodedMesh.indices;
+		const uint32_t growthPercent			= reserveGrowth ? c_meshBufferGrowthPercent : 0u;
+
+		Ogre::RenderSystem *renderSystem = mRoot->getRenderSystem();
+		Ogre::VaoManager *vaoManager = renderSystem->getVaoManager();
+
+		SharedMeshBuffers *buffers = new SharedMeshBuffers();
+		buffers->vertexBuffer		= 0;
+		buffers->numVertices		= optimizedNumVertices;
+		buffers->dynamicVertexData	= 0;
+		buffers->dynamicRegion		= 0;
+		buffers->uniqueMaterials	= decodedMesh.uniqueMaterials;
+		buffers->aabb				= decodedMesh.source.aabb;
+		buffers->refCount			= 0;
+		buffers->contentHash		= decodedMesh.source.contentHash;
+		buffers->isInCache			= false;
+		buffers->lodJobId			= 0;
+
+		if( optimizedNumVertices != 0 )
+		{
+			//Create actual GPU buffers. The shadow copy must be as big as the buffer.
+			const uint32_t numVertices = addGrowth( optimizedNumVertices, growthPercent );
+			const size_t bytesPerVertex =
+					Ogre::VaoManager::calculateVertexSize( decodedMesh.vertexElements[0] );
+			if( numVertices != optimizedNumVertices )
+			{
+				decodedMesh.vertexData.ptr = growBufferData( decodedMesh.vertexData.ptr,
+															 optimizedNumVertices * bytesPerVertex,
+															 numVertices * bytesPerVertex );
+			}
+
+			if( dynamic )
+			{
+				//Keep the data ourselves. It gets to the GPU with refreshDynamicMeshBuffers.
+				buffers->vertexBuffer = vaoManager->createVertexBuffer(
+											decodedMesh.vertexElements[0], numVertices,
+											Ogre::BT_DYNAMIC_PERSISTENT, 0, false );
+				buffers->dynamicVertexData = decodedMesh.vertexData.ptr;
+				buffers->staleVertices.assign( vaoManager->getDynamicBufferMultiplier(),
+											   std::pair<uint32_t, uint32_t>(
+												   0, optimizedNumVertices ) );
+			}
+			else
+			{
+				buffers->vertexBuffer = vaoManager->createVertexBuffer(
+											decodedMesh.vertexElements[0], numVertices,
+											Ogre::BT_DEFAULT, decodedMesh.vertexData.ptr, true );
+			}
+			decodedMesh.vertexData.ptr = 0;
+		}
+
+		//The index data is already in its final format. The buffers take ownership of it.
+		const size_t bytesPerIndex =
+				decodedMesh.indexType == Ogre::IndexBufferPacked::IT_32BIT ? 4u : 2u;
+		std::vector<SubMeshIndices>::iterator itor = indices.begin();
+		std::vector<SubMeshIndices>::iterator end  = indices.end();
+		while( itor != end )
+		{
+			const uint32_t numIndices = addGrowth( itor->numIndices, growthPercent );
+			if( numIndices != itor->numIndices )
+			{
+				itor->data = growBufferData( itor->data, itor->numIndices * bytesPerIndex,
+											 numIndices * bytesPerIndex );
+			}
+
+			Ogre::IndexBufferPacked *indexBuffer = vaoManager->createIndexBuffer(
+						decodedMesh.indexType, numIndices, Ogre::BT_DEFAULT, itor->data, true );
+			itor->data = 0;
+			buffers->indexBuffers.push_back( indexBuffer );
+			buffers->numIndices.push_back( itor->numIndices );
+
+			++itor;
+		}
+
+		cacheMeshBuffers( buffers );
+		queueLodJob( decodedMesh, buffers );
+
+		return buffers;
+	}
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::noteMeshEdit( BlenderMesh &meshEntry )
+	{
+		if( m_numRenderSyncs - meshEntry.editWindowStart >= c_dynamicMeshEditWindow )
+		{
+			meshEntry.editWindowStart	= m_numRenderSyncs;
+			meshEntry.numWindowEdits	= 0;
+		}
+
+		if( meshEntry.numWindowEdits < c_dynamicMeshMinEdits )
+			++meshEntry.numWindowEdits;
+
+		return meshEntry.numWindowEdits >= c_dynamicMeshMinEdits;
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::setMeshBuffersDynamic( SharedMeshBuffers *buffers, bool dynamic )
+	{
+		Ogre::VertexBufferPacked *oldVertexBuffer = buffers->vertexBuffer;
+		assert( oldVertexBuffer && (buffers->dynamicVertexData != 0) != dynamic );
+
+		Ogre::VaoManager *vaoManager = mRoot->getRenderSystem()->getVaoManager();
+
+		const Ogre::VertexElement2Vec &vertexElements = oldVertexBuffer->getVertexElements();
+		const uint32_t numElements	= static_cast<uint32_t>( oldVertexBuffer->getNumElements() );
+		const size_t bytesPerVertex	= oldVertexBuffer->getBytesPerElement();
+
+		if( dynamic )
+		{
+			//Dynamic buffers can't keep a shadow copy. Keep our own.
+			buffers->dynamicVertexData = OGRE_MALLOC_SIMD( numElements * bytesPerVertex,
+														   Ogre::MEMCATEGORY_GEOMETRY );
+			memcpy( buffers->dynamicVertexData, oldVertexBuffer->getShadowCopy(),
+					numElements * bytesPerVertex );
+			buffers->vertexBuffer = vaoManager->createVertexBuffer( vertexElements, numElements,
+																	Ogre::BT_DYNAMIC_PERSISTENT,
+																	0, false );
+			buffers->staleVertices.assign( vaoManager->getDynamicBufferMultiplier(),
+										   std::pair<uint32_t, uint32_t>( 0, buffers->numVertices ) );
+			buffers->dynamicRegion = 0;
+		}
+		else
+		{
+			//Our copy becomes the shadow copy, which must be as big as the buffer.
+			void *vertexData = growBufferData( buffers->dynamicVertexData,
+											   buffers->numVertices * bytesPerVertex,
+											   numElements * bytesPerVertex );
+			buffers->dynamicVertexData = 0;
+			buffers->staleVertices.clear();
+			buffers->vertexBuffer = vaoManager->createVertexBuffer( vertexElements, numElements,
+																	Ogre::BT_DEFAULT,
+																	vertexData, true );
+		}
+
+		//Same vertex format, so the Items can stay.
+		BlenderMeshMap::iterator itor = m_meshes.begin();
+		BlenderMeshMap::iterator end  = m_meshes.end();
+		while( itor != end )
+		{
+			if( itor->second.buffers == buffers )
+			{
+				rebindMesh( itor->second, buffers );
+
+				BlenderMeshSourceMap::const_iterator itSource = m_meshSources.find( itor->first );
+				if( itSource != m_meshSources.end() )
+					setupMeshMaterials( itor->second, itSource->second.materialTable );
+			}
+			++itor;
+		}
+
+		vaoManager->destroyVertexBuffer( oldVertexBuffer );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::demoteDynamicMeshBuffers( bool onlyIdle )
+	{
+		BlenderMeshMap::const_iterator itor = m_meshes.begin();
+		BlenderMeshMap::const_iterator end  = m_meshes.end();
+
+		while( itor != end )
+		{
+			SharedMeshBuffers *buffers = itor->second.buffers;
+			if( buffers->dynamicVertexData )
+			{
+				//Shared buffers can't be edited in place anymore, see canUpdateMesh.
+				BlenderMeshSourceMap::const_iterator itSource = m_meshSources.find( itor->first );
+				if( !onlyIdle || buffers->refCount > 1u || itSource == m_meshSources.end() ||
+					m_numRenderSyncs - itSource->second.lastChangeSync >= c_dynamicMeshIdleSyncs )
+				{
+					setMeshBuffersDynamic( buffers, false );
+				}
+			}
+
+			++itor;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::refreshDynamicMeshBuffers()
+	{
+		BlenderMeshMap::const_iterator itor = m_meshes.begin();
+		BlenderMeshMap::const_iterator end  = m_meshes.end();
+
+		while( itor != end )
+		{
+			SharedMeshBuffers *buffers = itor->second.buffers;
+
+			//If the region the GPU reads is up to date, there's nothing to do.
+			//Otherwise moving on to the next region (which map does) brings it up to date,
+			//since changes are flagged in every region. Regions past the next one catch up
+			//once it's their turn.
+			if( buffers->dynamicVertexData &&
+				std::min( buffers->staleVertices[buffers->dynamicRegion].second,
+						  buffers->numVertices ) >
+				buffers->staleVertices[buffers->dynamicRegion].first )
+			{
+				const uint8_t nextRegion = static_cast<uint8_t>( (buffers->dynamicRegion + 1u) %
+																 buffers->staleVertices.size() );
+				std::pair<uint32_t, uint32_t> &staleVertices = buffers->staleVertices[nextRegion];
+				uint32_t firstVertex	= std::min( staleVertices.first, buffers->numVertices );
+				uint32_t endVertex		= std::min( staleVertices.second, buffers->numVertices );
+				if( firstVertex >= endVertex )
+				{
+					//Nothing to copy, but we still map to move on to that region.
+					firstVertex = 0;
+					endVertex = 0;
+				}
+
+				Ogre::VertexBufferPacked *vertexBuffer = buffers->vertexBuffer;
+				const size_t bytesPerVertex = vertexBuffer->getBytesPerElement();
+
+				void *dstData = vertexBuffer->map( firstVertex,
+												   std::max( endVertex - firstVertex, 1u ) );
+				memcpy( dstData, reinterpret_cast<const uint8_t*>( buffers->dynamicVertexData ) +
+						firstVertex * bytesPerVertex,
+						(endVertex - firstVertex) * bytesPerVertex );
+				vertexBuffer->unmap( Ogre::UO_KEEP_PERSISTENT );
+
+				staleVertices = std::pair<uint32_t, uint32_t>( 0, 0 );
+				buffers->dynamicRegion = nextRegion;
+			}
+
+			++itor;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::createMesh( uint32_t meshId, const Ogre::String &meshName,
+								  SharedMeshBuffers *buffers )
+	{
+		Ogre::MeshPtr meshPtr = Ogre::MeshManager::getSingleton().createManual(
+					toStr64(meshId), Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME );
+
+		attachMeshBuffers( meshPtr.get(), buffers );
 
 		BlenderMesh meshEntry;
 		meshEntry.meshPtr			= meshPtr.get();
+		meshEntry.buffers			= buffers;
 		meshEntry.userFriendlyName	= meshName;
+		meshEntry.editWindowStart	= m_numRenderSyncs;
+		meshEntry.numWindowEdits	= 0;
 		m_meshes[meshId] = meshEntry;
 	}
 	//-----------------------------------------------------------------------------------
-	void DergoSystem::updateMesh( const BlenderMesh &meshEntry, uint32_t optimizedNumVertices,
-								  Ogre::FreeOnDestructor &vertexDataPtrContainer,
-								  const std::vector< std::vector<uint32_t> > &indices,
-								  const Ogre::Aabb &aabb )
+	void DergoSystem::attachMeshBuffers( Ogre::Mesh *meshPtr, SharedMeshBuffers *buffers )
 	{
+		assert( meshPtr->getNumSubMeshes() == 0 );
+
 		Ogre::RenderSystem *renderSystem = mRoot->getRenderSystem();
 		Ogre::VaoManager *vaoManager = renderSystem->getVaoManager();
 
+		Ogre::VertexBufferPackedVec vertexBuffers;
+		if( buffers->vertexBuffer )
+			vertexBuffers.push_back( buffers->vertexBuffer );
+
+		//Each mesh has its own Vaos, even if the buffers are shared.
+		for( size_t i=0; i<buffers->indexBuffers.size(); ++i )
+		{
+			Ogre::VertexArrayObject *vao = vaoManager->createVertexArrayObject( vertexBuffers,
+																				buffers->indexBuffers[i],
+																				Ogre::OT_TRIANGLE_LIST );
+			//The index buffer may have room to grow
+			vao->setPrimitiveRange( 0, buffers->numIndices[i] );
+			Ogre::SubMesh *subMesh = meshPtr->createSubMesh();
+			subMesh->mVao[0].push_back( vao );
+			subMesh->mVao[1].push_back( vao );
+
+			//One more Vao per LOD, sharing the vertex buffer
+			std::vector<SharedMeshBuffers::Lod>::const_iterator itLod = buffers->lods.begin();
+			std::vector<SharedMeshBuffers::Lod>::const_iterator enLod = buffers->lods.end();
+			while( itLod != enLod )
+			{
+				vao = vaoManager->createVertexArrayObject( vertexBuffers, itLod->indexBuffers[i],
+														   Ogre::OT_TRIANGLE_LIST );
+				subMesh->mVao[0].push_back( vao );
+				subMesh->mVao[1].push_back( vao );
+				++itLod;
+			}
+
+			subMesh->setMaterialName( "##INTERNAL## DEFAULT" );
+		}
+
+		{
+			//Mesh only gets LOD values from the serializer. Items read them
+			//straight from this array (see MovableObject::mLodMesh). The mesh
+			//may be getting other buffers, so reset them even without LODs.
+			Ogre::LodStrategy *lodStrategy =
+					Ogre::LodStrategyManager::getSingleton().getDefaultStrategy();
+			Ogre::LodValueArray *lodValues =
+					const_cast<Ogre::LodValueArray*>( meshPtr->_getLodValueArray() );
+			lodValues->clear();
+			lodValues->push_back( lodStrategy->getBaseValue() );
+
+			std::vector<SharedMeshBuffers::Lod>::const_iterator itLod = buffers->lods.begin();
+			std::vector<SharedMeshBuffers::Lod>::const_iterator enLod = buffers->lods.end();
+			while( itLod != enLod )
+			{
+				lodValues->push_back( lodStrategy->transformUserValue( itLod->distance ) );
+				++itLod;
+			}
+		}
+
+		meshPtr->_setBounds( buffers->aabb );
+
+		++buffers->refCount;
+	}
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::canUpdateMesh( const BlenderMesh &meshEntry,
+									 const DecodedMesh &decodedMesh ) const
+	{
+		const SharedMeshBuffers *buffers = meshEntry.buffers;
+
+		//Other meshes are using them
+		if( buffers->refCount > 1u )
+			return false;
+
+		//The LODs would be stale. It's cheaper to start over than to remove them.
+		if( !buffers->lods.empty() )
+			return false;
+
+		const std::vector<SubMeshIndices> &indices = decodedMesh.indices;
+		if( indices.size() != buffers->indexBuffers.size() )
+			return false;
+
+		const Ogre::VertexBufferPacked *vertexBuffer = buffers->vertexBuffer;
+		if( !vertexBuffer )
+			return decodedMesh.optimizedNumVertices == 0;
+
+		//Vertex format changed! (e.g. added or removed UVs)
+		if( decodedMesh.vertexElements[0] != vertexBuffer->getVertexElements() )
+			return false;
+
+		//Current buffer can't hold it, or it's way too big
+		const uint32_t optimizedNumVertices = decodedMesh.optimizedNumVertices;
+		if( optimizedNumVertices > vertexBuffer->getNumElements() ||
+			optimizedNumVertices < (vertexBuffer->getNumElements() >> 2u) )
+		{
+			return false;
+		}
+
+		for( size_t i=0; i<indices.size(); ++i )
+		{
+			const Ogre::IndexBufferPacked *indexBuffer = buffers->indexBuffers[i];
+			if( indices[i].numIndices > indexBuffer->getNumElements() ||
+				indices[i].numIndices < (indexBuffer->getNumElements() >> 2u) )
+			{
+				return false;
+			}
+
+			//Indices were prepared for a different index type
+			if( indexBuffer->getIndexType() != decodedMesh.indexType )
+				return false;
+		}
+
+		return true;
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::updateMesh( const BlenderMesh &meshEntry, DecodedMesh &decodedMesh )
+	{
+		++m_numMeshesUpdatedInPlace;
+
+		const uint32_t optimizedNumVertices			= decodedMesh.optimizedNumVertices;
+		const std::vector<SubMeshIndices> &indices	= decodedMesh.indices;
+		const Ogre::Aabb &aabb						= decodedMesh.source.aabb;
+
 		Ogre::Mesh *meshPtr = meshEntry.meshPtr;
 
+		SharedMeshBuffers *buffers = meshEntry.buffers;
+		assert( buffers->refCount == 1u );
+		uncacheMeshBuffers( buffers );
+
 		//Upload vertex data (all submeshes share it)
-		if( meshPtr->getNumSubMeshes() > 0 )
+		if( buffers->dynamicVertexData )
+		{
+			//Take the data as it is. refreshDynamicMeshBuffers copies it to the GPU.
+			std::swap( buffers->dynamicVertexData, decodedMesh.vertexData.ptr );
+			markDynamicVerticesStale( buffers->staleVertices, 0, optimizedNumVertices );
+		}
+		else if( meshPtr->getNumSubMeshes() > 0 )
 		{
 			Ogre::SubMesh *subMesh = meshPtr->getSubMesh( 0 );
 			Ogre::VertexBufferPacked *vertexBuffer = subMesh->mVao[0][0]->getVertexBuffers()[0];
-			vertexBuffer->upload( vertexDataPtrContainer.ptr, 0, optimizedNumVertices );
+			vertexBuffer->upload( decodedMesh.vertexData.ptr, 0, optimizedNumVertices );
 		}
+		buffers->numVertices = optimizedNumVertices;
 
 		for( uint16_t i=0; i<meshPtr->getNumSubMeshes(); ++i )
 		{
 			Ogre::SubMesh *subMesh = meshPtr->getSubMesh( i );
 
+			//commitMesh made sure the index type matches.
 			Ogre::IndexBufferPacked *indexBuffer = subMesh->mVao[0][0]->getIndexBuffer();
-			if( indexBuffer->getIndexType() == Ogre::IndexBufferPacked::IT_32BIT )
-			{
-				indexBuffer->upload( &indices[i][0], 0, indices[i].size() );
-			}
-			else
-			{
-				//const_cast so we can update the shadow copy without
-				//malloc'ing extra memory and perform the copy in place.
-				uint16_t * RESTRICT_ALIAS shadowCopy = reinterpret_cast<uint16_t * RESTRICT_ALIAS>(
-													const_cast<void*>( indexBuffer->getShadowCopy() ));
-				Ogre::StagingBuffer *stagingBuffer = vaoManager->getStagingBuffer(
-							indices[i].size() * sizeof(uint16_t), true );
-
-				uint16_t * RESTRICT_ALIAS index16 = reinterpret_cast<uint16_t * RESTRICT_ALIAS>(
-							stagingBuffer->map( indices[i].size() * sizeof(uint16_t) ) );
-
-				for( size_t j=0; j<indices[i].size(); ++j )
-				{
-					shadowCopy[j]	= static_cast<uint16_t>( indices[i][j] );
-					index16[j]		= static_cast<uint16_t>( indices[i][j] );
-				}
+			assert( indexBuffer->getIndexType() == decodedMesh.indexType );
+			if( indices[i].numIndices != 0 )
+				indexBuffer->upload( indices[i].data, 0, indices[i].numIndices );
 
-				stagingBuffer->unmap( Ogre::StagingBuffer::
-									  Destination( indexBuffer, 0, 0,
-												   indices[i].size() * sizeof(uint16_t) ) );
-				stagingBuffer->removeReferenceCount();
-			}
-
-			subMesh->mVao[0][0]->setPrimitiveRange( 0, indices[i].size() );
+			//The buffer may be bigger; only draw what's in use.
+			subMesh->mVao[0][0]->setPrimitiveRange( 0, indices[i].numIndices );
 			subMesh->setMaterialName( "##INTERNAL## DEFAULT" );
+			buffers->numIndices[i] = indices[i].numIndices;
 		}
 
 		meshPtr->_setBounds( aabb );
+
+		//Items copied the Aabb when they were created.
+		BlenderItemVec::const_iterator itItem = meshEntry.items.begin();
+		BlenderItemVec::const_iterator enItem = meshEntry.items.end();
+		while( itItem != enItem )
+		{
+			itItem->item->setLocalAabb( aabb );
+			++itItem;
+		}
+
+		buffers->uniqueMaterials	= decodedMesh.uniqueMaterials;
+		buffers->aabb				= aabb;
+		buffers->contentHash		= decodedMesh.source.contentHash;
+		cacheMeshBuffers( buffers );
+		queueLodJob( decodedMesh, buffers );
 	}
 	//-----------------------------------------------------------------------------------
-	void DergoSystem::recreateMesh( uint32_t meshId, BlenderMesh meshEntry, uint32_t optimizedNumVertices,
-									const Ogre::VertexElement2VecVec &vertexElements,
-									Ogre::FreeOnDestructor &vertexDataPtrContainer,
-									const std::vector< std::vector<uint32_t> > &indices,
-									const Ogre::Aabb &aabb )
+	void DergoSystem::recreateMesh( uint32_t meshId, BlenderMesh meshEntry,
+									SharedMeshBuffers *buffers )
 	{
+		++m_numMeshesRecreated;
+
 		//Destroy all items, but first saving their state.
 		ItemDataVec itemsData;
 		itemsData.reserve( meshEntry.items.size() );
@@ -1157,6 +2938,8 @@ namespace DERGO
 			sceneNode->getParentSceneNode()->removeAndDestroyChild( sceneNode );
 			mSceneManager->destroyItem( itor->item );
 
+			m_itemIndex.erase( getItemKey( meshId, itor->id ) );
+
 			++itor;
 		}
 
@@ -1165,28 +2948,88 @@ namespace DERGO
 		//Destroy mesh
 		Ogre::String userFriendlyName = meshEntry.userFriendlyName;
 
-		destroyMeshVaos( meshEntry.meshPtr );
+		destroyMeshVaos( meshEntry );
 		Ogre::MeshManager::getSingleton().remove( meshEntry.meshPtr->getName() );
 		meshEntry.meshPtr = 0;
 		m_meshes.erase( meshId );
 
 		//Create mesh again.
-		createMesh( meshId, userFriendlyName, optimizedNumVertices,
-					vertexElements, vertexDataPtrContainer, indices, aabb );
+		createMesh( meshId, userFriendlyName, buffers );
 
 		//Restore the items.
 		BlenderMesh &newBlenderMesh = m_meshes[meshId];
+		newBlenderMesh.editWindowStart	= meshEntry.editWindowStart;
+		newBlenderMesh.numWindowEdits	= meshEntry.numWindowEdits;
 
 		ItemDataVec::const_iterator itItem = itemsData.begin();
 		ItemDataVec::const_iterator enItem = itemsData.end();
 
 		while( itItem != enItem )
 		{
-			createItem( newBlenderMesh, *itItem );
+			createItem( meshId, newBlenderMesh, *itItem );
+			++itItem;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::rebindMesh( BlenderMesh &meshEntry, SharedMeshBuffers *buffers )
+	{
+		++m_numMeshesRebound;
+
+		//SubItems copy the Vaos when they're created. Tear them down before the
+		//Vaos & submeshes they point to are gone, and build them again after.
+		BlenderItemVec::const_iterator itItem = meshEntry.items.begin();
+		BlenderItemVec::const_iterator enItem = meshEntry.items.end();
+		while( itItem != enItem )
+		{
+			itItem->item->_deinitialise();
+			++itItem;
+		}
+
+		//Hold a reference, in case these are the buffers we're releasing.
+		++buffers->refCount;
+
+		Ogre::Mesh *meshPtr = meshEntry.meshPtr;
+		destroyMeshVaos( meshEntry );
+		while( meshPtr->getNumSubMeshes() > 0 )
+			meshPtr->destroySubMesh( meshPtr->getNumSubMeshes() - 1u );
+
+		attachMeshBuffers( meshPtr, buffers );
+		meshEntry.buffers = buffers;
+
+		--buffers->refCount;
+
+		itItem = meshEntry.items.begin();
+		while( itItem != enItem )
+		{
+			itItem->item->_initialise();
 			++itItem;
 		}
 	}
 	//-----------------------------------------------------------------------------------
+	void DergoSystem::replaceMeshBuffers( uint32_t meshId, BlenderMesh &meshEntry,
+										  SharedMeshBuffers *buffers )
+	{
+		const Ogre::VertexBufferPacked *oldVertexBuffer = meshEntry.buffers->vertexBuffer;
+		const Ogre::VertexBufferPacked *newVertexBuffer = buffers->vertexBuffer;
+
+		//Items can be rebuilt in place. But a different vertex format needs different
+		//shaders and input layouts, so start over with new Items instead.
+		const bool sameFormat = oldVertexBuffer && newVertexBuffer &&
+								oldVertexBuffer->getVertexElements() ==
+								newVertexBuffer->getVertexElements();
+		if( sameFormat )
+		{
+			rebindMesh( meshEntry, buffers );
+		}
+		else
+		{
+			//Hold a reference, in case these are the buffers we're releasing.
+			++buffers->refCount;
+			recreateMesh( meshId, meshEntry, buffers );
+			--buffers->refCount;
+		}
+	}
+	//-----------------------------------------------------------------------------------
 	bool DergoSystem::syncItem( Network::SmartData &smartData )
 	{
 		bool retVal = true;
@@ -1209,36 +3052,139 @@ namespace DERGO
 		itemData.scale.y = smartData.read<float>();
 		itemData.scale.z = smartData.read<float>();
 
-		BlenderMeshMap::iterator itMeshEntry = m_meshes.find( meshId );
-		if( itMeshEntry != m_meshes.end() )
+		const BlenderItemLocation *location = m_itemIndex.find( getItemKey( meshId, itemData.id ) );
+		if( location )
 		{
-			BlenderItemVec::iterator itItem = itMeshEntry->second.findItem( itemData.id );
-			if( itItem != itMeshEntry->second.items.end() )
+			Ogre::Item *item = location->mesh->items[location->slot].item;
+			item->setName( itemData.name );
+			Ogre::Node *node = item->getParentNode();
+			node->setPosition( itemData.position );
+			node->setOrientation( itemData.rotation );
+			node->setScale( itemData.scale );
+		}
+		else
+		{
+			BlenderMeshMap::iterator itMeshEntry = m_meshes.find( meshId );
+			if( itMeshEntry != m_meshes.end() )
 			{
-				itItem->item->setName( itemData.name );
-				Ogre::Node *node = itItem->item->getParentNode();
-				node->setPosition( itemData.position );
-				node->setOrientation( itemData.rotation );
-				node->setScale( itemData.scale );
+				createItem( meshId, itMeshEntry->second, itemData );
 			}
 			else
 			{
-				createItem( itMeshEntry->second, itemData );
+				//Shouldn't happen! Tell client to resync
+				assert( false );
+				retVal = false;
 			}
 		}
-		else
+
+		return retVal;
+	}
+	//-----------------------------------------------------------------------------------
+	/// Applies a FromClient::ItemTransformBatch. The arrays point straight into
+	/// the network data, thus they may not be aligned.
+	class DergoSystem::ItemTransformBatchTask : public Ogre::UniformScalableTask
+	{
+		uint32_t		meshId;
+		uint32_t		numItems;
+		const uint8_t	*itemIds;
+		const uint8_t	*positions;
+		const uint8_t	*rotations;
+		const uint8_t	*scales;
+
+		const FlatIdMap<BlenderItemLocation> &itemIndex;
+
+		/// Per thread. Number of items that could not be found.
+		std::vector<uint32_t> numMissingItems;
+
+	public:
+		ItemTransformBatchTask( uint32_t _meshId, uint32_t _numItems, const uint8_t *data,
+								const FlatIdMap<BlenderItemLocation> &_itemIndex,
+								size_t numThreads ) :
+			meshId( _meshId ),
+			numItems( _numItems ),
+			itemIds( data ),
+			positions( itemIds + sizeof(uint32_t) * _numItems ),
+			rotations( positions + sizeof(float) * 3u * _numItems ),
+			scales( rotations + sizeof(float) * 4u * _numItems ),
+			itemIndex( _itemIndex ),
+			numMissingItems( numThreads, 0 )
 		{
-			//Shouldn't happen! Tell client to resync
-			assert( false );
-			retVal = false;
 		}
 
-		return retVal;
+		virtual void execute( size_t threadId, size_t numThreads )
+		{
+			const uint32_t itemsPerThread = static_cast<uint32_t>(
+												Ogre::alignToNextMultiple( numItems, numThreads ) /
+												numThreads );
+			const uint32_t start	= std::min<uint32_t>( itemsPerThread * threadId, numItems );
+			const uint32_t end		= std::min<uint32_t>( start + itemsPerThread, numItems );
+
+			for( uint32_t i=start; i<end; ++i )
+			{
+				uint32_t itemId;
+				float position[3], rotation[4], scale[3];
+				memcpy( &itemId, itemIds + i * sizeof(itemId), sizeof(itemId) );
+				memcpy( position, positions + i * sizeof(position), sizeof(position) );
+				memcpy( rotation, rotations + i * sizeof(rotation), sizeof(rotation) );
+				memcpy( scale, scales + i * sizeof(scale), sizeof(scale) );
+
+				const BlenderItemLocation *location = itemIndex.find( getItemKey( meshId, itemId ) );
+				if( !location )
+				{
+					++numMissingItems[threadId];
+					continue;
+				}
+
+				//Each item has its own node, so threads never touch the same one.
+				Ogre::Node *node = location->mesh->items[location->slot].item->getParentNode();
+				node->setPosition( position[0], position[1], position[2] );
+				node->setOrientation( rotation[0], rotation[1], rotation[2], rotation[3] );
+				node->setScale( scale[0], scale[1], scale[2] );
+			}
+		}
+
+		uint32_t getNumMissingItems() const
+		{
+			uint32_t retVal = 0;
+			for( size_t i=0; i<numMissingItems.size(); ++i )
+				retVal += numMissingItems[i];
+			return retVal;
+		}
+	};
+	//-----------------------------------------------------------------------------------
+	bool DergoSystem::syncItemTransformBatch( Network::SmartData &smartData )
+	{
+		const uint32_t meshId	= smartData.read<uint32_t>();
+		const uint32_t numItems	= smartData.read<uint32_t>();
+
+		const size_t bytesPerItem = sizeof(uint32_t) + sizeof(float) * (3u + 4u + 3u);
+		if( numItems > (smartData.getCapacity() - smartData.getOffset()) / bytesPerItem )
+			return false;
+
+		//Don't wake up the worker threads for a handful of items
+		const size_t c_minItemsForThreading = 1024u;
+		const size_t numThreads = numItems >= c_minItemsForThreading ?
+									  mSceneManager->getNumWorkerThreads() : 1u;
+
+		ItemTransformBatchTask task( meshId, numItems,
+									 reinterpret_cast<const uint8_t*>( smartData.getCurrentPtr() ),
+									 m_itemIndex, numThreads );
+		if( numThreads > 1u )
+			mSceneManager->executeUserScalableTask( &task, true );
+		else
+			task.execute( 0, 1u );
+
+		smartData.seekCur( static_cast<int>( numItems * bytesPerItem ) );
+
+		//Items that don't exist can't be created without their names. Let client resync.
+		return task.getNumMissingItems() == 0;
 	}
 	//-----------------------------------------------------------------------------------
-	void DergoSystem::createItem( BlenderMesh &blenderMesh, const ItemData &itemData )
+	void DergoSystem::createItem( uint32_t meshId, BlenderMesh &blenderMesh,
+								  const ItemData &itemData )
 	{
         Ogre::Item *item = mSceneManager->createItem( blenderMesh.meshPtr->getName() );
+		++m_numItemsCreated;
 		item->setName( itemData.name );
 		item->setVisibilityFlags( 1u );
 
@@ -1248,6 +3194,9 @@ namespace DERGO
 		sceneNode->setScale( itemData.scale );
 		sceneNode->attachObject( item );
 
+		m_itemIndex.insert( getItemKey( meshId, itemData.id ),
+							BlenderItemLocation( &blenderMesh,
+												 static_cast<uint32_t>( blenderMesh.items.size() ) ) );
 		blenderMesh.items.push_back( BlenderItem( itemData.id, item ) );
 	}
 	//-----------------------------------------------------------------------------------
@@ -1258,24 +3207,30 @@ namespace DERGO
 		uint32_t meshId = smartData.read<uint32_t>();
 		uint32_t itemId = smartData.read<uint32_t>();
 
-		BlenderMeshMap::iterator itMeshEntry = m_meshes.find( meshId );
-		if( itMeshEntry != m_meshes.end() )
+		const uint64_t itemKey = getItemKey( meshId, itemId );
+		const BlenderItemLocation *location = m_itemIndex.find( itemKey );
+
+		//The client may request us to delete the same object twice. Just ignore
+		//the remaining ones. Unfortunately due to how Blender works on name
+		//changes it is hard to send exactly one delete without duplicates.
+		if( location )
 		{
-			BlenderItemVec::iterator itemIt = itMeshEntry->second.findItem( itemId );
+			BlenderItemVec &items = location->mesh->items;
+			const uint32_t slot = location->slot;
 
-			//The client may request us to delete the same object twice. Just ignore
-			//the remaining ones. Unfortunately due to how Blender works on name
-			//changes it is hard to send exactly one delete without duplicates.
-			if( itemIt != itMeshEntry->second.items.end() )
-			{
-				Ogre::SceneNode *sceneNode = itemIt->item->getParentSceneNode();
-				sceneNode->getParentSceneNode()->removeAndDestroyChild( sceneNode );
-				mSceneManager->destroyItem( itemIt->item );
+			BlenderItemVec::iterator itemIt = items.begin() + slot;
+			Ogre::SceneNode *sceneNode = itemIt->item->getParentSceneNode();
+			sceneNode->getParentSceneNode()->removeAndDestroyChild( sceneNode );
+			mSceneManager->destroyItem( itemIt->item );
 
-				Ogre::efficientVectorRemove( itMeshEntry->second.items, itemIt );
-			}
+			//The last item takes the place of the removed one
+			Ogre::efficientVectorRemove( items, itemIt );
+			if( slot < items.size() )
+				m_itemIndex.find( getItemKey( meshId, items[slot].id ) )->slot = slot;
+
+			m_itemIndex.erase( itemKey );
 		}
-		else
+		else if( m_meshes.find( meshId ) == m_meshes.end() )
 		{
 			//Shouldn't happen! Tell client to resync
 			assert( false );
@@ -2100,7 +4055,7 @@ namespace DERGO
 				}
 
 				//Remove the mesh.
-				destroyMeshVaos( itor->second.meshPtr );
+				destroyMeshVaos( itor->second );
 				Ogre::MeshManager::getSingleton().remove( itor->second.meshPtr->getName() );
 				itor->second.meshPtr = 0;
 
@@ -2108,6 +4063,13 @@ namespace DERGO
 			}
 
 			m_meshes.clear();
+			m_itemIndex.clear();
+			m_meshSources.clear();
+			assert( m_meshBufferCache.empty() );
+
+			m_meshesUnderEditMutex.lock();
+			m_meshesUnderEdit.clear();
+			m_meshesUnderEditMutex.unlock();
 		}
 
 		{
@@ -2168,6 +4130,10 @@ namespace DERGO
 
 			m_textures.clear();
 		}
+
+		//Nothing the client sent is here anymore. Don't let it resume.
+		m_sessionManifest.clear();
+		++m_sessionId;
 	}
 	//-----------------------------------------------------------------------------------
 	void DergoSystem::exportToFile( Network::SmartData &smartData )
@@ -2214,6 +4180,10 @@ namespace DERGO
 		hlmsPbs->setParallaxCorrectedCubemap( m_parallaxCorrectedCubemap, m_pccVctMinDistance,
 											  m_pccVctMaxDistance );
 
+		//The exporter reads the meshes back from their vertex buffers.
+		if( meshes )
+			demoteDynamicMeshBuffers( false );
+
 		Ogre::SceneFormatExporter exporter( mRoot, mSceneManager, m_instantRadiosity );
 		exporter.setListener( this );
 		exporter.exportSceneToFile( fullPath, exportFlags );
@@ -2221,10 +4191,167 @@ namespace DERGO
 		hlmsPbs->setParallaxCorrectedCubemap( oldPcc, m_pccVctMinDistance, m_pccVctMaxDistance );
 	}
 	//-----------------------------------------------------------------------------------
+	void DergoSystem::sendRenderResult( Ogre::TextureGpu *rtt, bufferevent *bev,
+										NetworkSystem &networkSystem )
+	{
+		ReadbackSlot &slot = m_readbackSlots[m_nextReadbackSlot];
+		m_nextReadbackSlot = (m_nextReadbackSlot + 1u) % c_numReadbackSlots;
+
+		//The client doesn't ask for another frame until it got the previous
+		//one, so this should almost never wait at all.
+		while( slot.inFlight.load( std::memory_order_acquire ) )
+			Ogre::Threads::Sleep( 1 );
+
+		if( slot.isMapped )
+		{
+			slot.ticket->unmap();
+			slot.isMapped = false;
+		}
+
+		Ogre::TextureGpuManager *textureManager = mRoot->getRenderSystem()->getTextureGpuManager();
+
+		if( slot.ticket && (slot.width != rtt->getWidth() || slot.height != rtt->getHeight() ||
+							slot.pixelFormat != rtt->getPixelFormat()) )
+		{
+			textureManager->destroyAsyncTextureTicket( slot.ticket );
+			slot.ticket = 0;
+		}
+
+		if( !slot.ticket )
+		{
+			slot.width			= rtt->getWidth();
+			slot.height			= rtt->getHeight();
+			slot.pixelFormat	= rtt->getPixelFormat();
+			slot.ticket = textureManager->createAsyncTextureTicket( slot.width, slot.height, 1u,
+																	Ogre::TextureTypes::Type2D,
+																	slot.pixelFormat );
+		}
+
+		slot.ticket->download( rtt, 0, true );
+		const Ogre::TextureBox box = slot.ticket->map( 0 );
+		slot.isMapped = true;
+
+		if( m_resultEncoder.encode( box, mSceneManager ) )
+		{
+			//The encoded frame is copied to the socket; the slot is free right away.
+			const std::vector<Ogre::uint8> &encoded = m_resultEncoder.getEncoded();
+			networkSystem.send( bev, Network::FromServer::Result, &encoded[0], encoded.size() );
+			return;
+		}
+
+		//Rows may be padded in the staging memory, in which case they're sent one by one.
+		const size_t bytesPerRow = box.width * box.bytesPerPixel;
+		std::vector<NetworkSystem::DataChunk> chunks;
+		if( box.bytesPerRow == bytesPerRow )
+		{
+			const NetworkSystem::DataChunk chunk = { box.data, bytesPerRow * box.height };
+			chunks.push_back( chunk );
+		}
+		else
+		{
+			for( size_t y=0; y<box.height; ++y )
+			{
+				const NetworkSystem::DataChunk chunk =
+				{
+					reinterpret_cast<const uint8_t*>( box.data ) + y * box.bytesPerRow,
+					bytesPerRow
+				};
+				chunks.push_back( chunk );
+			}
+		}
+
+		uint8_t prefix[2u * sizeof(uint16_t) + sizeof(uint8_t)];
+		const uint16_t resolution[2] = { static_cast<uint16_t>( box.width ),
+										 static_cast<uint16_t>( box.height ) };
+		memcpy( prefix, resolution, sizeof(resolution) );
+		prefix[sizeof(resolution)] = Network::ResultEncoding::Raw;
+
+		m_resultEncoder.rawFrameSent( bytesPerRow * box.height );
+
+		slot.inFlight.store( true, std::memory_order_relaxed );
+		networkSystem.sendReferenced( bev, Network::FromServer::Result,
+									  prefix, sizeof(prefix),
+									  &chunks[0], chunks.size(),
+									  readbackSlotSent, &slot );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::readbackSlotSent( void *userData )
+	{
+		ReadbackSlot *slot = reinterpret_cast<ReadbackSlot*>( userData );
+		slot->inFlight.store( false, std::memory_order_release );
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::destroyReadbackSlots()
+	{
+		//The network is no longer running by the time we get here, so
+		//don't wait for slots that are still flagged as in flight.
+		Ogre::TextureGpuManager *textureManager = mRoot->getRenderSystem()->getTextureGpuManager();
+		for( size_t i=0; i<c_numReadbackSlots; ++i )
+		{
+			ReadbackSlot &slot = m_readbackSlots[i];
+			if( slot.isMapped )
+				slot.ticket->unmap();
+			if( slot.ticket )
+				textureManager->destroyAsyncTextureTicket( slot.ticket );
+			slot.ticket		= 0;
+			slot.isMapped	= false;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	/// See FromServer::Hello. The client computes the same thing with Python's zlib.
+	static uint64_t digestPayload( const void *data, size_t sizeBytes )
+	{
+		const Bytef *bytes = reinterpret_cast<const Bytef*>( data );
+		const uInt length = static_cast<uInt>( sizeBytes );
+		const uint64_t crc = crc32( crc32( 0L, Z_NULL, 0 ), bytes, length );
+		const uint64_t adler = adler32( adler32( 0L, Z_NULL, 0 ), bytes, length );
+		return (crc << 32u) | adler;
+	}
+	//-----------------------------------------------------------------------------------
+	DecodedMessage* DergoSystem::decodeMessage( const Network::MessageHeader &header,
+												Network::SmartData &smartData )
+	{
+		DecodedMessage *retVal = 0;
+
+		if( header.messageType == Network::FromClient::Mesh ||
+			header.messageType == Network::FromClient::MeshLoops )
+		{
+			DecodedMesh *decodedMesh = new DecodedMesh();
+			decodedMesh->payloadDigest = digestPayload( smartData.getCurrentPtr(), header.sizeBytes );
+			if( header.messageType == Network::FromClient::Mesh )
+				syncMesh( smartData, *decodedMesh );
+			else
+				syncMeshLoops( smartData, *decodedMesh );
+
+			//Copies of the same mesh only need to be prepared once
+			const MeshContentHash &contentHash = decodedMesh->source.contentHash;
+			if( !isMeshBufferCached( contentHash ) )
+			{
+				if( !loadMeshFromDiskCache( *decodedMesh ) )
+				{
+					restorePreparedMeshHistory( *decodedMesh );
+					prepareMesh( *decodedMesh );
+					saveMeshToDiskCache( *decodedMesh );
+				}
+				storePreparedMeshHistory( *decodedMesh );
+
+				m_recentlyPreparedMeshes[m_nextRecentlyPreparedMesh] = contentHash;
+				m_nextRecentlyPreparedMesh = (m_nextRecentlyPreparedMesh + 1u) %
+											 c_numRecentlyPreparedMeshes;
+			}
+			retVal = decodedMesh;
+		}
+
+		return retVal;
+	}
+	//-----------------------------------------------------------------------------------
 	void DergoSystem::processMessage( const Network::MessageHeader &header,
 									  Network::SmartData &smartData,
+									  DecodedMessage *decodedMessage,
 									  bufferevent *bev, NetworkSystem &networkSystem )
 	{
+		updateSessionManifest( header, smartData, decodedMessage );
+
 		switch( header.messageType )
 		{
 		case Network::FromClient::ConnectionTest:
@@ -2238,6 +4365,34 @@ namespace DERGO
 								"Hello you too", sizeof("Hello you too") );
 		}
 			break;
+		case Network::FromClient::Init:
+		{
+			size_t numEncodings = 0;
+			if( header.sizeBytes )
+			{
+				numEncodings = std::min<size_t>( smartData.read<uint8_t>(),
+												 header.sizeBytes - sizeof(uint8_t) );
+			}
+			m_resultEncoder.setSupportedEncodings(
+						reinterpret_cast<const Ogre::uint8*>( smartData.getCurrentPtr() ),
+						numEncodings );
+		}
+			break;
+		case Network::FromClient::Hello:
+			syncHello( smartData, bev, networkSystem );
+			break;
+		case Network::FromClient::Stats:
+		{
+			const uint32_t stats[4] =
+			{
+				m_numItemsCreated,
+				m_numMeshesRecreated,
+				m_numMeshesRebound,
+				m_numMeshesUpdatedInPlace
+			};
+			networkSystem.send( bev, Network::FromServer::Stats, stats, sizeof(stats) );
+		}
+			break;
 		case Network::FromClient::WorldParams:
 			syncWorld( smartData );
 			break;
@@ -2251,7 +4406,13 @@ namespace DERGO
 			syncShadowsSettings( smartData );
 			break;
 		case Network::FromClient::Mesh:
-			syncMesh( smartData );
+		case Network::FromClient::MeshLoops:
+			assert( dynamic_cast<DecodedMesh*>( decodedMessage ) );
+			commitMesh( *static_cast<DecodedMesh*>( decodedMessage ) );
+			break;
+		case Network::FromClient::MeshDelta:
+			if( !syncMeshDelta( smartData ) )
+				networkSystem.send( bev, Network::FromServer::Resync, 0, 0 );
 			break;
 		case Network::FromClient::Item:
 			if( !syncItem( smartData ) )
@@ -2261,6 +4422,10 @@ namespace DERGO
 			if( !destroyItem( smartData ) )
 				networkSystem.send( bev, Network::FromServer::Resync, 0, 0 );
 			break;
+		case Network::FromClient::ItemTransformBatch:
+			if( !syncItemTransformBatch( smartData ) )
+				networkSystem.send( bev, Network::FromServer::Resync, 0, 0 );
+			break;
 		case Network::FromClient::Light:
 			syncLight( smartData );
 			break;
@@ -2302,6 +4467,12 @@ namespace DERGO
 			break;
 		case Network::FromClient::Render:
 		{
+			++m_numRenderSyncs;
+			optimizeStaticMeshes();
+			attachFinishedLods();
+			demoteDynamicMeshBuffers( true );
+			expireMeshesUnderEdit();
+
 			const bool returnResult		= smartData.read<uint8_t>() != 0;
 			const uint64_t windowId		= smartData.read<uint64_t>();
 			const Ogre::uint16 width	= smartData.read<Ogre::uint16>();
@@ -2421,26 +4592,52 @@ namespace DERGO
 			if( returnResult )
 			{
 				updateDirtyVct();
+				refreshDynamicMeshBuffers();
 				//update();
 				mSceneManager->updateSceneGraph();
 				mWorkspace->_beginUpdate( true );
 				mWorkspace->_update();
 				mWorkspace->_endUpdate( true );
 				mSceneManager->clearFrameData();
+				//End the frame like Root::renderOneFrame does, so the next
+				//refreshDynamicMeshBuffers can map the dynamic buffers again.
+				mRoot->getRenderSystem()->_update();
 
 				Ogre::CompositorNode *internalTextureNode = mWorkspace->findNode( "InternalTextureNode" );
 
 				Ogre::TextureGpu *rtt = internalTextureNode->getDefinedTexture( "internalTexture" );
 
-				Ogre::Image2 tmpImage;
-				tmpImage.convertFromTexture( rtt, 0, 0, true );
+				if( rtt->isMultisample() && rtt->hasMsaaExplicitResolves() )
+				{
+					//Tickets can't download an unresolved surface. Let Image2 resolve it.
+					Ogre::Image2 tmpImage;
+					tmpImage.convertFromTexture( rtt, 0, 0, true );
 
-				Network::SmartData toClient( 2 * sizeof(Ogre::uint16) + tmpImage.getSizeBytes() );
-				toClient.write<uint16_t>( width );
-				toClient.write<uint16_t>( height );
-				memcpy( toClient.getCurrentPtr(), tmpImage.getRawBuffer(), tmpImage.getSizeBytes() );
-				networkSystem.send( bev, Network::FromServer::Result,
-									toClient.getBasePtr(), toClient.getCapacity() );
+					const Ogre::TextureBox box = tmpImage.getData( 0 );
+					if( m_resultEncoder.encode( box, mSceneManager ) )
+					{
+						const std::vector<Ogre::uint8> &encoded = m_resultEncoder.getEncoded();
+						networkSystem.send( bev, Network::FromServer::Result,
+											&encoded[0], encoded.size() );
+					}
+					else
+					{
+						Network::SmartData toClient( 2 * sizeof(Ogre::uint16) + sizeof(Ogre::uint8) +
+													 tmpImage.getSizeBytes() );
+						toClient.write<uint16_t>( width );
+						toClient.write<uint16_t>( height );
+						toClient.write<uint8_t>( Network::ResultEncoding::Raw );
+						memcpy( toClient.getCurrentPtr(), tmpImage.getRawBuffer(),
+								tmpImage.getSizeBytes() );
+						networkSystem.send( bev, Network::FromServer::Result,
+											toClient.getBasePtr(), toClient.getCapacity() );
+						m_resultEncoder.rawFrameSent( tmpImage.getSizeBytes() );
+					}
+				}
+				else
+				{
+					sendRenderResult( rtt, bev, networkSystem );
+				}
 			}
 			break;
 		}
@@ -2479,6 +4676,7 @@ namespace DERGO
 			if( !(frame % 8) )
 			{
 				updateDirtyVct();
+				refreshDynamicMeshBuffers();
 				update();
 			}
 			++frame;
@@ -2489,9 +4687,184 @@ namespace DERGO
 		}
 	}
 	//-----------------------------------------------------------------------------------
+	void DergoSystem::updateSessionManifest( const Network::MessageHeader &header,
+											 const Network::SmartData &smartData,
+											 DecodedMessage *decodedMessage )
+	{
+		const uint8_t *payload = reinterpret_cast<const uint8_t*>( smartData.getCurrentPtr() );
+
+		SessionObjectKey key;
+		key.messageType	= header.messageType;
+		key.parentId	= 0;
+		key.id			= 0;
+
+		size_t idSize = sizeof(uint32_t);
+		bool isRemoval = false;
+
+		switch( header.messageType )
+		{
+		case Network::FromClient::WorldParams:
+		case Network::FromClient::InstantRadiosity:
+		case Network::FromClient::ParallaxCorrectedCubemaps:
+		case Network::FromClient::ShadowsSettings:
+			idSize = 0;
+			break;
+		case Network::FromClient::Mesh:
+		case Network::FromClient::Light:
+		case Network::FromClient::Empty:
+		case Network::FromClient::Material:
+			break;
+		case Network::FromClient::MeshLoops:
+			//Both ways of sending a mesh replace each other
+			key.messageType = Network::FromClient::Mesh;
+			break;
+		case Network::FromClient::Texture:
+			idSize = sizeof(uint64_t);
+			break;
+		case Network::FromClient::Item:
+			idSize = sizeof(uint32_t) * 2u;
+			break;
+		case Network::FromClient::ItemRemove:
+			key.messageType = Network::FromClient::Item;
+			idSize = sizeof(uint32_t) * 2u;
+			isRemoval = true;
+			break;
+		case Network::FromClient::MeshDelta:
+			//We can't tell the digest of the whole mesh anymore
+			key.messageType = Network::FromClient::Mesh;
+			isRemoval = true;
+			break;
+		case Network::FromClient::LightRemove:
+			key.messageType = Network::FromClient::Light;
+			isRemoval = true;
+			break;
+		case Network::FromClient::EmptyRemove:
+			key.messageType = Network::FromClient::Empty;
+			isRemoval = true;
+			break;
+		case Network::FromClient::ItemTransformBatch:
+		{
+			//The items no longer match their last Item message
+			uint32_t ids[2];
+			if( header.sizeBytes < sizeof(ids) )
+				return;
+			memcpy( ids, payload, sizeof(ids) );
+
+			const size_t numItems = std::min<size_t>( ids[1], (header.sizeBytes - sizeof(ids)) /
+																sizeof(uint32_t) );
+			key.messageType	= Network::FromClient::Item;
+			key.parentId	= ids[0];
+			for( size_t i=0; i<numItems; ++i )
+			{
+				uint32_t itemId;
+				memcpy( &itemId, payload + sizeof(ids) + i * sizeof(uint32_t), sizeof(itemId) );
+				key.id = itemId;
+				m_sessionManifest.erase( key );
+			}
+			return;
+		}
+		default:
+			return;
+		}
+
+		if( header.sizeBytes < idSize )
+			return;
+
+		if( idSize == sizeof(uint64_t) )
+		{
+			memcpy( &key.id, payload, sizeof(uint64_t) );
+		}
+		else if( idSize != 0 )
+		{
+			uint32_t ids[2] = { 0, 0 };
+			memcpy( ids, payload, idSize );
+			if( key.messageType == Network::FromClient::Item )
+			{
+				key.parentId	= ids[0];
+				key.id			= ids[1];
+			}
+			else
+			{
+				key.id = ids[0];
+			}
+		}
+
+		if( isRemoval )
+		{
+			m_sessionManifest.erase( key );
+		}
+		else if( key.messageType == Network::FromClient::Mesh )
+		{
+			assert( dynamic_cast<DecodedMesh*>( decodedMessage ) );
+			m_sessionManifest[key] = static_cast<DecodedMesh*>( decodedMessage )->payloadDigest;
+		}
+		else
+		{
+			m_sessionManifest[key] = digestPayload( payload, header.sizeBytes );
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void DergoSystem::syncHello( Network::SmartData &smartData, bufferevent *bev,
+								 NetworkSystem &networkSystem )
+	{
+		const uint64_t sessionId = smartData.read<uint64_t>();
+
+		const bool resumed = sessionId != 0 && sessionId == m_sessionId;
+		if( resumed )
+		{
+			printf( "Resuming session. The client may skip resending %u objects\n",
+					static_cast<unsigned int>( m_sessionManifest.size() ) );
+		}
+		else
+		{
+			reset();
+		}
+
+		const size_t c_entrySize = sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t) * 2u;
+		const uint32_t numObjects = static_cast<uint32_t>( m_sessionManifest.size() );
+
+		std::vector<uint8_t> data( sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t) +
+								   numObjects * c_entrySize );
+		uint8_t *dstData = &data[0];
+
+		memcpy( dstData, &m_sessionId, sizeof(uint64_t) );
+		dstData += sizeof(uint64_t);
+		*dstData++ = resumed ? 1u : 0u;
+		memcpy( dstData, &numObjects, sizeof(uint32_t) );
+		dstData += sizeof(uint32_t);
+
+		SessionManifestMap::const_iterator itor = m_sessionManifest.begin();
+		SessionManifestMap::const_iterator end  = m_sessionManifest.end();
+
+		while( itor != end )
+		{
+			*dstData++ = itor->first.messageType;
+			memcpy( dstData, &itor->first.parentId, sizeof(uint32_t) );
+			dstData += sizeof(uint32_t);
+			memcpy( dstData, &itor->first.id, sizeof(uint64_t) );
+			dstData += sizeof(uint64_t);
+			memcpy( dstData, &itor->second, sizeof(uint64_t) );
+			dstData += sizeof(uint64_t);
+			++itor;
+		}
+
+		networkSystem.send( bev, Network::FromServer::Hello, &data[0],
+							static_cast<Ogre::uint32>( data.size() ) );
+	}
+	//-----------------------------------------------------------------------------------
 	void DergoSystem::allConnectionsTerminated()
 	{
-		reset();
+		//Keep the scene around for a while, in case the client comes back (see syncHello)
+		if( m_sessionGracePeriod )
+		{
+			printf( "Keeping the scene for %u seconds, in case the client reconnects\n",
+					m_sessionGracePeriod );
+		}
+		else
+		{
+			reset();
+		}
+		m_resultEncoder.reset();
 
 		Ogre::CompositorManager2 *compositorManager = mRoot->getCompositorManager2();
 		WindowMap::const_iterator itor = m_renderWindows.begin();
@@ -2511,6 +4884,12 @@ namespace DERGO
 		m_renderWindows.clear();
 	}
 	//-----------------------------------------------------------------------------------
+	void DergoSystem::idleTimeout()
+	{
+		printf( "The client didn't reconnect in time. Resetting the scene\n" );
+		reset();
+	}
+	//-----------------------------------------------------------------------------------
 	void DergoSystem::savingChangeTextureName( Ogre::String &inOutAliasName, Ogre::String &inOutTexName )
 	{
 		TexAliasToFullPathMap::const_iterator itor = m_textures.find( inOutAliasName );
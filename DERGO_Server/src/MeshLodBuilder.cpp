@@ -0,0 +1,210 @@
+
+#include "MeshLodBuilder.h"
+
+namespace DERGO
+{
+	using Ogre::ThreadHandle;
+
+	/// Max number of jobs in flight before they pile up in the backlog.
+	static const size_t c_maxPendingLodJobs = 64u;
+	/// How far (relative to the mesh's radius) simplification may move the surface.
+	static const float c_maxLodError = 0.1f;
+	/// A LOD is used once its error covers about a pixel of a 1080p viewport
+	/// with a 60° field of view: 1080 / (2 * tan( 30° )) ~= 1000
+	static const float c_lodDistancePerError = 1000.0f;
+	/// Each LOD is used at least this much further than the previous one.
+	static const float c_minLodDistanceStep = 1.5f;
+
+	unsigned long meshLodBuilderThread( ThreadHandle *threadHandle )
+	{
+		MeshLodBuilder *lodBuilder = reinterpret_cast<MeshLodBuilder*>(
+										 threadHandle->getUserParam() );
+		lodBuilder->_builderThread();
+		return 0;
+	}
+	THREAD_DECLARE( meshLodBuilderThread );
+	//-------------------------------------------------------------------------
+	MeshLodJob::~MeshLodJob()
+	{
+		std::vector< std::vector<SubMeshIndices> >::const_iterator itor = lods.begin();
+		std::vector< std::vector<SubMeshIndices> >::const_iterator end  = lods.end();
+
+		while( itor != end )
+		{
+			std::vector<SubMeshIndices>::const_iterator itIndices = itor->begin();
+			std::vector<SubMeshIndices>::const_iterator enIndices = itor->end();
+			while( itIndices != enIndices )
+			{
+				OGRE_FREE_SIMD( itIndices->data, Ogre::MEMCATEGORY_GEOMETRY );
+				++itIndices;
+			}
+			++itor;
+		}
+	}
+	//-------------------------------------------------------------------------
+	MeshLodBuilder::MeshLodBuilder() :
+		m_pendingJobs( c_maxPendingLodJobs ),
+		m_exit( false )
+	{
+		m_threads.push_back( Ogre::Threads::CreateThread( THREAD_GET( meshLodBuilderThread ),
+														  0, this ) );
+	}
+	//-------------------------------------------------------------------------
+	MeshLodBuilder::~MeshLodBuilder()
+	{
+		m_exit = true;
+
+		while( !m_backlog.empty() )
+		{
+			delete m_backlog.front();
+			m_backlog.pop_front();
+		}
+
+		//Null job wakes up the thread so it sees m_exit
+		m_pendingJobs.push( 0 );
+		Ogre::Threads::WaitForThreads( m_threads );
+
+		std::vector<MeshLodJob*>::const_iterator itor = m_finishedJobs.begin();
+		std::vector<MeshLodJob*>::const_iterator end  = m_finishedJobs.end();
+		while( itor != end )
+			delete *itor++;
+		m_finishedJobs.clear();
+	}
+	//-------------------------------------------------------------------------
+	void MeshLodBuilder::flushBacklog()
+	{
+		while( !m_backlog.empty() && m_pendingJobs.tryPush( m_backlog.front() ) )
+			m_backlog.pop_front();
+	}
+	//-------------------------------------------------------------------------
+	void MeshLodBuilder::queueJob( MeshLodJob *job )
+	{
+		m_backlog.push_back( job );
+		flushBacklog();
+	}
+	//-------------------------------------------------------------------------
+	void MeshLodBuilder::collectFinishedJobs( std::vector<MeshLodJob*> &outJobs )
+	{
+		flushBacklog();
+
+		m_finishedJobsMutex.lock();
+		outJobs.insert( outJobs.end(), m_finishedJobs.begin(), m_finishedJobs.end() );
+		m_finishedJobs.clear();
+		m_finishedJobsMutex.unlock();
+	}
+	//-------------------------------------------------------------------------
+	void MeshLodBuilder::buildLods( MeshLodJob &job )
+	{
+		const size_t numSubMeshes = job.subMeshIndices.size();
+		const uint32_t numVertices = static_cast<uint32_t>( job.positions.size() / 3u );
+
+		//All submeshes are simplified together, so there are no cracks between them.
+		//Tags tell which submesh each triangle belongs to.
+		std::vector<uint32_t> indices;
+		std::vector<uint32_t> triangleTags;
+		for( size_t i=0; i<numSubMeshes; ++i )
+		{
+			const std::vector<uint32_t> &subMeshIndices = job.subMeshIndices[i];
+			indices.insert( indices.end(), subMeshIndices.begin(), subMeshIndices.end() );
+			triangleTags.resize( indices.size() / 3u, static_cast<uint32_t>( i ) );
+		}
+
+		if( indices.empty() )
+			return;
+
+		//Submeshes that get simplified away completely keep the triangles
+		//they had in the previous LOD.
+		std::vector< std::vector<uint32_t> > lastSubMeshIndices( job.subMeshIndices );
+		std::vector< std::vector<uint32_t> > subMeshIndices( numSubMeshes );
+
+		uint32_t numIndices = static_cast<uint32_t>( indices.size() );
+		float lastDistance = job.radius;
+
+		for( uint8_t lod=0; lod<job.numLods; ++lod )
+		{
+			const uint32_t targetNumIndices =
+					static_cast<uint32_t>( (numIndices / 3u) * job.reduction ) * 3u;
+
+			float error = 0;
+			const uint32_t newNumIndices = VertexUtils::simplify( &indices[0], numIndices,
+																  &triangleTags[0],
+																  &job.positions[0], numVertices,
+																  targetNumIndices,
+																  job.radius * c_maxLodError,
+																  &error );
+
+			//Not worth another LOD (e.g. it's all seams, or the error got too big)
+			if( newNumIndices > numIndices - numIndices / 10u )
+				break;
+
+			numIndices = newNumIndices;
+
+			for( size_t i=0; i<numSubMeshes; ++i )
+				subMeshIndices[i].clear();
+			for( uint32_t i=0; i<numIndices; i += 3u )
+			{
+				std::vector<uint32_t> &dst = subMeshIndices[triangleTags[i / 3u]];
+				dst.insert( dst.end(), indices.begin() + i, indices.begin() + i + 3u );
+			}
+
+			std::vector<SubMeshIndices> lodIndices;
+			lodIndices.reserve( numSubMeshes );
+			for( size_t i=0; i<numSubMeshes; ++i )
+			{
+				if( !subMeshIndices[i].empty() )
+					lastSubMeshIndices[i].swap( subMeshIndices[i] );
+
+				const std::vector<uint32_t> &src = lastSubMeshIndices[i];
+
+				SubMeshIndices dst;
+				dst.numIndices = static_cast<uint32_t>( src.size() );
+				if( job.use32BitIndices )
+				{
+					uint32_t *data = reinterpret_cast<uint32_t*>(
+										 OGRE_MALLOC_SIMD( src.size() * sizeof(uint32_t),
+														   Ogre::MEMCATEGORY_GEOMETRY ) );
+					std::copy( src.begin(), src.end(), data );
+					dst.data = data;
+				}
+				else
+				{
+					uint16_t *data = reinterpret_cast<uint16_t*>(
+										 OGRE_MALLOC_SIMD( src.size() * sizeof(uint16_t),
+														   Ogre::MEMCATEGORY_GEOMETRY ) );
+					for( size_t j=0; j<src.size(); ++j )
+						data[j] = static_cast<uint16_t>( src[j] );
+					dst.data = data;
+				}
+				lodIndices.push_back( dst );
+			}
+
+			job.lods.push_back( std::vector<SubMeshIndices>() );
+			job.lods.back().swap( lodIndices );
+
+			lastDistance = std::max( error * c_lodDistancePerError,
+									 lastDistance * c_minLodDistanceStep );
+			job.lodDistances.push_back( lastDistance );
+		}
+	}
+	//-------------------------------------------------------------------------
+	void MeshLodBuilder::_builderThread()
+	{
+		while( true )
+		{
+			MeshLodJob *job = m_pendingJobs.pop();
+			if( m_exit )
+			{
+				delete job;
+				if( !job )
+					break;
+				continue;
+			}
+
+			buildLods( *job );
+
+			m_finishedJobsMutex.lock();
+			m_finishedJobs.push_back( job );
+			m_finishedJobsMutex.unlock();
+		}
+	}
+}
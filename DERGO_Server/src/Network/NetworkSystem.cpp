@@ -23,11 +23,35 @@
 #include <event2/listener.h>
 #include <event2/util.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 
 static const int PORT = 9995;
+/// Max number of messages waiting on each stage of the pipeline before the
+/// previous stage stalls (and ultimately, we stop reading from the socket).
+static const size_t c_maxPendingMessages = 64u;
+/// Print the dropped message counts this often. Same as ResultEncoder's stats.
+static const Ogre::uint64 c_reportIntervalMicroseconds = 5000000u;
 
 namespace DERGO
 {
+	using Ogre::ThreadHandle;
+
+	unsigned long networkThread( ThreadHandle *threadHandle )
+	{
+		NetworkSystem *networkSystem = reinterpret_cast<NetworkSystem*>( threadHandle->getUserParam() );
+		networkSystem->_networkThread();
+		return 0;
+	}
+	THREAD_DECLARE( networkThread );
+
+	unsigned long decodeThread( ThreadHandle *threadHandle )
+	{
+		NetworkSystem *networkSystem = reinterpret_cast<NetworkSystem*>( threadHandle->getUserParam() );
+		networkSystem->_decodeThread();
+		return 0;
+	}
+	THREAD_DECLARE( decodeThread );
+
 	static void buffered_on_read( bufferevent *bev, void *_userData )
 	{
 		NetworkSystem *networkSystem = reinterpret_cast<NetworkSystem*>( _userData );
@@ -53,12 +77,32 @@ namespace DERGO
 		networkSystem->_signal_cb( sig, events );
 	}
 
+	static void idle_timeout_cb( evutil_socket_t fd, short events, void *_userData )
+	{
+		NetworkSystem *networkSystem = reinterpret_cast<NetworkSystem*>( _userData );
+		networkSystem->_idle_timeout_cb();
+	}
+
+	static void queue_space_cb( evutil_socket_t fd, short events, void *_userData )
+	{
+		NetworkSystem *networkSystem = reinterpret_cast<NetworkSystem*>( _userData );
+		networkSystem->_queue_space_cb();
+	}
+
 	NetworkSystem::NetworkSystem() :
 		m_eventBase( 0 ),
-		m_numActiveConnections( 0 )
+		m_idleTimeoutEvent( 0 ),
+		m_idleTimeoutSeconds( 0 ),
+		m_numActiveConnections( 0 ),
+		m_receivedQueue( c_maxPendingMessages ),
+		m_receiveStalled( false ),
+		m_queueSpaceEvent( 0 ),
+		m_decodedQueue( c_maxPendingMessages ),
+		m_lastReportMicroseconds( 0 )
 	{
 		assert( sizeof(Network::MessageHeader) == HEADER_SIZE );
-		m_rcvBuffer.resize( 8 * 1024 * 1024 );
+		memset( m_numDroppedMessages, 0, sizeof(m_numDroppedMessages) );
+		memset( m_numReportedDroppedMessages, 0, sizeof(m_numReportedDroppedMessages) );
 	}
 	//-------------------------------------------------------------------------
 	NetworkSystem::~NetworkSystem()
@@ -72,9 +116,21 @@ namespace DERGO
 		m_listeners.push_back( listener );
 	}
 	//-------------------------------------------------------------------------
+	void NetworkSystem::setIdleTimeout( Ogre::uint32 seconds )
+	{
+		assert( !m_eventBase && "Must be called before start" );
+		m_idleTimeoutSeconds = seconds;
+	}
+	//-------------------------------------------------------------------------
 	int NetworkSystem::start()
 	{
-		m_currentStream.clear();
+		//Must happen before creating anything, so that we can
+		//send from the main thread while libevent runs in its own.
+#ifdef _WIN32
+		evthread_use_windows_threads();
+#else
+		evthread_use_pthreads();
+#endif
 		m_eventBase = event_base_new();
 		if( !m_eventBase )
 		{
@@ -107,16 +163,298 @@ namespace DERGO
 			return 1;
 		}
 
-		event_base_dispatch( m_eventBase );
+		if( m_idleTimeoutSeconds )
+			m_idleTimeoutEvent = evtimer_new( m_eventBase, idle_timeout_cb, reinterpret_cast<void*>(this) );
+
+		//Only ever activated by hand, from the decode thread
+		m_queueSpaceEvent = event_new( m_eventBase, -1, 0, queue_space_cb,
+									   reinterpret_cast<void*>(this) );
+
+		Ogre::ThreadHandleVec threads;
+		threads.push_back( Ogre::Threads::CreateThread( THREAD_GET( networkThread ), 0, this ) );
+		threads.push_back( Ogre::Threads::CreateThread( THREAD_GET( decodeThread ), 1, this ) );
+
+		//Commit stage. Runs here, since listeners expect to be
+		//called from the same thread that initialized them.
+		bool quit = false;
+		while( !quit )
+		{
+			//Grab everything that is already waiting, so we can skip superseded updates.
+			m_pendingBatch.push_back( m_decodedQueue.pop() );
+			PendingMessage message;
+			while( m_pendingBatch.size() < c_maxPendingMessages &&
+				   m_decodedQueue.tryPop( message ) )
+			{
+				m_pendingBatch.push_back( message );
+			}
+
+			coalescePendingBatch();
+
+			std::vector<PendingMessage>::iterator itor = m_pendingBatch.begin();
+			std::vector<PendingMessage>::iterator end  = m_pendingBatch.end();
+
+			while( itor != end )
+			{
+				quit |= !processPendingMessage( *itor );
+				++itor;
+			}
+
+			m_pendingBatch.clear();
+		}
+
+		Ogre::Threads::WaitForThreads( threads );
 
 		evconnlistener_free( listener );
 		event_free( signal_event );
+		if( m_idleTimeoutEvent )
+		{
+			event_free( m_idleTimeoutEvent );
+			m_idleTimeoutEvent = 0;
+		}
+		event_free( m_queueSpaceEvent );
+		m_queueSpaceEvent = 0;
 		event_base_free( m_eventBase );
 		m_eventBase = 0;
 
 		return 0;
 	}
 	//-------------------------------------------------------------------------
+	bool NetworkSystem::processPendingMessage( PendingMessage &message )
+	{
+		bool retVal = true;
+
+		switch( message.type )
+		{
+		case PendingMessage::Message:
+		{
+			const size_t payloadSize = evbuffer_get_length( message.payload );
+			Network::SmartData smartData( evbuffer_pullup( message.payload, -1 ),
+										  payloadSize, false );
+
+			std::vector<NetworkListener*>::const_iterator itor = m_listeners.begin();
+			std::vector<NetworkListener*>::const_iterator end  = m_listeners.end();
+
+			while( itor != end )
+			{
+				DecodedMessage *decodedMessage = message.decodedBy == *itor ?
+													 message.decodedMessage : 0;
+				(*itor)->processMessage( message.header, smartData, decodedMessage,
+										 message.bev, *this );
+				++itor;
+			}
+
+			assert( smartData.getOffset() <= message.header.sizeBytes &&
+					"processMessage read beyond of what it was allowed" );
+
+			destroyPendingMessage( message );
+			break;
+		}
+		case PendingMessage::ConnectionTerminated:
+			if( message.lastConnection )
+			{
+				std::vector<NetworkListener*>::const_iterator itor = m_listeners.begin();
+				std::vector<NetworkListener*>::const_iterator end  = m_listeners.end();
+
+				while( itor != end )
+				{
+					(*itor)->allConnectionsTerminated();
+					++itor;
+				}
+			}
+			bufferevent_free( message.bev );
+			break;
+		case PendingMessage::IdleTimeout:
+		{
+			std::vector<NetworkListener*>::const_iterator itor = m_listeners.begin();
+			std::vector<NetworkListener*>::const_iterator end  = m_listeners.end();
+
+			while( itor != end )
+			{
+				(*itor)->idleTimeout();
+				++itor;
+			}
+			break;
+		}
+		case PendingMessage::Quit:
+			retVal = false;
+			break;
+		}
+
+		return retVal;
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::destroyPendingMessage( PendingMessage &message )
+	{
+		delete message.decodedMessage;
+		message.decodedMessage = 0;
+		evbuffer_free( message.payload );
+		message.payload = 0;
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::coalescePendingBatch()
+	{
+		//Walk backwards: an update is superseded if the same object gets
+		//updated or removed again later. Removals are always kept.
+		//m_coalescingKeys holds what gets updated later, up to the next barrier.
+		m_coalescingKeys.clear();
+
+		size_t numKept = m_pendingBatch.size();
+		for( size_t i=m_pendingBatch.size(); i--; )
+		{
+			PendingMessage &message = m_pendingBatch[i];
+
+			CoalescingKey key;
+			bool isRemoval;
+			bool allObjects;
+			Ogre::uint32 meshId;
+			if( message.type == PendingMessage::Message &&
+				getCoalescingKey( message, key, isRemoval ) )
+			{
+				const bool wasInserted = m_coalescingKeys.insert( key ).second;
+				if( !wasInserted && !isRemoval )
+				{
+					++m_numDroppedMessages[message.header.messageType];
+					destroyPendingMessage( message );
+					continue;
+				}
+			}
+			else if( getCoalescingBarrier( message, allObjects, meshId ) )
+			{
+				if( allObjects )
+				{
+					m_coalescingKeys.clear();
+				}
+				else
+				{
+					std::set<CoalescingKey>::iterator itKey = m_coalescingKeys.begin();
+					while( itKey != m_coalescingKeys.end() )
+					{
+						if( itKey->objectType == Network::FromClient::Item &&
+							itKey->meshId == meshId )
+						{
+							m_coalescingKeys.erase( itKey++ );
+						}
+						else
+						{
+							++itKey;
+						}
+					}
+				}
+			}
+
+			m_pendingBatch[--numKept] = message;
+		}
+
+		m_pendingBatch.erase( m_pendingBatch.begin(), m_pendingBatch.begin() + numKept );
+
+		reportDroppedMessages();
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::reportDroppedMessages()
+	{
+		const Ogre::uint64 nowMicroseconds = m_timer.getMicroseconds();
+		const Ogre::uint64 elapsedMicroseconds = nowMicroseconds - m_lastReportMicroseconds;
+		if( elapsedMicroseconds < c_reportIntervalMicroseconds )
+			return;
+
+		const Ogre::uint64 numItems		= m_numDroppedMessages[Network::FromClient::Item] -
+										  m_numReportedDroppedMessages[Network::FromClient::Item];
+		const Ogre::uint64 numLights	= m_numDroppedMessages[Network::FromClient::Light] -
+										  m_numReportedDroppedMessages[Network::FromClient::Light];
+		const Ogre::uint64 numEmpties	= m_numDroppedMessages[Network::FromClient::Empty] -
+										  m_numReportedDroppedMessages[Network::FromClient::Empty];
+
+		if( numItems || numLights || numEmpties )
+		{
+			printf( "Dropped superseded updates in the last %.1f s: %llu Item, %llu Light, "
+					"%llu Empty\n", static_cast<double>( elapsedMicroseconds ) * 1e-6,
+					static_cast<unsigned long long>( numItems ),
+					static_cast<unsigned long long>( numLights ),
+					static_cast<unsigned long long>( numEmpties ) );
+		}
+
+		memcpy( m_numReportedDroppedMessages, m_numDroppedMessages,
+				sizeof(m_numDroppedMessages) );
+		m_lastReportMicroseconds = nowMicroseconds;
+	}
+	//-------------------------------------------------------------------------
+	bool NetworkSystem::getCoalescingKey( const PendingMessage &message, CoalescingKey &outKey,
+										  bool &outIsRemoval )
+	{
+		size_t idOffset = 0;
+
+		switch( message.header.messageType )
+		{
+		case Network::FromClient::Item:
+		case Network::FromClient::ItemRemove:
+			//Items are identified by both their mesh and item IDs
+			outKey.objectType	= Network::FromClient::Item;
+			outIsRemoval		= message.header.messageType == Network::FromClient::ItemRemove;
+			idOffset			= sizeof(Ogre::uint32);
+			break;
+		case Network::FromClient::Light:
+		case Network::FromClient::LightRemove:
+			outKey.objectType	= Network::FromClient::Light;
+			outIsRemoval		= message.header.messageType == Network::FromClient::LightRemove;
+			break;
+		case Network::FromClient::Empty:
+		case Network::FromClient::EmptyRemove:
+			outKey.objectType	= Network::FromClient::Empty;
+			outIsRemoval		= message.header.messageType == Network::FromClient::EmptyRemove;
+			break;
+		default:
+			return false;
+		}
+
+		Ogre::uint32 ids[2] = { 0, 0 };
+		const size_t idsSize = idOffset + sizeof(Ogre::uint32);
+		if( message.header.sizeBytes < idsSize )
+			return false;
+
+		evbuffer_copyout( message.payload, ids, idsSize );
+
+		outKey.bev		= message.bev;
+		outKey.meshId	= idOffset ? ids[0] : 0;
+		outKey.id		= idOffset ? ids[1] : ids[0];
+
+		return true;
+	}
+	//-------------------------------------------------------------------------
+	bool NetworkSystem::getCoalescingBarrier( const PendingMessage &message, bool &outAllObjects,
+											  Ogre::uint32 &outMeshId )
+	{
+		outAllObjects	= true;
+		outMeshId		= 0;
+
+		if( message.type != PendingMessage::Message )
+			return true;
+
+		switch( message.header.messageType )
+		{
+		case Network::FromClient::Reset:
+		case Network::FromClient::Hello:
+			return true;
+		case Network::FromClient::Mesh:
+		case Network::FromClient::MeshLoops:
+		case Network::FromClient::ItemTransformBatch:
+			//If we can't tell which mesh, assume all of them
+			if( message.header.sizeBytes >= sizeof(Ogre::uint32) )
+			{
+				evbuffer_copyout( message.payload, &outMeshId, sizeof(Ogre::uint32) );
+				outAllObjects = false;
+			}
+			return true;
+		default:
+			return false;
+		}
+	}
+	//-------------------------------------------------------------------------
+	Ogre::uint64 NetworkSystem::getNumDroppedMessages(
+			Network::FromClient::FromClient messageType ) const
+	{
+		return m_numDroppedMessages[messageType];
+	}
+	//-------------------------------------------------------------------------
 	void NetworkSystem::send( bufferevent *bev, Network::FromServer::FromServer msg,
 							  const void *data, Ogre::uint32 sizeBytes )
 	{
@@ -131,62 +469,186 @@ namespace DERGO
 		bufferevent_write( bev, smartData.getBasePtr(), smartData.getOffset() );
 	}
 	//-------------------------------------------------------------------------
+	/// evbuffer_add_reference cleanup function
+	struct SentCallbackData
+	{
+		NetworkSystem::SentCallback	onSent;
+		void						*userData;
+	};
+	static void referencedChunkSent( const void *data, size_t datalen, void *extra )
+	{
+		SentCallbackData *callbackData = reinterpret_cast<SentCallbackData*>( extra );
+		callbackData->onSent( callbackData->userData );
+		delete callbackData;
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::sendReferenced( bufferevent *bev, Network::FromServer::FromServer msg,
+										const void *data, Ogre::uint32 sizeBytes,
+										const DataChunk *chunks, size_t numChunks,
+										SentCallback onSent, void *userData )
+	{
+		size_t totalSizeBytes = sizeBytes;
+		for( size_t i=0; i<numChunks; ++i )
+			totalSizeBytes += chunks[i].sizeBytes;
+
+		m_stashData.resize( sizeof(Network::MessageHeader) + sizeBytes );
+
+		Network::SmartData smartData( &m_stashData[0], m_stashData.size(), false );
+
+		smartData.write<Ogre::uint32>( static_cast<Ogre::uint32>( totalSizeBytes ) );
+		smartData.write<Ogre::uint8>( msg );
+		smartData.write( reinterpret_cast<const unsigned char*>(data), sizeBytes );
+
+		//Everything must land in the output buffer together, and in order.
+		evbuffer *output = bufferevent_get_output( bev );
+		evbuffer_lock( output );
+		evbuffer_add( output, smartData.getBasePtr(), smartData.getOffset() );
+
+		//Chunks are drained in order, so we only need to know about the last one.
+		for( size_t i=0; i + 1u < numChunks; ++i )
+			evbuffer_add_reference( output, chunks[i].data, chunks[i].sizeBytes, 0, 0 );
+
+		bool callbackPending = false;
+		if( numChunks )
+		{
+			SentCallbackData *callbackData = new SentCallbackData;
+			callbackData->onSent	= onSent;
+			callbackData->userData	= userData;
+			callbackPending = evbuffer_add_reference( output, chunks[numChunks - 1u].data,
+													  chunks[numChunks - 1u].sizeBytes,
+													  referencedChunkSent, callbackData ) == 0;
+			if( !callbackPending )
+				delete callbackData;
+		}
+		evbuffer_unlock( output );
+
+		if( !callbackPending )
+			onSent( userData );
+	}
+	//-------------------------------------------------------------------------
 	void NetworkSystem::abortConnection( const char *msg, bufferevent *bev )
 	{
 		printf( "%s", msg );
 
 		assert( false );
 
-		bufferevent_free( bev );
-		m_currentStream.clear();
+		terminateConnection( bev );
 	}
 	//-------------------------------------------------------------------------
-	void NetworkSystem::_buffered_on_read( bufferevent *bev )
+	void NetworkSystem::terminateConnection( bufferevent *bev )
 	{
-		//Ogre::uint8 data[8192];
+		//We can't free it yet. Messages from this connection may still be in the pipeline.
+		bufferevent_disable( bev, EV_READ|EV_WRITE );
+		bufferevent_setcb( bev, NULL, NULL, NULL, NULL );
+		m_pausedBevs.erase( bev );
 
-		/* Read 8k at a time and send it to all connected clients. */
-		while( true )
+		--m_numActiveConnections;
+
+		PendingMessage message;
+		message.type			= PendingMessage::ConnectionTerminated;
+		message.bev				= bev;
+		message.lastConnection	= m_numActiveConnections == 0;
+		queueReceived( message );
+
+		if( m_idleTimeoutEvent && m_numActiveConnections == 0 )
 		{
-//			const size_t bytesRead = bufferevent_read(bev, data, sizeof(data));
-//			if( bytesRead == 0 || bytesRead > sizeof(data) )
-//			{
-//				// Done.
-//				break;
-//			}
-
-//			const size_t oldSize = m_currentStream.size();
-//			m_currentStream.resize( oldSize + bytesRead );
-//			memcpy( &m_currentStream[oldSize], data, bytesRead );
-			const size_t bytesRead = bufferevent_read(bev, &m_rcvBuffer[0], m_rcvBuffer.size());
-			if( bytesRead == 0 || bytesRead > m_rcvBuffer.size() )
-			{
-				// Done.
-				break;
-			}
+			timeval timeout = { static_cast<long>( m_idleTimeoutSeconds ), 0 };
+			evtimer_add( m_idleTimeoutEvent, &timeout );
+		}
+	}
+	//-------------------------------------------------------------------------
+	bool NetworkSystem::queueReceived( const PendingMessage &message )
+	{
+		m_receivedBacklog.push_back( message );
+		return flushReceivedBacklog();
+	}
+	//-------------------------------------------------------------------------
+	bool NetworkSystem::flushReceivedBacklog()
+	{
+		while( !m_receivedBacklog.empty() && m_receivedQueue.tryPush( m_receivedBacklog.front() ) )
+			m_receivedBacklog.pop_front();
+
+		if( m_receivedBacklog.empty() )
+			return true;
+
+		m_receiveStalled.store( true, std::memory_order_release );
+
+		//The decode thread may have made room right before it could see the flag.
+		while( !m_receivedBacklog.empty() && m_receivedQueue.tryPush( m_receivedBacklog.front() ) )
+			m_receivedBacklog.pop_front();
+
+		return m_receivedBacklog.empty();
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::_networkThread()
+	{
+		event_base_dispatch( m_eventBase );
 
-			const size_t oldSize = m_currentStream.size();
-			m_currentStream.resize( oldSize + bytesRead );
-			memcpy( &m_currentStream[oldSize], &m_rcvBuffer[0], bytesRead );
+		//libevent's loop is over, so we aren't holding any lock. Blocking is fine now.
+		while( !m_receivedBacklog.empty() )
+		{
+			m_receivedQueue.push( m_receivedBacklog.front() );
+			m_receivedBacklog.pop_front();
 		}
 
-		if( m_currentStream.empty() )
-			return;
+		PendingMessage message;
+		message.type = PendingMessage::Quit;
+		m_receivedQueue.push( message );
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::_decodeThread()
+	{
+		bool quit = false;
+		while( !quit )
+		{
+			PendingMessage message = m_receivedQueue.pop();
 
-		Network::SmartData smartData( &m_currentStream[0], m_currentStream.size(), false );
+			//There's room now. Wake up the network thread if it's waiting for it.
+			if( m_receiveStalled.exchange( false, std::memory_order_acq_rel ) )
+				event_active( m_queueSpaceEvent, 0, 0 );
 
-		size_t remainingBytes = smartData.getCapacity() - smartData.getOffset();
+			if( message.type == PendingMessage::Message )
+			{
+				//Only copies if libevent had the message scattered across several chunks
+				const size_t payloadSize = evbuffer_get_length( message.payload );
+				Network::SmartData smartData( evbuffer_pullup( message.payload, -1 ),
+											  payloadSize, false );
+
+				std::vector<NetworkListener*>::const_iterator itor = m_listeners.begin();
+				std::vector<NetworkListener*>::const_iterator end  = m_listeners.end();
+
+				while( itor != end && !message.decodedMessage )
+				{
+					smartData.seekSet( 0 );
+					message.decodedMessage = (*itor)->decodeMessage( message.header, smartData );
+					if( message.decodedMessage )
+						message.decodedBy = *itor;
+					++itor;
+				}
+			}
+
+			quit = message.type == PendingMessage::Quit;
+
+			m_decodedQueue.push( message );
+		}
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::_buffered_on_read( bufferevent *bev )
+	{
+		evbuffer *input = bufferevent_get_input( bev );
 
-		while( remainingBytes >= HEADER_SIZE )
+		while( true )
 		{
-			Network::MessageHeader header = smartData.read<Network::MessageHeader>();
-			if( header.sizeBytes > smartData.getCapacity() - smartData.getOffset() )
+			const size_t bytesAvailable = evbuffer_get_length( input );
+			if( bytesAvailable < HEADER_SIZE )
 			{
-				//Packet is incomplete. Process it the next time.
-				smartData.seekCur( -HEADER_SIZE );
+				bufferevent_setwatermark( bev, EV_READ, HEADER_SIZE, 0 );
 				break;
 			}
 
+			Network::MessageHeader header;
+			evbuffer_copyout( input, &header, HEADER_SIZE );
+
 			if( header.messageType >= Network::FromClient::NumClientMessages )
 			{
 				abortConnection( "Message type is higher than NumClientMessages. "
@@ -194,40 +656,39 @@ namespace DERGO
 				return;
 			}
 
-			const size_t nextPos = smartData.getOffset() + header.sizeBytes;
-
-			std::vector<NetworkListener*>::const_iterator itor = m_listeners.begin();
-			std::vector<NetworkListener*>::const_iterator end  = m_listeners.end();
-
-			while( itor != end )
+			const size_t messageSize = HEADER_SIZE + header.sizeBytes;
+			if( bytesAvailable < messageSize )
 			{
-				(*itor)->processMessage( header, smartData, bev, *this );
-				++itor;
+				//Packet is incomplete. Don't wake us up until all of it arrived.
+				bufferevent_setwatermark( bev, EV_READ, messageSize, 0 );
+				break;
 			}
 
-			assert( smartData.getOffset() <= nextPos &&
-					"processMessage read beyond of what it was allowed" );
+			evbuffer_drain( input, HEADER_SIZE );
 
-			smartData.seekSet( nextPos );
-			remainingBytes = smartData.getCapacity() - smartData.getOffset();
-		}
+			PendingMessage message;
+			message.type	= PendingMessage::Message;
+			message.header	= header;
+			message.bev		= bev;
+			message.payload	= evbuffer_new();
+			//Hands over libevent's chunks instead of copying them, whenever possible.
+			evbuffer_remove_buffer( input, message.payload, header.sizeBytes );
 
-		const size_t bytesLeftUnread = smartData.getCapacity() - smartData.getOffset();
-		if( bytesLeftUnread )
-		{
-			//If there was any leftover, we'll read it the next time.
-			memmove( &m_currentStream[0],
-					&m_currentStream[smartData.getOffset()],
-					bytesLeftUnread );
+			if( !queueReceived( message ) )
+			{
+				//Leave the rest in the socket until the decode thread catches up.
+				bufferevent_disable( bev, EV_READ );
+				m_pausedBevs.insert( bev );
+				break;
+			}
 		}
-
-		m_currentStream.resize( bytesLeftUnread );
 	}
 	//-------------------------------------------------------------------------
 	void NetworkSystem::_listener_cb( evconnlistener *listener, evutil_socket_t fd,
 									  sockaddr *sa, int socklen )
 	{
-		bufferevent *bev = bufferevent_socket_new( m_eventBase, fd, BEV_OPT_CLOSE_ON_FREE );
+		bufferevent *bev = bufferevent_socket_new( m_eventBase, fd,
+												   BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE );
 		if (!bev)
 		{
 			fprintf(stderr, "Error constructing bufferevent!");
@@ -259,6 +720,9 @@ namespace DERGO
 
 		++m_numActiveConnections;
 
+		if( m_idleTimeoutEvent )
+			evtimer_del( m_idleTimeoutEvent );
+
 		printf( "Incoming new client connection from %s\n", ipAddress );
 	}
 	//-------------------------------------------------------------------------
@@ -271,23 +735,9 @@ namespace DERGO
 				strerror(errno));/*XXX win32*/
 		}
 
-		--m_numActiveConnections;
-
-		if( m_numActiveConnections == 0 )
-		{
-			std::vector<NetworkListener*>::const_iterator itor = m_listeners.begin();
-			std::vector<NetworkListener*>::const_iterator end  = m_listeners.end();
-
-			while( itor != end )
-			{
-				(*itor)->allConnectionsTerminated();
-				++itor;
-			}
-		}
-
 		/* None of the other events can happen here, since we haven't enabled
 		 * timeouts */
-		bufferevent_free( bev );
+		terminateConnection( bev );
 	}
 	//-------------------------------------------------------------------------
 	void NetworkSystem::_signal_cb( evutil_socket_t sig, short events )
@@ -298,4 +748,37 @@ namespace DERGO
 
 		event_base_loopexit( m_eventBase, &delay );
 	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::_idle_timeout_cb()
+	{
+		//Goes through the queue, so it's processed after whatever the
+		//last connection sent, and before anything a new one sends.
+		PendingMessage message;
+		message.type = PendingMessage::IdleTimeout;
+		queueReceived( message );
+	}
+	//-------------------------------------------------------------------------
+	void NetworkSystem::_queue_space_cb()
+	{
+		if( !flushReceivedBacklog() )
+			return; //Still full. We'll be called again.
+
+		//Resume reading. What's already in their input buffers won't trigger
+		//the read callback again, so go through it ourselves.
+		std::set<bufferevent*> pausedBevs;
+		pausedBevs.swap( m_pausedBevs );
+
+		std::set<bufferevent*>::const_iterator itor = pausedBevs.begin();
+		std::set<bufferevent*>::const_iterator end  = pausedBevs.end();
+
+		while( itor != end )
+		{
+			bufferevent *bev = *itor;
+			bufferevent_lock( bev );
+			bufferevent_enable( bev, EV_READ );
+			_buffered_on_read( bev );
+			bufferevent_unlock( bev );
+			++itor;
+		}
+	}
 }
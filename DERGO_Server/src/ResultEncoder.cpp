@@ -0,0 +1,390 @@
+
+#include "ResultEncoder.h"
+
+#include "OgreSceneManager.h"
+#include "OgreMath.h"
+#include "OgreTextureBox.h"
+#include "Threading/OgreUniformScalableTask.h"
+
+#include <zlib.h>
+
+namespace DERGO
+{
+	static const char *c_resultEncodingNames[Network::ResultEncoding::NumResultEncodings] =
+	{
+		"Raw",
+		"DeltaDeflate",
+		"YCoCgTiles"
+	};
+
+	static const Ogre::uint32 c_rowsPerBand	= 64u;
+	static const Ogre::uint32 c_tileSize	= 16u;
+	static const size_t c_tileSizeBytes		= c_tileSize * c_tileSize +
+											  2u * (c_tileSize / 2u) * (c_tileSize / 2u);
+
+	/// Print the stats this often.
+	static const Ogre::uint64 c_reportIntervalMicroseconds = 5000000u;
+
+	//-------------------------------------------------------------------------
+	class ResultEncoder::DeltaDeflateTask : public Ogre::UniformScalableTask
+	{
+		const Ogre::TextureBox &box;
+		std::vector< std::vector<Ogre::uint8> > &bands;
+		std::vector< std::vector<Ogre::uint8> > &threadScratch;
+
+	public:
+		DeltaDeflateTask( const Ogre::TextureBox &_box,
+						  std::vector< std::vector<Ogre::uint8> > &_bands,
+						  std::vector< std::vector<Ogre::uint8> > &_threadScratch ) :
+			box( _box ),
+			bands( _bands ),
+			threadScratch( _threadScratch )
+		{
+		}
+
+		virtual void execute( size_t threadId, size_t numThreads )
+		{
+			const size_t rowSizeBytes = box.width * 4u;
+			std::vector<Ogre::uint8> &scratch = threadScratch[threadId];
+			scratch.resize( rowSizeBytes * c_rowsPerBand );
+
+			//Interleave the bands, since the bottom of the viewport is usually
+			//more expensive to compress than the sky at the top.
+			for( size_t bandIdx=threadId; bandIdx<bands.size(); bandIdx += numThreads )
+			{
+				const Ogre::uint32 firstRow	= static_cast<Ogre::uint32>( bandIdx * c_rowsPerBand );
+				const Ogre::uint32 numRows	= std::min( c_rowsPerBand, box.height - firstRow );
+
+				const Ogre::uint8 *srcRow = reinterpret_cast<const Ogre::uint8*>( box.data ) +
+											firstRow * box.bytesPerRow;
+				memcpy( &scratch[0], srcRow, rowSizeBytes );
+
+				for( Ogre::uint32 y=1u; y<numRows; ++y )
+				{
+					const Ogre::uint8 * RESTRICT_ALIAS rowAbove = srcRow;
+					srcRow += box.bytesPerRow;
+					Ogre::uint8 * RESTRICT_ALIAS dstRow = &scratch[y * rowSizeBytes];
+					for( size_t i=0; i<rowSizeBytes; ++i )
+						dstRow[i] = static_cast<Ogre::uint8>( srcRow[i] - rowAbove[i] );
+				}
+
+				const uLong srcSizeBytes = static_cast<uLong>( numRows * rowSizeBytes );
+				uLongf compressedSizeBytes = compressBound( srcSizeBytes );
+
+				//Bands that fail to compress are left empty
+				std::vector<Ogre::uint8> &band = bands[bandIdx];
+				band.resize( sizeof(Ogre::uint32) + compressedSizeBytes );
+				if( compress2( &band[sizeof(Ogre::uint32)], &compressedSizeBytes,
+							   &scratch[0], srcSizeBytes, Z_BEST_SPEED ) != Z_OK )
+				{
+					band.clear();
+					continue;
+				}
+
+				const Ogre::uint32 bandSizeBytes = static_cast<Ogre::uint32>( compressedSizeBytes );
+				memcpy( &band[0], &bandSizeBytes, sizeof(bandSizeBytes) );
+				band.resize( sizeof(Ogre::uint32) + compressedSizeBytes );
+			}
+		}
+	};
+	//-------------------------------------------------------------------------
+	class ResultEncoder::YCoCgTilesTask : public Ogre::UniformScalableTask
+	{
+		const Ogre::TextureBox &box;
+		Ogre::uint8 *previousFrame;
+		bool forceKeyframe;
+		Ogre::uint32 numTilesX;
+		std::vector< std::vector<Ogre::uint8> > &tileRows;
+		Ogre::uint8 *dirtyTiles;
+
+		bool isTileDirty( Ogre::uint32 x0, Ogre::uint32 y0, Ogre::uint32 x1, Ogre::uint32 y1 ) const
+		{
+			const size_t previousRowSizeBytes = box.width * 4u;
+			for( Ogre::uint32 y=y0; y<y1; ++y )
+			{
+				const Ogre::uint8 *srcRow = reinterpret_cast<const Ogre::uint8*>( box.data ) +
+											y * box.bytesPerRow;
+				if( memcmp( srcRow + x0 * 4u, previousFrame + y * previousRowSizeBytes + x0 * 4u,
+							(x1 - x0) * 4u ) != 0 )
+				{
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void encodeTile( Ogre::uint32 x0, Ogre::uint32 y0, Ogre::uint8 * RESTRICT_ALIAS dst ) const
+		{
+			//(r - b) and (2g - r - b) of each pixel, to be averaged in 2x2 blocks
+			int co[c_tileSize][c_tileSize];
+			int cg[c_tileSize][c_tileSize];
+
+			for( Ogre::uint32 y=0; y<c_tileSize; ++y )
+			{
+				const Ogre::uint32 srcY = std::min( y0 + y, box.height - 1u );
+				const Ogre::uint8 *srcRow = reinterpret_cast<const Ogre::uint8*>( box.data ) +
+											srcY * box.bytesPerRow;
+				for( Ogre::uint32 x=0; x<c_tileSize; ++x )
+				{
+					const Ogre::uint8 *src = srcRow + std::min( x0 + x, box.width - 1u ) * 4u;
+					const int r = src[0];
+					const int g = src[1];
+					const int b = src[2];
+					*dst++ = static_cast<Ogre::uint8>( (r + 2 * g + b + 2) >> 2 );
+					co[y][x] = r - b;
+					cg[y][x] = 2 * g - r - b;
+				}
+			}
+
+			for( Ogre::uint32 y=0; y<c_tileSize; y += 2u )
+			{
+				for( Ogre::uint32 x=0; x<c_tileSize; x += 2u )
+				{
+					const int sum = co[y][x] + co[y][x+1u] + co[y+1u][x] + co[y+1u][x+1u];
+					*dst++ = static_cast<Ogre::uint8>( Ogre::Math::Clamp( ((sum + 4) >> 3) + 128,
+																		  0, 255 ) );
+				}
+			}
+
+			for( Ogre::uint32 y=0; y<c_tileSize; y += 2u )
+			{
+				for( Ogre::uint32 x=0; x<c_tileSize; x += 2u )
+				{
+					const int sum = cg[y][x] + cg[y][x+1u] + cg[y+1u][x] + cg[y+1u][x+1u];
+					*dst++ = static_cast<Ogre::uint8>( Ogre::Math::Clamp( ((sum + 8) >> 4) + 128,
+																		  0, 255 ) );
+				}
+			}
+		}
+
+	public:
+		YCoCgTilesTask( const Ogre::TextureBox &_box, Ogre::uint8 *_previousFrame,
+						bool _forceKeyframe, Ogre::uint32 _numTilesX,
+						std::vector< std::vector<Ogre::uint8> > &_tileRows,
+						Ogre::uint8 *_dirtyTiles ) :
+			box( _box ),
+			previousFrame( _previousFrame ),
+			forceKeyframe( _forceKeyframe ),
+			numTilesX( _numTilesX ),
+			tileRows( _tileRows ),
+			dirtyTiles( _dirtyTiles )
+		{
+		}
+
+		virtual void execute( size_t threadId, size_t numThreads )
+		{
+			const size_t previousRowSizeBytes = box.width * 4u;
+
+			for( size_t tileY=threadId; tileY<tileRows.size(); tileY += numThreads )
+			{
+				std::vector<Ogre::uint8> &tileRow = tileRows[tileY];
+				tileRow.clear();
+
+				const Ogre::uint32 y0 = static_cast<Ogre::uint32>( tileY * c_tileSize );
+				const Ogre::uint32 y1 = std::min( y0 + c_tileSize, box.height );
+
+				for( Ogre::uint32 tileX=0; tileX<numTilesX; ++tileX )
+				{
+					const Ogre::uint32 x0 = tileX * c_tileSize;
+					const Ogre::uint32 x1 = std::min( x0 + c_tileSize, box.width );
+
+					const bool isDirty = forceKeyframe || isTileDirty( x0, y0, x1, y1 );
+					dirtyTiles[tileY * numTilesX + tileX] = isDirty;
+
+					if( isDirty )
+					{
+						for( Ogre::uint32 y=y0; y<y1; ++y )
+						{
+							memcpy( previousFrame + y * previousRowSizeBytes + x0 * 4u,
+									reinterpret_cast<const Ogre::uint8*>( box.data ) +
+									y * box.bytesPerRow + x0 * 4u,
+									(x1 - x0) * 4u );
+						}
+
+						tileRow.resize( tileRow.size() + c_tileSizeBytes );
+						encodeTile( x0, y0, &tileRow[tileRow.size() - c_tileSizeBytes] );
+					}
+				}
+			}
+		}
+	};
+	//-------------------------------------------------------------------------
+	//-------------------------------------------------------------------------
+	//-------------------------------------------------------------------------
+	ResultEncoder::ResultEncoder() :
+		m_encoding( Network::ResultEncoding::Raw ),
+		m_previousWidth( 0 ),
+		m_previousHeight( 0 ),
+		m_forceKeyframe( true ),
+		m_lastReportMicroseconds( 0 )
+	{
+		memset( m_stats, 0, sizeof(m_stats) );
+	}
+	//-------------------------------------------------------------------------
+	void ResultEncoder::setSupportedEncodings( const Ogre::uint8 *encodings, size_t numEncodings )
+	{
+		m_encoding = Network::ResultEncoding::Raw;
+		for( size_t i=0; i<numEncodings; ++i )
+		{
+			if( encodings[i] < Network::ResultEncoding::NumResultEncodings )
+			{
+				m_encoding = static_cast<Network::ResultEncoding::ResultEncoding>( encodings[i] );
+				break;
+			}
+		}
+
+		m_forceKeyframe = true;
+
+		printf( "Sending viewport results as %s\n", c_resultEncodingNames[m_encoding] );
+	}
+	//-------------------------------------------------------------------------
+	void ResultEncoder::reset()
+	{
+		m_encoding = Network::ResultEncoding::Raw;
+		m_forceKeyframe = true;
+
+		std::vector<Ogre::uint8>().swap( m_previousFrame );
+		m_previousWidth		= 0;
+		m_previousHeight	= 0;
+	}
+	//-------------------------------------------------------------------------
+	bool ResultEncoder::encode( const Ogre::TextureBox &box, Ogre::SceneManager *sceneManager )
+	{
+		if( m_encoding == Network::ResultEncoding::Raw || box.bytesPerPixel != 4u ||
+			!box.width || !box.height )
+		{
+			return false;
+		}
+
+		const Ogre::uint64 startMicroseconds = m_timer.getMicroseconds();
+
+		m_encoded.resize( 2u * sizeof(Ogre::uint16) + sizeof(Ogre::uint8) );
+		const Ogre::uint16 width	= static_cast<Ogre::uint16>( box.width );
+		const Ogre::uint16 height	= static_cast<Ogre::uint16>( box.height );
+		memcpy( &m_encoded[0], &width, sizeof(width) );
+		memcpy( &m_encoded[sizeof(width)], &height, sizeof(height) );
+		m_encoded[2u * sizeof(Ogre::uint16)] = static_cast<Ogre::uint8>( m_encoding );
+
+		if( m_encoding == Network::ResultEncoding::DeltaDeflate )
+			encodeDeltaDeflate( box, sceneManager );
+		else
+			encodeYCoCgTiles( box, sceneManager );
+
+		if( m_encoded.empty() )
+			return false;
+
+		addFrameStats( m_encoding, box.width * box.height * 4u, m_encoded.size(),
+					   m_timer.getMicroseconds() - startMicroseconds );
+
+		return true;
+	}
+	//-------------------------------------------------------------------------
+	void ResultEncoder::encodeDeltaDeflate( const Ogre::TextureBox &box,
+											Ogre::SceneManager *sceneManager )
+	{
+		m_bands.resize( (box.height + c_rowsPerBand - 1u) / c_rowsPerBand );
+		m_threadScratch.resize( sceneManager->getNumWorkerThreads() );
+
+		DeltaDeflateTask task( box, m_bands, m_threadScratch );
+		sceneManager->executeUserScalableTask( &task, true );
+
+		const Ogre::uint16 rowsPerBand = static_cast<Ogre::uint16>( c_rowsPerBand );
+		const size_t rowsPerBandOffset = m_encoded.size();
+		m_encoded.resize( rowsPerBandOffset + sizeof(rowsPerBand) );
+		memcpy( &m_encoded[rowsPerBandOffset], &rowsPerBand, sizeof(rowsPerBand) );
+
+		std::vector< std::vector<Ogre::uint8> >::const_iterator itor = m_bands.begin();
+		std::vector< std::vector<Ogre::uint8> >::const_iterator end  = m_bands.end();
+
+		while( itor != end )
+		{
+			if( itor->empty() )
+			{
+				m_encoded.clear();
+				return;
+			}
+
+			m_encoded.insert( m_encoded.end(), itor->begin(), itor->end() );
+			++itor;
+		}
+	}
+	//-------------------------------------------------------------------------
+	void ResultEncoder::encodeYCoCgTiles( const Ogre::TextureBox &box,
+										  Ogre::SceneManager *sceneManager )
+	{
+		if( box.width != m_previousWidth || box.height != m_previousHeight )
+		{
+			m_previousWidth		= box.width;
+			m_previousHeight	= box.height;
+			m_previousFrame.resize( box.width * box.height * 4u );
+			m_forceKeyframe = true;
+		}
+
+		const Ogre::uint32 numTilesX = (box.width + c_tileSize - 1u) / c_tileSize;
+		const Ogre::uint32 numTilesY = (box.height + c_tileSize - 1u) / c_tileSize;
+		m_tileRows.resize( numTilesY );
+		m_dirtyTiles.resize( numTilesX * numTilesY );
+
+		YCoCgTilesTask task( box, &m_previousFrame[0], m_forceKeyframe, numTilesX,
+							 m_tileRows, &m_dirtyTiles[0] );
+		sceneManager->executeUserScalableTask( &task, true );
+
+		m_forceKeyframe = false;
+
+		const size_t maskOffset = m_encoded.size();
+		m_encoded.resize( maskOffset + (m_dirtyTiles.size() + 7u) / 8u, 0 );
+		for( size_t i=0; i<m_dirtyTiles.size(); ++i )
+		{
+			if( m_dirtyTiles[i] )
+				m_encoded[maskOffset + (i >> 3u)] |= static_cast<Ogre::uint8>( 0x80u >> (i & 0x07u) );
+		}
+
+		std::vector< std::vector<Ogre::uint8> >::const_iterator itor = m_tileRows.begin();
+		std::vector< std::vector<Ogre::uint8> >::const_iterator end  = m_tileRows.end();
+
+		while( itor != end )
+		{
+			m_encoded.insert( m_encoded.end(), itor->begin(), itor->end() );
+			++itor;
+		}
+	}
+	//-------------------------------------------------------------------------
+	void ResultEncoder::rawFrameSent( size_t sizeBytes )
+	{
+		addFrameStats( Network::ResultEncoding::Raw, sizeBytes, sizeBytes, 0 );
+	}
+	//-------------------------------------------------------------------------
+	void ResultEncoder::addFrameStats( Network::ResultEncoding::ResultEncoding encoding,
+									   size_t numRawBytes, size_t numSentBytes,
+									   Ogre::uint64 encodeMicroseconds )
+	{
+		EncodingStats &stats = m_stats[encoding];
+		++stats.numFrames;
+		stats.numRawBytes			+= numRawBytes;
+		stats.numSentBytes			+= numSentBytes;
+		stats.encodeMicroseconds	+= encodeMicroseconds;
+
+		const Ogre::uint64 nowMicroseconds = m_timer.getMicroseconds();
+		const Ogre::uint64 elapsedMicroseconds = nowMicroseconds - m_lastReportMicroseconds;
+		if( elapsedMicroseconds < c_reportIntervalMicroseconds )
+			return;
+
+		const double elapsedSeconds = static_cast<double>( elapsedMicroseconds ) * 1e-6;
+		for( size_t i=0; i<Network::ResultEncoding::NumResultEncodings; ++i )
+		{
+			const EncodingStats &s = m_stats[i];
+			if( s.numFrames )
+			{
+				printf( "Result %s: %.1f fps, %.2f MB/s, %.1f%% of raw size, %.2f ms to encode\n",
+						c_resultEncodingNames[i], s.numFrames / elapsedSeconds,
+						s.numSentBytes / (elapsedSeconds * 1024.0 * 1024.0),
+						100.0 * s.numSentBytes / std::max<size_t>( s.numRawBytes, 1u ),
+						s.encodeMicroseconds * 1e-3 / s.numFrames );
+			}
+		}
+
+		memset( m_stats, 0, sizeof(m_stats) );
+		m_lastReportMicroseconds = nowMicroseconds;
+	}
+}
@@ -0,0 +1,78 @@
+
+#include "ScalableTaskPool.h"
+
+#include "Threading/OgreBarrier.h"
+#include "Threading/OgreUniformScalableTask.h"
+
+namespace DERGO
+{
+	using Ogre::ThreadHandle;
+
+	unsigned long scalableTaskPoolWorkerThread( ThreadHandle *threadHandle )
+	{
+		ScalableTaskPool *taskPool = reinterpret_cast<ScalableTaskPool*>(
+										 threadHandle->getUserParam() );
+		taskPool->_workerThread( threadHandle->getThreadIdx() );
+		return 0;
+	}
+	THREAD_DECLARE( scalableTaskPoolWorkerThread );
+	//-------------------------------------------------------------------------
+	ScalableTaskPool::ScalableTaskPool( size_t numThreads ) :
+		m_numThreads( std::max<size_t>( numThreads, 1u ) ),
+		m_barrier( 0 ),
+		m_task( 0 ),
+		m_exit( false )
+	{
+		//Workers + whoever calls executeTask
+		m_barrier = new Ogre::Barrier( m_numThreads + 1u );
+
+		m_threads.reserve( m_numThreads );
+		for( size_t i=0; i<m_numThreads; ++i )
+		{
+			m_threads.push_back( Ogre::Threads::CreateThread(
+									 THREAD_GET( scalableTaskPoolWorkerThread ), i, this ) );
+		}
+	}
+	//-------------------------------------------------------------------------
+	ScalableTaskPool::~ScalableTaskPool()
+	{
+		m_exit = true;
+		m_barrier->sync();
+		Ogre::Threads::WaitForThreads( m_threads );
+
+		delete m_barrier;
+		m_barrier = 0;
+	}
+	//-------------------------------------------------------------------------
+	void ScalableTaskPool::executeTask( Ogre::UniformScalableTask *task, bool bBlock )
+	{
+		m_mutex.lock();
+
+		m_task = task;
+		m_barrier->sync(); //Wake up the workers
+
+		if( bBlock )
+			waitForPendingTask();
+	}
+	//-------------------------------------------------------------------------
+	void ScalableTaskPool::waitForPendingTask()
+	{
+		m_barrier->sync();
+		m_task = 0;
+
+		m_mutex.unlock();
+	}
+	//-------------------------------------------------------------------------
+	void ScalableTaskPool::_workerThread( size_t threadIdx )
+	{
+		while( true )
+		{
+			m_barrier->sync();
+			if( m_exit )
+				break;
+
+			m_task->execute( threadIdx, m_numThreads );
+			m_barrier->sync();
+		}
+	}
+}
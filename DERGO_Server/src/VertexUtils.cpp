@@ -3,9 +3,21 @@
 
 #include "OgreVector2.h"
 #include "OgreVector3.h"
+#include "OgreQuaternion.h"
 
 #include "OgreHardwareVertexBuffer.h"
 
+#include "Hash/MurmurHash3.h"
+
+#include <algorithm>
+#include <limits>
+#include <math.h>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+	#define DERGO_HAVE_SSE2 1
+	#include <emmintrin.h>
+#endif
+
 namespace DERGO
 {
 #if defined( _MSC_VER ) && _MSC_VER < 1600
@@ -14,472 +26,2515 @@ namespace DERGO
     using ::uint8_t;
 #endif
 
+	static const uint32_t c_emptySlot = 0xFFFFFFFF;
+
+	/// Hashes the raw bytes of a vertex. Bitwise identical vertices always hash the same,
+	/// which is exactly the criteria we use to consider two vertices equal.
+	inline uint32_t hashVertex( const uint8_t *vertex, uint32_t bytesPerVertex )
+	{
+		uint32_t retVal;
+		Ogre::MurmurHash3_x86_32( vertex, bytesPerVertex, 0x9E3779B9, &retVal );
+		return retVal;
+	}
+
+#if !DERGO_HAVE_SSE2
+	/// Scalar version of the float -> half conversion in VertexUtils::floatToHalf4.
+	/// Both must produce the exact same bits.
+	inline uint16_t floatToHalf( float value )
+	{
+		uint32_t f;
+		memcpy( &f, &value, sizeof(f) );
+
+		const uint32_t sign = f & 0x80000000u;
+		f ^= sign;
+
+		uint32_t retVal;
+		if( f >= ((127u + 16u) << 23u) )
+		{
+			//Too big for a half (infinity), or NaN
+			retVal = f > (255u << 23u) ? 0x7E00u : 0x7C00u;
+		}
+		else if( f < ((127u - 14u) << 23u) )
+		{
+			//Denormal or zero. Let the FPU do the rounding by adding a magic number.
+			const uint32_t denormMagic = ((127u - 15u) + (23u - 10u) + 1u) << 23u;
+			float magic, tmp;
+			memcpy( &magic, &denormMagic, sizeof(magic) );
+			memcpy( &tmp, &f, sizeof(tmp) );
+			tmp += magic;
+			memcpy( &f, &tmp, sizeof(f) );
+			retVal = f - denormMagic;
+		}
+		else
+		{
+			//Rebias the exponent, and round the mantissa to nearest even
+			const uint32_t mantissaOdd = (f >> 13u) & 1u;
+			f += 0xFFFu - ((127u - 15u) << 23u);
+			f += mantissaOdd;
+			retVal = f >> 13u;
+		}
+
+		return static_cast<uint16_t>( retVal | (sign >> 16u) );
+	}
+#endif
+
+	/// Encodes the tangent space the same way Ogre does when importing v1 meshes with
+	/// QTangents, so that Hlms decodes it: normal = X axis, tangent = Y axis, and the
+	/// sign of w is the parity of the binormal.
+	inline void encodeQTangent( int16_t * RESTRICT_ALIAS dst, const Ogre::Vector3 &normal,
+								const Ogre::Vector3 &tangent, float parity )
+	{
+		using namespace Ogre;
+
+		//The rotation matrix must be orthonormal
+		Vector3 vNormal = normal;
+		if( vNormal.normalise() < 1e-6f )
+			vNormal = Vector3::UNIT_Z;
+		Vector3 vTangent = tangent - vNormal * vNormal.dotProduct( tangent );
+		if( vTangent.normalise() < 1e-6f )
+			vTangent = vNormal.perpendicular();
+
+		Quaternion qTangent( vNormal, vTangent, vNormal.crossProduct( vTangent ) );
+		qTangent.normalise();
+
+		if( qTangent.w < 0 )
+			qTangent = -qTangent;
+
+		//'-0' can't be represented with integers, so w must never be 0 or we'd lose the
+		//parity. Bias = 1 / [2^(bits-1) - 1], while keeping the quaternion normalized.
+		const float bias = 1.0f / 32767.0f;
+		if( qTangent.w < bias )
+		{
+			const float normFactor = sqrtf( 1.0f - bias * bias );
+			qTangent.w = bias;
+			qTangent.x *= normFactor;
+			qTangent.y *= normFactor;
+			qTangent.z *= normFactor;
+		}
+
+		if( parity < 0 )
+			qTangent = -qTangent;
+
+		dst[0] = static_cast<int16_t>( floorf( qTangent.x * 32767.0f + 0.5f ) );
+		dst[1] = static_cast<int16_t>( floorf( qTangent.y * 32767.0f + 0.5f ) );
+		dst[2] = static_cast<int16_t>( floorf( qTangent.z * 32767.0f + 0.5f ) );
+		dst[3] = static_cast<int16_t>( floorf( qTangent.w * 32767.0f + 0.5f ) );
+	}
+
+	/// Writes the position followed by the normal (24 bytes), which is how they're laid out
+	/// both in our vertex buffers and in BlenderRawVertex.
+	inline void writePosNormal( uint8_t * RESTRICT_ALIAS dst, const Ogre::Vector3 &vPos,
+								const Ogre::Vector3 &vNormal )
+	{
+		memcpy( dst, &vPos, sizeof(Ogre::Vector3) );
+		memcpy( dst + sizeof(Ogre::Vector3), &vNormal, sizeof(Ogre::Vector3) );
+	}
+
+	/// Converts the 4 colours of a face to RGBA8 (alpha is always 255).
+	inline void convertFaceColours( uint8_t outColours[4][4], const BlenderFaceColour &faceColour )
+	{
+		for( size_t i=0; i<4u; ++i )
+		{
+			outColours[i][0] = static_cast<uint8_t>( faceColour.colour[i].x * 255.0f + 0.5f );
+			outColours[i][1] = static_cast<uint8_t>( faceColour.colour[i].y * 255.0f + 0.5f );
+			outColours[i][2] = static_cast<uint8_t>( faceColour.colour[i].z * 255.0f + 0.5f );
+			outColours[i][3] = 255;
+		}
+	}
+
+	/// Copies the 4 UVs of a face, mirroring V.
+	inline void mirrorFaceUvs( float outUvs[8], const BlenderFaceUv &faceUv )
+	{
+		for( size_t i=0; i<4u; ++i )
+		{
+			outUvs[i * 2u + 0u] = faceUv.uv[i].x;
+			outUvs[i * 2u + 1u] = 1.0f - faceUv.uv[i].y;
+		}
+	}
+
+	/// Running min & max of positions, for the AABB.
+	struct PositionBounds
+	{
+#if DERGO_HAVE_SSE2
+		__m128 vMin;
+		__m128 vMax;
+
+		PositionBounds() :
+			vMin( _mm_set1_ps(  std::numeric_limits<float>::max() ) ),
+			vMax( _mm_set1_ps( -std::numeric_limits<float>::max() ) )
+		{
+		}
+
+		/// Loads 4 floats, which is safe since BlenderRawVertex::vNormal follows vPos.
+		void add( const BlenderRawVertex &rawVertex )
+		{
+			const __m128 pos = _mm_loadu_ps( &rawVertex.vPos.x ); //px py pz nx
+			vMin = _mm_min_ps( vMin, pos );
+			vMax = _mm_max_ps( vMax, pos );
+		}
+
+		void mergeInto( Ogre::Vector3 &inOutMin, Ogre::Vector3 &inOutMax ) const
+		{
+			float values[2][4];
+			_mm_storeu_ps( values[0], vMin );
+			_mm_storeu_ps( values[1], vMax );
+			inOutMin.makeFloor( Ogre::Vector3( values[0][0], values[0][1], values[0][2] ) );
+			inOutMax.makeCeil( Ogre::Vector3( values[1][0], values[1][1], values[1][2] ) );
+		}
+#else
+		Ogre::Vector3 vMin;
+		Ogre::Vector3 vMax;
+
+		PositionBounds() :
+			vMin(  std::numeric_limits<float>::max() ),
+			vMax( -std::numeric_limits<float>::max() )
+		{
+		}
+
+		void add( const BlenderRawVertex &rawVertex )
+		{
+			vMin.makeFloor( rawVertex.vPos );
+			vMax.makeCeil( rawVertex.vPos );
+		}
+
+		void mergeInto( Ogre::Vector3 &inOutMin, Ogre::Vector3 &inOutMax ) const
+		{
+			inOutMin.makeFloor( vMin );
+			inOutMax.makeCeil( vMax );
+		}
+#endif
+	};
+
+	/// Tells deindexFaces to use the numUVs argument instead of its template parameter.
+	static const uint8_t c_anyNumUVs = 255u;
+
+	/// See VertexUtils::deindex. Specialized per layout so that the compiler can
+	/// unroll the UV loop and drop the colour code entirely when unused.
+	template <bool HasColour, uint8_t NumUVs>
+	void deindexFaces( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
+					   const BlenderFace *faces, uint32_t numFaces,
+					   const BlenderRawVertex *blenderRawVertices,
+					   const BlenderFaceColour *facesColour,
+					   const BlenderFaceUv *faceUv, uint32_t uvSetStride, uint8_t numUVsArg,
+					   uint16_t * RESTRICT_ALIAS materialIds,
+					   Ogre::Vector3 *inOutMin, Ogre::Vector3 *inOutMax )
+	{
+		using namespace Ogre;
+
+		//Which corners of the face make each triangle
+		static const uint8_t c_triCorners[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+
+		const uint8_t numUVs			= NumUVs == c_anyNumUVs ? numUVsArg : NumUVs;
+		const uint32_t colourOffset		= sizeof(Vector3) * 2u;
+		const uint32_t uvOffset			= VertexUtils::getUvOffset( HasColour, 0u );
+		const uint32_t tangentOffset	= uvOffset + sizeof(Vector2) * numUVs;
+		const uint32_t tangentSize		= bytesPerVertex - tangentOffset;
+		const bool computeBounds		= inOutMin != 0;
+
+		PositionBounds bounds;
+
+		for( ::uint32_t i=0; i<numFaces; ++i )
+		{
+			const BlenderFace &face = faces[i];
+			const uint32_t numTris = face.numIndicesInFace == 4 ? 2u : 1u;
+
+			//Pick where the normals come from once per face, so that the
+			//compiler can use conditional moves instead of branching per vertex.
+			const bool useSmooth = (face.materialId & 0x8000) != 0;
+			const BlenderRawVertex *rawVertices[4];
+			const Vector3 *normals[4];
+			for( uint32_t j=0; j<numTris + 2u; ++j )
+			{
+				rawVertices[j]	= &blenderRawVertices[face.vertexIndex[j]];
+				normals[j]		= useSmooth ? &rawVertices[j]->vNormal : &face.faceNormal;
+			}
+
+			//Saves a pass over all the raw vertices later; they're in cache now.
+			if( computeBounds )
+			{
+				for( uint32_t j=0; j<numTris + 2u; ++j )
+					bounds.add( *rawVertices[j] );
+			}
+
+			uint8_t colours[4][4];
+			if( HasColour )
+				convertFaceColours( colours, facesColour[i] );
+
+			for( uint32_t j=0; j<numTris; ++j )
+			{
+				for( uint32_t k=0; k<3u; ++k )
+				{
+					const uint8_t corner = c_triCorners[j][k];
+					uint8_t * RESTRICT_ALIAS dst = dstData + (j * 3u + k) * bytesPerVertex;
+
+					writePosNormal( dst, rawVertices[corner]->vPos, *normals[corner] );
+					if( HasColour )
+						memcpy( dst + colourOffset, colours[corner], sizeof(uint8_t) * 4u );
+					//Welding compares whole vertices; don't leave garbage in the tangent.
+					if( tangentSize )
+						memset( dst + tangentOffset, 0, tangentSize );
+				}
+
+				*materialIds++ = face.materialId & 0x7FFF;
+			}
+
+			//The vertices we've just written are still in L1
+			for( uint8_t uvSet=0; uvSet<numUVs; ++uvSet )
+			{
+				float uvs[8];
+				mirrorFaceUvs( uvs, faceUv[uvSetStride * uvSet + i] );
+
+				uint8_t * RESTRICT_ALIAS dst = dstData + uvOffset + sizeof(Vector2) * uvSet;
+				for( uint32_t j=0; j<numTris; ++j )
+				{
+					for( uint32_t k=0; k<3u; ++k )
+					{
+						memcpy( dst + (j * 3u + k) * bytesPerVertex,
+								uvs + c_triCorners[j][k] * 2u, sizeof(float) * 2u );
+					}
+				}
+			}
+
+			dstData += numTris * 3u * bytesPerVertex;
+		}
+
+		if( computeBounds )
+			bounds.mergeInto( *inOutMin, *inOutMax );
+	}
+
+	template <bool HasColour>
+	void deindexFaces( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
+					   const BlenderFace *faces, uint32_t numFaces,
+					   const BlenderRawVertex *blenderRawVertices,
+					   const BlenderFaceColour *facesColour,
+					   const BlenderFaceUv *faceUv, uint32_t uvSetStride, uint8_t numUVs,
+					   uint16_t * RESTRICT_ALIAS materialIds,
+					   Ogre::Vector3 *inOutMin, Ogre::Vector3 *inOutMax )
+	{
+		switch( numUVs )
+		{
+		case 0:
+			deindexFaces<HasColour, 0>( dstData, bytesPerVertex, faces, numFaces, blenderRawVertices,
+										facesColour, faceUv, uvSetStride, numUVs, materialIds,
+										inOutMin, inOutMax );
+			break;
+		case 1:
+			deindexFaces<HasColour, 1>( dstData, bytesPerVertex, faces, numFaces, blenderRawVertices,
+										facesColour, faceUv, uvSetStride, numUVs, materialIds,
+										inOutMin, inOutMax );
+			break;
+		case 2:
+			deindexFaces<HasColour, 2>( dstData, bytesPerVertex, faces, numFaces, blenderRawVertices,
+										facesColour, faceUv, uvSetStride, numUVs, materialIds,
+										inOutMin, inOutMax );
+			break;
+		case 3:
+			deindexFaces<HasColour, 3>( dstData, bytesPerVertex, faces, numFaces, blenderRawVertices,
+										facesColour, faceUv, uvSetStride, numUVs, materialIds,
+										inOutMin, inOutMax );
+			break;
+		default:
+			deindexFaces<HasColour, c_anyNumUVs>( dstData, bytesPerVertex, faces, numFaces,
+												  blenderRawVertices, facesColour, faceUv,
+												  uvSetStride, numUVs, materialIds,
+												  inOutMin, inOutMax );
+			break;
+		}
+	}
+
 	void VertexUtils::deindex( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
 							   const BlenderFace *faces, uint32_t numFaces,
 							   const BlenderRawVertex *blenderRawVertices,
-							   uint16_t * RESTRICT_ALIAS materialIds )
+							   const BlenderFaceColour *facesColour,
+							   const BlenderFaceUv *faceUv, uint32_t uvSetStride, uint8_t numUVs,
+							   uint16_t * RESTRICT_ALIAS materialIds,
+							   Ogre::Vector3 *inOutMin, Ogre::Vector3 *inOutMax )
+	{
+		if( facesColour )
+		{
+			deindexFaces<true>( dstData, bytesPerVertex, faces, numFaces, blenderRawVertices,
+								facesColour, faceUv, uvSetStride, numUVs, materialIds,
+								inOutMin, inOutMax );
+		}
+		else
+		{
+			deindexFaces<false>( dstData, bytesPerVertex, faces, numFaces, blenderRawVertices,
+								 facesColour, faceUv, uvSetStride, numUVs, materialIds,
+								 inOutMin, inOutMax );
+		}
+	}
+	//-------------------------------------------------------------------------
+	uint32_t VertexUtils::getUvOffset( bool hasColour, uint8_t uvSet )
+	{
+		return sizeof(Ogre::Vector3) * 2u + (hasColour ? sizeof(uint8_t) * 4u : 0u) +
+				sizeof(Ogre::Vector2) * uvSet;
+	}
+	//-------------------------------------------------------------------------
+	uint32_t VertexUtils::shrinkVertexBuffer( uint8_t *vertexData,
+											  Ogre::FastArray<uint32_t> &vertexConversionLutArg,
+											  uint32_t bytesPerVertex,
+											  uint32_t numVertices )
+	{
+		//Swap the internal pointer to a local version of the
+		//array to allow compiler optimizations (otherwise the
+		//compiler can't know if vertexConversionLutArg.mSize
+		//and co. may change after every non-trivial call)
+		Ogre::FastArray<uint32_t> vertexConversionLut;
+		vertexConversionLut.swap( vertexConversionLutArg );
+
+		vertexConversionLut.resize( numVertices );
+
+		//Open addressing hash table with linear probing. Each slot holds the index of an
+		//already compacted (unique) vertex; and we keep its hash around so that collisions
+		//rarely need to go through memcmp. Keep load factor <= 0.5
+		uint32_t tableSize = 1u;
+		while( tableSize < numVertices * 2u )
+			tableSize <<= 1u;
+		const uint32_t tableMask = tableSize - 1u;
+
+		std::vector<uint32_t> slots( tableSize, c_emptySlot );
+		std::vector<uint32_t> slotHashes( tableSize );
+
+		uint32_t numUniqueVerts = 0;
+
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			const uint8_t *srcVertex = vertexData + i * bytesPerVertex;
+
+			const uint32_t hash = hashVertex( srcVertex, bytesPerVertex );
+			uint32_t slotIdx = hash & tableMask;
+
+			while( slots[slotIdx] != c_emptySlot &&
+				   (slotHashes[slotIdx] != hash ||
+					memcmp( vertexData + slots[slotIdx] * bytesPerVertex,
+							srcVertex, bytesPerVertex ) != 0) )
+			{
+				slotIdx = (slotIdx + 1u) & tableMask;
+			}
+
+			if( slots[slotIdx] != c_emptySlot )
+			{
+				//Duplicate. Point to the vertex we've already kept.
+				vertexConversionLut[i] = slots[slotIdx];
+			}
+			else
+			{
+				//New vertex. Compact it in place: numUniqueVerts <= i, thus
+				//we never overwrite a vertex we haven't looked at yet.
+				if( numUniqueVerts != i )
+				{
+					memcpy( vertexData + numUniqueVerts * bytesPerVertex,
+							srcVertex, bytesPerVertex );
+				}
+
+				slots[slotIdx]		= numUniqueVerts;
+				slotHashes[slotIdx]	= hash;
+				vertexConversionLut[i] = numUniqueVerts++;
+			}
+		}
+
+		vertexConversionLut.swap( vertexConversionLutArg );
+
+		return numUniqueVerts;
+	}
+	//-----------------------------------------------------------------------------------
+	namespace TangentTriFlags
+	{
+		enum TangentTriFlags
+		{
+			/// The UVs aren't mirrored. Tells the parity of the bitangent.
+			OrientPreserving	= 1u << 0u,
+			/// Null UV area. Joins whatever group its vertices are in.
+			GroupWithAny		= 1u << 1u,
+			/// Two of its corners are the same vertex. Contributes nothing.
+			Degenerate			= 1u << 2u
+		};
+	}
+
+	/// What MikkTSpace considers a vertex: corners with the same position, normal & UV.
+	struct TangentVertexLayout
+	{
+		uint8_t const *vertexData;
+		uint32_t bytesPerVertex;
+		uint32_t posStride;
+		uint32_t normalStride;
+		uint32_t uvStride;
+
+		const Ogre::Vector3& position( uint32_t idx ) const
+		{
+			return *reinterpret_cast<const Ogre::Vector3*>( vertexData + idx * bytesPerVertex +
+															posStride );
+		}
+		const Ogre::Vector3& normal( uint32_t idx ) const
+		{
+			return *reinterpret_cast<const Ogre::Vector3*>( vertexData + idx * bytesPerVertex +
+															normalStride );
+		}
+		const Ogre::Vector2& uv( uint32_t idx ) const
+		{
+			return *reinterpret_cast<const Ogre::Vector2*>( vertexData + idx * bytesPerVertex +
+															uvStride );
+		}
+
+		uint32_t hash( uint32_t idx ) const
+		{
+			uint8_t key[sizeof(Ogre::Vector3) * 2u + sizeof(Ogre::Vector2)];
+			memcpy( key, &position( idx ), sizeof(Ogre::Vector3) );
+			memcpy( key + sizeof(Ogre::Vector3), &normal( idx ), sizeof(Ogre::Vector3) );
+			memcpy( key + sizeof(Ogre::Vector3) * 2u, &uv( idx ), sizeof(Ogre::Vector2) );
+			return hashVertex( key, sizeof(key) );
+		}
+
+		/// Bitwise, like welding.
+		int compare( uint32_t a, uint32_t b ) const
+		{
+			if( a == b )
+				return 0;
+			int retVal = memcmp( &position( a ), &position( b ), sizeof(Ogre::Vector3) );
+			if( !retVal )
+				retVal = memcmp( &normal( a ), &normal( b ), sizeof(Ogre::Vector3) );
+			if( !retVal )
+				retVal = memcmp( &uv( a ), &uv( b ), sizeof(Ogre::Vector2) );
+			return retVal;
+		}
+	};
+
+	/// MikkTSpace's NotZero
+	inline bool tangentNotZero( float value )
+	{
+		return fabsf( value ) > std::numeric_limits<float>::min();
+	}
+
+	/// Projects v onto the plane perpendicular to n, normalised unless it's null.
+	inline Ogre::Vector3 projectTangent( const Ogre::Vector3 &v, const Ogre::Vector3 &n )
+	{
+		Ogre::Vector3 retVal = v - n * n.dotProduct( v );
+		const Ogre::Real length = retVal.length();
+		if( tangentNotZero( length ) )
+			retVal /= length;
+		return retVal;
+	}
+
+	/// Per triangle tangent (MikkTSpace's vOs) & TangentTriFlags.
+	inline void computeTriangleTangent( const TangentVertexLayout &layout, const uint32_t *indexData,
+										uint32_t triIdx, Ogre::Vector3 &outTangent,
+										uint8_t &outFlags )
+	{
+		using namespace Ogre;
+
+		const uint32_t i0 = indexData[triIdx * 3u + 0u];
+		const uint32_t i1 = indexData[triIdx * 3u + 1u];
+		const uint32_t i2 = indexData[triIdx * 3u + 2u];
+
+		if( !layout.compare( i0, i1 ) || !layout.compare( i1, i2 ) || !layout.compare( i0, i2 ) )
+		{
+			outTangent	= Vector3::ZERO;
+			outFlags	= TangentTriFlags::Degenerate;
+			return;
+		}
+
+		const Vector3 deltaPos1 = layout.position( i1 ) - layout.position( i0 );
+		const Vector3 deltaPos2 = layout.position( i2 ) - layout.position( i0 );
+		const Vector2 deltaUV1 = layout.uv( i1 ) - layout.uv( i0 );
+		const Vector2 deltaUV2 = layout.uv( i2 ) - layout.uv( i0 );
+
+		//Our V is mirrored, which mirrors the orientation as well, but not vOs.
+		//The parity thus keeps the same convention we always used.
+		const Real uvArea = deltaUV1.crossProduct( deltaUV2 );
+		Vector3 vOs = deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y;
+
+		uint8_t flags = TangentTriFlags::GroupWithAny;
+		if( uvArea > 0 )
+			flags |= TangentTriFlags::OrientPreserving;
+
+		if( tangentNotZero( uvArea ) )
+		{
+			const Vector3 vOt = deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x;
+			const Real absArea	= Math::Abs( uvArea );
+			const Real lengthOs	= vOs.length();
+			const Real lengthOt	= vOt.length();
+
+			if( tangentNotZero( lengthOs ) )
+				vOs *= (uvArea > 0 ? 1.0f : -1.0f) / lengthOs;
+
+			if( tangentNotZero( lengthOs / absArea ) && tangentNotZero( lengthOt / absArea ) )
+				flags &= ~TangentTriFlags::GroupWithAny;
+		}
+
+		outTangent	= vOs;
+		outFlags	= flags;
+	}
+
+	/// The corner's share of its vertex's tangent: the triangle's tangent
+	/// weighted by the angle the triangle has at that corner.
+	inline Ogre::Vector3 tangentCornerContribution( const TangentVertexLayout &layout,
+													const uint32_t *indexData, uint32_t corner,
+													const Ogre::Vector3 &triTangent )
+	{
+		using namespace Ogre;
+
+		const uint32_t triStart	= corner - corner % 3u;
+		const uint32_t prev		= corner == triStart ? triStart + 2u : corner - 1u;
+		const uint32_t next		= corner == triStart + 2u ? triStart : corner + 1u;
+
+		const uint32_t vertexIdx = indexData[corner];
+		const Vector3 &n	= layout.normal( vertexIdx );
+		const Vector3 &pos	= layout.position( vertexIdx );
+
+		const Vector3 edge0 = projectTangent( layout.position( indexData[prev] ) - pos, n );
+		const Vector3 edge1 = projectTangent( layout.position( indexData[next] ) - pos, n );
+		const Real angle = acosf( Math::Clamp( edge0.dotProduct( edge1 ), -1.0f, 1.0f ) );
+
+		return projectTangent( triTangent, n ) * angle;
+	}
+
+	/// Which of a vertex's tangents a corner contributes to:
+	/// 0 = not mirrored, 1 = mirrored, 2 = joins any, 3 = degenerate
+	inline uint32_t tangentCornerGroup( const uint8_t *triFlags, uint32_t corner )
+	{
+		const uint8_t flags = triFlags[corner / 3u];
+		if( flags & TangentTriFlags::Degenerate )
+			return 3u;
+		if( flags & TangentTriFlags::GroupWithAny )
+			return 2u;
+		return (flags & TangentTriFlags::OrientPreserving) ? 0u : 1u;
+	}
+
+	/** Groups corners by vertex (as in TangentVertexLayout) with a hash table and a
+		counting sort. Within a group, corners keep the order they had.
+	@param vertexLeaders [in/out]
+		Scratch memory, one per welded vertex. The entries of the vertices used by corners
+		must be c_emptySlot; they're left with the index of their group.
+	@param outRunOffsets [out]
+		Group i is outCorners[outRunOffsets[i]] through outCorners[outRunOffsets[i+1] - 1]
+	*/
+	static void groupTangentCorners( const uint32_t *corners, uint32_t numCorners,
+									 const TangentVertexLayout &layout, const uint32_t *indexData,
+									 const uint32_t *hashes, uint32_t *vertexLeaders,
+									 std::vector<uint32_t> &outCorners,
+									 std::vector<uint32_t> &outRunOffsets )
+	{
+		uint32_t tableSize = 1u;
+		while( tableSize < numCorners * 2u )
+			tableSize <<= 1u;
+		const uint32_t tableMask = tableSize - 1u;
+
+		//Slots hold the first welded vertex of each group. Its vertexLeaders entry
+		//tells the index of the group.
+		std::vector<uint32_t> slots( tableSize, c_emptySlot );
+		uint32_t numRuns = 0;
+
+		for( uint32_t i=0; i<numCorners; ++i )
+		{
+			const uint32_t vertexIdx = indexData[corners[i]];
+			if( vertexLeaders[vertexIdx] != c_emptySlot )
+				continue;
+
+			const uint32_t hash = hashes[vertexIdx];
+			uint32_t slotIdx = hash & tableMask;
+			while( slots[slotIdx] != c_emptySlot &&
+				   (hashes[slots[slotIdx]] != hash || layout.compare( slots[slotIdx], vertexIdx )) )
+			{
+				slotIdx = (slotIdx + 1u) & tableMask;
+			}
+
+			if( slots[slotIdx] == c_emptySlot )
+			{
+				slots[slotIdx] = vertexIdx;
+				vertexLeaders[vertexIdx] = numRuns++;
+			}
+			else
+			{
+				vertexLeaders[vertexIdx] = vertexLeaders[slots[slotIdx]];
+			}
+		}
+
+		outRunOffsets.clear();
+		outRunOffsets.resize( numRuns + 1u, 0 );
+		for( uint32_t i=0; i<numCorners; ++i )
+			++outRunOffsets[vertexLeaders[indexData[corners[i]]] + 1u];
+		for( uint32_t i=0; i<numRuns; ++i )
+			outRunOffsets[i + 1u] += outRunOffsets[i];
+
+		std::vector<uint32_t> writeOffsets( outRunOffsets.begin(), outRunOffsets.end() - 1 );
+		outCorners.resize( numCorners );
+		for( uint32_t i=0; i<numCorners; ++i )
+			outCorners[writeOffsets[vertexLeaders[indexData[corners[i]]]]++] = corners[i];
+	}
+
+	/** Solves the tangents of corners grouped with groupTangentCorners.
+	@param vertexGroups [in/out]
+		One per welded vertex, must start as 0. Which group the vertex got: 1 = not mirrored,
+		2 = mirrored, 3 = none (i.e. all its triangles have null UV area).
+	@param outSplits [out]
+		Vertices in both groups get a copy for the mirrored one. When null, they stay in
+		the 1st group.
+	@param outSplitCorners [out]
+		(corner, index into outSplits) of the corners that must use the copies.
+	*/
+	static void solveTangentCorners( const std::vector<uint32_t> &corners,
+									 const std::vector<uint32_t> &runOffsets,
+									 const TangentVertexLayout &layout, const uint32_t *indexData,
+									 const Ogre::Vector3 *triTangents, const uint8_t *triFlags,
+									 uint8_t *vertexData, uint32_t tangentStride,
+									 uint8_t *vertexGroups,
+									 std::vector<GenerateTangentsTask::TangentSplit> *outSplits,
+									 std::vector< std::pair<uint32_t, uint32_t> > *outSplitCorners )
 	{
 		using namespace Ogre;
 
-		for( ::uint32_t i=0; i<numFaces; ++i )
-		{
-			Vector3 * RESTRICT_ALIAS vPos[3];
-			Vector3 * RESTRICT_ALIAS vNormal[3];
+		const size_t numRuns = runOffsets.size() - 1u;
+		for( size_t run=0; run<numRuns; ++run )
+		{
+			const uint32_t runStart	= runOffsets[run];
+			const uint32_t runEnd	= runOffsets[run + 1u];
+
+			Vector3 tangents[2] = { Vector3::ZERO, Vector3::ZERO };
+			bool hasGroup[2] = { false, false };
+
+			for( uint32_t i=runStart; i<runEnd; ++i )
+			{
+				const uint32_t group = tangentCornerGroup( triFlags, corners[i] );
+				if( group < 2u )
+				{
+					tangents[group] += tangentCornerContribution( layout, indexData, corners[i],
+																  triTangents[corners[i] / 3u] );
+					hasGroup[group] = true;
+				}
+			}
+
+			const uint32_t anyGroup = hasGroup[0] ? 0u : (hasGroup[1] ? 1u : 2u);
+			if( anyGroup < 2u )
+			{
+				for( uint32_t i=runStart; i<runEnd; ++i )
+				{
+					if( tangentCornerGroup( triFlags, corners[i] ) == 2u )
+					{
+						tangents[anyGroup] += tangentCornerContribution(
+												  layout, indexData, corners[i],
+												  triTangents[corners[i] / 3u] );
+					}
+				}
+			}
+
+			for( size_t i=0; i<2u; ++i )
+			{
+				const Real length = tangents[i].length();
+				if( tangentNotZero( length ) )
+					tangents[i] /= length;
+			}
+
+			//Not mirrored corners first, so that they're the ones keeping the vertex.
+			const size_t runSplitStart = outSplits ? outSplits->size() : 0u;
+			for( uint32_t pass=0; pass<4u; ++pass )
+			{
+				for( uint32_t i=runStart; i<runEnd; ++i )
+				{
+					const uint32_t corner = corners[i];
+					if( tangentCornerGroup( triFlags, corner ) != pass )
+						continue;
+
+					const uint32_t vertexIdx	= indexData[corner];
+					const uint32_t group		= pass < 2u ? pass : anyGroup;
+
+					if( !vertexGroups[vertexIdx] )
+					{
+						vertexGroups[vertexIdx] = static_cast<uint8_t>( group + 1u );
+
+						uint8_t *vertex = vertexData + vertexIdx * layout.bytesPerVertex +
+										  tangentStride;
+						const Vector3 tangent = group < 2u ? tangents[group] : Vector3::ZERO;
+						const float parity = group == 1u ? -1.0f : 1.0f;
+						memcpy( vertex, &tangent, sizeof(Vector3) );
+						memcpy( vertex + sizeof(Vector3), &parity, sizeof(float) );
+					}
+					else if( pass == 1u && vertexGroups[vertexIdx] != 2u && outSplits )
+					{
+						//Null area triangles don't deserve a split; they use whatever
+						//the vertex has. Vertices rarely have more than a few corners.
+						size_t splitIdx = runSplitStart;
+						while( splitIdx < outSplits->size() &&
+							   (*outSplits)[splitIdx].srcVertex != vertexIdx )
+						{
+							++splitIdx;
+						}
+
+						if( splitIdx == outSplits->size() )
+						{
+							GenerateTangentsTask::TangentSplit split;
+							split.srcVertex = vertexIdx;
+							split.tangent	= tangents[1];
+							split.parity	= -1.0f;
+							outSplits->push_back( split );
+						}
+						outSplitCorners->push_back( std::pair<uint32_t, uint32_t>(
+														corner, static_cast<uint32_t>( splitIdx ) ) );
+					}
+				}
+			}
+		}
+	}
+
+	/// Splits count elements evenly among threads.
+	inline void getTangentThreadRange( size_t threadId, size_t numThreads, uint32_t count,
+									   uint32_t &outStart, uint32_t &outEnd )
+	{
+		const uint32_t numPerThread = Ogre::alignToNextMultiple( count, numThreads ) / numThreads;
+		outStart = std::min<uint32_t>( count, threadId * numPerThread );
+		outEnd = std::min<uint32_t>( count, outStart + numPerThread );
+	}
+	//-----------------------------------------------------------------------------------
+	void VertexUtils::generateTangentsPartial( uint8_t *vertexData, const uint32_t *indexData,
+											   uint32_t bytesPerVertex, uint32_t numVertices,
+											   uint32_t numIndices, uint32_t posStride,
+											   uint32_t normalStride, uint32_t tangentStride,
+											   uint32_t uvStride, uint8_t *inOutDirtyVertices )
+	{
+		using namespace Ogre;
+
+		//Bit 0: position or normal changed (input). Bit 1: tangent needs to be recalculated.
+		for( ::uint32_t i=0; i<numIndices; i += 3 )
+		{
+			if( (inOutDirtyVertices[indexData[i+0]] | inOutDirtyVertices[indexData[i+1]] |
+				 inOutDirtyVertices[indexData[i+2]]) & 0x01u )
+			{
+				inOutDirtyVertices[indexData[i+0]] |= 0x02u;
+				inOutDirtyVertices[indexData[i+1]] |= 0x02u;
+				inOutDirtyVertices[indexData[i+2]] |= 0x02u;
+			}
+		}
+
+		TangentVertexLayout layout;
+		layout.vertexData		= vertexData;
+		layout.bytesPerVertex	= bytesPerVertex;
+		layout.posStride		= posStride;
+		layout.normalStride		= normalStride;
+		layout.uvStride			= uvStride;
+
+		std::vector< ::uint32_t > hashes( numVertices, 0 );
+		for( ::uint32_t i=0; i<numVertices; ++i )
+		{
+			if( inOutDirtyVertices[i] & 0x02u )
+				hashes[i] = layout.hash( i );
+		}
+
+		//Every corner of an affected vertex. Their triangles may contain unaffected
+		//vertices too, which must be left alone.
+		std::vector< ::uint32_t > corners;
+		std::vector<Vector3> triTangents( numIndices / 3u, Vector3::ZERO );
+		std::vector<uint8_t> triFlags( numIndices / 3u, 0 );
+		for( ::uint32_t i=0; i<numIndices; i += 3 )
+		{
+			bool touched = false;
+			for( ::uint32_t j=i; j<i + 3u; ++j )
+			{
+				if( inOutDirtyVertices[indexData[j]] & 0x02u )
+				{
+					corners.push_back( j );
+					touched = true;
+				}
+			}
+
+			if( touched )
+			{
+				computeTriangleTangent( layout, indexData, i / 3u,
+										triTangents[i / 3u], triFlags[i / 3u] );
+			}
+		}
+
+		if( corners.empty() )
+			return;
+
+		std::vector< ::uint32_t > vertexLeaders( numVertices, c_emptySlot );
+		std::vector< ::uint32_t > groupedCorners;
+		std::vector< ::uint32_t > runOffsets;
+		groupTangentCorners( &corners[0], static_cast< ::uint32_t >( corners.size() ), layout,
+							 indexData, &hashes[0], &vertexLeaders[0], groupedCorners, runOffsets );
+
+		//Vertices were already split when the mesh was built (and only the UVs could
+		//change that), so no splitting here.
+		std::vector<uint8_t> vertexGroups( numVertices, 0 );
+		solveTangentCorners( groupedCorners, runOffsets, layout, indexData, &triTangents[0],
+							 &triFlags[0], vertexData, tangentStride, &vertexGroups[0], 0, 0 );
+	}
+	//-----------------------------------------------------------------------------------
+	void VertexUtils::floatToHalf4( uint16_t * RESTRICT_ALIAS dst, const float * RESTRICT_ALIAS src )
+	{
+#if DERGO_HAVE_SSE2
+		const __m128i signMask		= _mm_set1_epi32( static_cast<int>( 0x80000000u ) );
+		const __m128i halfMax		= _mm_set1_epi32( (127 + 16) << 23 );
+		const __m128i minNormal		= _mm_set1_epi32( (127 - 14) << 23 );
+		const __m128i denormMagic	= _mm_set1_epi32( ((127 - 15) + (23 - 10) + 1) << 23 );
+		const __m128i normalBias	= _mm_set1_epi32( 0xFFF - ((127 - 15) << 23) );
+
+		const __m128 value		= _mm_loadu_ps( src );
+		const __m128 justSign	= _mm_and_ps( _mm_castsi128_ps( signMask ), value );
+		const __m128 absValue	= _mm_xor_ps( value, justSign );
+		const __m128i absInt	= _mm_castps_si128( absValue );
+
+		//Infinity or NaN (NaNs keep a mantissa bit set)
+		const __m128i isNan		= _mm_castps_si128( _mm_cmpunord_ps( absValue, absValue ) );
+		const __m128i infOrNan	= _mm_or_si128( _mm_and_si128( isNan, _mm_set1_epi32( 0x200 ) ),
+												_mm_set1_epi32( 0x7C00 ) );
+		const __m128i isRegular	= _mm_cmpgt_epi32( halfMax, absInt );
+
+		//Denormals: let the FPU do the rounding by adding a magic number
+		const __m128i isDenormal	= _mm_cmpgt_epi32( minNormal, absInt );
+		const __m128i denormal		= _mm_sub_epi32( _mm_castps_si128(
+														 _mm_add_ps( absValue,
+																	 _mm_castsi128_ps( denormMagic ) ) ),
+													 denormMagic );
+
+		//Normals: rebias the exponent, and round the mantissa to nearest even
+		const __m128i mantissaOdd	= _mm_srai_epi32( _mm_slli_epi32( absInt, 31 - 13 ), 31 );
+		const __m128i normal		= _mm_srli_epi32( _mm_sub_epi32( _mm_add_epi32( absInt, normalBias ),
+																	 mantissaOdd ), 13 );
+
+		__m128i result = _mm_or_si128( _mm_and_si128( isDenormal, denormal ),
+									   _mm_andnot_si128( isDenormal, normal ) );
+		result = _mm_or_si128( _mm_and_si128( isRegular, result ),
+							   _mm_andnot_si128( isRegular, infOrNan ) );
+
+		//The sign goes to bit 15. Shifting it arithmetically makes negative halves negative
+		//32-bit ints too, so that the saturating pack leaves all halves untouched.
+		result = _mm_or_si128( result, _mm_srai_epi32( _mm_castps_si128( justSign ), 16 ) );
+		_mm_storel_epi64( reinterpret_cast<__m128i*>( dst ), _mm_packs_epi32( result, result ) );
+#else
+		for( size_t i=0; i<4u; ++i )
+			dst[i] = floatToHalf( src[i] );
+#endif
+	}
+	//-----------------------------------------------------------------------------------
+	void VertexUtils::compactVertices( uint8_t * RESTRICT_ALIAS dstData, uint32_t dstBytesPerVertex,
+									   const uint8_t * RESTRICT_ALIAS srcData,
+									   uint32_t srcBytesPerVertex, uint32_t numVertices,
+									   bool halfPositions, bool hasColour, uint8_t numUVs,
+									   bool hasTangents )
+	{
+		using namespace Ogre;
+
+		const uint32_t colourOffset		= sizeof(Vector3) * 2u;
+		const uint32_t uvOffset			= getUvOffset( hasColour, 0u );
+		const uint32_t tangentOffset	= uvOffset + sizeof(Vector2) * numUVs;
+
+		for( ::uint32_t i=0; i<numVertices; ++i )
+		{
+			uint8_t * RESTRICT_ALIAS dst = dstData;
+
+			const float * RESTRICT_ALIAS vPos = reinterpret_cast<const float*>( srcData );
+			if( halfPositions )
+			{
+				const float position[4] = { vPos[0], vPos[1], vPos[2], 1.0f };
+				floatToHalf4( reinterpret_cast<uint16_t*>( dst ), position );
+				dst += sizeof(uint16_t) * 4u;
+			}
+			else
+			{
+				memcpy( dst, vPos, sizeof(float) * 3u );
+				dst += sizeof(float) * 3u;
+			}
+
+			const Vector3 *vNormal = reinterpret_cast<const Vector3*>( srcData + sizeof(Vector3) );
+			if( hasTangents )
+			{
+				const Vector3 *vTangent = reinterpret_cast<const Vector3*>( srcData + tangentOffset );
+				const float *fParity = reinterpret_cast<const float*>( srcData + tangentOffset +
+																	   sizeof(Vector3) );
+				encodeQTangent( reinterpret_cast<int16_t*>( dst ), *vNormal, *vTangent, *fParity );
+			}
+			else
+			{
+				encodeQTangent( reinterpret_cast<int16_t*>( dst ), *vNormal, Vector3::ZERO, 1.0f );
+			}
+			dst += sizeof(int16_t) * 4u;
+
+			if( hasColour )
+			{
+				memcpy( dst, srcData + colourOffset, sizeof(uint8_t) * 4u );
+				dst += sizeof(uint8_t) * 4u;
+			}
+
+			//Two UVs per conversion
+			const float * RESTRICT_ALIAS uv = reinterpret_cast<const float*>( srcData + uvOffset );
+			uint8_t uvsLeft = numUVs;
+			while( uvsLeft >= 2u )
+			{
+				floatToHalf4( reinterpret_cast<uint16_t*>( dst ), uv );
+				dst += sizeof(uint16_t) * 4u;
+				uv += 4u;
+				uvsLeft -= 2u;
+			}
+			if( uvsLeft )
+			{
+				const float lastUv[4] = { uv[0], uv[1], 0.0f, 0.0f };
+				uint16_t halves[4];
+				floatToHalf4( halves, lastUv );
+				memcpy( dst, halves, sizeof(uint16_t) * 2u );
+			}
+
+			srcData += srcBytesPerVertex;
+			dstData += dstBytesPerVertex;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	static const int32_t c_vertexCacheSize = 32;
+
+	/// Vertex scoring of Forsyth's algorithm. The tables hold the results of his pow()s.
+	struct VertexCacheScoring
+	{
+		/// By position in the cache. The last triangle's vertices get a fixed score,
+		/// so that the next triangle doesn't always take the same strip direction.
+		float	cacheScore[c_vertexCacheSize];
+		/// By number of triangles still using the vertex. Boosts vertices that are
+		/// almost done, so they don't linger around as isolated triangles.
+		float	valenceScore[64];
+
+		VertexCacheScoring()
+		{
+			for( int32_t i=0; i<c_vertexCacheSize; ++i )
+			{
+				if( i < 3 )
+					cacheScore[i] = 0.75f;
+				else
+				{
+					const float scaler = 1.0f - (i - 3) / static_cast<float>( c_vertexCacheSize - 3 );
+					cacheScore[i] = powf( scaler, 1.5f );
+				}
+			}
+			valenceScore[0] = 0.0f;
+			for( size_t i=1; i<64u; ++i )
+				valenceScore[i] = 2.0f / sqrtf( static_cast<float>( i ) );
+		}
+
+		float getScore( int32_t cachePosition, uint32_t numActiveTris ) const
+		{
+			if( numActiveTris == 0 )
+				return -1.0f; //No triangle needs it anymore
+			float score = cachePosition >= 0 ? cacheScore[cachePosition] : 0.0f;
+			score += valenceScore[std::min<uint32_t>( numActiveTris, 63u )];
+			return score;
+		}
+	};
+
+	template <typename T>
+	static void optimizeVertexCacheImpl( T *indices, uint32_t numIndices, uint32_t *globalToLocal )
+	{
+		const uint32_t numTris = numIndices / 3u;
+		if( numTris < 2u )
+			return;
+
+		const VertexCacheScoring scoring;
+
+		//Work with local vertex indices, so memory is proportional to the triangles we've got.
+		std::vector<uint32_t> localIndices( numIndices );
+		std::vector<T> localToGlobal;
+		for( uint32_t i=0; i<numIndices; ++i )
+		{
+			uint32_t &local = globalToLocal[indices[i]];
+			if( local == c_emptySlot )
+			{
+				local = static_cast<uint32_t>( localToGlobal.size() );
+				localToGlobal.push_back( indices[i] );
+			}
+			localIndices[i] = local;
+		}
+
+		const uint32_t numVertices = static_cast<uint32_t>( localToGlobal.size() );
+		for( uint32_t i=0; i<numVertices; ++i )
+			globalToLocal[localToGlobal[i]] = c_emptySlot;
+
+		//Triangles of each vertex. The first numActiveTris[v] of them aren't emitted yet.
+		std::vector<uint32_t> numActiveTris( numVertices, 0 );
+		for( uint32_t i=0; i<numIndices; ++i )
+			++numActiveTris[localIndices[i]];
+
+		std::vector<uint32_t> vertexTrisStart( numVertices + 1u, 0 );
+		for( uint32_t i=0; i<numVertices; ++i )
+			vertexTrisStart[i + 1u] = vertexTrisStart[i] + numActiveTris[i];
+
+		std::vector<uint32_t> vertexTris( numIndices );
+		{
+			std::vector<uint32_t> cursor( vertexTrisStart.begin(), vertexTrisStart.end() - 1 );
+			for( uint32_t i=0; i<numIndices; ++i )
+				vertexTris[cursor[localIndices[i]]++] = i / 3u;
+		}
+
+		std::vector<int32_t> cachePosition( numVertices, -1 );
+		std::vector<float> vertexScore( numVertices );
+		for( uint32_t i=0; i<numVertices; ++i )
+			vertexScore[i] = scoring.getScore( -1, numActiveTris[i] );
+
+		uint32_t bestTri = 0;
+		{
+			float bestScore = -1.0f;
+			for( uint32_t i=0; i<numTris; ++i )
+			{
+				const float score = vertexScore[localIndices[i * 3u + 0u]] +
+									vertexScore[localIndices[i * 3u + 1u]] +
+									vertexScore[localIndices[i * 3u + 2u]];
+				if( score > bestScore )
+				{
+					bestScore = score;
+					bestTri = i;
+				}
+			}
+		}
+
+		std::vector<uint8_t> triEmitted( numTris, 0 );
+
+		uint32_t cache[c_vertexCacheSize + 3];
+		int32_t cacheSize = 0;
+
+		std::vector<T> output( numIndices );
+		uint32_t nextUnemittedTri = 0;
+
+		for( uint32_t emitted=0; emitted<numTris; ++emitted )
+		{
+			if( bestTri == c_emptySlot )
+			{
+				//Nothing in the cache is connected to anything left. Take whatever comes next.
+				while( triEmitted[nextUnemittedTri] )
+					++nextUnemittedTri;
+				bestTri = nextUnemittedTri;
+			}
+
+			triEmitted[bestTri] = 1u;
+			const uint32_t *triVertices = &localIndices[bestTri * 3u];
+
+			//The triangle's vertices go first in the cache, then what was there before.
+			uint32_t newCache[c_vertexCacheSize + 3];
+			int32_t newCacheSize = 0;
+			for( size_t i=0; i<3u; ++i )
+			{
+				const uint32_t v = triVertices[i];
+				output[emitted * 3u + i] = localToGlobal[v];
+				newCache[newCacheSize++] = v;
+
+				//Remove the triangle from the vertex's active ones
+				uint32_t *tris = &vertexTris[vertexTrisStart[v]];
+				uint32_t j = 0;
+				while( tris[j] != bestTri )
+					++j;
+				std::swap( tris[j], tris[numActiveTris[v] - 1u] );
+				--numActiveTris[v];
+			}
+
+			for( int32_t i=0; i<cacheSize; ++i )
+			{
+				const uint32_t v = cache[i];
+				if( v != triVertices[0] && v != triVertices[1] && v != triVertices[2] )
+					newCache[newCacheSize++] = v;
+			}
+
+			//Rescore everything that moved in (or fell out of) the cache...
+			for( int32_t i=0; i<newCacheSize; ++i )
+			{
+				const uint32_t v = newCache[i];
+				cachePosition[v] = i < c_vertexCacheSize ? i : -1;
+				vertexScore[v] = scoring.getScore( cachePosition[v], numActiveTris[v] );
+			}
+
+			//...then the triangles using it, which are the candidates for the next one.
+			bestTri = c_emptySlot;
+			float bestScore = -1.0f;
+			for( int32_t i=0; i<newCacheSize; ++i )
+			{
+				const uint32_t v = newCache[i];
+				const uint32_t *tris = &vertexTris[vertexTrisStart[v]];
+				for( uint32_t j=0; j<numActiveTris[v]; ++j )
+				{
+					const uint32_t tri = tris[j];
+					const float score = vertexScore[localIndices[tri * 3u + 0u]] +
+										vertexScore[localIndices[tri * 3u + 1u]] +
+										vertexScore[localIndices[tri * 3u + 2u]];
+					if( score > bestScore )
+					{
+						bestScore = score;
+						bestTri = tri;
+					}
+				}
+			}
+
+			cacheSize = std::min( newCacheSize, c_vertexCacheSize );
+			memcpy( cache, newCache, cacheSize * sizeof(uint32_t) );
+		}
+
+		memcpy( indices, &output[0], numIndices * sizeof(T) );
+	}
+	//-----------------------------------------------------------------------------------
+	void VertexUtils::optimizeVertexCache( uint16_t *indices, uint32_t numIndices,
+										   uint32_t *globalToLocal )
+	{
+		optimizeVertexCacheImpl( indices, numIndices, globalToLocal );
+	}
+	//-----------------------------------------------------------------------------------
+	void VertexUtils::optimizeVertexCache( uint32_t *indices, uint32_t numIndices,
+										   uint32_t *globalToLocal )
+	{
+		optimizeVertexCacheImpl( indices, numIndices, globalToLocal );
+	}
+	//-----------------------------------------------------------------------------------
+	float VertexUtils::halfToFloat( uint16_t value )
+	{
+		const uint32_t sign		= (value & 0x8000u) << 16u;
+		uint32_t exponent		= (value >> 10u) & 0x1Fu;
+		uint32_t mantissa		= value & 0x3FFu;
+
+		uint32_t bits;
+		if( exponent == 0x1Fu )
+		{
+			//Infinity & NaN
+			bits = sign | 0x7F800000u | (mantissa << 13u);
+		}
+		else if( exponent != 0 )
+		{
+			bits = sign | ((exponent + 112u) << 23u) | (mantissa << 13u);
+		}
+		else if( mantissa != 0 )
+		{
+			//Denormal. Normalize it, floats have exponent to spare.
+			exponent = 113u;
+			while( !(mantissa & 0x400u) )
+			{
+				mantissa <<= 1u;
+				--exponent;
+			}
+			bits = sign | (exponent << 23u) | ((mantissa & 0x3FFu) << 13u);
+		}
+		else
+		{
+			bits = sign;
+		}
+
+		float retVal;
+		memcpy( &retVal, &bits, sizeof(retVal) );
+		return retVal;
+	}
+	//-----------------------------------------------------------------------------------
+	float VertexUtils::getMaxHalfError( float maxAbs )
+	{
+		maxAbs = fabsf( maxAbs );
+		if( maxAbs >= 65520.0f )
+			return std::numeric_limits<float>::infinity();
+		if( maxAbs < 6.103515625e-05f )
+			return ldexpf( 1.0f, -25 ); //Denormals are 2^-24 apart
+
+		//maxAbs is in [2^(exponent-1); 2^exponent), where halves are 2^(exponent-11) apart
+		int exponent;
+		frexpf( maxAbs, &exponent );
+		return ldexpf( 1.0f, exponent - 12 );
+	}
+	//-----------------------------------------------------------------------------------
+	/// Sum of squared distances to a set of weighted planes, as a symmetric 4x4 matrix.
+	/// Doubles, since the terms cancel each other out a lot far from the origin.
+	struct EdgeCollapseQuadric
+	{
+		double a00, a01, a02, a11, a12, a22;
+		double b0, b1, b2;
+		double c;
+		/// Sum of the weights, to turn the error back into a distance.
+		double weight;
+
+		void setZero()
+		{
+			a00 = a01 = a02 = a11 = a12 = a22 = 0;
+			b0 = b1 = b2 = 0;
+			c = 0;
+			weight = 0;
+		}
+
+		/// Plane n·p + d = 0. n must be normalized.
+		void addPlane( double nx, double ny, double nz, double d, double planeWeight )
+		{
+			a00 += nx * nx * planeWeight;
+			a01 += nx * ny * planeWeight;
+			a02 += nx * nz * planeWeight;
+			a11 += ny * ny * planeWeight;
+			a12 += ny * nz * planeWeight;
+			a22 += nz * nz * planeWeight;
+			b0 += nx * d * planeWeight;
+			b1 += ny * d * planeWeight;
+			b2 += nz * d * planeWeight;
+			c += d * d * planeWeight;
+			weight += planeWeight;
+		}
+
+		void add( const EdgeCollapseQuadric &other )
+		{
+			a00 += other.a00; a01 += other.a01; a02 += other.a02;
+			a11 += other.a11; a12 += other.a12; a22 += other.a22;
+			b0 += other.b0; b1 += other.b1; b2 += other.b2;
+			c += other.c;
+			weight += other.weight;
+		}
+
+		/// Mean squared distance from p to the planes.
+		double getError( const float *p ) const
+		{
+			const double x = p[0], y = p[1], z = p[2];
+			const double error = x * (a00 * x + 2.0 * (a01 * y + a02 * z + b0)) +
+								 y * (a11 * y + 2.0 * (a12 * z + b1)) +
+								 z * (a22 * z + 2.0 * b2) + c;
+			return weight > 0 ? std::max( error, 0.0 ) / weight : 0.0;
+		}
+	};
+
+	namespace EdgeCollapseKind
+	{
+	enum EdgeCollapseKind
+	{
+		/// Can collapse onto any neighbour
+		Manifold,
+		/// On an open border. Can only collapse onto its neighbours along the border.
+		Border,
+		/// Seams, corners & non-manifold geometry. Never moves.
+		Locked
+	};
+	}
+
+	struct EdgeCollapse
+	{
+		/// Vertex that goes away
+		uint32_t	src;
+		/// Vertex it collapses onto
+		uint32_t	dst;
+		float		error;
+
+		bool operator < ( const EdgeCollapse &other ) const	{ return error < other.error; }
+	};
+
+	/// Orders vertices by their position, bitwise.
+	struct VertexPositionCmp
+	{
+		const float *positions;
+
+		VertexPositionCmp( const float *_positions ) : positions( _positions ) {}
+
+		bool operator () ( uint32_t a, uint32_t b ) const
+		{
+			return memcmp( positions + a * 3u, positions + b * 3u, sizeof(float) * 3u ) < 0;
+		}
+	};
+
+	static inline uint64_t makeEdgeKey( uint32_t from, uint32_t to )
+	{
+		return (static_cast<uint64_t>( from ) << 32u) | to;
+	}
+
+	static inline void triangleNormal( const float *p0, const float *p1, const float *p2,
+									   float outNormal[3] )
+	{
+		const float e0[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		const float e1[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		outNormal[0] = e0[1] * e1[2] - e0[2] * e1[1];
+		outNormal[1] = e0[2] * e1[0] - e0[0] * e1[2];
+		outNormal[2] = e0[0] * e1[1] - e0[1] * e1[0];
+	}
+
+	/// Border edges get planes perpendicular to their triangle, much heavier than
+	/// the surface, so that the silhouette of open meshes is kept.
+	static const double c_borderQuadricWeight = 10.0;
+
+	uint32_t VertexUtils::simplify( uint32_t *indices, uint32_t numIndices, uint32_t *triangleTags,
+									const float *positions, uint32_t numVertices,
+									uint32_t targetNumIndices, float maxError, float *outError )
+	{
+		*outError = 0;
+
+		if( numIndices <= targetNumIndices )
+			return numIndices;
+
+		//Vertices that share their position get the same representative. Edges are
+		//matched by representatives, so that seams don't look like open borders.
+		std::vector<uint32_t> representative( numVertices, c_emptySlot );
+		std::vector<uint8_t> isSeam( numVertices, 0 );
+		{
+			std::vector<uint32_t> usedVertices;
+			for( uint32_t i=0; i<numIndices; ++i )
+			{
+				if( representative[indices[i]] == c_emptySlot )
+				{
+					representative[indices[i]] = indices[i];
+					usedVertices.push_back( indices[i] );
+				}
+			}
+
+			std::sort( usedVertices.begin(), usedVertices.end(),
+					   VertexPositionCmp( positions ) );
+
+			size_t groupStart = 0;
+			for( size_t i=1; i<=usedVertices.size(); ++i )
+			{
+				if( i == usedVertices.size() ||
+					memcmp( positions + usedVertices[i] * 3u,
+							positions + usedVertices[groupStart] * 3u, sizeof(float) * 3u ) )
+				{
+					for( size_t j=groupStart; j<i; ++j )
+					{
+						representative[usedVertices[j]] = usedVertices[groupStart];
+						isSeam[usedVertices[j]] = (i - groupStart) > 1u;
+					}
+					groupStart = i;
+				}
+			}
+		}
+
+		//Find open borders. Indexed by representative.
+		std::vector<uint8_t> kinds( numVertices, EdgeCollapseKind::Manifold );
+		std::vector<uint32_t> borderNext( numVertices, c_emptySlot );
+		std::vector<uint32_t> borderPrev( numVertices, c_emptySlot );
+		std::vector<uint64_t> edges;
+		std::vector<EdgeCollapseQuadric> quadrics( numVertices );
+		{
+			for( uint32_t i=0; i<numVertices; ++i )
+				quadrics[i].setZero();
+
+			edges.reserve( numIndices );
+			for( uint32_t i=0; i<numIndices; i += 3u )
+			{
+				for( uint32_t j=0; j<3u; ++j )
+				{
+					edges.push_back( makeEdgeKey( representative[indices[i + j]],
+												  representative[indices[i + (j + 1u) % 3u]] ) );
+				}
+			}
+			std::sort( edges.begin(), edges.end() );
+
+			for( size_t i=1; i<edges.size(); ++i )
+			{
+				if( edges[i] == edges[i - 1u] )
+				{
+					//Same edge, same direction: more than 2 triangles share it, or
+					//there are flipped triangles. Don't touch it.
+					kinds[edges[i] >> 32u] = EdgeCollapseKind::Locked;
+					kinds[edges[i] & 0xFFFFFFFFu] = EdgeCollapseKind::Locked;
+				}
+			}
+
+			for( uint32_t i=0; i<numIndices; i += 3u )
+			{
+				const float *p[3] =
+				{
+					positions + indices[i + 0u] * 3u,
+					positions + indices[i + 1u] * 3u,
+					positions + indices[i + 2u] * 3u
+				};
+
+				float normal[3];
+				triangleNormal( p[0], p[1], p[2], normal );
+				const double doubleArea = sqrt( double( normal[0] ) * normal[0] +
+												double( normal[1] ) * normal[1] +
+												double( normal[2] ) * normal[2] );
+				if( doubleArea > 0 )
+				{
+					const double nx = normal[0] / doubleArea;
+					const double ny = normal[1] / doubleArea;
+					const double nz = normal[2] / doubleArea;
+					const double d = -(nx * p[0][0] + ny * p[0][1] + nz * p[0][2]);
+					for( uint32_t j=0; j<3u; ++j )
+						quadrics[indices[i + j]].addPlane( nx, ny, nz, d, doubleArea * 0.5 );
+				}
+
+				for( uint32_t j=0; j<3u; ++j )
+				{
+					const uint32_t from	= representative[indices[i + j]];
+					const uint32_t to	= representative[indices[i + (j + 1u) % 3u]];
+					if( std::binary_search( edges.begin(), edges.end(), makeEdgeKey( to, from ) ) )
+						continue;
+
+					//Open edge. Borders can only have one way in and one way out.
+					if( borderNext[from] != c_emptySlot || borderPrev[to] != c_emptySlot )
+					{
+						kinds[from] = EdgeCollapseKind::Locked;
+						kinds[to] = EdgeCollapseKind::Locked;
+					}
+					borderNext[from] = to;
+					borderPrev[to] = from;
+					if( kinds[from] == EdgeCollapseKind::Manifold )
+						kinds[from] = EdgeCollapseKind::Border;
+					if( kinds[to] == EdgeCollapseKind::Manifold )
+						kinds[to] = EdgeCollapseKind::Border;
+
+					if( doubleArea > 0 )
+					{
+						const float *p0 = p[j];
+						const float *p1 = p[(j + 1u) % 3u];
+						double edge[3] = { double( p1[0] ) - p0[0], double( p1[1] ) - p0[1],
+										   double( p1[2] ) - p0[2] };
+						const double edgeLengthSq = edge[0] * edge[0] + edge[1] * edge[1] +
+													edge[2] * edge[2];
+						double nx = edge[1] * normal[2] - edge[2] * normal[1];
+						double ny = edge[2] * normal[0] - edge[0] * normal[2];
+						double nz = edge[0] * normal[1] - edge[1] * normal[0];
+						const double length = sqrt( nx * nx + ny * ny + nz * nz );
+						if( length > 0 )
+						{
+							nx /= length;
+							ny /= length;
+							nz /= length;
+							const double d = -(nx * p0[0] + ny * p0[1] + nz * p0[2]);
+							const double planeWeight = edgeLengthSq * c_borderQuadricWeight;
+							quadrics[indices[i + j]].addPlane( nx, ny, nz, d, planeWeight );
+							quadrics[indices[i + (j + 1u) % 3u]].addPlane( nx, ny, nz, d,
+																		   planeWeight );
+						}
+					}
+				}
+			}
+
+			std::vector<uint64_t>().swap( edges );
+
+			//Seams never move. Everything else takes the kind of its representative
+			//(which is itself, since only seams share positions).
+			for( uint32_t i=0; i<numVertices; ++i )
+			{
+				if( isSeam[i] )
+					kinds[i] = EdgeCollapseKind::Locked;
+			}
+		}
+
+		const float maxErrorSq = maxError * maxError;
+		float errorSq = 0;
+
+		std::vector<EdgeCollapse> collapses;
+		std::vector<uint32_t> remap( numVertices );
+		std::vector<uint8_t> touched( numVertices );
+		std::vector<uint32_t> adjacencyOffsets( numVertices + 1u );
+		std::vector<uint32_t> adjacency;
+
+		while( numIndices > targetNumIndices )
+		{
+			//Gather every collapse allowed, in the cheapest direction of each edge.
+			//Interior edges show up in two triangles; only take them once.
+			collapses.clear();
+			for( uint32_t i=0; i<numIndices; ++i )
+			{
+				const uint32_t v0 = indices[i];
+				const uint32_t v1 = indices[i - (i % 3u) + (i + 1u) % 3u];
+				const bool isBorderEdge = borderNext[representative[v0]] == representative[v1];
+				if( v0 > v1 && !isBorderEdge )
+					continue;
+
+				EdgeCollapse collapse;
+				collapse.error = std::numeric_limits<float>::max();
+				for( uint32_t j=0; j<2u; ++j )
+				{
+					const uint32_t src = j == 0 ? v0 : v1;
+					const uint32_t dst = j == 0 ? v1 : v0;
+
+					if( kinds[src] == EdgeCollapseKind::Locked ||
+						(kinds[src] == EdgeCollapseKind::Border && !isBorderEdge) )
+					{
+						continue;
+					}
+
+					const float error = static_cast<float>(
+											quadrics[src].getError( positions + dst * 3u ) );
+					if( error < collapse.error )
+					{
+						collapse.src	= src;
+						collapse.dst	= dst;
+						collapse.error	= error;
+					}
+				}
+
+				if( collapse.error <= maxErrorSq )
+					collapses.push_back( collapse );
+			}
+
+			if( collapses.empty() )
+				break;
+
+			std::sort( collapses.begin(), collapses.end() );
+
+			//Triangles around each vertex
+			std::fill( adjacencyOffsets.begin(), adjacencyOffsets.end(), 0u );
+			for( uint32_t i=0; i<numIndices; ++i )
+				++adjacencyOffsets[indices[i] + 1u];
+			for( uint32_t i=0; i<numVertices; ++i )
+				adjacencyOffsets[i + 1u] += adjacencyOffsets[i];
+			adjacency.resize( numIndices );
+			for( uint32_t i=0; i<numIndices; ++i )
+				adjacency[adjacencyOffsets[indices[i]]++] = i / 3u;
+			for( uint32_t i=numVertices; i>0; --i )
+				adjacencyOffsets[i] = adjacencyOffsets[i - 1u];
+			adjacencyOffsets[0] = 0;
+
+			for( uint32_t i=0; i<numVertices; ++i )
+				remap[i] = i;
+			std::fill( touched.begin(), touched.end(), 0u );
+
+			//Each collapse removes 2 triangles (1 on borders). Don't overshoot by much.
+			const uint32_t numTriangles = numIndices / 3u;
+			const uint32_t targetNumTriangles = targetNumIndices / 3u;
+			const uint32_t maxCollapses = (numTriangles - targetNumTriangles) / 2u + 1u;
+			uint32_t numCollapses = 0;
+
+			std::vector<EdgeCollapse>::const_iterator itor = collapses.begin();
+			std::vector<EdgeCollapse>::const_iterator end  = collapses.end();
+
+			while( itor != end && numCollapses < maxCollapses )
+			{
+				const uint32_t src = itor->src;
+				const uint32_t dst = itor->dst;
+
+				if( !touched[src] && !touched[dst] )
+				{
+					//Triangles around src must not flip (nor become slivers) once src moves.
+					bool canCollapse = true;
+					const float *dstPos = positions + dst * 3u;
+					for( uint32_t j=adjacencyOffsets[src];
+						 j<adjacencyOffsets[src + 1u] && canCollapse; ++j )
+					{
+						const uint32_t *triangle = indices + adjacency[j] * 3u;
+						if( triangle[0] == dst || triangle[1] == dst || triangle[2] == dst )
+							continue;
+
+						const float *p[3];
+						const float *newP[3];
+						for( uint32_t k=0; k<3u; ++k )
+						{
+							p[k] = positions + triangle[k] * 3u;
+							newP[k] = triangle[k] == src ? dstPos : p[k];
+						}
+
+						float oldNormal[3], newNormal[3];
+						triangleNormal( p[0], p[1], p[2], oldNormal );
+						triangleNormal( newP[0], newP[1], newP[2], newNormal );
+						const float dot = oldNormal[0] * newNormal[0] + oldNormal[1] * newNormal[1] +
+										  oldNormal[2] * newNormal[2];
+						const float oldLengthSq = oldNormal[0] * oldNormal[0] +
+												  oldNormal[1] * oldNormal[1] +
+												  oldNormal[2] * oldNormal[2];
+						const float newLengthSq = newNormal[0] * newNormal[0] +
+												  newNormal[1] * newNormal[1] +
+												  newNormal[2] * newNormal[2];
+						//cos( angle ) must be above 0.2
+						if( dot <= 0 || dot * dot <= 0.04f * oldLengthSq * newLengthSq )
+							canCollapse = false;
+					}
+
+					if( canCollapse )
+					{
+						remap[src] = dst;
+						quadrics[dst].add( quadrics[src] );
+						errorSq = std::max( errorSq, itor->error );
+						++numCollapses;
+
+						//Neighbours of src can't move this pass, or the flip test would be stale.
+						for( uint32_t j=adjacencyOffsets[src]; j<adjacencyOffsets[src + 1u]; ++j )
+						{
+							const uint32_t *triangle = indices + adjacency[j] * 3u;
+							touched[triangle[0]] = 1u;
+							touched[triangle[1]] = 1u;
+							touched[triangle[2]] = 1u;
+						}
+						touched[dst] = 1u;
+					}
+				}
+
+				++itor;
+			}
+
+			if( !numCollapses )
+				break;
 
-			for( int j=0; j<3; ++j )
+			//Apply the collapses & drop triangles that became degenerate.
+			uint32_t numIndicesLeft = 0;
+			for( uint32_t i=0; i<numIndices; i += 3u )
 			{
-				vPos[j]		= reinterpret_cast<Vector3 * RESTRICT_ALIAS>(
-								dstData + j * bytesPerVertex );
-				vNormal[j]	= reinterpret_cast<Vector3 * RESTRICT_ALIAS>(
-								dstData + sizeof(Ogre::Vector3) + j * bytesPerVertex );
+				const uint32_t v0 = remap[indices[i + 0u]];
+				const uint32_t v1 = remap[indices[i + 1u]];
+				const uint32_t v2 = remap[indices[i + 2u]];
+				if( v0 != v1 && v1 != v2 && v2 != v0 )
+				{
+					if( triangleTags )
+						triangleTags[numIndicesLeft / 3u] = triangleTags[i / 3u];
+					indices[numIndicesLeft + 0u] = v0;
+					indices[numIndicesLeft + 1u] = v1;
+					indices[numIndicesLeft + 2u] = v2;
+					numIndicesLeft += 3u;
+				}
 			}
+			numIndices = numIndicesLeft;
+		}
+
+		*outError = sqrtf( errorSq );
 
-			const ::uint32_t k0 = faces[i].vertexIndex[0];
-			const ::uint32_t k1 = faces[i].vertexIndex[1];
-			const ::uint32_t k2 = faces[i].vertexIndex[2];
+		return numIndices;
+	}
+	//-----------------------------------------------------------------------------------
+	void MeshPatchMap::build( const BlenderFace *faces, uint32_t numFaces, uint32_t numRawVertices,
+							  const uint32_t *vertexConversionLut, uint32_t numGpuVertices )
+	{
+		//Faces that use a flat normal are identified by their face index. Smooth ones
+		//take everything from the raw vertex, so the face they belong to is irrelevant.
+		const uint32_t c_smoothFace = 0xFFFFFFFF;
+
+		faceFirstVertex.resize( numFaces + 1u );
+		gpuVertexFlags.clear();
+		gpuVertexFlags.resize( numGpuVertices, 0 );
+		rawVertexAmbiguous.clear();
+		rawVertexAmbiguous.resize( numRawVertices, 0 );
 
-			const bool useSmooth = (faces[i].materialId & 0x8000) != 0;
+		std::vector<uint32_t> gpuToRaw( numGpuVertices, c_emptySlot );
+		std::vector<uint32_t> gpuToFace( numGpuVertices, c_emptySlot );
 
-			*vPos[0]	= blenderRawVertices[k0].vPos;
-			*vNormal[0]	= useSmooth ? blenderRawVertices[k0].vNormal : faces[i].faceNormal;
-			*vPos[1]	= blenderRawVertices[k1].vPos;
-			*vNormal[1]	= useSmooth ? blenderRawVertices[k1].vNormal : faces[i].faceNormal;
-			*vPos[2]	= blenderRawVertices[k2].vPos;
-			*vNormal[2]	= useSmooth ? blenderRawVertices[k2].vNormal : faces[i].faceNormal;
+		uint32_t deindexedIdx = 0;
+		for( uint32_t i=0; i<numFaces; ++i )
+		{
+			const BlenderFace &face = faces[i];
+			const bool useSmooth = (face.materialId & 0x8000) != 0;
+			const uint32_t faceKey = useSmooth ? c_smoothFace : i;
 
-			*materialIds++ = faces[i].materialId & 0x7FFF;
+			//Same order as VertexUtils::deindex
+			const uint32_t c_quadOrder[6] = { 0, 1, 2, 0, 2, 3 };
+			const uint32_t numCorners = face.numIndicesInFace == 4 ? 6u : 3u;
 
-			dstData += bytesPerVertex * 3u;
+			faceFirstVertex[i] = deindexedIdx;
 
-			if( faces[i].numIndicesInFace == 4 )
+			for( uint32_t j=0; j<numCorners; ++j )
 			{
-				const ::uint32_t k3 = faces[i].vertexIndex[3];
+				const uint32_t rawIdx = face.vertexIndex[c_quadOrder[j]];
+				const uint32_t gpuIdx = vertexConversionLut[deindexedIdx++];
 
-				for( int j=0; j<3; ++j )
+				if( gpuToRaw[gpuIdx] == c_emptySlot )
+				{
+					gpuToRaw[gpuIdx]	= rawIdx;
+					gpuToFace[gpuIdx]	= faceKey;
+					gpuVertexFlags[gpuIdx] = useSmooth ? GpuVertexSmooth : 0;
+				}
+				else if( gpuToRaw[gpuIdx] != rawIdx || gpuToFace[gpuIdx] != faceKey )
 				{
-					vPos[j]		= reinterpret_cast<Vector3 * RESTRICT_ALIAS>(
-									dstData + j * bytesPerVertex );
-					vNormal[j]	= reinterpret_cast<Vector3 * RESTRICT_ALIAS>(
-									dstData + sizeof(Ogre::Vector3) + j * bytesPerVertex );
+					gpuVertexFlags[gpuIdx] |= GpuVertexAmbiguous;
+					rawVertexAmbiguous[rawIdx] = 1u;
+					rawVertexAmbiguous[gpuToRaw[gpuIdx]] = 1u;
 				}
+			}
+		}
 
-				*vPos[0]	= blenderRawVertices[k0].vPos;
-				*vNormal[0]	= useSmooth ? blenderRawVertices[k0].vNormal : faces[i].faceNormal;
-				*vPos[1]	= blenderRawVertices[k2].vPos;
-				*vNormal[1]	= useSmooth ? blenderRawVertices[k2].vNormal : faces[i].faceNormal;
-				*vPos[2]	= blenderRawVertices[k3].vPos;
-				*vNormal[2]	= useSmooth ? blenderRawVertices[k3].vNormal : faces[i].faceNormal;
+		faceFirstVertex[numFaces] = deindexedIdx;
 
-				*materialIds++ = faces[i].materialId & 0x7FFF;
+		//Build the raw -> GPU table (CSR) with a counting sort.
+		rawToGpuOffsets.clear();
+		rawToGpuOffsets.resize( numRawVertices + 1u, 0 );
+		for( uint32_t i=0; i<numGpuVertices; ++i )
+			++rawToGpuOffsets[gpuToRaw[i] + 1u];
+		for( uint32_t i=0; i<numRawVertices; ++i )
+			rawToGpuOffsets[i + 1u] += rawToGpuOffsets[i];
 
-				dstData += bytesPerVertex * 3u;
-			}
-		}
+		rawToGpu.resize( numGpuVertices );
+		std::vector<uint32_t> writeOffsets( rawToGpuOffsets.begin(), rawToGpuOffsets.end() - 1 );
+		for( uint32_t i=0; i<numGpuVertices; ++i )
+			rawToGpu[writeOffsets[gpuToRaw[i]]++] = i;
 	}
-	//-------------------------------------------------------------------------
-	void VertexUtils::deindex( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
-							   const BlenderFace *faces, uint32_t numFaces,
-							   const BlenderFaceColour *facesColour )
+	//-----------------------------------------------------------------------------------
+	void MeshPatchMap::clear()
 	{
-		using namespace Ogre;
-
-		for( ::uint32_t i=0; i<numFaces; ++i )
+		faceFirstVertex.clear();
+		rawToGpuOffsets.clear();
+		rawToGpu.clear();
+		gpuVertexFlags.clear();
+		rawVertexAmbiguous.clear();
+	}
+	//-----------------------------------------------------------------------------------
+	void MeshPatchMap::swap( MeshPatchMap &other )
+	{
+		faceFirstVertex.swap( other.faceFirstVertex );
+		rawToGpuOffsets.swap( other.rawToGpuOffsets );
+		rawToGpu.swap( other.rawToGpu );
+		gpuVertexFlags.swap( other.gpuVertexFlags );
+		rawVertexAmbiguous.swap( other.rawVertexAmbiguous );
+	}
+	//-----------------------------------------------------------------------------------
+	GenerateTangentsTask::GenerateTangentsTask( uint8_t *_vertexData, uint32_t _bytesPerVertex,
+												uint32_t _numVertices, uint32_t _posStride,
+												uint32_t _normalStride, uint32_t _tangentStride,
+												uint32_t _uvStride, uint32_t *_indexData,
+												uint32_t _numIndices, size_t numThreads ) :
+		vertexData( _vertexData ),
+		bytesPerVertex( _bytesPerVertex ),
+		numVertices( _numVertices ),
+		numOutVertices( _numVertices ),
+		posStride( _posStride ),
+		normalStride( _normalStride ),
+		tangentStride( _tangentStride ),
+		uvStride( _uvStride ),
+		indexData( _indexData ),
+		numIndices( _numIndices ),
+		barrier( 0 )
+	{
+		triTangents.resize( numIndices / 3u );
+		triFlags.resize( numIndices / 3u );
+		hashes.resize( numVertices );
+		bucketCorners.resize( numIndices );
+		bucketCounts.resize( numThreads * numThreads, 0 );
+		vertexLeaders.resize( numVertices, c_emptySlot );
+		vertexGroups.resize( numVertices, 0 );
+		threadSplits.resize( numThreads );
+		threadSplitCorners.resize( numThreads );
+		barrier = new Ogre::Barrier( numThreads );
+	}
+	//-----------------------------------------------------------------------------------
+	GenerateTangentsTask::~GenerateTangentsTask()
+	{
+		delete barrier;
+		barrier = 0;
+	}
+	//-----------------------------------------------------------------------------------
+	void GenerateTangentsTask::execute( size_t threadId, size_t numThreads )
+	{
+		TangentVertexLayout layout;
+		layout.vertexData		= vertexData;
+		layout.bytesPerVertex	= bytesPerVertex;
+		layout.posStride		= posStride;
+		layout.normalStride		= normalStride;
+		layout.uvStride			= uvStride;
+
+		uint32_t vertexStart, vertexEnd;
+		uint32_t triStart, triEnd;
+		getTangentThreadRange( threadId, numThreads, numVertices, vertexStart, vertexEnd );
+		getTangentThreadRange( threadId, numThreads, numIndices / 3u, triStart, triEnd );
+
+		//Step 1: Hash our range of vertices, and get the tangent of our range of triangles.
+		for( uint32_t i=vertexStart; i<vertexEnd; ++i )
+			hashes[i] = layout.hash( i );
+		for( uint32_t i=triStart; i<triEnd; ++i )
+			computeTriangleTangent( layout, indexData, i, triTangents[i], triFlags[i] );
+
+		barrier->sync();
+
+		//Step 2: Count how many of our corners go into each bucket.
+		uint32_t * RESTRICT_ALIAS threadBucketCounts = &bucketCounts[threadId * numThreads];
+		for( uint32_t i=triStart * 3u; i<triEnd * 3u; ++i )
+			++threadBucketCounts[(static_cast<uint64_t>( hashes[indexData[i]] ) * numThreads) >> 32u];
+
+		barrier->sync();
+
+		//Step 3: Scatter our corners into their buckets, after those of lower threads.
+		uint32_t bucketStart = 0;
+		uint32_t bucketSize = 0;
 		{
-			uint8_t * RESTRICT_ALIAS diffuseColour[3];
-
-			for( int j=0; j<3; ++j )
+			std::vector<uint32_t> offsets( numThreads, 0 );
+			uint32_t nextBucketStart = 0;
+			for( size_t b=0; b<numThreads; ++b )
 			{
-				diffuseColour[j] = reinterpret_cast<uint8_t * RESTRICT_ALIAS>(
-									dstData + sizeof(Ogre::Vector3) * 2u + j * bytesPerVertex );
-			}
+				if( b == threadId )
+					bucketStart = nextBucketStart;
 
-			diffuseColour[0][0] = static_cast<uint8_t>( facesColour[i].colour[0].x * 255.0f + 0.5f );
-			diffuseColour[0][1] = static_cast<uint8_t>( facesColour[i].colour[0].y * 255.0f + 0.5f );
-			diffuseColour[0][2] = static_cast<uint8_t>( facesColour[i].colour[0].z * 255.0f + 0.5f );
-			diffuseColour[0][3] = 255;
+				offsets[b] = nextBucketStart;
+				for( size_t t=0; t<numThreads; ++t )
+				{
+					if( t < threadId )
+						offsets[b] += bucketCounts[t * numThreads + b];
+					nextBucketStart += bucketCounts[t * numThreads + b];
+				}
 
-			diffuseColour[1][0] = static_cast<uint8_t>( facesColour[i].colour[1].x * 255.0f + 0.5f );
-			diffuseColour[1][1] = static_cast<uint8_t>( facesColour[i].colour[1].y * 255.0f + 0.5f );
-			diffuseColour[1][2] = static_cast<uint8_t>( facesColour[i].colour[1].z * 255.0f + 0.5f );
-			diffuseColour[1][3] = 255;
+				if( b == threadId )
+					bucketSize = nextBucketStart - bucketStart;
+			}
 
-			diffuseColour[2][0] = static_cast<uint8_t>( facesColour[i].colour[2].x * 255.0f + 0.5f );
-			diffuseColour[2][1] = static_cast<uint8_t>( facesColour[i].colour[2].y * 255.0f + 0.5f );
-			diffuseColour[2][2] = static_cast<uint8_t>( facesColour[i].colour[2].z * 255.0f + 0.5f );
-			diffuseColour[2][3] = 255;
+			for( uint32_t i=triStart * 3u; i<triEnd * 3u; ++i )
+			{
+				const size_t bucketIdx =
+						(static_cast<uint64_t>( hashes[indexData[i]] ) * numThreads) >> 32u;
+				bucketCorners[offsets[bucketIdx]++] = i;
+			}
+		}
 
-			dstData += bytesPerVertex * 3u;
+		barrier->sync();
 
-			if( faces[i].numIndicesInFace == 4 )
-			{
-				for( int j=0; j<3; ++j )
-				{
-					diffuseColour[j] = reinterpret_cast<uint8_t * RESTRICT_ALIAS>(
-										dstData + sizeof(Ogre::Vector3) * 2u + j * bytesPerVertex );
-				}
+		//Step 4: Solve the vertices in the bucket we own (bucket index = threadId).
+		//We're the only ones writing to them. Corners that need a split vertex are
+		//remembered, since other threads still read indexData.
+		std::vector<TangentSplit> &splits = threadSplits[threadId];
+		std::vector< std::pair<uint32_t, uint32_t> > &splitCorners = threadSplitCorners[threadId];
+		if( bucketSize )
+		{
+			std::vector<uint32_t> groupedCorners;
+			std::vector<uint32_t> runOffsets;
+			groupTangentCorners( &bucketCorners[bucketStart], bucketSize, layout, indexData,
+								 &hashes[0], &vertexLeaders[0], groupedCorners, runOffsets );
+			solveTangentCorners( groupedCorners, runOffsets, layout, indexData, &triTangents[0],
+								 &triFlags[0], vertexData, tangentStride, &vertexGroups[0],
+								 &splits, &splitCorners );
+		}
 
-				diffuseColour[0][0] = static_cast<uint8_t>( facesColour[i].colour[0].x * 255.0f + 0.5f );
-				diffuseColour[0][1] = static_cast<uint8_t>( facesColour[i].colour[0].y * 255.0f + 0.5f );
-				diffuseColour[0][2] = static_cast<uint8_t>( facesColour[i].colour[0].z * 255.0f + 0.5f );
-				diffuseColour[0][3] = 255;
+		barrier->sync();
 
-				diffuseColour[1][0] = static_cast<uint8_t>( facesColour[i].colour[2].x * 255.0f + 0.5f );
-				diffuseColour[1][1] = static_cast<uint8_t>( facesColour[i].colour[2].y * 255.0f + 0.5f );
-				diffuseColour[1][2] = static_cast<uint8_t>( facesColour[i].colour[2].z * 255.0f + 0.5f );
-				diffuseColour[1][3] = 255;
+		//Step 5: Prefix sum to know where our split vertices start, then append them.
+		{
+			uint32_t dstIdx = numVertices;
+			for( size_t t=0; t<threadId; ++t )
+				dstIdx += static_cast<uint32_t>( threadSplits[t].size() );
 
-				diffuseColour[2][0] = static_cast<uint8_t>( facesColour[i].colour[3].x * 255.0f + 0.5f );
-				diffuseColour[2][1] = static_cast<uint8_t>( facesColour[i].colour[3].y * 255.0f + 0.5f );
-				diffuseColour[2][2] = static_cast<uint8_t>( facesColour[i].colour[3].z * 255.0f + 0.5f );
-				diffuseColour[2][3] = 255;
+			for( size_t i=0; i<splits.size(); ++i )
+			{
+				uint8_t *dstVertex = vertexData + (dstIdx + i) * bytesPerVertex;
+				memcpy( dstVertex, vertexData + splits[i].srcVertex * bytesPerVertex,
+						bytesPerVertex );
+				memcpy( dstVertex + tangentStride, &splits[i].tangent, sizeof(Ogre::Vector3) );
+				memcpy( dstVertex + tangentStride + sizeof(Ogre::Vector3), &splits[i].parity,
+						sizeof(float) );
+			}
 
-				dstData += bytesPerVertex * 3u;
+			std::vector< std::pair<uint32_t, uint32_t> >::const_iterator itor = splitCorners.begin();
+			std::vector< std::pair<uint32_t, uint32_t> >::const_iterator end  = splitCorners.end();
+			while( itor != end )
+			{
+				indexData[itor->first] = dstIdx + itor->second;
+				++itor;
 			}
+
+			if( threadId == numThreads - 1u )
+				numOutVertices = dstIdx + static_cast<uint32_t>( splits.size() );
 		}
 	}
-	//-------------------------------------------------------------------------
-	void VertexUtils::deindex( uint8_t * RESTRICT_ALIAS dstData, uint32_t bytesPerVertex,
-							   const BlenderFace *faces, uint32_t numFaces,
-							   const BlenderFaceUv *faceUv, uint32_t uvStride )
+	//-----------------------------------------------------------------------------------
+	ShrinkVertexBufferTask::ShrinkVertexBufferTask( const uint8_t *_srcVertexData,
+													uint8_t *_dstVertexData,
+													uint32_t _bytesPerVertex, uint32_t _numVertices,
+													Ogre::FastArray<uint32_t> *_vertexConversionLut,
+													size_t numThreads ) :
+		srcVertexData( _srcVertexData ),
+		dstVertexData( _dstVertexData ),
+		bytesPerVertex( _bytesPerVertex ),
+		numVertices( _numVertices ),
+		numUniqueVertices( 0 ),
+		vertexConversionLut( _vertexConversionLut ),
+		barrier( 0 )
 	{
-		using namespace Ogre;
+		assert( srcVertexData != dstVertexData );
+
+		vertexConversionLut->resize( numVertices );
+		hashes.resize( numVertices );
+		leaders.resize( numVertices );
+		bucketVertices.resize( numVertices );
+		bucketCounts.resize( numThreads * numThreads, 0 );
+		uniqueCounts.resize( numThreads, 0 );
+		barrier = new Ogre::Barrier( numThreads );
+	}
+	//-----------------------------------------------------------------------------------
+	ShrinkVertexBufferTask::~ShrinkVertexBufferTask()
+	{
+		delete barrier;
+		barrier = 0;
+	}
+	//-----------------------------------------------------------------------------------
+	void ShrinkVertexBufferTask::getThreadRange( size_t threadId, size_t numThreads,
+												 uint32_t &outStart, uint32_t &outEnd ) const
+	{
+		const uint32_t numVertsPerThread = Ogre::alignToNextMultiple( numVertices,
+																	  numThreads ) / numThreads;
+		outStart = std::min<uint32_t>( numVertices, threadId * numVertsPerThread );
+		outEnd = std::min<uint32_t>( numVertices, outStart + numVertsPerThread );
+	}
+	//-----------------------------------------------------------------------------------
+	void ShrinkVertexBufferTask::execute( size_t threadId, size_t numThreads )
+	{
+		uint32_t vertexStart, vertexEnd;
+		getThreadRange( threadId, numThreads, vertexStart, vertexEnd );
 
-		for( ::uint32_t i=0; i<numFaces; ++i )
+		uint32_t * RESTRICT_ALIAS threadBucketCounts = &bucketCounts[threadId * numThreads];
+
+		//Step 1: Hash our range of vertices and count how many go into each bucket.
+		for( uint32_t i=vertexStart; i<vertexEnd; ++i )
+		{
+			const uint32_t hash = hashVertex( srcVertexData + i * bytesPerVertex, bytesPerVertex );
+			hashes[i] = hash;
+			++threadBucketCounts[(static_cast<uint64_t>( hash ) * numThreads) >> 32u];
+		}
+
+		barrier->sync();
+
+		//Step 2: Scatter our vertex indices into their buckets. Buckets are laid out
+		//contiguously, and within a bucket our vertices go after those of lower threads,
+		//so that each bucket stays sorted by vertex index.
 		{
-			Vector2 * RESTRICT_ALIAS uv[3];
+			std::vector<uint32_t> offsets( numThreads, 0 );
+			uint32_t bucketStart = 0;
+			for( size_t b=0; b<numThreads; ++b )
+			{
+				offsets[b] = bucketStart;
+				for( size_t t=0; t<numThreads; ++t )
+				{
+					if( t < threadId )
+						offsets[b] += bucketCounts[t * numThreads + b];
+					bucketStart += bucketCounts[t * numThreads + b];
+				}
+			}
+
+			for( uint32_t i=vertexStart; i<vertexEnd; ++i )
+			{
+				const size_t bucketIdx = (static_cast<uint64_t>( hashes[i] ) * numThreads) >> 32u;
+				bucketVertices[offsets[bucketIdx]++] = i;
+			}
+		}
 
-			for( int j=0; j<3; ++j )
+		barrier->sync();
+
+		//Step 3: Weld the vertices in the bucket we own (bucket index = threadId).
+		{
+			uint32_t bucketStart = 0;
+			uint32_t bucketSize = 0;
+			for( size_t b=0; b<=threadId; ++b )
 			{
-				uv[j] = reinterpret_cast<Vector2 * RESTRICT_ALIAS>(
-							dstData + uvStride + j * bytesPerVertex );
+				bucketStart += bucketSize;
+				bucketSize = 0;
+				for( size_t t=0; t<numThreads; ++t )
+					bucketSize += bucketCounts[t * numThreads + b];
 			}
 
-			//Copy UVs, mirroring V.
-			uv[0]->x = faceUv[i].uv[0].x;
-			uv[0]->y = 1.0f - faceUv[i].uv[0].y;
-			uv[1]->x = faceUv[i].uv[1].x;
-			uv[1]->y = 1.0f - faceUv[i].uv[1].y;
-			uv[2]->x = faceUv[i].uv[2].x;
-			uv[2]->y = 1.0f - faceUv[i].uv[2].y;
+			uint32_t tableSize = 1u;
+			while( tableSize < bucketSize * 2u )
+				tableSize <<= 1u;
+			const uint32_t tableMask = tableSize - 1u;
 
-			dstData += bytesPerVertex * 3u;
+			std::vector<uint32_t> slots( tableSize, c_emptySlot );
 
-			if( faces[i].numIndicesInFace == 4 )
+			for( uint32_t j=bucketStart; j<bucketStart + bucketSize; ++j )
 			{
-				for( int j=0; j<3; ++j )
+				const uint32_t vertexIdx = bucketVertices[j];
+				const uint32_t hash = hashes[vertexIdx];
+				const uint8_t *srcVertex = srcVertexData + vertexIdx * bytesPerVertex;
+
+				uint32_t slotIdx = hash & tableMask;
+				while( slots[slotIdx] != c_emptySlot &&
+					   (hashes[slots[slotIdx]] != hash ||
+						memcmp( srcVertexData + slots[slotIdx] * bytesPerVertex,
+								srcVertex, bytesPerVertex ) != 0) )
 				{
-					uv[j] = reinterpret_cast<Vector2 * RESTRICT_ALIAS>(
-								dstData + uvStride + j * bytesPerVertex );
+					slotIdx = (slotIdx + 1u) & tableMask;
 				}
 
-				uv[0]->x = faceUv[i].uv[0].x;
-				uv[0]->y = 1.0f - faceUv[i].uv[0].y;
-				uv[1]->x = faceUv[i].uv[2].x;
-				uv[1]->y = 1.0f - faceUv[i].uv[2].y;
-				uv[2]->x = faceUv[i].uv[3].x;
-				uv[2]->y = 1.0f - faceUv[i].uv[3].y;
-
-				dstData += bytesPerVertex * 3u;
+				if( slots[slotIdx] == c_emptySlot )
+					slots[slotIdx] = vertexIdx;
+				leaders[vertexIdx] = slots[slotIdx];
 			}
 		}
-	}
-	//-------------------------------------------------------------------------
-	uint32_t VertexUtils::shrinkVertexBuffer( uint8_t *vertexData,
-											  Ogre::FastArray<uint32_t> &vertexConversionLutArg,
-											  uint32_t bytesPerVertex,
-											  uint32_t numVertices )
-	{
-		//Mark duplicated vertices as such.
-		//Swap the internal pointer to a local version of the
-		//array to allow compiler optimizations (otherwise the
-		//compiler can't know if vertexConversionLutArg.mSize
-		//and co. may change after every non-trivial call)
-		Ogre::FastArray<uint32_t> vertexConversionLut;
-		vertexConversionLut.swap( vertexConversionLutArg );
 
-		vertexConversionLut.resize( numVertices );
-		for( uint32_t i=0; i<numVertices; ++i )
-			vertexConversionLut[i] = i;
+		barrier->sync();
 
-		for( uint32_t i=0; i<numVertices; ++i )
+		//Step 4: Count the unique vertices in our range
+		{
+			uint32_t numUnique = 0;
+			for( uint32_t i=vertexStart; i<vertexEnd; ++i )
+				numUnique += leaders[i] == i ? 1u : 0u;
+			uniqueCounts[threadId] = numUnique;
+		}
+
+		barrier->sync();
+
+		//Step 5: Prefix sum to know where our unique vertices start, then compact them.
+		Ogre::FastArray<uint32_t> &lut = *vertexConversionLut;
 		{
-			for( uint32_t j=i+1; j<numVertices; ++j )
+			uint32_t dstIdx = 0;
+			for( size_t t=0; t<threadId; ++t )
+				dstIdx += uniqueCounts[t];
+
+			for( uint32_t i=vertexStart; i<vertexEnd; ++i )
 			{
-				if( vertexConversionLut[j] == j )
+				if( leaders[i] == i )
 				{
-					if( memcmp( vertexData + i * bytesPerVertex,
-								vertexData + j * bytesPerVertex,
-								bytesPerVertex ) == 0 )
-					{
-						vertexConversionLut[j] = i;
-					}
+					memcpy( dstVertexData + dstIdx * bytesPerVertex,
+							srcVertexData + i * bytesPerVertex, bytesPerVertex );
+					lut[i] = dstIdx++;
 				}
 			}
+
+			if( threadId == numThreads - 1u )
+				numUniqueVertices = dstIdx;
 		}
 
-		uint32_t newNumVertices = numVertices;
+		barrier->sync();
 
-		//Remove the duplicated vertices, iterating in reverse order for lower algorithmic complexity.
-		for( uint32_t i=numVertices; --i; )
+		//Step 6: Duplicates point to wherever their leader ended up.
+		for( uint32_t i=vertexStart; i<vertexEnd; ++i )
 		{
-			if( vertexConversionLut[i] != i )
-			{
-				--newNumVertices;
-				memmove( vertexData + i * bytesPerVertex,
-						 vertexData + (i+1) * bytesPerVertex,
-						 (newNumVertices - i) * bytesPerVertex );
-			}
+			if( leaders[i] != i )
+				lut[i] = lut[leaders[i]];
 		}
+	}
+	//-----------------------------------------------------------------------------------
+	ReweldVertexBufferTask::ReweldVertexBufferTask( const uint8_t *_srcVertexData,
+													uint8_t *_dstVertexData,
+													uint32_t _bytesPerVertex, uint32_t _numVertices,
+													const uint32_t *_vertexConversionLut,
+													size_t numThreads ) :
+		srcVertexData( _srcVertexData ),
+		dstVertexData( _dstVertexData ),
+		bytesPerVertex( _bytesPerVertex ),
+		numVertices( _numVertices ),
+		numUniqueVertices( 0 ),
+		vertexConversionLut( _vertexConversionLut ),
+		barrier( 0 )
+	{
+		assert( srcVertexData != dstVertexData );
 
-		//vertexConversionLut.resize( numVertices );
-		//The table is outdated because some vertices have shifted. Example:
-		//Before:
-		//Vertices 0 & 5 were unique, 8 vertices:
-		//  0000 5555
-		//But now vertex 5 has become vertex 1. We need the table to say:
-		//  0000 1111
-		uint32_t numUniqueVerts = 0;
-		for( uint32_t i=0; i<numVertices; ++i )
+		threadMaxUnique.resize( numThreads, 0 );
+		bucketVertices.resize( numVertices );
+		bucketCounts.resize( numThreads * numThreads, 0 );
+		threadMismatches.resize( numThreads, 0 );
+		barrier = new Ogre::Barrier( numThreads );
+	}
+	//-----------------------------------------------------------------------------------
+	ReweldVertexBufferTask::~ReweldVertexBufferTask()
+	{
+		delete barrier;
+		barrier = 0;
+	}
+	//-----------------------------------------------------------------------------------
+	void ReweldVertexBufferTask::getThreadRange( size_t threadId, size_t numThreads,
+												 uint32_t &outStart, uint32_t &outEnd ) const
+	{
+		const uint32_t numVertsPerThread = Ogre::alignToNextMultiple( numVertices,
+																	  numThreads ) / numThreads;
+		outStart = std::min<uint32_t>( numVertices, threadId * numVertsPerThread );
+		outEnd = std::min<uint32_t>( numVertices, outStart + numVertsPerThread );
+	}
+	//-----------------------------------------------------------------------------------
+	uint32_t ReweldVertexBufferTask::getNumUniqueVertices() const
+	{
+		std::vector<uint8_t>::const_iterator itor = threadMismatches.begin();
+		std::vector<uint8_t>::const_iterator end  = threadMismatches.end();
+		while( itor != end )
 		{
-			if( vertexConversionLut[i] == i )
-				vertexConversionLut[i] = numUniqueVerts++;
-			else
-				vertexConversionLut[i] = vertexConversionLut[vertexConversionLut[i]];
+			if( *itor++ )
+				return 0;
 		}
 
-		vertexConversionLut.swap( vertexConversionLutArg );
-
-		assert( newNumVertices == numUniqueVerts );
-
-		return newNumVertices;
+		return numUniqueVertices;
 	}
 	//-----------------------------------------------------------------------------------
-	void VertexUtils::generateTangents( uint8_t *vertexData, uint32_t bytesPerVertex,
-										uint32_t numVertices, uint32_t posStride, uint32_t normalStride,
-										uint32_t tangentStride, uint32_t uvStride )
+	void ReweldVertexBufferTask::execute( size_t threadId, size_t numThreads )
 	{
-		using namespace Ogre;
-		for( ::uint32_t i=0; i<numVertices; i += 3 )
-		{
-			//Lengyel's Method, it is fast and simple. Also we don't need to care about duplicating
-			//vertices due to parity discontinuities or averaging tangents that are too different
-			//since the input assumes 3 vertices per triangle.
-			Vector3 const * RESTRICT_ALIAS vPos[3];
-			Vector3 const * RESTRICT_ALIAS vNormal[3];
-			Vector2 const * RESTRICT_ALIAS uv[3];
-			Vector3 * RESTRICT_ALIAS vTangent[3];
-			float * RESTRICT_ALIAS fParity[3];
-
-			for( int j=0; j<3; ++j )
-			{
-				vPos[j] = reinterpret_cast<Vector3 const * RESTRICT_ALIAS>(
-							vertexData + posStride + j * bytesPerVertex );
-				vNormal[j] = reinterpret_cast<Vector3 const * RESTRICT_ALIAS>(
-							vertexData + normalStride + j * bytesPerVertex );
-				uv[j] = reinterpret_cast<Vector2 const * RESTRICT_ALIAS>(
-							vertexData + uvStride + j * bytesPerVertex );
-				vTangent[j] = reinterpret_cast<Vector3 * RESTRICT_ALIAS>(
-							vertexData + tangentStride + j * bytesPerVertex );
-				fParity[j] = reinterpret_cast<float * RESTRICT_ALIAS>(
-							vertexData + tangentStride + sizeof(Vector3) + j * bytesPerVertex );
-			}
-
-			const Vector2 deltaUV1 = *uv[1] - *uv[0];
-			const Vector2 deltaUV2 = *uv[2] - *uv[0];
-			const Vector3 deltaPos1 = *vPos[1] - *vPos[0];
-			const Vector3 deltaPos2 = *vPos[2] - *vPos[0];
-
-			// face normal
-			Vector3 tsN = deltaPos1.crossProduct(deltaPos2);
-			tsN.normalise();
-
-			const Real uvarea = deltaUV1.crossProduct(deltaUV2);
-			if( Math::RealEqual(uvarea, 0.0f) )
-			{
-				// no tangent, null uv area
-				*vTangent[0] = *vTangent[1] = *vTangent[2] = Vector3::ZERO;
-			}
-			else
-			{
-				// Normalise by uvarea
-				const Real a =  deltaUV2.y / uvarea;
-				const Real b = -deltaUV1.y / uvarea;
-				const Real c = -deltaUV2.x / uvarea;
-				const Real d =  deltaUV1.x / uvarea;
+		uint32_t vertexStart, vertexEnd;
+		getThreadRange( threadId, numThreads, vertexStart, vertexEnd );
+
+		const uint32_t * RESTRICT_ALIAS lut = vertexConversionLut;
 
-				const Vector3 tsU = (deltaPos1 * a) + (deltaPos2 * b);
-				const Vector3 tsV = (deltaPos1 * c) + (deltaPos2 * d);
+		//Step 1: Find out how many unique vertices the LUT welds into.
+		{
+			uint32_t maxUnique = 0;
+			for( uint32_t i=vertexStart; i<vertexEnd; ++i )
+				maxUnique = std::max( maxUnique, lut[i] );
+			threadMaxUnique[threadId] = maxUnique;
+		}
 
-				// Gram-Schmidt orthogonalize
-				*vTangent[0] = (tsU - (*vNormal[0]) * vNormal[0]->dotProduct( tsU )).normalisedCopy();
-				*vTangent[1] = (tsU - (*vNormal[1]) * vNormal[1]->dotProduct( tsU )).normalisedCopy();
-				*vTangent[2] = (tsU - (*vNormal[2]) * vNormal[2]->dotProduct( tsU )).normalisedCopy();
+		barrier->sync();
 
-				//Calculate handedness
-				const float parity = tsN.crossProduct(tsU).dotProduct(tsV) < 0.0f ? -1.0f : 1.0f;
-				*fParity[0] = parity;
-				*fParity[1] = parity;
-				*fParity[2] = parity;
-			}
+		uint32_t numUnique = 0;
+		for( size_t t=0; t<numThreads; ++t )
+			numUnique = std::max( numUnique, threadMaxUnique[t] + 1u );
 
-			vertexData += bytesPerVertex * 3;
+		//All threads agree on this, so they all leave before the next sync.
+		if( numVertices == 0 || numUnique > numVertices )
+		{
+			threadMismatches[threadId] = 1u;
+			return;
 		}
-	}
-	//-----------------------------------------------------------------------------------
-	void VertexUtils::generateTanUV( const uint8_t *vertexData, const uint32_t *indexData,
-									 uint32_t bytesPerVertex, uint32_t numVertices, uint32_t numIndices,
-									 uint32_t posStride, uint32_t normalStride, uint32_t tangentStride,
-									 uint32_t uvStride, Ogre::Vector3 * RESTRICT_ALIAS outData )
-	{
-		using namespace Ogre;
 
-		Vector3 * RESTRICT_ALIAS tsUs = outData;
-		Vector3 * RESTRICT_ALIAS tsVs = outData + numVertices;
+		//Step 2: Count how many of our vertices go into each bucket. The bucket
+		//of a vertex is the thread that owns the unique vertex it welds into.
+		uint32_t * RESTRICT_ALIAS threadBucketCounts = &bucketCounts[threadId * numThreads];
+		for( uint32_t i=vertexStart; i<vertexEnd; ++i )
+			++threadBucketCounts[(static_cast<uint64_t>( lut[i] ) * numThreads) / numUnique];
 
-		for( ::uint32_t i=0; i<numIndices; i += 3 )
+		if( threadId == 0 )
+			representatives.resize( numUnique, c_emptySlot );
+
+		barrier->sync();
+
+		//Step 3: Scatter our vertex indices into their buckets (see ShrinkVertexBufferTask).
 		{
-			//Lengyel's Method, it is fast and simple. Also we don't need to care about duplicating
-			//vertices due to parity discontinuities or averaging tangents that are too different
-			//since the input assumes 3 vertices per triangle.
-			Vector3 const * RESTRICT_ALIAS vPos[3];
-			Vector3 const * RESTRICT_ALIAS vNormal[3];
-			Vector2 const * RESTRICT_ALIAS uv[3];
+			std::vector<uint32_t> offsets( numThreads, 0 );
+			uint32_t bucketStart = 0;
+			for( size_t b=0; b<numThreads; ++b )
+			{
+				offsets[b] = bucketStart;
+				for( size_t t=0; t<numThreads; ++t )
+				{
+					if( t < threadId )
+						offsets[b] += bucketCounts[t * numThreads + b];
+					bucketStart += bucketCounts[t * numThreads + b];
+				}
+			}
 
-			for( int j=0; j<3; ++j )
+			for( uint32_t i=vertexStart; i<vertexEnd; ++i )
 			{
-				vPos[j] = reinterpret_cast<Vector3 const * RESTRICT_ALIAS>(
-							vertexData + posStride + indexData[i+j] * bytesPerVertex );
-				vNormal[j] = reinterpret_cast<Vector3 const * RESTRICT_ALIAS>(
-							vertexData + normalStride + indexData[i+j] * bytesPerVertex );
-				uv[j] = reinterpret_cast<Vector2 const * RESTRICT_ALIAS>(
-							vertexData + uvStride + indexData[i+j] * bytesPerVertex );
+				const size_t bucketIdx = (static_cast<uint64_t>( lut[i] ) * numThreads) /
+										 numUnique;
+				bucketVertices[offsets[bucketIdx]++] = i;
 			}
+		}
 
-			const Vector2 deltaUV1 = *uv[1] - *uv[0];
-			const Vector2 deltaUV2 = *uv[2] - *uv[0];
-			const Vector3 deltaPos1 = *vPos[1] - *vPos[0];
-			const Vector3 deltaPos2 = *vPos[2] - *vPos[0];
+		barrier->sync();
 
-			// face normal
-			Vector3 tsN = deltaPos1.crossProduct(deltaPos2);
-			tsN.normalise();
+		//Step 4: Weld the vertices in the bucket we own, checking they're all still
+		//equal to the first one, which is the one that gets copied.
+		{
+			uint32_t bucketStart = 0;
+			uint32_t bucketSize = 0;
+			for( size_t b=0; b<=threadId; ++b )
+			{
+				bucketStart += bucketSize;
+				bucketSize = 0;
+				for( size_t t=0; t<numThreads; ++t )
+					bucketSize += bucketCounts[t * numThreads + b];
+			}
 
-			const Real uvarea = deltaUV1.crossProduct(deltaUV2);
-			if( !Math::RealEqual(uvarea, 0.0f) )
+			//Unique vertices we own: [ceil( threadId * numUnique / numThreads ); ceil( ... ))
+			const uint32_t uniqueStart = static_cast<uint32_t>(
+						(threadId * static_cast<uint64_t>( numUnique ) + numThreads - 1u) /
+						numThreads );
+			const uint32_t uniqueEnd = static_cast<uint32_t>(
+						((threadId + 1u) * static_cast<uint64_t>( numUnique ) + numThreads - 1u) /
+						numThreads );
+
+			uint32_t numRepresentatives = 0;
+			bool mismatch = false;
+			for( uint32_t j=bucketStart; j<bucketStart + bucketSize && !mismatch; ++j )
 			{
-				// Normalise by uvarea
-				const Real a =  deltaUV2.y / uvarea;
-				const Real b = -deltaUV1.y / uvarea;
-				const Real c = -deltaUV2.x / uvarea;
-				const Real d =  deltaUV1.x / uvarea;
+				const uint32_t vertexIdx = bucketVertices[j];
+				const uint32_t uniqueIdx = lut[vertexIdx];
+				const uint8_t *srcVertex = srcVertexData + vertexIdx * bytesPerVertex;
+
+				if( representatives[uniqueIdx] == c_emptySlot )
+				{
+					representatives[uniqueIdx] = vertexIdx;
+					memcpy( dstVertexData + uniqueIdx * bytesPerVertex, srcVertex,
+							bytesPerVertex );
+					++numRepresentatives;
+				}
+				else
+				{
+					mismatch = memcmp( srcVertexData + representatives[uniqueIdx] * bytesPerVertex,
+									   srcVertex, bytesPerVertex ) != 0;
+				}
+			}
 
-				const Vector3 tsU = (deltaPos1 * a) + (deltaPos2 * b);
-				const Vector3 tsV = (deltaPos1 * c) + (deltaPos2 * d);
+			threadMismatches[threadId] = mismatch ||
+										 numRepresentatives != uniqueEnd - uniqueStart;
+			if( threadId == 0 )
+				numUniqueVertices = numUnique;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void CompactVerticesTask::execute( size_t threadId, size_t numThreads )
+	{
+		const uint32_t numVerticesPerThread = Ogre::alignToNextMultiple( numVertices,
+																		 numThreads ) / numThreads;
 
-				uint32_t idx = indexData[i+0];
-				tsUs[idx] += tsU;
-				tsVs[idx] += tsV;
+		//If we've got 4 threads and 2 vertices, threads 2 & 3 need
+		//to process 0 vertices: Make sure we don't overflow.
+		uint32_t verticesToProcess = numVertices - std::min<uint32_t>( numVertices,
+																	   threadId * numVerticesPerThread );
+		verticesToProcess = std::min( numVerticesPerThread, verticesToProcess );
+
+		const size_t firstVertex = threadId * numVerticesPerThread;
+		VertexUtils::compactVertices( dstData + firstVertex * dstBytesPerVertex, dstBytesPerVertex,
+									  srcData + firstVertex * srcBytesPerVertex, srcBytesPerVertex,
+									  verticesToProcess, halfPositions, hasColour, numUVs,
+									  hasTangents );
+	}
+	//-----------------------------------------------------------------------------------
+	SplitSubMeshesTask::SplitSubMeshesTask( const uint16_t *_materialIds, uint32_t _numTriangles,
+											const uint32_t *_vertexConversionLut,
+											bool _use32BitIndices,
+											std::vector<uint16_t> *_uniqueMaterials,
+											std::vector<SubMeshIndices> *_indices,
+											size_t numThreads ) :
+		materialIds( _materialIds ),
+		numTriangles( _numTriangles ),
+		vertexConversionLut( _vertexConversionLut ),
+		use32BitIndices( _use32BitIndices ),
+		uniqueMaterials( _uniqueMaterials ),
+		indices( _indices ),
+		threadCounts( numThreads ),
+		threadMaterials( numThreads ),
+		barrier( 0 )
+	{
+		uniqueMaterials->clear();
+		indices->clear();
+		barrier = new Ogre::Barrier( numThreads );
+	}
+	//-----------------------------------------------------------------------------------
+	SplitSubMeshesTask::~SplitSubMeshesTask()
+	{
+		delete barrier;
+		barrier = 0;
+	}
+	//-----------------------------------------------------------------------------------
+	void SplitSubMeshesTask::getThreadRange( size_t threadId, size_t numThreads,
+											 uint32_t &outStart, uint32_t &outEnd ) const
+	{
+		const uint32_t numTrisPerThread = Ogre::alignToNextMultiple( numTriangles,
+																	 numThreads ) / numThreads;
+		outStart = std::min<uint32_t>( numTriangles, threadId * numTrisPerThread );
+		outEnd = std::min<uint32_t>( numTriangles, outStart + numTrisPerThread );
+	}
+	//-----------------------------------------------------------------------------------
+	void SplitSubMeshesTask::allocateSubMeshes( size_t numThreads )
+	{
+		//Materials are numbered in the order they first appear. Since thread ranges are
+		//sorted, going through each thread's materials in order gives the global order.
+		for( size_t t=0; t<numThreads; ++t )
+		{
+			std::vector<uint16_t>::const_iterator itor = threadMaterials[t].begin();
+			std::vector<uint16_t>::const_iterator end  = threadMaterials[t].end();
+			while( itor != end )
+			{
+				if( *itor >= materialToSubMesh.size() )
+					materialToSubMesh.resize( *itor + 1u, 0xFFFF );
+				if( materialToSubMesh[*itor] == 0xFFFF )
+				{
+					materialToSubMesh[*itor] = static_cast<uint16_t>( uniqueMaterials->size() );
+					uniqueMaterials->push_back( *itor );
+				}
+				++itor;
+			}
+		}
 
-				idx = indexData[i+1];
-				tsUs[idx] += tsU;
-				tsVs[idx] += tsV;
+		const size_t numSubMeshes = uniqueMaterials->size();
+		const size_t bytesPerIndex = use32BitIndices ? sizeof(uint32_t) : sizeof(uint16_t);
 
-				idx = indexData[i+2];
-				tsUs[idx] += tsU;
-				tsVs[idx] += tsV;
+		//Each thread writes its triangles after those of the threads before it.
+		threadOffsets.resize( numThreads * numSubMeshes );
+		indices->resize( numSubMeshes );
+		for( size_t i=0; i<numSubMeshes; ++i )
+		{
+			const uint16_t materialId = (*uniqueMaterials)[i];
+			uint32_t numIndices = 0;
+			for( size_t t=0; t<numThreads; ++t )
+			{
+				threadOffsets[t * numSubMeshes + i] = numIndices;
+				if( materialId < threadCounts[t].size() )
+					numIndices += threadCounts[t][materialId] * 3u;
 			}
+
+			SubMeshIndices &subMeshIndices = (*indices)[i];
+			subMeshIndices.numIndices = numIndices;
+			subMeshIndices.data = OGRE_MALLOC_SIMD( numIndices * bytesPerIndex,
+													Ogre::MEMCATEGORY_GEOMETRY );
 		}
 	}
 	//-----------------------------------------------------------------------------------
-	void VertexUtils::generateTangetsMergeTUV( uint8_t *vertexData, uint32_t bytesPerVertex,
-											   uint32_t numVertices, uint32_t normalStride,
-											   uint32_t tangentStride,
-											   Ogre::Vector3 * RESTRICT_ALIAS inOutUvBuffer,
-											   size_t numThreads )
+	template <typename T>
+	void SplitSubMeshesTask::scatter( uint32_t triStart, uint32_t triEnd,
+									  const uint32_t *offsets )
 	{
-		using namespace Ogre;
+		const size_t numSubMeshes = indices->size();
 
-		Vector3 * RESTRICT_ALIAS tsUs = inOutUvBuffer;
-		Vector3 * RESTRICT_ALIAS tsVs = inOutUvBuffer + numVertices;
+		std::vector<T*> dst( numSubMeshes );
+		for( size_t i=0; i<numSubMeshes; ++i )
+			dst[i] = reinterpret_cast<T*>( (*indices)[i].data ) + offsets[i];
 
-		for( ::uint32_t i=0; i<numVertices; ++i )
+		const uint32_t * RESTRICT_ALIAS lut = vertexConversionLut + triStart * 3u;
+		for( uint32_t i=triStart; i<triEnd; ++i )
+		{
+			T* &subMeshDst = dst[materialToSubMesh[materialIds[i]]];
+			subMeshDst[0] = static_cast<T>( lut[0] );
+			subMeshDst[1] = static_cast<T>( lut[1] );
+			subMeshDst[2] = static_cast<T>( lut[2] );
+			subMeshDst += 3u;
+			lut += 3u;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	void SplitSubMeshesTask::execute( size_t threadId, size_t numThreads )
+	{
+		uint32_t triStart, triEnd;
+		getThreadRange( threadId, numThreads, triStart, triEnd );
+
+		//Step 1: Count the triangles of each material in our range.
 		{
-			for( size_t j=1; j<numThreads; ++j )
+			std::vector<uint32_t> &counts = threadCounts[threadId];
+			std::vector<uint16_t> &materials = threadMaterials[threadId];
+			for( uint32_t i=triStart; i<triEnd; ++i )
 			{
-				//Merge the tsU & tsV vectors calculated by the other threads for these same vertices
-				tsUs[i] += inOutUvBuffer[i + numVertices * 2u * j];
-				tsVs[i] += inOutUvBuffer[i + numVertices * 2u * j + numVertices];
+				const uint16_t materialId = materialIds[i];
+				if( materialId >= counts.size() )
+					counts.resize( materialId + 1u, 0 );
+				if( counts[materialId]++ == 0 )
+					materials.push_back( materialId );
 			}
+		}
 
-			Vector3 const * RESTRICT_ALIAS vNormal;
-			Vector3 * RESTRICT_ALIAS vTangent;
-			float * RESTRICT_ALIAS fParity;
+		barrier->sync();
 
-			vNormal		= reinterpret_cast<Vector3 const * RESTRICT_ALIAS>( vertexData + normalStride );
-			vTangent	= reinterpret_cast<Vector3 * RESTRICT_ALIAS>( vertexData + tangentStride );
-			fParity		= reinterpret_cast<float * RESTRICT_ALIAS>( vertexData +
-																	tangentStride + sizeof(Vector3) );
+		//Step 2: Assign submeshes and allocate their exact size.
+		if( threadId == 0 )
+			allocateSubMeshes( numThreads );
 
-			// Gram-Schmidt orthogonalize
-			*vTangent = (tsUs[i] - (*vNormal) * vNormal->dotProduct( tsUs[i] )).normalisedCopy();
+		barrier->sync();
 
-			//Calculate handedness
-			*fParity = vNormal->crossProduct(tsUs[i]).dotProduct(tsVs[i]) < 0.0f ? -1.0f : 1.0f;
+		//Step 3: Write our triangles into each submesh.
+		const size_t numSubMeshes = indices->size();
+		if( numSubMeshes == 0 )
+			return;
 
-			vertexData += bytesPerVertex;
-		}
+		const uint32_t *offsets = &threadOffsets[threadId * numSubMeshes];
+		if( use32BitIndices )
+			scatter<uint32_t>( triStart, triEnd, offsets );
+		else
+			scatter<uint16_t>( triStart, triEnd, offsets );
 	}
 	//-----------------------------------------------------------------------------------
-	void GenerateTangentsTask::execute( size_t threadId, size_t numThreads )
+	OptimizeVertexCacheTask::OptimizeVertexCacheTask( std::vector<SubMeshIndices> *_indices,
+													  bool _use32BitIndices,
+													  const uint8_t *_srcVertexData,
+													  uint8_t *_dstVertexData,
+													  uint32_t _bytesPerVertex,
+													  uint32_t _numVertices,
+													  Ogre::FastArray<uint32_t> *_vertexConversionLut,
+													  size_t numThreads ) :
+		indices( _indices ),
+		use32BitIndices( _use32BitIndices ),
+		srcVertexData( _srcVertexData ),
+		dstVertexData( _dstVertexData ),
+		bytesPerVertex( _bytesPerVertex ),
+		numVertices( _numVertices ),
+		vertexConversionLut( _vertexConversionLut ),
+		barrier( 0 )
+	{
+		assert( srcVertexData != dstVertexData );
+		vertexRemap.resize( numVertices, c_emptySlot );
+		barrier = new Ogre::Barrier( numThreads );
+	}
+	//-----------------------------------------------------------------------------------
+	OptimizeVertexCacheTask::~OptimizeVertexCacheTask()
+	{
+		delete barrier;
+		barrier = 0;
+	}
+	//-----------------------------------------------------------------------------------
+	void OptimizeVertexCacheTask::getChunk( const SubMeshIndices &subMesh, size_t threadId,
+											size_t numThreads, uint32_t &outStart,
+											uint32_t &outEnd ) const
+	{
+		//Chunks that are too small lose too much when optimised on their own.
+		const uint32_t c_minTrisPerChunk = 4096u;
+
+		const uint32_t numTris = subMesh.numIndices / 3u;
+		const uint32_t numChunks = static_cast<uint32_t>(
+									   std::max<size_t>( 1u, std::min<size_t>(
+															 numThreads,
+															 numTris / c_minTrisPerChunk ) ) );
+		const uint32_t numTrisPerChunk = Ogre::alignToNextMultiple( numTris,
+																	numChunks ) / numChunks;
+		outStart = std::min<uint32_t>( numTris, threadId * numTrisPerChunk );
+		outEnd = std::min<uint32_t>( numTris, outStart + numTrisPerChunk );
+	}
+	//-----------------------------------------------------------------------------------
+	void OptimizeVertexCacheTask::buildVertexRemap()
 	{
-		if( !indexData )
+		uint32_t nextVertex = 0;
+
+		std::vector<SubMeshIndices>::const_iterator itor = indices->begin();
+		std::vector<SubMeshIndices>::const_iterator end  = indices->end();
+		while( itor != end )
 		{
-			//Make sure numVertices is always multiple of 3 when assigned to each thread
-			const uint32_t totalTris = numVertices / 3u;
-			const uint32_t numTrisPerThread = Ogre::alignToNextMultiple( totalTris,
-																		 numThreads ) / numThreads;
+			for( uint32_t i=0; i<itor->numIndices; ++i )
+			{
+				const uint32_t index = use32BitIndices ?
+										   reinterpret_cast<const uint32_t*>( itor->data )[i] :
+										   reinterpret_cast<const uint16_t*>( itor->data )[i];
+				if( vertexRemap[index] == c_emptySlot )
+					vertexRemap[index] = nextVertex++;
+			}
+			++itor;
+		}
 
-			//If we've got 4 threads and 2 tris, threads 2 & 3 need
-			//to process 0 triangles: Make sure we don't overflow.
-			uint32_t trisToProcess = totalTris - std::min<uint32_t>( totalTris,
-																	 threadId * numTrisPerThread );
-			trisToProcess = std::min( numTrisPerThread, trisToProcess );
+		//Every welded vertex belongs to a triangle, but just in case.
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			if( vertexRemap[i] == c_emptySlot )
+				vertexRemap[i] = nextVertex++;
+		}
+	}
+	//-----------------------------------------------------------------------------------
+	template <typename T>
+	void OptimizeVertexCacheTask::remapIndices( size_t threadId, size_t numThreads )
+	{
+		std::vector<SubMeshIndices>::const_iterator itor = indices->begin();
+		std::vector<SubMeshIndices>::const_iterator end  = indices->end();
+		while( itor != end )
+		{
+			uint32_t triStart, triEnd;
+			getChunk( *itor, threadId, numThreads, triStart, triEnd );
 
-			VertexUtils::generateTangents( vertexData + threadId * bytesPerVertex *
-														numTrisPerThread * 3u,
-										   bytesPerVertex, trisToProcess * 3u,
-										   posStride, normalStride,
-										   tangentStride, uvStride );
+			T * RESTRICT_ALIAS subMeshIndices = reinterpret_cast<T*>( itor->data );
+			for( uint32_t i=triStart * 3u; i<triEnd * 3u; ++i )
+				subMeshIndices[i] = static_cast<T>( vertexRemap[subMeshIndices[i]] );
+			++itor;
 		}
-		else
+	}
+	//-----------------------------------------------------------------------------------
+	void OptimizeVertexCacheTask::execute( size_t threadId, size_t numThreads )
+	{
+		//Step 1: Reorder the triangles of our chunk of each submesh.
 		{
-			//Make sure numIndices is always multiple of 3 when assigned to each thread
-			const uint32_t totalTris = numIndices / 3u;
-			const uint32_t numTrisPerThread = Ogre::alignToNextMultiple( totalTris,
-																		 numThreads ) / numThreads;
+			std::vector<uint32_t> globalToLocal;
 
-			//If we've got 4 threads and 2 tris, threads 2 & 3 need
-			//to process 0 triangles: Make sure we don't overflow.
-			uint32_t trisToProcess = totalTris - std::min<uint32_t>( totalTris,
-																	 threadId * numTrisPerThread );
-			trisToProcess = std::min( numTrisPerThread, trisToProcess );
+			std::vector<SubMeshIndices>::const_iterator itor = indices->begin();
+			std::vector<SubMeshIndices>::const_iterator end  = indices->end();
+			while( itor != end )
+			{
+				uint32_t triStart, triEnd;
+				getChunk( *itor, threadId, numThreads, triStart, triEnd );
+				if( triStart != triEnd )
+				{
+					if( globalToLocal.empty() )
+						globalToLocal.resize( numVertices, c_emptySlot );
 
-			VertexUtils::generateTanUV( vertexData,
-										indexData + threadId * numTrisPerThread * 3u,
-										bytesPerVertex, numVertices, trisToProcess * 3u,
-										posStride, normalStride,
-										tangentStride, uvStride,
-										&tuvBuffer[numVertices * 2u * threadId] );
+					if( use32BitIndices )
+					{
+						VertexUtils::optimizeVertexCache(
+									reinterpret_cast<uint32_t*>( itor->data ) + triStart * 3u,
+									(triEnd - triStart) * 3u, &globalToLocal[0] );
+					}
+					else
+					{
+						VertexUtils::optimizeVertexCache(
+									reinterpret_cast<uint16_t*>( itor->data ) + triStart * 3u,
+									(triEnd - triStart) * 3u, &globalToLocal[0] );
+					}
+				}
+				++itor;
+			}
+		}
 
-			barrier->sync();
+		barrier->sync();
 
-			if( threadId == 0 )
-			{
-				VertexUtils::generateTangetsMergeTUV( vertexData, bytesPerVertex, numVertices,
-													  normalStride, tangentStride, &tuvBuffer[0],
-													  numThreads );
-			}
+		//Step 2: Number the vertices in the order they're first used.
+		if( threadId == 0 )
+			buildVertexRemap();
+
+		barrier->sync();
+
+		//Step 3: Move our range of vertices to their new place, and update the indices.
+		const uint32_t numVerticesPerThread = Ogre::alignToNextMultiple( numVertices,
+																		 numThreads ) / numThreads;
+		const uint32_t vertexStart = std::min<uint32_t>( numVertices, threadId * numVerticesPerThread );
+		const uint32_t vertexEnd = std::min<uint32_t>( numVertices, vertexStart + numVerticesPerThread );
+		for( uint32_t i=vertexStart; i<vertexEnd; ++i )
+		{
+			memcpy( dstVertexData + vertexRemap[i] * bytesPerVertex,
+					srcVertexData + i * bytesPerVertex, bytesPerVertex );
 		}
+
+		if( use32BitIndices )
+			remapIndices<uint32_t>( threadId, numThreads );
+		else
+			remapIndices<uint16_t>( threadId, numThreads );
+
+		const uint32_t lutSize = static_cast<uint32_t>( vertexConversionLut->size() );
+		const uint32_t lutPerThread = Ogre::alignToNextMultiple( lutSize, numThreads ) / numThreads;
+		const uint32_t lutStart = std::min<uint32_t>( lutSize, threadId * lutPerThread );
+		const uint32_t lutEnd = std::min<uint32_t>( lutSize, lutStart + lutPerThread );
+		uint32_t * RESTRICT_ALIAS lut = vertexConversionLut->begin();
+		for( uint32_t i=lutStart; i<lutEnd; ++i )
+			lut[i] = vertexRemap[lut[i]];
 	}
 	//-----------------------------------------------------------------------------------
 	void DeindexTask::execute( size_t threadId, size_t numThreads )
@@ -511,34 +2566,32 @@ namespace DERGO
 		if( !materialIds->empty() )
 			ptrMaterialIds = &(*materialIds)[0];
 
+		const uint32_t firstFace = threadId * numFacesPerThread;
 		VertexUtils::deindex( vertexData + vertexStartThreadIdx[threadId] * bytesPerVertex,
-							  bytesPerVertex,
-							  ptrFaces + threadId * numFacesPerThread,
-							  numFacesToProcess, ptrRawVertices,
-							  ptrMaterialIds + vertexStartThreadIdx[threadId] / 3u );
+							  bytesPerVertex, ptrFaces + firstFace, numFacesToProcess,
+							  ptrRawVertices,
+							  ptrFacesColour ? ptrFacesColour + firstFace : 0,
+							  ptrFacesUv ? ptrFacesUv + firstFace : 0, totalFaces, numUVs,
+							  ptrMaterialIds + vertexStartThreadIdx[threadId] / 3u,
+							  computeAabb ? &threadMin[threadId] : 0,
+							  computeAabb ? &threadMax[threadId] : 0 );
+	}
+	//-----------------------------------------------------------------------------------
+	Ogre::Aabb DeindexTask::getAabb() const
+	{
+		if( faces->empty() )
+			return Ogre::Aabb::BOX_NULL;
 
-		uint32_t uvStride = sizeof(Ogre::Vector3) * 2u;
-		if( !facesColour->empty() )
+		Ogre::Vector3 vMin(  std::numeric_limits<float>::max() );
+		Ogre::Vector3 vMax( -std::numeric_limits<float>::max() );
+		for( size_t i=0; i<threadMin.size(); ++i )
 		{
-			VertexUtils::deindex( vertexData + vertexStartThreadIdx[threadId] * bytesPerVertex,
-								  bytesPerVertex,
-								  ptrFaces + threadId * numFacesPerThread,
-								  numFacesToProcess,
-								  ptrFacesColour + threadId * numFacesPerThread );
-
-			uvStride += sizeof(uint8_t) * 4u;
+			vMin.makeFloor( threadMin[i] );
+			vMax.makeCeil( threadMax[i] );
 		}
 
-		for( uint32_t i=0; i<numUVs; ++i )
-		{
-			VertexUtils::deindex( vertexData + vertexStartThreadIdx[threadId] * bytesPerVertex,
-								  bytesPerVertex,
-								  ptrFaces + threadId * numFacesPerThread,
-								  numFacesToProcess,
-								  ptrFacesUv + totalFaces * i + threadId * numFacesPerThread,
-								  uvStride );
-
-			uvStride += sizeof(Ogre::Vector2);
-		}
+		Ogre::Aabb retVal;
+		retVal.setExtents( vMin, vMax );
+		return retVal;
 	}
 }
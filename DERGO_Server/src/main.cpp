@@ -18,11 +18,21 @@ static const int PORT = 9995;
 #include "DergoSystem.h"
 #include "Network/NetworkSystem.h"
 
+#include <stdlib.h>
+
 int main( int argc, char **argv )
 {
 	DERGO::DergoSystem dergoSystem;
 	DERGO::NetworkSystem networkSystem;
 
+	//The disk cache of prepared meshes is opt-in. Its size cap, in megabytes
+	const char *meshDiskCacheSize = getenv( "DERGO_MESH_DISK_CACHE_MB" );
+	if( meshDiskCacheSize )
+	{
+		dergoSystem.setMeshDiskCacheMaxSize( static_cast<Ogre::uint64>(
+												 strtoul( meshDiskCacheSize, 0, 10 ) ) << 20u );
+	}
+
 	dergoSystem.initialize();
 
 #ifdef _WIN32
@@ -32,6 +42,12 @@ int main( int argc, char **argv )
 
 	networkSystem.addListener( &dergoSystem );
 
+	//How long we keep the scene after the client disconnects, so it can resume the session
+	const char *gracePeriod = getenv( "DERGO_SESSION_GRACE_PERIOD" );
+	if( gracePeriod )
+		dergoSystem.setSessionGracePeriod( static_cast<Ogre::uint32>( strtoul( gracePeriod, 0, 10 ) ) );
+	networkSystem.setIdleTimeout( dergoSystem.getSessionGracePeriod() );
+
 	int retVal = networkSystem.start();
 
 	dergoSystem.deinitialize();
@@ -0,0 +1,164 @@
+
+#include "VertexUtils.h"
+#include "OgreTimer.h"
+#include "ReferenceDeindex.h"
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+/*
+	Time it takes VertexUtils::deindex to deindex a 2M face mesh (one thread), against the
+	separate scalar passes it used to make (see ReferenceDeindex.h), for a few vertex
+	layouts. Also checks that both produce the same bytes.
+	Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+namespace
+{
+	const uint32_t c_numFaces		= 2000000u;
+	const uint32_t c_numRawVertices	= 1000000u;
+	const size_t c_numRuns			= 5u;
+
+	/// Not rand(), so the mesh is the same everywhere.
+	float randomFloat( uint32_t &state )
+	{
+		state = state * 1664525u + 1013904223u;
+		return static_cast<float>( state >> 8u ) / static_cast<float>( 1u << 24u );
+	}
+
+	struct Mesh
+	{
+		std::vector<BlenderFace>		faces;
+		std::vector<BlenderRawVertex>	rawVertices;
+		std::vector<BlenderFaceColour>	colours;
+		/// 2 UV sets
+		std::vector<BlenderFaceUv>		uvs;
+		uint32_t						numVertices;
+	};
+
+	/// 3 out of 4 faces are quads, and half of them are smooth. Faces use nearby vertices,
+	/// like real meshes do.
+	void generateMesh( Mesh &mesh )
+	{
+		uint32_t state = 1u;
+
+		mesh.rawVertices.resize( c_numRawVertices );
+		for( uint32_t i=0; i<c_numRawVertices; ++i )
+		{
+			float *values = &mesh.rawVertices[i].vPos.x;
+			for( size_t j=0; j<6u; ++j )
+				values[j] = randomFloat( state ) * 2.0f - 1.0f;
+		}
+
+		mesh.faces.resize( c_numFaces );
+		mesh.colours.resize( c_numFaces );
+		mesh.uvs.resize( c_numFaces * 2u );
+		mesh.numVertices = 0;
+		for( uint32_t i=0; i<c_numFaces; ++i )
+		{
+			BlenderFace &face = mesh.faces[i];
+			const uint32_t base = (i / 2u) % (c_numRawVertices - 16u);
+			for( uint32_t j=0; j<4u; ++j )
+				face.vertexIndex[j] = base + j * 4u + static_cast<uint32_t>( randomFloat( state ) * 4.0f );
+			face.faceNormal			= Ogre::Vector3( randomFloat( state ), randomFloat( state ), 1.0f );
+			face.materialId			= static_cast<uint16_t>( i % 3u ) |
+									  (randomFloat( state ) < 0.5f ? 0x8000u : 0u);
+			face.numIndicesInFace	= randomFloat( state ) < 0.75f ? 4u : 3u;
+			mesh.numVertices += face.numIndicesInFace == 4 ? 6u : 3u;
+
+			for( uint32_t j=0; j<4u; ++j )
+			{
+				mesh.colours[i].colour[j] = Ogre::Vector3( randomFloat( state ), randomFloat( state ),
+														   randomFloat( state ) );
+				mesh.uvs[i].uv[j] = Ogre::Vector2( randomFloat( state ), randomFloat( state ) );
+				mesh.uvs[c_numFaces + i].uv[j] = Ogre::Vector2( randomFloat( state ),
+																randomFloat( state ) );
+			}
+		}
+	}
+
+	struct Layout
+	{
+		const char	*name;
+		bool		hasColour;
+		uint8_t		numUVs;
+		bool		hasTangent;
+	};
+
+	/// Returns the best time in ms.
+	template <typename DeindexFunc>
+	double timeDeindex( DeindexFunc deindexFunc, const Mesh &mesh, const Layout &layout,
+						uint8_t fillValue, std::vector<uint8_t> &outVertexData,
+						std::vector<uint16_t> &outMaterialIds )
+	{
+		const uint32_t bytesPerVertex = sizeof(float) * 6u + (layout.hasColour ? 4u : 0u) +
+										sizeof(float) * 2u * layout.numUVs +
+										(layout.hasTangent ? sizeof(float) * 4u : 0u);
+		outVertexData.resize( mesh.numVertices * bytesPerVertex );
+		outMaterialIds.resize( mesh.numVertices / 3u );
+
+		Ogre::Timer timer;
+		double bestTime = 1e30;
+		for( size_t i=0; i<c_numRuns; ++i )
+		{
+			memset( &outVertexData[0], fillValue, outVertexData.size() );
+
+			const uint64_t start = timer.getMicroseconds();
+			deindexFunc( &outVertexData[0], bytesPerVertex, &mesh.faces[0], c_numFaces,
+						 &mesh.rawVertices[0], layout.hasColour ? &mesh.colours[0] : 0,
+						 &mesh.uvs[0], c_numFaces, layout.numUVs, &outMaterialIds[0] );
+			bestTime = std::min( bestTime, (timer.getMicroseconds() - start) / 1000.0 );
+		}
+		return bestTime;
+	}
+
+	void deindex( uint8_t *dstData, uint32_t bytesPerVertex, const BlenderFace *faces,
+				  uint32_t numFaces, const BlenderRawVertex *blenderRawVertices,
+				  const BlenderFaceColour *facesColour, const BlenderFaceUv *faceUv,
+				  uint32_t uvSetStride, uint8_t numUVs, uint16_t *materialIds )
+	{
+		VertexUtils::deindex( dstData, bytesPerVertex, faces, numFaces, blenderRawVertices,
+							  facesColour, faceUv, uvSetStride, numUVs, materialIds );
+	}
+}
+//-----------------------------------------------------------------------------------
+int main()
+{
+	Mesh mesh;
+	generateMesh( mesh );
+
+	const Layout layouts[3] =
+	{
+		{ "position & normal", false, 0u, false },
+		{ "+ colour & 1 UV", true, 1u, false },
+		{ "+ 2 UVs & tangent", true, 2u, true }
+	};
+
+	printf( "%u faces, %u vertices, best of %u runs.\n",
+			c_numFaces, mesh.numVertices, static_cast<unsigned>( c_numRuns ) );
+	printf( "%-20s %14s %14s  %s\n", "Layout", "Separate (ms)", "deindex (ms)", "Output" );
+
+	bool success = true;
+	for( size_t i=0; i<3u; ++i )
+	{
+		std::vector<uint8_t> refVertexData, vertexData;
+		std::vector<uint16_t> refMaterialIds, materialIds;
+
+		//The old passes left the tangent alone, deindex must zero it
+		const double refTime	= timeDeindex( Reference::deindex, mesh, layouts[i], 0u,
+											   refVertexData, refMaterialIds );
+		const double time		= timeDeindex( deindex, mesh, layouts[i], 0xCDu,
+											   vertexData, materialIds );
+
+		const bool identical = refVertexData == vertexData && refMaterialIds == materialIds;
+		printf( "%-20s %14.1f %14.1f  %s\n", layouts[i].name, refTime, time,
+				identical ? "identical" : "DIFFERENT" );
+		success &= identical;
+	}
+
+	return success ? 0 : 1;
+}
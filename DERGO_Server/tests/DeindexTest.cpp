@@ -0,0 +1,145 @@
+
+#include "VertexUtils.h"
+#include "ReferenceDeindex.h"
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+/*
+	Checks that the single pass VertexUtils::deindex does the same as the separate passes
+	it replaced (see ReferenceDeindex.h), on random meshes of every vertex layout:
+		* Same positions, normals, colours, UVs & material IDs, byte for byte.
+		* The tangent slot is zeroed, no matter what was in memory.
+		* The AABB covers exactly the vertices the faces use.
+		* getUvOffset (which tangent generation uses to find its UVs) points to where
+		  deindex wrote each UV set, also when there are colours.
+	Returns 0 on success. Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+static const uint32_t c_numFaces		= 5000u;
+static const uint32_t c_numRawVertices	= 3000u;
+
+/// Not rand(), so the meshes are the same everywhere.
+static float randomFloat( uint32_t &state )
+{
+	state = state * 1664525u + 1013904223u;
+	return static_cast<float>( state >> 8u ) / static_cast<float>( 1u << 24u );
+}
+//-----------------------------------------------------------------------------------
+static bool testLayout( bool hasColour, uint8_t numUVs, bool hasTangent, uint32_t &state )
+{
+	std::vector<BlenderRawVertex> rawVertices( c_numRawVertices );
+	for( uint32_t i=0; i<c_numRawVertices; ++i )
+	{
+		float *values = &rawVertices[i].vPos.x;
+		for( size_t j=0; j<6u; ++j )
+			values[j] = randomFloat( state ) * 200.0f - 100.0f;
+	}
+
+	//Leave the last raw vertices unused, so the AABB can't just take all of them
+	const uint32_t numUsedRawVertices = c_numRawVertices - 100u;
+
+	std::vector<BlenderFace> faces( c_numFaces );
+	std::vector<BlenderFaceColour> colours( c_numFaces );
+	std::vector<BlenderFaceUv> uvs( c_numFaces * std::max<uint8_t>( numUVs, 1u ) );
+	uint32_t numVertices = 0;
+	for( uint32_t i=0; i<c_numFaces; ++i )
+	{
+		BlenderFace &face = faces[i];
+		for( size_t j=0; j<4u; ++j )
+		{
+			face.vertexIndex[j] = static_cast<uint32_t>( randomFloat( state ) *
+														 numUsedRawVertices );
+		}
+		face.faceNormal			= Ogre::Vector3( randomFloat( state ), randomFloat( state ),
+												 randomFloat( state ) );
+		face.materialId			= static_cast<uint16_t>( randomFloat( state ) * 0x7FFF ) |
+								  (randomFloat( state ) < 0.5f ? 0x8000u : 0u);
+		face.numIndicesInFace	= randomFloat( state ) < 0.5f ? 4u : 3u;
+		numVertices += face.numIndicesInFace == 4 ? 6u : 3u;
+
+		for( size_t j=0; j<4u; ++j )
+		{
+			colours[i].colour[j] = Ogre::Vector3( randomFloat( state ), randomFloat( state ),
+												  randomFloat( state ) );
+		}
+	}
+	for( size_t i=0; i<uvs.size(); ++i )
+	{
+		for( size_t j=0; j<4u; ++j )
+			uvs[i].uv[j] = Ogre::Vector2( randomFloat( state ), randomFloat( state ) );
+	}
+
+	const uint32_t tangentOffset	= VertexUtils::getUvOffset( hasColour, numUVs );
+	const uint32_t bytesPerVertex	= tangentOffset + (hasTangent ? sizeof(float) * 4u : 0u);
+
+	//Garbage where deindex writes, zeroes where the reference does; so the tangent must
+	//come out zeroed for both to match.
+	std::vector<uint8_t> vertexData( numVertices * bytesPerVertex, 0xCDu );
+	std::vector<uint8_t> refVertexData( numVertices * bytesPerVertex, 0u );
+	std::vector<uint16_t> materialIds( numVertices / 3u, 0xCDCDu );
+	std::vector<uint16_t> refMaterialIds( numVertices / 3u );
+
+	Ogre::Vector3 vMin( std::numeric_limits<float>::max() );
+	Ogre::Vector3 vMax( -std::numeric_limits<float>::max() );
+	VertexUtils::deindex( &vertexData[0], bytesPerVertex, &faces[0], c_numFaces, &rawVertices[0],
+						  hasColour ? &colours[0] : 0, &uvs[0], c_numFaces, numUVs,
+						  &materialIds[0], &vMin, &vMax );
+	Reference::deindex( &refVertexData[0], bytesPerVertex, &faces[0], c_numFaces, &rawVertices[0],
+						hasColour ? &colours[0] : 0, &uvs[0], c_numFaces, numUVs,
+						&refMaterialIds[0] );
+
+	bool success = vertexData == refVertexData && materialIds == refMaterialIds;
+
+	//The AABB of the vertices the faces use
+	Ogre::Vector3 refMin( std::numeric_limits<float>::max() );
+	Ogre::Vector3 refMax( -std::numeric_limits<float>::max() );
+	for( uint32_t i=0; i<c_numFaces; ++i )
+	{
+		for( uint32_t j=0; j<faces[i].numIndicesInFace; ++j )
+		{
+			refMin.makeFloor( rawVertices[faces[i].vertexIndex[j]].vPos );
+			refMax.makeCeil( rawVertices[faces[i].vertexIndex[j]].vPos );
+		}
+	}
+	success &= vMin == refMin && vMax == refMax;
+
+	//The first vertex of each face comes from its corner 0
+	const uint8_t *vertex = &vertexData[0];
+	for( uint32_t i=0; i<c_numFaces; ++i )
+	{
+		for( uint8_t uvSet=0; uvSet<numUVs; ++uvSet )
+		{
+			const Ogre::Vector2 &uv = uvs[c_numFaces * uvSet + i].uv[0];
+			const float expected[2] = { uv.x, 1.0f - uv.y };
+			success &= memcmp( vertex + VertexUtils::getUvOffset( hasColour, uvSet ), expected,
+							   sizeof(expected) ) == 0;
+		}
+		vertex += (faces[i].numIndicesInFace == 4 ? 6u : 3u) * bytesPerVertex;
+	}
+
+	printf( "Colour %-3s %u UVs, tangent %-3s: %s\n", hasColour ? "yes" : "no",
+			static_cast<unsigned>( numUVs ), hasTangent ? "yes" : "no",
+			success ? "OK" : "FAILED" );
+	return success;
+}
+//-----------------------------------------------------------------------------------
+int main()
+{
+	bool success = true;
+	uint32_t state = 1u;
+
+	//Up to 5 UV sets, to go through every specialization of deindexFaces and the generic one
+	for( uint8_t numUVs=0; numUVs<=5u; ++numUVs )
+	{
+		for( size_t i=0; i<4u; ++i )
+			success &= testLayout( (i & 1u) != 0, numUVs, (i & 2u) != 0, state );
+	}
+
+	printf( success ? "All tests passed\n" : "Some tests FAILED\n" );
+	return success ? 0 : 1;
+}
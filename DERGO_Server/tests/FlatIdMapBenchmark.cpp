@@ -0,0 +1,247 @@
+
+#include "FlatIdMap.h"
+#include "OgreTimer.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <stdio.h>
+
+/*
+	FlatIdMap microbenchmark: the item lookups of a resync, in isolation.
+	One mesh with N instances (e.g. scattered vegetation) gets every item created, then
+	found again & moved, then removed in random order. Items are found either with a linear
+	scan of the mesh's items (what syncItem and destroyItem used to do), or through a
+	FlatIdMap keyed like DergoSystem::m_itemIndex.
+	This is NOT DergoSystem: Item, Mesh & ItemLocation below are stand-ins for Ogre's Item &
+	SceneNode, BlenderMesh and BlenderItemLocation, and no messages are decoded. It shows how
+	the lookups scale, not how long a real resync takes; creating the Ogre items & nodes
+	dominates that.
+	Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+namespace
+{
+	/// Stand-in for the Item & its SceneNode.
+	struct Node
+	{
+		float position[3];
+		float rotation[4];
+		float scale[3];
+	};
+
+	struct Item
+	{
+		uint32_t	id;
+		Node		*node;
+
+		Item( uint32_t _id, Node *_node ) : id( _id ), node( _node ) {}
+	};
+	typedef std::vector<Item> ItemVec;
+
+	struct Mesh
+	{
+		ItemVec items;
+	};
+	typedef std::map<uint32_t, Mesh> MeshMap;
+
+	struct ItemLocation
+	{
+		Mesh		*mesh;
+		uint32_t	slot;
+
+		ItemLocation() : mesh( 0 ), slot( 0 ) {}
+		ItemLocation( Mesh *_mesh, uint32_t _slot ) : mesh( _mesh ), slot( _slot ) {}
+	};
+
+	uint64_t getItemKey( uint32_t meshId, uint32_t itemId )
+	{
+		return (static_cast<uint64_t>( meshId ) << 32u) | itemId;
+	}
+
+	void setTransform( Node *node, uint32_t itemId )
+	{
+		const float value = static_cast<float>( itemId );
+		for( size_t i=0; i<3u; ++i )
+		{
+			node->position[i]	= value;
+			node->scale[i]		= 1.0f;
+		}
+		for( size_t i=0; i<4u; ++i )
+			node->rotation[i] = i == 0 ? 1.0f : 0.0f;
+	}
+
+	void removeItem( ItemVec &items, size_t slot )
+	{
+		delete items[slot].node;
+		items[slot] = items.back();
+		items.pop_back();
+	}
+
+	//-------------------------------------------------------------------------------
+	/// The lookups syncItem & destroyItem used to do.
+	struct LinearScanScene
+	{
+		MeshMap meshes;
+
+		ItemVec::iterator findItem( Mesh &mesh, uint32_t itemId )
+		{
+			ItemVec::iterator itor = mesh.items.begin();
+			ItemVec::iterator end  = mesh.items.end();
+			while( itor != end && itor->id != itemId )
+				++itor;
+			return itor;
+		}
+
+		void syncItem( uint32_t meshId, uint32_t itemId )
+		{
+			MeshMap::iterator itMesh = meshes.find( meshId );
+			if( itMesh == meshes.end() )
+				return;
+
+			ItemVec::iterator itItem = findItem( itMesh->second, itemId );
+			if( itItem != itMesh->second.items.end() )
+			{
+				setTransform( itItem->node, itemId );
+			}
+			else
+			{
+				Node *node = new Node();
+				setTransform( node, itemId );
+				itMesh->second.items.push_back( Item( itemId, node ) );
+			}
+		}
+
+		void destroyItem( uint32_t meshId, uint32_t itemId )
+		{
+			MeshMap::iterator itMesh = meshes.find( meshId );
+			if( itMesh == meshes.end() )
+				return;
+
+			ItemVec::iterator itItem = findItem( itMesh->second, itemId );
+			if( itItem != itMesh->second.items.end() )
+				removeItem( itMesh->second.items, itItem - itMesh->second.items.begin() );
+		}
+	};
+
+	//-------------------------------------------------------------------------------
+	/// The lookups syncItem & destroyItem do now through DergoSystem::m_itemIndex.
+	struct IndexedScene
+	{
+		MeshMap						meshes;
+		FlatIdMap<ItemLocation>	itemIndex;
+
+		void syncItem( uint32_t meshId, uint32_t itemId )
+		{
+			const ItemLocation *location = itemIndex.find( getItemKey( meshId, itemId ) );
+			if( location )
+			{
+				setTransform( location->mesh->items[location->slot].node, itemId );
+			}
+			else
+			{
+				MeshMap::iterator itMesh = meshes.find( meshId );
+				if( itMesh == meshes.end() )
+					return;
+
+				Mesh &mesh = itMesh->second;
+				Node *node = new Node();
+				setTransform( node, itemId );
+				itemIndex.insert( getItemKey( meshId, itemId ),
+								  ItemLocation( &mesh, static_cast<uint32_t>( mesh.items.size() ) ) );
+				mesh.items.push_back( Item( itemId, node ) );
+			}
+		}
+
+		void destroyItem( uint32_t meshId, uint32_t itemId )
+		{
+			const uint64_t itemKey = getItemKey( meshId, itemId );
+			const ItemLocation *location = itemIndex.find( itemKey );
+			if( !location )
+				return;
+
+			ItemVec &items = location->mesh->items;
+			const uint32_t slot = location->slot;
+			removeItem( items, slot );
+			if( slot < items.size() )
+				itemIndex.find( getItemKey( meshId, items[slot].id ) )->slot = slot;
+			itemIndex.erase( itemKey );
+		}
+	};
+
+	//-------------------------------------------------------------------------------
+	struct Timings
+	{
+		double create;
+		double resync;
+		double destroy;
+	};
+
+	template <typename Scene>
+	Timings runBenchmark( uint32_t numItems, const std::vector<uint32_t> &removalOrder )
+	{
+		const uint32_t meshId = 1u;
+
+		Scene scene;
+		scene.meshes[meshId];
+
+		Ogre::Timer timer;
+		Timings timings;
+
+		uint64_t start = timer.getMicroseconds();
+		for( uint32_t i=0; i<numItems; ++i )
+			scene.syncItem( meshId, i + 1u );
+		timings.create = (timer.getMicroseconds() - start) / 1000.0;
+
+		start = timer.getMicroseconds();
+		for( uint32_t i=0; i<numItems; ++i )
+			scene.syncItem( meshId, i + 1u );
+		timings.resync = (timer.getMicroseconds() - start) / 1000.0;
+
+		start = timer.getMicroseconds();
+		for( size_t i=0; i<removalOrder.size(); ++i )
+			scene.destroyItem( meshId, removalOrder[i] );
+		timings.destroy = (timer.getMicroseconds() - start) / 1000.0;
+
+		if( !scene.meshes[meshId].items.empty() )
+			printf( "Not all items were removed!\n" );
+
+		return timings;
+	}
+}
+//-----------------------------------------------------------------------------------
+int main()
+{
+	const uint32_t numItemsPerRun[3] = { 1000u, 10000u, 100000u };
+
+	printf( "FlatIdMap microbenchmark, with stand-in items (not DergoSystem)\n" );
+	printf( "%9s  %-12s %12s %12s %12s\n", "Instances", "Lookup", "Create (ms)", "Resync (ms)",
+			"Remove (ms)" );
+
+	for( size_t i=0; i<3u; ++i )
+	{
+		const uint32_t numItems = numItemsPerRun[i];
+
+		//Removals come in no particular order (e.g. deleting a selection)
+		std::vector<uint32_t> removalOrder( numItems );
+		uint32_t state = 1u;
+		for( uint32_t j=0; j<numItems; ++j )
+		{
+			removalOrder[j] = j + 1u;
+			state = state * 1664525u + 1013904223u;
+			std::swap( removalOrder[j], removalOrder[state % (j + 1u)] );
+		}
+
+		const Timings linear	= runBenchmark<LinearScanScene>( numItems, removalOrder );
+		const Timings indexed	= runBenchmark<IndexedScene>( numItems, removalOrder );
+
+		printf( "%9u  %-12s %12.2f %12.2f %12.2f\n", numItems, "linear scan",
+				linear.create, linear.resync, linear.destroy );
+		printf( "%9u  %-12s %12.2f %12.2f %12.2f\n", numItems, "FlatIdMap",
+				indexed.create, indexed.resync, indexed.destroy );
+	}
+
+	return 0;
+}
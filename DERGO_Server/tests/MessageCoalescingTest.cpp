@@ -0,0 +1,233 @@
+
+#include "Network/NetworkSystem.h"
+#include "Network/NetworkMessage.h"
+#include "Network/SmartData.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+	Checks which Item messages NetworkSystem::coalescePendingBatch skips, by sending batches
+	of messages to a real NetworkSystem (on port 9995) and recording what reaches the listener.
+	The listener stalls on the first message, so that everything after it piles up in one
+	batch. Returns 0 on success. Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+namespace
+{
+	/// What reached processMessage. For items, ids are the mesh & item ID.
+	struct Received
+	{
+		Ogre::uint8		messageType;
+		Ogre::uint32	ids[2];
+
+		bool operator == ( const Received &other ) const
+		{
+			return messageType == other.messageType &&
+				   ids[0] == other.ids[0] && ids[1] == other.ids[1];
+		}
+	};
+
+	class RecordingListener : public NetworkListener
+	{
+	public:
+		std::vector<Received> m_received;
+
+		virtual void processMessage( const Network::MessageHeader &header,
+									 Network::SmartData &smartData,
+									 DecodedMessage *decodedMessage,
+									 bufferevent *bev, NetworkSystem &networkSystem )
+		{
+			if( header.messageType == Network::FromClient::ConnectionTest )
+			{
+				//Let the rest of the sequence arrive, so it's coalesced as one batch
+				usleep( 300000 );
+				return;
+			}
+
+			Received received;
+			memset( &received, 0, sizeof(received) );
+			received.messageType = header.messageType;
+			memcpy( received.ids, smartData.getCurrentPtr(),
+					std::min<size_t>( header.sizeBytes, sizeof(received.ids) ) );
+			m_received.push_back( received );
+		}
+
+		virtual void allConnectionsTerminated()
+		{
+			raise( SIGINT );
+		}
+	};
+
+	struct Message
+	{
+		Ogre::uint8					messageType;
+		std::vector<Ogre::uint8>	payload;
+	};
+
+	Message makeMessage( Network::FromClient::FromClient messageType,
+						 Ogre::uint32 meshId, Ogre::uint32 id0, Ogre::uint32 id1 = 0 )
+	{
+		Message message;
+		message.messageType = static_cast<Ogre::uint8>( messageType );
+
+		//Only the IDs at the start matter to NetworkSystem
+		const Ogre::uint32 ids[3] = { meshId, id0, id1 };
+		message.payload.resize( sizeof(ids) + 16u );
+		memcpy( &message.payload[0], ids, sizeof(ids) );
+		return message;
+	}
+
+	Received makeReceived( Network::FromClient::FromClient messageType,
+						   Ogre::uint32 id0, Ogre::uint32 id1 )
+	{
+		Received received;
+		received.messageType = static_cast<Ogre::uint8>( messageType );
+		received.ids[0] = id0;
+		received.ids[1] = id1;
+		return received;
+	}
+
+	void sendMessages( const std::vector<Message> &messages )
+	{
+		int fd = -1;
+		for( int attempt=0; attempt<100 && fd < 0; ++attempt )
+		{
+			fd = socket( AF_INET, SOCK_STREAM, 0 );
+			sockaddr_in sin;
+			memset( &sin, 0, sizeof(sin) );
+			sin.sin_family		= AF_INET;
+			sin.sin_port		= htons( 9995 );
+			sin.sin_addr.s_addr	= htonl( INADDR_LOOPBACK );
+			if( connect( fd, reinterpret_cast<sockaddr*>( &sin ), sizeof(sin) ) != 0 )
+			{
+				//The server may not be listening yet
+				close( fd );
+				fd = -1;
+				usleep( 50000 );
+			}
+		}
+
+		if( fd < 0 )
+		{
+			printf( "Couldn't connect to the NetworkSystem\n" );
+			raise( SIGINT );
+			return;
+		}
+
+		std::vector<Ogre::uint8> stream;
+		for( size_t i=0; i<messages.size(); ++i )
+		{
+			const Ogre::uint32 sizeBytes = static_cast<Ogre::uint32>( messages[i].payload.size() );
+			const size_t offset = stream.size();
+			stream.resize( offset + HEADER_SIZE + sizeBytes );
+			memcpy( &stream[offset], &sizeBytes, sizeof(sizeBytes) );
+			stream[offset + sizeof(sizeBytes)] = messages[i].messageType;
+			if( sizeBytes )
+				memcpy( &stream[offset + HEADER_SIZE], &messages[i].payload[0], sizeBytes );
+		}
+
+		//The stall message first, on its own
+		send( fd, &stream[0], HEADER_SIZE, 0 );
+		usleep( 50000 );
+		send( fd, &stream[HEADER_SIZE], stream.size() - HEADER_SIZE, 0 );
+
+		//Give the server time to read everything before we close
+		usleep( 100000 );
+		close( fd );
+	}
+}
+//-----------------------------------------------------------------------------------
+int main()
+{
+	using namespace Network::FromClient;
+
+	std::vector<Message> messages;
+	Message stall;
+	stall.messageType = ConnectionTest;
+	messages.push_back( stall );
+
+	std::vector<Received> expected;
+
+	//An item created, moved by a batch, then updated: the batch needs the item to exist
+	messages.push_back( makeMessage( Item, 1u, 10u ) );
+	messages.push_back( makeMessage( ItemTransformBatch, 1u, 1u, 10u ) );
+	messages.push_back( makeMessage( Item, 1u, 10u ) );
+	expected.push_back( makeReceived( Item, 1u, 10u ) );
+	expected.push_back( makeReceived( ItemTransformBatch, 1u, 1u ) );
+	expected.push_back( makeReceived( Item, 1u, 10u ) );
+
+	//The mesh may get recreated (along with its items) in between
+	messages.push_back( makeMessage( Item, 2u, 20u ) );
+	messages.push_back( makeMessage( MeshLoops, 2u, 0u ) );
+	messages.push_back( makeMessage( Item, 2u, 20u ) );
+	expected.push_back( makeReceived( Item, 2u, 20u ) );
+	expected.push_back( makeReceived( MeshLoops, 2u, 0u ) );
+	expected.push_back( makeReceived( Item, 2u, 20u ) );
+
+	//Updates of items in other meshes don't depend on the batch; coalesce them as usual
+	messages.push_back( makeMessage( Item, 3u, 30u ) );
+	messages.push_back( makeMessage( ItemTransformBatch, 4u, 1u, 40u ) );
+	messages.push_back( makeMessage( Item, 3u, 30u ) );
+	expected.push_back( makeReceived( ItemTransformBatch, 4u, 1u ) );
+	expected.push_back( makeReceived( Item, 3u, 30u ) );
+
+	//A reset in between: the item must be created again after it
+	messages.push_back( makeMessage( Item, 5u, 50u ) );
+	messages.push_back( makeMessage( Reset, 0u, 0u ) );
+	messages.push_back( makeMessage( Item, 5u, 50u ) );
+	expected.push_back( makeReceived( Item, 5u, 50u ) );
+	expected.push_back( makeReceived( Reset, 0u, 0u ) );
+	expected.push_back( makeReceived( Item, 5u, 50u ) );
+
+	//Plain superseded updates & removals still get coalesced
+	messages.push_back( makeMessage( Item, 6u, 60u ) );
+	messages.push_back( makeMessage( Item, 6u, 60u ) );
+	messages.push_back( makeMessage( Item, 6u, 61u ) );
+	messages.push_back( makeMessage( ItemRemove, 6u, 61u ) );
+	expected.push_back( makeReceived( Item, 6u, 60u ) );
+	expected.push_back( makeReceived( ItemRemove, 6u, 61u ) );
+
+	NetworkSystem networkSystem;
+	RecordingListener listener;
+	networkSystem.addListener( &listener );
+
+	std::thread client( sendMessages, messages );
+	networkSystem.start();
+	client.join();
+
+	const bool success = listener.m_received == expected &&
+						 networkSystem.getNumDroppedMessages( Item ) == 3u;
+
+	for( size_t i=0; i<std::max( expected.size(), listener.m_received.size() ); ++i )
+	{
+		char line[2][64] = { "-", "-" };
+		if( i < expected.size() )
+		{
+			sprintf( line[0], "%u (%u, %u)", expected[i].messageType,
+					 expected[i].ids[0], expected[i].ids[1] );
+		}
+		if( i < listener.m_received.size() )
+		{
+			sprintf( line[1], "%u (%u, %u)", listener.m_received[i].messageType,
+					 listener.m_received[i].ids[0], listener.m_received[i].ids[1] );
+		}
+		printf( "expected %-20s got %s\n", line[0], line[1] );
+	}
+	printf( "Dropped %llu Item messages (expected 3)\n",
+			static_cast<unsigned long long>( networkSystem.getNumDroppedMessages( Item ) ) );
+
+	printf( success ? "All tests passed\n" : "Some tests FAILED\n" );
+	return success ? 0 : 1;
+}
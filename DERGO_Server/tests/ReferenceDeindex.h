@@ -0,0 +1,91 @@
+#pragma once
+
+#include "VertexUtils.h"
+
+#include <string.h>
+
+namespace DERGO
+{
+namespace Reference
+{
+	/** How VertexUtils::deindex used to work: one plain scalar pass over the faces for
+		positions & normals, another one for colours, and one more per UV set.
+		Same arguments & layout as VertexUtils::deindex, except that the tangent slot
+		(whatever follows the UVs) is left untouched.
+	*/
+	inline void deindex( uint8_t *dstData, uint32_t bytesPerVertex,
+						 const BlenderFace *faces, uint32_t numFaces,
+						 const BlenderRawVertex *blenderRawVertices,
+						 const BlenderFaceColour *facesColour,
+						 const BlenderFaceUv *faceUv, uint32_t uvSetStride, uint8_t numUVs,
+						 uint16_t *materialIds )
+	{
+		//Which corners of the face make each triangle
+		static const uint8_t c_triCorners[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+
+		const uint32_t colourOffset	= sizeof(Ogre::Vector3) * 2u;
+		const uint32_t uvOffset		= colourOffset + (facesColour ? sizeof(uint8_t) * 4u : 0u);
+
+		uint8_t *dst = dstData;
+		for( uint32_t i=0; i<numFaces; ++i )
+		{
+			const BlenderFace &face = faces[i];
+			const bool useSmooth = (face.materialId & 0x8000) != 0;
+			for( uint32_t j=0; j<(face.numIndicesInFace == 4 ? 2u : 1u); ++j )
+			{
+				for( uint32_t k=0; k<3u; ++k )
+				{
+					const BlenderRawVertex &rawVertex =
+							blenderRawVertices[face.vertexIndex[c_triCorners[j][k]]];
+					memcpy( dst, &rawVertex.vPos, sizeof(Ogre::Vector3) );
+					memcpy( dst + sizeof(Ogre::Vector3),
+							useSmooth ? &rawVertex.vNormal : &face.faceNormal,
+							sizeof(Ogre::Vector3) );
+					dst += bytesPerVertex;
+				}
+				*materialIds++ = face.materialId & 0x7FFF;
+			}
+		}
+
+		if( facesColour )
+		{
+			dst = dstData + colourOffset;
+			for( uint32_t i=0; i<numFaces; ++i )
+			{
+				for( uint32_t j=0; j<(faces[i].numIndicesInFace == 4 ? 2u : 1u); ++j )
+				{
+					for( uint32_t k=0; k<3u; ++k )
+					{
+						const Ogre::Vector3 &colour = facesColour[i].colour[c_triCorners[j][k]];
+						dst[0] = static_cast<uint8_t>( colour.x * 255.0f + 0.5f );
+						dst[1] = static_cast<uint8_t>( colour.y * 255.0f + 0.5f );
+						dst[2] = static_cast<uint8_t>( colour.z * 255.0f + 0.5f );
+						dst[3] = 255;
+						dst += bytesPerVertex;
+					}
+				}
+			}
+		}
+
+		for( uint8_t uvSet=0; uvSet<numUVs; ++uvSet )
+		{
+			dst = dstData + uvOffset + sizeof(Ogre::Vector2) * uvSet;
+			for( uint32_t i=0; i<numFaces; ++i )
+			{
+				const BlenderFaceUv &uvs = faceUv[uvSetStride * uvSet + i];
+				for( uint32_t j=0; j<(faces[i].numIndicesInFace == 4 ? 2u : 1u); ++j )
+				{
+					for( uint32_t k=0; k<3u; ++k )
+					{
+						//Mirror V
+						const Ogre::Vector2 &uv = uvs.uv[c_triCorners[j][k]];
+						const float mirrored[2] = { uv.x, 1.0f - uv.y };
+						memcpy( dst, mirrored, sizeof(mirrored) );
+						dst += bytesPerVertex;
+					}
+				}
+			}
+		}
+	}
+}
+}
@@ -0,0 +1,187 @@
+
+#include "VertexUtils.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+/*
+	Checks how ReweldVertexBufferTask validates the LUT of a previous build:
+		* The LUT ShrinkVertexBufferTask made for the same vertices is accepted, and gives
+		  the same output.
+		* So is that LUT with its unique vertices reordered (what OptimizeVertexCacheTask
+		  does), with every vertex ending up where the LUT says.
+		* Vertices that became equal since stay apart.
+		* It's rejected (0 unique vertices) when a vertex differs from the others welded
+		  with it, when a unique vertex is unused, or when an entry is out of range.
+	On 1 to 4 threads. Returns 0 on success. Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+static const uint32_t c_bytesPerVertex = 32u;
+
+/// Not rand(), so the inputs are the same everywhere.
+static uint32_t randomUint( uint32_t &state, uint32_t maxValue )
+{
+	state = state * 1664525u + 1013904223u;
+	return static_cast<uint32_t>( (static_cast<uint64_t>( state >> 8u ) * maxValue) >> 24u );
+}
+//-----------------------------------------------------------------------------------
+static void executeTask( Ogre::UniformScalableTask &task, size_t numThreads )
+{
+	std::vector<std::thread> threads;
+	for( size_t i=0; i<numThreads; ++i )
+		threads.push_back( std::thread( &Ogre::UniformScalableTask::execute, &task, i, numThreads ) );
+	for( size_t i=0; i<numThreads; ++i )
+		threads[i].join();
+}
+//-----------------------------------------------------------------------------------
+/// Returns the number of unique vertices, 0 if the LUT was rejected.
+static uint32_t reweld( const std::vector<uint8_t> &vertexData, const uint32_t *lut,
+						size_t numThreads, std::vector<uint8_t> &outVertexData )
+{
+	const uint32_t numVertices = static_cast<uint32_t>( vertexData.size() / c_bytesPerVertex );
+	outVertexData.clear();
+	outVertexData.resize( vertexData.size(), 0xCDu );
+	ReweldVertexBufferTask task( &vertexData[0], &outVertexData[0], c_bytesPerVertex,
+								 numVertices, lut, numThreads );
+	executeTask( task, numThreads );
+	return task.getNumUniqueVertices();
+}
+//-----------------------------------------------------------------------------------
+/// Every vertex must be where the LUT says.
+static bool matchesLut( const std::vector<uint8_t> &vertexData, const uint32_t *lut,
+						const std::vector<uint8_t> &welded )
+{
+	bool success = true;
+	for( size_t i=0; i<vertexData.size() / c_bytesPerVertex; ++i )
+	{
+		success &= memcmp( &welded[lut[i] * c_bytesPerVertex], &vertexData[i * c_bytesPerVertex],
+						   c_bytesPerVertex ) == 0;
+	}
+	return success;
+}
+//-----------------------------------------------------------------------------------
+static bool check( bool condition, const char *what, uint32_t numVertices, size_t numThreads )
+{
+	if( !condition )
+	{
+		printf( "%u vertices, %u threads: %s FAILED\n", numVertices,
+				static_cast<unsigned>( numThreads ), what );
+	}
+	return condition;
+}
+//-----------------------------------------------------------------------------------
+int main()
+{
+	bool success = true;
+	uint32_t state = 1u;
+
+	const uint32_t numVerticesPerRun[3] = { 7u, 1000u, 300000u };
+	for( size_t run=0; run<3u; ++run )
+	{
+		const uint32_t numVertices			= numVerticesPerRun[run];
+		const uint32_t numUniqueVertices	= std::max( numVertices / 5u, 1u );
+
+		//Each vertex is a copy of one of numUniqueVertices random ones
+		std::vector<uint8_t> uniqueData( numUniqueVertices * c_bytesPerVertex );
+		for( size_t i=0; i<uniqueData.size(); ++i )
+			uniqueData[i] = static_cast<uint8_t>( randomUint( state, 256u ) );
+		std::vector<uint8_t> vertexData( numVertices * c_bytesPerVertex );
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			memcpy( &vertexData[i * c_bytesPerVertex],
+					&uniqueData[randomUint( state, numUniqueVertices ) * c_bytesPerVertex],
+					c_bytesPerVertex );
+		}
+
+		std::vector<uint8_t> shrunk( vertexData.size() );
+		Ogre::FastArray<uint32_t> lut;
+		uint32_t numWelded;
+		{
+			ShrinkVertexBufferTask task( &vertexData[0], &shrunk[0], c_bytesPerVertex,
+										 numVertices, &lut, 2u );
+			executeTask( task, 2u );
+			numWelded = task.getNumUniqueVertices();
+		}
+
+		//The unique vertices in another order
+		std::vector<uint32_t> remap( numWelded );
+		for( uint32_t i=0; i<numWelded; ++i )
+			remap[i] = i;
+		for( uint32_t i=numWelded; i-- > 1u; )
+			std::swap( remap[i], remap[randomUint( state, i + 1u )] );
+		std::vector<uint32_t> permutedLut( numVertices );
+		for( uint32_t i=0; i<numVertices; ++i )
+			permutedLut[i] = remap[lut[i]];
+
+		//Pick a vertex that shares its unique vertex with an earlier one
+		uint32_t sharedVertex = numVertices;
+		std::vector<uint8_t> seen( numWelded, 0u );
+		for( uint32_t i=0; i<numVertices && sharedVertex == numVertices; ++i )
+		{
+			if( seen[lut[i]] )
+				sharedVertex = i;
+			seen[lut[i]] = 1u;
+		}
+
+		for( size_t numThreads=1u; numThreads<=4u; ++numThreads )
+		{
+			std::vector<uint8_t> welded;
+
+			success &= check( reweld( vertexData, lut.begin(), numThreads, welded ) == numWelded &&
+							  memcmp( &welded[0], &shrunk[0], numWelded * c_bytesPerVertex ) == 0,
+							  "Same LUT", numVertices, numThreads );
+
+			success &= check( reweld( vertexData, &permutedLut[0], numThreads, welded ) == numWelded &&
+							  matchesLut( vertexData, &permutedLut[0], welded ),
+							  "Reordered LUT", numVertices, numThreads );
+
+			//Make the first two unique vertices equal. The LUT keeps them apart.
+			if( numWelded >= 2u )
+			{
+				std::vector<uint8_t> merged( vertexData );
+				for( uint32_t i=0; i<numVertices; ++i )
+				{
+					if( lut[i] == 1u )
+						memcpy( &merged[i * c_bytesPerVertex], &shrunk[0], c_bytesPerVertex );
+				}
+				success &= check( reweld( merged, lut.begin(), numThreads, welded ) == numWelded &&
+								  matchesLut( merged, lut.begin(), welded ),
+								  "Vertices that became equal", numVertices, numThreads );
+			}
+
+			if( sharedVertex != numVertices )
+			{
+				std::vector<uint8_t> changed( vertexData );
+				changed[sharedVertex * c_bytesPerVertex + 3u] ^= 1u;
+				success &= check( reweld( changed, lut.begin(), numThreads, welded ) == 0u,
+								  "Vertex no longer equal", numVertices, numThreads );
+			}
+
+			//Move the last unique vertex one up, leaving a hole
+			std::vector<uint32_t> gapLut( lut.begin(), lut.end() );
+			for( uint32_t i=0; i<numVertices; ++i )
+			{
+				if( gapLut[i] == numWelded - 1u )
+					gapLut[i] = numWelded;
+			}
+			success &= check( reweld( vertexData, &gapLut[0], numThreads, welded ) == 0u,
+							  "Unused unique vertex", numVertices, numThreads );
+
+			std::vector<uint32_t> outOfRangeLut( lut.begin(), lut.end() );
+			outOfRangeLut[0] = numVertices + 5u;
+			success &= check( reweld( vertexData, &outOfRangeLut[0], numThreads, welded ) == 0u,
+							  "Out of range entry", numVertices, numThreads );
+		}
+
+		printf( "%u vertices (%u unique): %s\n", numVertices, numWelded,
+				success ? "OK" : "FAILED" );
+	}
+
+	printf( success ? "All tests passed\n" : "Some tests FAILED\n" );
+	return success ? 0 : 1;
+}
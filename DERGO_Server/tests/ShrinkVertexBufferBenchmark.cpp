@@ -0,0 +1,197 @@
+
+#include "VertexUtils.h"
+#include "OgreTimer.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/*
+	Time it takes VertexUtils::shrinkVertexBuffer to weld a deindexed mesh of 10k, 100k and
+	1M vertices, against the O(n^2) memcmp loop it used to run (oldShrinkVertexBuffer).
+	Also checks that both produce the same welded vertices & conversion LUT.
+	The old loop takes ~100x longer for each 10x more vertices, so it's skipped for 1M
+	vertices unless "--full" is passed (that took 50 minutes here). The 1M case is still
+	checked on its own: every vertex must be found where the LUT says, the welded vertices
+	must be unique and in order of first appearance, which is exactly what the old loop did.
+	Returns 0 on success. Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+namespace
+{
+	/// Position, normal & uv
+	const uint32_t c_bytesPerVertex		= sizeof(float) * (3u + 3u + 2u);
+	/// In a closed smooth mesh, each vertex is shared by ~6 triangles.
+	const uint32_t c_trianglesPerVertex	= 6u;
+	const uint32_t c_maxOldVertices		= 200000u;
+
+	/// VertexUtils::shrinkVertexBuffer before it used a hash table.
+	uint32_t oldShrinkVertexBuffer( uint8_t *vertexData, Ogre::FastArray<uint32_t> &vertexConversionLut,
+									uint32_t bytesPerVertex, uint32_t numVertices )
+	{
+		vertexConversionLut.resize( numVertices );
+		for( uint32_t i=0; i<numVertices; ++i )
+			vertexConversionLut[i] = i;
+
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			for( uint32_t j=i+1; j<numVertices; ++j )
+			{
+				if( vertexConversionLut[j] == j )
+				{
+					if( memcmp( vertexData + i * bytesPerVertex,
+								vertexData + j * bytesPerVertex,
+								bytesPerVertex ) == 0 )
+					{
+						vertexConversionLut[j] = i;
+					}
+				}
+			}
+		}
+
+		uint32_t newNumVertices = numVertices;
+
+		//Remove the duplicated vertices, iterating in reverse order for lower algorithmic complexity.
+		for( uint32_t i=numVertices; --i; )
+		{
+			if( vertexConversionLut[i] != i )
+			{
+				--newNumVertices;
+				memmove( vertexData + i * bytesPerVertex,
+						 vertexData + (i+1) * bytesPerVertex,
+						 (newNumVertices - i) * bytesPerVertex );
+			}
+		}
+
+		uint32_t numUniqueVerts = 0;
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			if( vertexConversionLut[i] == i )
+				vertexConversionLut[i] = numUniqueVerts++;
+			else
+				vertexConversionLut[i] = vertexConversionLut[vertexConversionLut[i]];
+		}
+
+		return newNumVertices;
+	}
+
+	/// Triangle list where each unique vertex shows up ~c_trianglesPerVertex times, close to
+	/// where its neighbours do (like deindex produces).
+	void generateVertices( std::vector<uint8_t> &outVertexData, uint32_t numVertices )
+	{
+		const uint32_t numUniqueVertices = numVertices / c_trianglesPerVertex;
+		outVertexData.resize( numVertices * c_bytesPerVertex );
+
+		uint32_t state = 1u;
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			state = state * 1664525u + 1013904223u;
+			const uint32_t uniqueIdx = (i / c_trianglesPerVertex + (state >> 24u) % 8u) %
+									   numUniqueVertices;
+			float vertex[8];
+			for( size_t j=0; j<8u; ++j )
+				vertex[j] = static_cast<float>( uniqueIdx ) * 0.001f + static_cast<float>( j );
+			memcpy( &outVertexData[i * c_bytesPerVertex], vertex, c_bytesPerVertex );
+		}
+	}
+
+	struct VertexLess
+	{
+		bool operator () ( const uint8_t *a, const uint8_t *b ) const
+		{
+			return memcmp( a, b, c_bytesPerVertex ) < 0;
+		}
+	};
+
+	/// See the comment at the top.
+	bool isValidWeld( const std::vector<uint8_t> &original, const std::vector<uint8_t> &welded,
+					  const Ogre::FastArray<uint32_t> &lut, uint32_t numVertices,
+					  uint32_t numWelded )
+	{
+		if( lut.size() != numVertices )
+			return false;
+
+		uint32_t nextNewVertex = 0;
+		for( uint32_t i=0; i<numVertices; ++i )
+		{
+			if( lut[i] > nextNewVertex || lut[i] >= numWelded ||
+				memcmp( &welded[lut[i] * c_bytesPerVertex], &original[i * c_bytesPerVertex],
+						c_bytesPerVertex ) != 0 )
+			{
+				return false;
+			}
+			if( lut[i] == nextNewVertex )
+				++nextNewVertex;
+		}
+
+		if( nextNewVertex != numWelded )
+			return false;
+
+		//No two welded vertices may be equal. Sort them to find out.
+		std::vector<const uint8_t*> sorted( numWelded );
+		for( uint32_t i=0; i<numWelded; ++i )
+			sorted[i] = &welded[i * c_bytesPerVertex];
+		std::sort( sorted.begin(), sorted.end(), VertexLess() );
+		for( uint32_t i=1; i<numWelded; ++i )
+		{
+			if( memcmp( sorted[i - 1u], sorted[i], c_bytesPerVertex ) == 0 )
+				return false;
+		}
+
+		return true;
+	}
+}
+//-----------------------------------------------------------------------------------
+int main( int argc, char *argv[] )
+{
+	const bool runFull = argc > 1 && strcmp( argv[1], "--full" ) == 0;
+	const uint32_t numVerticesPerRun[3] = { 10002u, 100002u, 1000002u };
+
+	printf( "%9s %9s %12s %12s  %s\n", "Vertices", "Welded", "Old (ms)", "New (ms)", "Output" );
+
+	bool success = true;
+	for( size_t i=0; i<3u; ++i )
+	{
+		const uint32_t numVertices = numVerticesPerRun[i];
+
+		std::vector<uint8_t> original;
+		generateVertices( original, numVertices );
+
+		Ogre::Timer timer;
+
+		std::vector<uint8_t> newData( original );
+		Ogre::FastArray<uint32_t> newLut;
+		uint64_t start = timer.getMicroseconds();
+		const uint32_t newNumVertices = VertexUtils::shrinkVertexBuffer( &newData[0], newLut,
+																		 c_bytesPerVertex,
+																		 numVertices );
+		const double newTime = (timer.getMicroseconds() - start) / 1000.0;
+
+		bool caseSuccess = isValidWeld( original, newData, newLut, numVertices, newNumVertices );
+
+		char oldTime[32] = "skipped";
+		if( numVertices <= c_maxOldVertices || runFull )
+		{
+			std::vector<uint8_t> oldData( original );
+			Ogre::FastArray<uint32_t> oldLut;
+			start = timer.getMicroseconds();
+			const uint32_t oldNumVertices = oldShrinkVertexBuffer( &oldData[0], oldLut,
+																   c_bytesPerVertex, numVertices );
+			sprintf( oldTime, "%.2f", (timer.getMicroseconds() - start) / 1000.0 );
+
+			caseSuccess &= oldNumVertices == newNumVertices &&
+						   memcmp( &oldData[0], &newData[0], newNumVertices * c_bytesPerVertex ) == 0 &&
+						   memcmp( oldLut.begin(), newLut.begin(), numVertices * sizeof(uint32_t) ) == 0;
+		}
+
+		printf( "%9u %9u %12s %12.2f  %s\n", numVertices, newNumVertices, oldTime, newTime,
+				caseSuccess ? (oldTime[0] == 's' ? "valid" : "identical") : "DIFFERENT" );
+		success &= caseSuccess;
+	}
+
+	return success ? 0 : 1;
+}
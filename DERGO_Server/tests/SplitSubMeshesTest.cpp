@@ -0,0 +1,143 @@
+
+#include "VertexUtils.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+/*
+	Checks that SplitSubMeshesTask produces the same submeshes as the std::find loop
+	prepareMesh used before it: one submesh per material in order of first appearance,
+	each with its triangles in their original order. Random inputs, with few & many
+	materials, sparse material IDs, 16 & 32-bit indices, and 1 to 8 threads (also more
+	threads than triangles).
+	Returns 0 on success. Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+static const size_t c_numRuns = 200u;
+
+/// Not rand(), so the inputs are the same everywhere.
+static uint32_t randomUint( uint32_t &state, uint32_t maxValue )
+{
+	state = state * 1664525u + 1013904223u;
+	return static_cast<uint32_t>( (static_cast<uint64_t>( state >> 8u ) * maxValue) >> 24u );
+}
+//-----------------------------------------------------------------------------------
+/// How prepareMesh used to split the triangles.
+static void referenceSplit( const std::vector<uint16_t> &materialIds, const std::vector<uint32_t> &lut,
+							std::vector<uint16_t> &uniqueMaterials,
+							std::vector< std::vector<uint32_t> > &indices )
+{
+	uint32_t currentVertex = 0;
+	std::vector<uint16_t>::const_iterator itor = materialIds.begin();
+	std::vector<uint16_t>::const_iterator end  = materialIds.end();
+
+	while( itor != end )
+	{
+		std::vector<uint16_t>::const_iterator itSubMesh = std::find( uniqueMaterials.begin(),
+																	 uniqueMaterials.end(),
+																	 *itor );
+		if( itSubMesh == uniqueMaterials.end() )
+		{
+			uniqueMaterials.push_back( *itor );
+			itSubMesh = uniqueMaterials.end() - 1;
+			indices.push_back( std::vector<uint32_t>() );
+		}
+
+		size_t subMeshIdx = itSubMesh - uniqueMaterials.begin();
+
+		indices[subMeshIdx].push_back( lut[currentVertex++] );
+		indices[subMeshIdx].push_back( lut[currentVertex++] );
+		indices[subMeshIdx].push_back( lut[currentVertex++] );
+
+		++itor;
+	}
+}
+//-----------------------------------------------------------------------------------
+static void executeTask( Ogre::UniformScalableTask &task, size_t numThreads )
+{
+	std::vector<std::thread> threads;
+	for( size_t i=0; i<numThreads; ++i )
+		threads.push_back( std::thread( &Ogre::UniformScalableTask::execute, &task, i, numThreads ) );
+	for( size_t i=0; i<numThreads; ++i )
+		threads[i].join();
+}
+//-----------------------------------------------------------------------------------
+int main()
+{
+	size_t numFailures = 0;
+	uint32_t state = 1u;
+
+	for( size_t run=0; run<c_numRuns; ++run )
+	{
+		const uint32_t numTriangles		= run == c_numRuns - 1u ? 1000000u :
+										  randomUint( state, 2000u );
+		const uint32_t numMaterials		= 1u + randomUint( state, run % 3u == 0u ? 40u : 4u );
+		//Material IDs that are far apart, to grow the per thread counts
+		const uint16_t materialStride	= run % 5u == 0u ? 1000u : 1u;
+		const bool use32BitIndices		= run % 2u == 0u;
+		const size_t numThreads			= 1u + randomUint( state, 8u );
+
+		std::vector<uint16_t> materialIds( numTriangles );
+		for( uint32_t i=0; i<numTriangles; ++i )
+		{
+			materialIds[i] = static_cast<uint16_t>( randomUint( state, numMaterials ) *
+													materialStride );
+		}
+
+		const uint32_t maxIndex = use32BitIndices ? 0x7FFFFFFFu : 0xFFFFu;
+		std::vector<uint32_t> lut( numTriangles * 3u );
+		for( size_t i=0; i<lut.size(); ++i )
+			lut[i] = randomUint( state, maxIndex );
+
+		std::vector<uint16_t> refUniqueMaterials;
+		std::vector< std::vector<uint32_t> > refIndices;
+		referenceSplit( materialIds, lut, refUniqueMaterials, refIndices );
+
+		std::vector<uint16_t> uniqueMaterials;
+		std::vector<SubMeshIndices> indices;
+		{
+			SplitSubMeshesTask task( numTriangles ? &materialIds[0] : 0, numTriangles,
+									 numTriangles ? &lut[0] : 0, use32BitIndices,
+									 &uniqueMaterials, &indices, numThreads );
+			executeTask( task, numThreads );
+		}
+
+		bool success = uniqueMaterials == refUniqueMaterials && indices.size() == refIndices.size();
+		for( size_t i=0; i<indices.size(); ++i )
+		{
+			if( success && indices[i].numIndices == refIndices[i].size() )
+			{
+				for( size_t j=0; j<refIndices[i].size(); ++j )
+				{
+					const uint32_t index = use32BitIndices ?
+											   reinterpret_cast<const uint32_t*>( indices[i].data )[j] :
+											   reinterpret_cast<const uint16_t*>( indices[i].data )[j];
+					success &= index == refIndices[i][j];
+				}
+			}
+			else
+			{
+				success = false;
+			}
+			OGRE_FREE_SIMD( indices[i].data, Ogre::MEMCATEGORY_GEOMETRY );
+		}
+
+		if( !success )
+		{
+			printf( "Run %u FAILED: %u triangles, %u materials (stride %u), %s indices, "
+					"%u threads\n", static_cast<unsigned>( run ), numTriangles, numMaterials,
+					materialStride, use32BitIndices ? "32-bit" : "16-bit",
+					static_cast<unsigned>( numThreads ) );
+			++numFailures;
+		}
+	}
+
+	printf( "SplitSubMeshesTask: %u of %u runs differ from the old split\n",
+			static_cast<unsigned>( numFailures ), static_cast<unsigned>( c_numRuns ) );
+	printf( numFailures ? "Some tests FAILED\n" : "All tests passed\n" );
+	return numFailures ? 1 : 0;
+}
@@ -0,0 +1,360 @@
+
+#include "VertexUtils.h"
+#include "OgreVector3.h"
+
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+	Round-trip precision of what compactVertices sends to the GPU:
+		* halfToFloat is exact for all 65536 halves.
+		* floatToHalf4 rounds all 2^32 floats to the nearest half, ties to even
+		  (overflows become infinity, NaNs stay NaNs).
+		* The QTangent encoding keeps the normal & tangent within c_maxQTangentErrorDeg
+		  degrees, and the parity exact.
+		* Half positions are only used where getMaxHalfError allows it, and then stay within
+		  c_maxHalfPositionError of the original positions.
+	Returns 0 on success. Build with -DDERGO_BUILD_TESTS=ON.
+*/
+
+using namespace DERGO;
+
+static const double c_maxQTangentErrorDeg = 0.03;
+static const uint32_t c_numQTangentVertices = 100000u;
+static const uint32_t c_numPositionVertices = 100000u;
+
+//-----------------------------------------------------------------------------------
+/// Reference half -> float, straight from the definition of the format.
+static double referenceHalfToFloat( uint16_t value )
+{
+	const double sign		= (value & 0x8000u) ? -1.0 : 1.0;
+	const int exponent		= (value >> 10u) & 0x1Fu;
+	const int mantissa		= value & 0x3FFu;
+
+	if( exponent == 0x1F )
+		return mantissa ? NAN : sign * INFINITY;
+	if( exponent == 0 )
+		return sign * ldexp( static_cast<double>( mantissa ), -24 );
+	return sign * ldexp( static_cast<double>( 1024 + mantissa ), exponent - 25 );
+}
+//-----------------------------------------------------------------------------------
+/// Reference float -> half. Scaling by powers of 2 is exact in double, and nearbyint
+/// rounds to nearest even. NaNs return 0x7E00 (with the sign); only their NaN-ness matters.
+static uint16_t referenceFloatToHalf( float value )
+{
+	const uint16_t sign = signbit( value ) ? 0x8000u : 0u;
+	if( isnan( value ) )
+		return sign | 0x7E00u;
+
+	const double absValue = fabs( static_cast<double>( value ) );
+	//Halfway between the biggest half (65504) and the next one it'd have (65536)
+	if( absValue >= 65520.0 )
+		return sign | 0x7C00u;
+
+	if( absValue < ldexp( 1.0, -14 ) )
+	{
+		//Denormal. Rounding up to 1024 correctly yields the smallest normal.
+		return sign | static_cast<uint16_t>( nearbyint( ldexp( absValue, 24 ) ) );
+	}
+
+	int exponent;
+	frexp( absValue, &exponent );
+	--exponent; //absValue is in [2^exponent; 2^(exponent+1))
+	const uint32_t mantissa = static_cast<uint32_t>( nearbyint( ldexp( absValue,
+																	   10 - exponent ) ) );
+	//Rounding up to 2048 correctly carries into the exponent.
+	return sign | static_cast<uint16_t>( ((exponent + 15) << 10u) + mantissa - 1024u );
+}
+//-----------------------------------------------------------------------------------
+static bool testHalfToFloat()
+{
+	size_t numErrors = 0;
+	for( uint32_t i=0; i<65536u; ++i )
+	{
+		const uint16_t half = static_cast<uint16_t>( i );
+		const float value = VertexUtils::halfToFloat( half );
+		const double expected = referenceHalfToFloat( half );
+
+		const bool matches = isnan( expected ) ? isnan( value ) != 0 :
+												 (value == expected &&
+												  signbit( value ) == signbit( expected ));
+		if( !matches )
+		{
+			if( numErrors < 8u )
+			{
+				printf( "halfToFloat( 0x%04x ) = %.9g, expected %.9g\n",
+						half, value, expected );
+			}
+			++numErrors;
+		}
+	}
+
+	printf( "halfToFloat: %lu errors in 65536 halves\n",
+			static_cast<unsigned long>( numErrors ) );
+	return numErrors == 0;
+}
+//-----------------------------------------------------------------------------------
+static bool testFloatToHalf4()
+{
+	uint64_t numErrors = 0;
+	double maxRelativeError = 0;
+
+	float values[4];
+	uint16_t halves[4];
+	uint64_t bits = 0;
+	while( bits < (1ull << 32u) )
+	{
+		for( size_t i=0; i<4u; ++i )
+		{
+			const uint32_t valueBits = static_cast<uint32_t>( bits + i );
+			memcpy( &values[i], &valueBits, sizeof(valueBits) );
+		}
+
+		VertexUtils::floatToHalf4( halves, values );
+
+		for( size_t i=0; i<4u; ++i )
+		{
+			const uint16_t expected = referenceFloatToHalf( values[i] );
+			const bool isNan = (halves[i] & 0x7C00u) == 0x7C00u && (halves[i] & 0x3FFu) != 0;
+			const bool matches = isnan( values[i] ) ?
+									 isNan && (halves[i] & 0x8000u) == (expected & 0x8000u) :
+									 halves[i] == expected;
+			if( !matches )
+			{
+				if( numErrors < 8u )
+				{
+					printf( "floatToHalf4( %.9g [0x%08x] ) = 0x%04x, expected 0x%04x\n",
+							values[i], static_cast<uint32_t>( bits + i ), halves[i], expected );
+				}
+				++numErrors;
+			}
+			else if( fabsf( values[i] ) >= 6.103515625e-05f && fabsf( values[i] ) <= 65504.0f )
+			{
+				//Normal range: the round trip must be within half an ulp (2^-11 relative)
+				const double roundTrip = VertexUtils::halfToFloat( halves[i] );
+				maxRelativeError = std::max( maxRelativeError,
+											 fabs( roundTrip - values[i] ) / fabs( values[i] ) );
+			}
+		}
+
+		bits += 4u;
+	}
+
+	printf( "floatToHalf4: %llu errors in 2^32 floats, max relative round trip error "
+			"%.3g in the normal range (limit %.3g)\n",
+			static_cast<unsigned long long>( numErrors ), maxRelativeError, ldexp( 1.0, -11 ) );
+	return numErrors == 0 && maxRelativeError <= ldexp( 1.0, -11 );
+}
+//-----------------------------------------------------------------------------------
+/// Not rand(), so the vectors (and thus the worst error found) are the same everywhere.
+static float randomFloat( uint32_t &state )
+{
+	state = state * 1664525u + 1013904223u;
+	return static_cast<float>( state >> 8u ) / static_cast<float>( 1u << 24u );
+}
+static Ogre::Vector3 randomDirection( uint32_t &state )
+{
+	Ogre::Vector3 dir;
+	do
+	{
+		dir.x = randomFloat( state ) * 2.0f - 1.0f;
+		dir.y = randomFloat( state ) * 2.0f - 1.0f;
+		dir.z = randomFloat( state ) * 2.0f - 1.0f;
+	}
+	while( dir.squaredLength() > 1.0f || dir.squaredLength() < 1e-4f );
+	return dir.normalisedCopy();
+}
+//-----------------------------------------------------------------------------------
+/// In radians. acos( dot ) would be too imprecise for the tiny angles we measure.
+static double angleBetween( const double a[3], const float b[3] )
+{
+	const double cross[3] =
+	{
+		a[1] * b[2] - a[2] * b[1],
+		a[2] * b[0] - a[0] * b[2],
+		a[0] * b[1] - a[1] * b[0]
+	};
+	const double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	return atan2( sqrt( cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2] ), dot );
+}
+//-----------------------------------------------------------------------------------
+static bool testQTangent()
+{
+	//Full layout: float3 position, float3 normal, float2 uv, float4 tangent (w = parity)
+	const uint32_t srcBytesPerVertex = sizeof(float) * (3u + 3u + 2u + 4u);
+	//Compact layout: half4 position, short4 QTangent, half2 uv
+	const uint32_t dstBytesPerVertex = sizeof(uint16_t) * (4u + 4u + 2u);
+
+	std::vector<float> srcData( c_numQTangentVertices * srcBytesPerVertex / sizeof(float) );
+	std::vector<uint8_t> dstData( c_numQTangentVertices * dstBytesPerVertex );
+
+	uint32_t state = 1u;
+	for( uint32_t i=0; i<c_numQTangentVertices; ++i )
+	{
+		float *vertex = &srcData[i * srcBytesPerVertex / sizeof(float)];
+
+		Ogre::Vector3 normal = randomDirection( state );
+		Ogre::Vector3 tangent = randomDirection( state );
+		if( i < 6u )
+		{
+			//The axes are where quaternions from matrices are most fragile
+			const float sign = i < 3u ? 1.0f : -1.0f;
+			normal = Ogre::Vector3( i % 3u == 0u ? sign : 0.0f, i % 3u == 1u ? sign : 0.0f,
+									i % 3u == 2u ? sign : 0.0f );
+			tangent = normal.perpendicular();
+		}
+		tangent = (tangent - normal * normal.dotProduct( tangent ));
+		if( tangent.squaredLength() < 1e-6f )
+			tangent = normal.perpendicular();
+		tangent.normalise();
+
+		vertex[0] = randomFloat( state ) * 10.0f - 5.0f;
+		vertex[1] = randomFloat( state ) * 10.0f - 5.0f;
+		vertex[2] = randomFloat( state ) * 10.0f - 5.0f;
+		vertex[3] = normal.x;
+		vertex[4] = normal.y;
+		vertex[5] = normal.z;
+		vertex[8] = tangent.x;
+		vertex[9] = tangent.y;
+		vertex[10] = tangent.z;
+		vertex[6] = randomFloat( state );
+		vertex[7] = randomFloat( state );
+		vertex[11] = randomFloat( state ) < 0.5f ? -1.0f : 1.0f;
+	}
+
+	VertexUtils::compactVertices( &dstData[0], dstBytesPerVertex,
+								  reinterpret_cast<const uint8_t*>( &srcData[0] ),
+								  srcBytesPerVertex, c_numQTangentVertices,
+								  true, false, 1u, true );
+
+	double maxNormalError = 0;
+	double maxTangentError = 0;
+	size_t numParityErrors = 0;
+	for( uint32_t i=0; i<c_numQTangentVertices; ++i )
+	{
+		const float *vertex = &srcData[i * srcBytesPerVertex / sizeof(float)];
+		int16_t qTangent[4];
+		memcpy( qTangent, &dstData[i * dstBytesPerVertex + sizeof(uint16_t) * 4u],
+				sizeof(qTangent) );
+
+		//Decode like the shaders do: normalize, then take the first two matrix columns
+		double q[4];
+		double length = 0;
+		for( size_t j=0; j<4u; ++j )
+		{
+			q[j] = std::max( qTangent[j] / 32767.0, -1.0 );
+			length += q[j] * q[j];
+		}
+		length = sqrt( length );
+		const double x = q[0] / length, y = q[1] / length, z = q[2] / length, w = q[3] / length;
+
+		const double normal[3] =
+		{
+			1.0 - 2.0 * (y * y + z * z),
+			2.0 * (x * y + w * z),
+			2.0 * (x * z - w * y)
+		};
+		const double tangent[3] =
+		{
+			2.0 * (x * y - w * z),
+			1.0 - 2.0 * (x * x + z * z),
+			2.0 * (y * z + w * x)
+		};
+
+		maxNormalError	= std::max( maxNormalError, angleBetween( normal, vertex + 3u ) );
+		maxTangentError	= std::max( maxTangentError, angleBetween( tangent, vertex + 8u ) );
+		if( (w < 0.0) != (vertex[11] < 0.0f) )
+			++numParityErrors;
+	}
+
+	const double radToDeg = 180.0 / 3.14159265358979323846;
+	maxNormalError	*= radToDeg;
+	maxTangentError	*= radToDeg;
+
+	printf( "QTangent: max normal error %.5f deg, max tangent error %.5f deg (limit %.2f), "
+			"%lu parity errors in %u vertices\n",
+			maxNormalError, maxTangentError, c_maxQTangentErrorDeg,
+			static_cast<unsigned long>( numParityErrors ), c_numQTangentVertices );
+	return maxNormalError <= c_maxQTangentErrorDeg && maxTangentError <= c_maxQTangentErrorDeg &&
+		   numParityErrors == 0;
+}
+//-----------------------------------------------------------------------------------
+/// Meshes of growing size, all centred around their origin. Like DergoSystem, only those
+/// whose positions can't move by more than c_maxHalfPositionError get half positions.
+static bool testHalfPositions()
+{
+	//Layout without tangents: float3 position, float3 normal, float2 uv
+	const uint32_t srcBytesPerVertex = sizeof(float) * (3u + 3u + 2u);
+	//Compact layout: half4 position, short4 QTangent, half2 uv
+	const uint32_t dstBytesPerVertex = sizeof(uint16_t) * (4u + 4u + 2u);
+
+	const float extents[8] = { 0.01f, 0.5f, 1.0f, 3.99f, 4.0f, 100.0f, 5000.0f, 60000.0f };
+	//Halves are 2^-9 apart in [2; 4), and 2^-8 in [4; 8): 4 m is where 1 mm is exceeded
+	const bool expectedHalf[8] = { true, true, true, true, false, false, false, false };
+
+	std::vector<float> srcData( c_numPositionVertices * srcBytesPerVertex / sizeof(float), 0.0f );
+	std::vector<uint8_t> dstData( c_numPositionVertices * dstBytesPerVertex );
+
+	bool success = true;
+	uint32_t state = 1u;
+	for( size_t i=0; i<8u; ++i )
+	{
+		const float maxError = VertexUtils::getMaxHalfError( extents[i] );
+		const bool halfPositions = maxError <= c_maxHalfPositionError;
+
+		for( uint32_t j=0; j<c_numPositionVertices; ++j )
+		{
+			float *vertex = &srcData[j * srcBytesPerVertex / sizeof(float)];
+			for( size_t k=0; k<3u; ++k )
+				vertex[k] = (randomFloat( state ) * 2.0f - 1.0f) * extents[i];
+			//The extremes of the AABB are always in the mesh
+			if( j < 2u )
+				vertex[0] = j == 0u ? extents[i] : -extents[i];
+			vertex[5] = 1.0f;
+		}
+
+		//Round trip them as halves even when they'd be rejected, to check the bound itself
+		VertexUtils::compactVertices( &dstData[0], dstBytesPerVertex,
+									  reinterpret_cast<const uint8_t*>( &srcData[0] ),
+									  srcBytesPerVertex, c_numPositionVertices,
+									  true, false, 1u, false );
+
+		double measuredError = 0;
+		for( uint32_t j=0; j<c_numPositionVertices; ++j )
+		{
+			const float *vertex = &srcData[j * srcBytesPerVertex / sizeof(float)];
+			uint16_t halves[3];
+			memcpy( halves, &dstData[j * dstBytesPerVertex], sizeof(halves) );
+			for( size_t k=0; k<3u; ++k )
+			{
+				measuredError = std::max( measuredError,
+										  fabs( static_cast<double>(
+													VertexUtils::halfToFloat( halves[k] ) ) -
+												vertex[k] ) );
+			}
+		}
+
+		const bool caseSuccess = halfPositions == expectedHalf[i] && measuredError <= maxError &&
+								 (!halfPositions || measuredError <= c_maxHalfPositionError);
+		printf( "Half positions, extent %g: %s, max error %.3g (bound %.3g, limit %.3g)%s\n",
+				extents[i], halfPositions ? "half" : "float", measuredError, maxError,
+				c_maxHalfPositionError, caseSuccess ? "" : " FAILED" );
+		success &= caseSuccess;
+	}
+
+	return success;
+}
+//-----------------------------------------------------------------------------------
+int main()
+{
+	bool success = testHalfToFloat();
+	success &= testFloatToHalf4();
+	success &= testQTangent();
+	success &= testHalfPositions();
+
+	printf( success ? "All tests passed\n" : "Some tests FAILED\n" );
+	return success ? 0 : 1;
+}